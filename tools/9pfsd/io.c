@@ -7,12 +7,19 @@
  *
  * I/O thread handling.
  *
- * Only handle one request at a time, pushing out the complete response
- * before looking for the next request.
+ * Each ring has an I/O thread reading requests from the ring and writing
+ * responses back to it.  Up to MAX_RING_REQUESTS requests per ring are in
+ * flight at a time, processed by a pool of worker threads shared by all
+ * rings.  Responses are sent in the order the requests complete, which the
+ * 9pfs protocol allows as they are matched via their tags.
+ *
+ * Twrite data is written to the file directly from the ring pages, the ring
+ * space being given back to the frontend only after that.
  */
 
 #include <assert.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,6 +29,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <xen-barrier.h>
@@ -58,6 +66,7 @@
 #define P9_MIN_MSIZE      2048
 #define P9_VERSION        "9P2000.u"
 #define P9_WALK_MAXELEM   16
+#define P9_WRITE_HDR_SIZE (sizeof(struct p9_header) + 16)  /* fid, offset, count */
 
 struct p9_qid {
     uint8_t type;
@@ -113,8 +122,37 @@ static unsigned int ring_out_data(struct ring *ring)
     return queued;
 }
 
-static unsigned int get_request_bytes(struct ring *ring, unsigned int off,
-                                      unsigned int total_len)
+/*
+ * Make consumed request space visible to the frontend.  Write data which is
+ * still to be written to a file stays in the ring until that is done.
+ */
+static void release_out_data(struct ring *ring)
+{
+    RING_IDX cons = ring->cons_pvt_out;
+    struct p9_req *req;
+    unsigned int i;
+
+    for ( i = 0; i < MAX_RING_REQUESTS; i++ )
+    {
+        req = ring->req + i;
+        if ( req->payload_held &&
+             ring->cons_pvt_out - req->payload > ring->cons_pvt_out - cons )
+            cons = req->payload;
+    }
+
+    if ( cons == ring->cons_pub_out )
+        return;
+
+    xen_rmb();           /* Read data out before setting visible consumer. */
+    ring->cons_pub_out = cons;
+    ring->intf->out_cons = cons;
+
+    /* Signal that more space is available now. */
+    xenevtchn_notify(xe, ring->evtchn);
+}
+
+static unsigned int get_request_bytes(struct ring *ring, void *buffer,
+                                      unsigned int off, unsigned int total_len)
 {
     unsigned int size;
     unsigned int out_data = ring_out_data(ring);
@@ -123,21 +161,34 @@ static unsigned int get_request_bytes(struct ring *ring, unsigned int off,
     size = min(total_len - off, out_data);
     prod = xen_9pfs_mask(ring->intf->out_prod, ring->ring_size);
     cons = xen_9pfs_mask(ring->cons_pvt_out, ring->ring_size);
-    xen_9pfs_read_packet(ring->buffer + off, ring->data.out, size,
+    xen_9pfs_read_packet(buffer + off, ring->data.out, size,
                          prod, &cons, ring->ring_size);
 
-    xen_rmb();           /* Read data out before setting visible consumer. */
     ring->cons_pvt_out += size;
-    ring->intf->out_cons = ring->cons_pvt_out;
-
-    /* Signal that more space is available now. */
-    xenevtchn_notify(xe, ring->evtchn);
+    release_out_data(ring);
 
     return size;
 }
 
-static unsigned int put_response_bytes(struct ring *ring, unsigned int off,
-                                       unsigned int total_len)
+/* Describe len bytes of the out ring starting at idx, which might wrap. */
+static unsigned int ring_out_iov(struct ring *ring, RING_IDX idx,
+                                 unsigned int len, struct iovec *iov)
+{
+    RING_IDX off = xen_9pfs_mask(idx, ring->ring_size);
+
+    iov[0].iov_base = ring->data.out + off;
+    iov[0].iov_len = min(len, ring->ring_size - off);
+    if ( iov[0].iov_len == len )
+        return 1;
+
+    iov[1].iov_base = ring->data.out;
+    iov[1].iov_len = len - iov[0].iov_len;
+
+    return 2;
+}
+
+static unsigned int put_response_bytes(struct ring *ring, const void *buffer,
+                                       unsigned int off, unsigned int total_len)
 {
     unsigned int size;
     unsigned int in_data = ring_in_free(ring);
@@ -146,7 +197,7 @@ static unsigned int put_response_bytes(struct ring *ring, unsigned int off,
     size = min(total_len - off, in_data);
     prod = xen_9pfs_mask(ring->prod_pvt_in, ring->ring_size);
     cons = xen_9pfs_mask(ring->intf->in_cons, ring->ring_size);
-    xen_9pfs_write_packet(ring->data.in, ring->buffer + off, size,
+    xen_9pfs_write_packet(ring->data.in, buffer + off, size,
                           &prod, cons, ring->ring_size);
 
     xen_wmb();           /* Write data out before setting visible producer. */
@@ -156,15 +207,6 @@ static unsigned int put_response_bytes(struct ring *ring, unsigned int off,
     return size;
 }
 
-static bool io_work_pending(struct ring *ring)
-{
-    if ( ring->stop_thread )
-        return true;
-    if ( ring->error )
-        return false;
-    return ring->handle_response ? ring_in_free(ring) : ring_out_data(ring);
-}
-
 static void fmt_err(const char *fmt)
 {
     syslog(LOG_CRIT, "illegal format %s passed to fill_buffer()", fmt);
@@ -323,10 +365,10 @@ static void fill_buffer_at(void **data, const char *fmt, ...)
     va_end(ap);
 }
 
-static void fill_buffer(struct ring *ring, uint8_t cmd, uint16_t tag,
+static void fill_buffer(struct p9_req *req, uint8_t cmd, uint16_t tag,
                         const char *fmt, ...)
 {
-    struct p9_header *hdr = ring->buffer;
+    struct p9_header *hdr = req->buffer;
     void *data = hdr + 1;
     va_list ap;
 
@@ -337,37 +379,37 @@ static void fill_buffer(struct ring *ring, uint8_t cmd, uint16_t tag,
     vfill_buffer_at(&data, fmt, ap);
     va_end(ap);
 
-    hdr->size = data - ring->buffer;
+    hdr->size = data - req->buffer;
 }
 
-static unsigned int add_string(struct ring *ring, const char *str,
+static unsigned int add_string(struct p9_req *req, const char *str,
                                unsigned int len)
 {
     char *tmp;
     unsigned int ret;
 
-    if ( ring->str_used + len + 1 > ring->str_size )
+    if ( req->str_used + len + 1 > req->str_size )
     {
-        tmp = realloc(ring->str, ring->str_used + len + 1);
+        tmp = realloc(req->str, req->str_used + len + 1);
         if ( !tmp )
             return ~0;
-        ring->str = tmp;
-        ring->str_size = ring->str_used + len + 1;
+        req->str = tmp;
+        req->str_size = req->str_used + len + 1;
     }
 
-    ret = ring->str_used;
-    memcpy(ring->str + ret, str, len);
-    ring->str_used += len;
-    ring->str[ring->str_used++] = 0;
+    ret = req->str_used;
+    memcpy(req->str + ret, str, len);
+    req->str_used += len;
+    req->str[req->str_used++] = 0;
 
     return ret;
 }
 
-static bool chk_data(struct ring *ring, void *data, unsigned int len)
+static bool chk_data(struct p9_req *req, void *data, unsigned int len)
 {
-    struct p9_header *hdr = ring->buffer;
+    struct p9_header *hdr = req->buffer;
 
-    if ( data + len <= ring->buffer + hdr->size )
+    if ( data + len <= req->buffer + hdr->size )
         return true;
 
     errno = E2BIG;
@@ -421,9 +463,9 @@ static bool fill_data_elem(void **par, void **array, unsigned int *array_sz,
  * Return value: number of filled variables, errno will be set in case of
  *   error.
  */
-static int fill_data(struct ring *ring, const char *fmt, ...)
+static int fill_data(struct p9_req *req, const char *fmt, ...)
 {
-    struct p9_header *hdr = ring->buffer;
+    struct p9_header *hdr = req->buffer;
     void *data = hdr + 1;
     void *par;
     unsigned int pars = 0;
@@ -447,7 +489,7 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
             f++;
             if ( !*f || array_sz )
                 fmt_err(fmt);
-            if ( !chk_data(ring, data, sizeof(uint16_t)) )
+            if ( !chk_data(req, data, sizeof(uint16_t)) )
                 goto out;
             array_sz = get_unaligned((uint16_t *)data);
             data += sizeof(uint16_t);
@@ -457,7 +499,7 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
             break;
 
         case 'b':
-            if ( !chk_data(ring, data, sizeof(uint8_t)) )
+            if ( !chk_data(req, data, sizeof(uint8_t)) )
                 goto out;
             if ( !fill_data_elem(&par, array, &array_sz, sizeof(uint8_t),
                                  data) )
@@ -468,20 +510,20 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
         case 'D':
             if ( array_sz )
                 fmt_err(fmt);
-            if ( !chk_data(ring, data, sizeof(uint32_t)) )
+            if ( !chk_data(req, data, sizeof(uint32_t)) )
                 goto out;
             len = get_unaligned((uint32_t *)data);
             data += sizeof(uint32_t);
             *(unsigned int *)par = len;
             par = va_arg(ap, void *);
-            if ( !chk_data(ring, data, len) )
+            if ( !chk_data(req, data, len) )
                 goto out;
             memcpy(par, data, len);
             data += len;
             break;
 
         case 'L':
-            if ( !chk_data(ring, data, sizeof(uint64_t)) )
+            if ( !chk_data(req, data, sizeof(uint64_t)) )
                 goto out;
             if ( !fill_data_elem(&par, array, &array_sz, sizeof(uint64_t),
                                  data) )
@@ -490,13 +532,13 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
             break;
 
         case 'S':
-            if ( !chk_data(ring, data, sizeof(uint16_t)) )
+            if ( !chk_data(req, data, sizeof(uint16_t)) )
                 goto out;
             len = get_unaligned((uint16_t *)data);
             data += sizeof(uint16_t);
-            if ( !chk_data(ring, data, len) )
+            if ( !chk_data(req, data, len) )
                 goto out;
-            str_off = add_string(ring, data, len);
+            str_off = add_string(req, data, len);
             if ( str_off == ~0 )
                 goto out;
             if ( !fill_data_elem(&par, array, &array_sz, sizeof(unsigned int),
@@ -506,7 +548,7 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
             break;
 
         case 'U':
-            if ( !chk_data(ring, data, sizeof(uint32_t)) )
+            if ( !chk_data(req, data, sizeof(uint32_t)) )
                 goto out;
             if ( !fill_data_elem(&par, array, &array_sz, sizeof(uint32_t),
                                  data) )
@@ -529,13 +571,19 @@ static int fill_data(struct ring *ring, const char *fmt, ...)
     return pars;
 }
 
+static struct fidhead *fid_bucket(device *device, unsigned int fid)
+{
+    return &device->fids[fid & (FID_HASH_SIZE - 1)];
+}
+
+/* Called with fid_mutex held.  Fids being clunked can't be found anymore. */
 static struct p9_fid *find_fid(device *device, unsigned int fid)
 {
     struct p9_fid *fidp;
 
-    XEN_TAILQ_FOREACH(fidp, &device->fids, list)
+    XEN_LIST_FOREACH(fidp, fid_bucket(device, fid), list)
     {
-        if ( fidp->fid == fid )
+        if ( fidp->fid == fid && !fidp->clunked )
             return fidp;
     }
 
@@ -567,11 +615,27 @@ static struct p9_fid *alloc_fid_mem(device *device, unsigned int fid,
         return NULL;
 
     fidp->fid = fid;
+    pthread_rwlock_init(&fidp->lock, NULL);
     strcpy(fidp->path, path);
 
     return fidp;
 }
 
+static void free_fid_mem(struct p9_fid *fidp)
+{
+    pthread_rwlock_destroy(&fidp->lock);
+    free(fidp);
+}
+
+/* Replace fidp by new_fidp in the fid table.  Called with fid_mutex held. */
+static void replace_fid(device *device, struct p9_fid *fidp,
+                        struct p9_fid *new_fidp)
+{
+    XEN_LIST_REMOVE(fidp, list);
+    XEN_LIST_INSERT_HEAD(fid_bucket(device, new_fidp->fid), new_fidp, list);
+    free_fid_mem(fidp);
+}
+
 static struct p9_fid *alloc_fid(device *device, unsigned int fid,
                                 const char *path)
 {
@@ -596,7 +660,7 @@ static struct p9_fid *alloc_fid(device *device, unsigned int fid,
         goto out;
 
     fidp->ref = 1;
-    XEN_TAILQ_INSERT_HEAD(&device->fids, fidp, list);
+    XEN_LIST_INSERT_HEAD(fid_bucket(device, fid), fidp, list);
     device->n_fids++;
 
  out:
@@ -616,21 +680,33 @@ static void free_fid(device *device, struct p9_fid *fidp)
     if ( !fidp->ref )
     {
         device->n_fids--;
-        XEN_TAILQ_REMOVE(&device->fids, fidp, list);
-        free(fidp);
+        XEN_LIST_REMOVE(fidp, list);
+        free_fid_mem(fidp);
     }
 
     pthread_mutex_unlock(&device->fid_mutex);
 }
 
+void init_fids(device *device)
+{
+    unsigned int i;
+
+    for ( i = 0; i < FID_HASH_SIZE; i++ )
+        XEN_LIST_INIT(&device->fids[i]);
+}
+
 void free_fids(device *device)
 {
     struct p9_fid *fidp;
+    unsigned int i;
 
-    while ( (fidp = XEN_TAILQ_FIRST(&device->fids)) != NULL )
+    for ( i = 0; i < FID_HASH_SIZE; i++ )
     {
-        XEN_TAILQ_REMOVE(&device->fids, fidp, list);
-        free(fidp);
+        while ( (fidp = XEN_LIST_FIRST(&device->fids[i])) != NULL )
+        {
+            XEN_LIST_REMOVE(fidp, list);
+            free_fid_mem(fidp);
+        }
     }
 }
 
@@ -682,7 +758,7 @@ static bool name_ok(const char *str)
 
 /* Including the '\0' */
 #define MAX_ERRSTR_LEN 80
-static void p9_error(struct ring *ring, uint16_t tag, uint32_t err)
+static void p9_error(struct p9_req *req, uint16_t tag, uint32_t err)
 {
     unsigned int erroff;
     static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -698,67 +774,68 @@ static void p9_error(struct ring *ring, uint16_t tag, uint32_t err)
     pthread_mutex_lock(&mutex);
     str = strerror(err);
     len = min(strlen(str), (size_t)(MAX_ERRSTR_LEN - 1));
-    memcpy(ring->buffer, str, len);
-    ((char *)ring->buffer)[len] = '\0';
+    memcpy(req->buffer, str, len);
+    ((char *)req->buffer)[len] = '\0';
     pthread_mutex_unlock(&mutex);
 
-    erroff = add_string(ring, ring->buffer, strlen(ring->buffer));
-    fill_buffer(ring, P9_CMD_ERROR, tag, "SU",
-                erroff != ~0 ? ring->str + erroff : "cannot allocate memory",
+    erroff = add_string(req, req->buffer, strlen(req->buffer));
+    fill_buffer(req, P9_CMD_ERROR, tag, "SU",
+                erroff != ~0 ? req->str + erroff : "cannot allocate memory",
                 &err);
 }
 
-static void p9_version(struct ring *ring, struct p9_header *hdr)
+static void p9_version(struct p9_req *req, struct p9_header *hdr)
 {
+    struct ring *ring = req->ring;
     uint32_t max_size;
     unsigned int off;
     char *version;
     int ret;
 
-    ret = fill_data(ring, "US", &max_size, &off);
+    ret = fill_data(req, "US", &max_size, &off);
     if ( ret != 2 )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         return;
     }
 
     if ( max_size < P9_MIN_MSIZE )
     {
-        p9_error(ring, hdr->tag, EMSGSIZE);
+        p9_error(req, hdr->tag, EMSGSIZE);
         return;
     }
 
     if ( max_size < ring->max_size )
         ring->max_size = max_size;
 
-    version = ring->str + off;
+    version = req->str + off;
     if ( strcmp(version, P9_VERSION) )
         version = "unknown";
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "US", &ring->max_size, version);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "US", &ring->max_size, version);
 }
 
-static void p9_attach(struct ring *ring, struct p9_header *hdr)
+static void p9_attach(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     uint32_t dummy_u32;
     unsigned int dummy_uint;
     struct p9_qid qid;
     int ret;
 
-    ret = fill_data(ring, "UUSSU", &fid, &dummy_u32, &dummy_uint, &dummy_uint,
+    ret = fill_data(req, "UUSSU", &fid, &dummy_u32, &dummy_uint, &dummy_uint,
                     &dummy_u32);
     if ( ret != 5 )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         return;
     }
 
     device->root_fid = alloc_fid(device, fid, relpath_from_path("/"));
     if ( !device->root_fid )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         return;
     }
 
@@ -767,16 +844,16 @@ static void p9_attach(struct ring *ring, struct p9_header *hdr)
     {
         free_fid(device, device->root_fid);
         device->root_fid = NULL;
-        p9_error(ring, hdr->tag, ret);
+        p9_error(req, hdr->tag, ret);
         return;
     }
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "Q", &qid);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "Q", &qid);
 }
 
-static void p9_walk(struct ring *ring, struct p9_header *hdr)
+static void p9_walk(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     uint32_t newfid;
     struct p9_fid *fidp = NULL;
@@ -789,44 +866,44 @@ static void p9_walk(struct ring *ring, struct p9_header *hdr)
     unsigned int path_len;
     int ret;
 
-    ret = fill_data(ring, "UUaS", &fid, &newfid, &n_names, &names);
+    ret = fill_data(req, "UUaS", &fid, &newfid, &n_names, &names);
     if ( n_names > P9_WALK_MAXELEM )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         goto out;
     }
     if ( ret != 3 + n_names )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         goto out;
     }
 
     fidp = get_fid_ref(device, fid);
     if ( !fidp )
     {
-        p9_error(ring, hdr->tag, ENOENT);
+        p9_error(req, hdr->tag, ENOENT);
         goto out;
     }
     if ( fidp->opened )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         goto out;
     }
 
     path_len = strlen(fidp->path) + 1;
     for ( i = 0; i < n_names; i++ )
     {
-        if ( !name_ok(ring->str + names[i]) )
+        if ( !name_ok(req->str + names[i]) )
         {
-            p9_error(ring, hdr->tag, ENOENT);
+            p9_error(req, hdr->tag, ENOENT);
             goto out;
         }
-        path_len += strlen(ring->str + names[i]) + 1;
+        path_len += strlen(req->str + names[i]) + 1;
     }
     path = calloc(path_len + 1, 1);
     if ( !path )
     {
-        p9_error(ring, hdr->tag, ENOMEM);
+        p9_error(req, hdr->tag, ENOMEM);
         goto out;
     }
     strcpy(path, fidp->path);
@@ -836,19 +913,19 @@ static void p9_walk(struct ring *ring, struct p9_header *hdr)
         qids = calloc(n_names, sizeof(*qids));
         if ( !qids )
         {
-            p9_error(ring, hdr->tag, ENOMEM);
+            p9_error(req, hdr->tag, ENOMEM);
             goto out;
         }
         for ( i = 0; i < n_names; i++ )
         {
             strcat(path, "/");
-            strcat(path, ring->str + names[i]);
+            strcat(path, req->str + names[i]);
             ret = fill_qid(device, path, qids + i, NULL);
             if ( ret )
             {
                 if ( !walked )
                 {
-                    p9_error(ring, hdr->tag, errno);
+                    p9_error(req, hdr->tag, errno);
                     goto out;
                 }
                 break;
@@ -877,9 +954,7 @@ static void p9_walk(struct ring *ring, struct p9_header *hdr)
                 if ( new_fidp )
                 {
                     new_fidp->ref = 2;
-                    XEN_TAILQ_REMOVE(&device->fids, fidp, list);
-                    XEN_TAILQ_INSERT_HEAD(&device->fids, new_fidp, list);
-                    free(fidp);
+                    replace_fid(device, fidp, new_fidp);
                     fidp = new_fidp;
                     ok = true;
                 }
@@ -892,12 +967,12 @@ static void p9_walk(struct ring *ring, struct p9_header *hdr)
 
         if ( !ok )
         {
-            p9_error(ring, hdr->tag, errno);
+            p9_error(req, hdr->tag, errno);
             goto out;
         }
     }
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "aQ", &walked, qids);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "aQ", &walked, qids);
 
  out:
     free_fid(device, fidp);
@@ -940,9 +1015,9 @@ static unsigned int get_iounit(struct ring *ring, struct stat *st)
     return (ring->max_size - st->st_blksize) & ~(st->st_blksize - 1);
 }
 
-static void p9_open(struct ring *ring, struct p9_header *hdr)
+static void p9_open(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     uint8_t mode;
     struct p9_fid *fidp;
@@ -952,24 +1027,27 @@ static void p9_open(struct ring *ring, struct p9_header *hdr)
     int flags;
     int ret;
 
-    ret = fill_data(ring, "Ub", &fid, &mode);
+    ret = fill_data(req, "Ub", &fid, &mode);
     if ( ret != 2 )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
     if ( mode & ~(P9_OMODEMASK | P9_OTRUNC | P9_OREMOVE) )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
     fidp = get_fid_ref(device, fid);
     if ( !fidp )
     {
-        p9_error(ring, hdr->tag, ENOENT);
+        p9_error(req, hdr->tag, ENOENT);
         return;
     }
+
+    pthread_rwlock_wrlock(&fidp->lock);
+
     if ( fidp->opened )
     {
         errno = EINVAL;
@@ -1016,21 +1094,24 @@ static void p9_open(struct ring *ring, struct p9_header *hdr)
     }
 
     fill_qid(device, fidp->path, &qid, &st);
-    iounit = get_iounit(ring, &st);
+    iounit = get_iounit(req->ring, &st);
     fidp->opened = true;
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "QU", &qid, &iounit);
+    pthread_rwlock_unlock(&fidp->lock);
+
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "QU", &qid, &iounit);
 
     return;
 
  err:
+    pthread_rwlock_unlock(&fidp->lock);
     free_fid(device, fidp);
-    p9_error(ring, hdr->tag, errno);
+    p9_error(req, hdr->tag, errno);
 }
 
-static void p9_create(struct ring *ring, struct p9_header *hdr)
+static void p9_create(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     unsigned int name_off;
     uint32_t perm;
@@ -1045,22 +1126,22 @@ static void p9_create(struct ring *ring, struct p9_header *hdr)
     int flags;
     int ret;
 
-    ret = fill_data(ring, "USUbS", &fid, &name_off, &perm, &mode, &ext_off);
+    ret = fill_data(req, "USUbS", &fid, &name_off, &perm, &mode, &ext_off);
     if ( ret != 5 )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
-    if ( !name_ok(ring->str + name_off) )
+    if ( !name_ok(req->str + name_off) )
     {
-        p9_error(ring, hdr->tag, ENOENT);
+        p9_error(req, hdr->tag, ENOENT);
         return;
     }
 
     if ( perm & P9_CREATE_PERM_NOTSUPP )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
@@ -1068,35 +1149,41 @@ static void p9_create(struct ring *ring, struct p9_header *hdr)
     if ( !fidp || fidp->opened )
     {
         free_fid(device, fidp);
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
     if ( fstatat(device->root_fd, fidp->path, &st, 0) < 0 )
     {
         free_fid(device, fidp);
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         return;
     }
 
-    path = malloc(strlen(fidp->path) + strlen(ring->str + name_off) + 2);
+    path = malloc(strlen(fidp->path) + strlen(req->str + name_off) + 2);
     if ( !path )
     {
         free_fid(device, fidp);
-        p9_error(ring, hdr->tag, ENOMEM);
+        p9_error(req, hdr->tag, ENOMEM);
         return;
     }
-    sprintf(path, "%s/%s", fidp->path, ring->str + name_off);
+    sprintf(path, "%s/%s", fidp->path, req->str + name_off);
     new_fidp = alloc_fid_mem(device, fid, path);
     free(path);
     if ( !new_fidp )
     {
         free_fid(device, fidp);
-        p9_error(ring, hdr->tag, ENOMEM);
+        p9_error(req, hdr->tag, ENOMEM);
         return;
     }
 
     pthread_mutex_lock(&device->fid_mutex);
 
+    /* The fid is replaced below, so nobody else may be using it. */
+    if ( fidp->ref != 2 )
+    {
+        errno = EBUSY;
+        goto err;
+    }
     new_fidp->ref = fidp->ref;
 
     if ( perm & P9_CREATE_PERM_DIR )
@@ -1110,9 +1197,7 @@ static void p9_create(struct ring *ring, struct p9_header *hdr)
         if ( mkdirat(device->root_fd, new_fidp->path, perm) < 0 )
             goto err;
 
-        XEN_TAILQ_REMOVE(&device->fids, fidp, list);
-        XEN_TAILQ_INSERT_HEAD(&device->fids, new_fidp, list);
-        free(fidp);
+        replace_fid(device, fidp, new_fidp);
         fidp = new_fidp;
         new_fidp = NULL;
 
@@ -1133,9 +1218,7 @@ static void p9_create(struct ring *ring, struct p9_header *hdr)
         }
         perm &= P9_CREATE_PERM_FILE_MASK & st.st_mode;
 
-        XEN_TAILQ_REMOVE(&device->fids, fidp, list);
-        XEN_TAILQ_INSERT_HEAD(&device->fids, new_fidp, list);
-        free(fidp);
+        replace_fid(device, fidp, new_fidp);
         fidp = new_fidp;
         new_fidp = NULL;
 
@@ -1149,46 +1232,59 @@ static void p9_create(struct ring *ring, struct p9_header *hdr)
         goto err;
 
     fill_qid(device, fidp->path, &qid, &st);
-    iounit = get_iounit(ring, &st);
+    iounit = get_iounit(req->ring, &st);
     fidp->opened = true;
     fidp->mode = mode;
 
     pthread_mutex_unlock(&device->fid_mutex);
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "QU", &qid, &iounit);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "QU", &qid, &iounit);
 
     return;
 
  err:
-    p9_error(ring, hdr->tag, errno);
+    p9_error(req, hdr->tag, errno);
 
     pthread_mutex_unlock(&device->fid_mutex);
 
-    free(new_fidp);
+    if ( new_fidp )
+        free_fid_mem(new_fidp);
     free_fid(device, fidp);
 }
 
-static void p9_clunk(struct ring *ring, struct p9_header *hdr)
+static void p9_clunk(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     struct p9_fid *fidp;
     int ret;
 
-    ret = fill_data(ring, "U", &fid);
+    ret = fill_data(req, "U", &fid);
     if ( ret != 1 )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
-    fidp = get_fid_ref(device, fid);
+    /* Make sure no new request can find the fid while it is being clunked. */
+    pthread_mutex_lock(&device->fid_mutex);
+    fidp = find_fid(device, fid);
+    if ( fidp )
+    {
+        fidp->ref++;
+        fidp->clunked = true;
+    }
+    pthread_mutex_unlock(&device->fid_mutex);
+
     if ( !fidp )
     {
-        p9_error(ring, hdr->tag, ENOENT);
+        p9_error(req, hdr->tag, ENOENT);
         return;
     }
 
+    /* Wait for requests still using the file. */
+    pthread_rwlock_wrlock(&fidp->lock);
+
     if ( fidp->opened )
     {
         fidp->opened = false;
@@ -1199,11 +1295,13 @@ static void p9_clunk(struct ring *ring, struct p9_header *hdr)
                      fidp->isdir ? AT_REMOVEDIR : 0);
     }
 
+    pthread_rwlock_unlock(&fidp->lock);
+
     /* 2 calls of free_fid(): one for our reference, and one to free it. */
     free_fid(device, fidp);
     free_fid(device, fidp);
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "");
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "");
 }
 
 static void fill_p9_stat(device *device, struct p9_stat *p9s, struct stat *st,
@@ -1233,45 +1331,45 @@ static void fill_p9_stat(device *device, struct p9_stat *p9s, struct stat *st,
     p9s->size = 71 + strlen(p9s->name);
 }
 
-static void p9_stat(struct ring *ring, struct p9_header *hdr)
+static void p9_stat(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     struct p9_fid *fidp;
     struct p9_stat p9s;
     struct stat st;
     int ret;
 
-    ret = fill_data(ring, "U", &fid);
+    ret = fill_data(req, "U", &fid);
     if ( ret != 1 )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
     fidp = get_fid_ref(device, fid);
     if ( !fidp )
     {
-        p9_error(ring, hdr->tag, ENOENT);
+        p9_error(req, hdr->tag, ENOENT);
         return;
     }
 
     if ( fstatat(device->root_fd, fidp->path, &st, 0) < 0 )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         goto out;
     }
     fill_p9_stat(device, &p9s, &st, strrchr(fidp->path, '/') + 1);
 
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "s", &p9s);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "s", &p9s);
 
  out:
     free_fid(device, fidp);
 }
 
-static void p9_read(struct ring *ring, struct p9_header *hdr)
+static void p9_read(struct p9_req *req, struct p9_header *hdr)
 {
-    device *device = ring->device;
+    device *device = req->ring->device;
     uint32_t fid;
     uint64_t off;
     unsigned int len;
@@ -1280,22 +1378,39 @@ static void p9_read(struct ring *ring, struct p9_header *hdr)
     struct p9_fid *fidp;
     int ret;
 
-    ret = fill_data(ring, "ULU", &fid, &off, &count);
+    ret = fill_data(req, "ULU", &fid, &off, &count);
     if ( ret != 3 )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
     fidp = get_fid_ref(device, fid);
-    if ( !fidp || !fidp->opened )
+    if ( !fidp )
+    {
+        p9_error(req, hdr->tag, EBADF);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fidp->lock);
+    if ( fidp->isdir )
+    {
+        /* Directory streams can't be shared, while file reads can. */
+        pthread_rwlock_unlock(&fidp->lock);
+        pthread_rwlock_wrlock(&fidp->lock);
+    }
+
+    if ( !fidp->opened )
     {
         errno = EBADF;
         goto err;
     }
 
+    /* The response has to fit into the buffer. */
+    count = min(count, (uint32_t)(req->ring->max_size - sizeof(*hdr) -
+                                  sizeof(uint32_t)));
     len = count;
-    buf = ring->buffer + sizeof(*hdr) + sizeof(uint32_t);
+    buf = req->buffer + sizeof(*hdr) + sizeof(uint32_t);
 
     if ( fidp->isdir )
     {
@@ -1343,190 +1458,488 @@ static void p9_read(struct ring *ring, struct p9_header *hdr)
             goto err;
     }
 
-    buf = ring->buffer + sizeof(*hdr) + sizeof(uint32_t);
+    /* The data has been read in place, fill_buffer() won't copy it. */
+    buf = req->buffer + sizeof(*hdr) + sizeof(uint32_t);
     len = count - len;
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "D", &len, buf);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "D", &len, buf);
 
  out:
+    pthread_rwlock_unlock(&fidp->lock);
     free_fid(device, fidp);
 
     return;
 
  err:
-    p9_error(ring, hdr->tag, errno);
+    p9_error(req, hdr->tag, errno);
     goto out;
 }
 
-static void p9_write(struct ring *ring, struct p9_header *hdr)
+static void p9_write(struct p9_req *req, struct p9_header *hdr)
 {
+    struct ring *ring = req->ring;
     device *device = ring->device;
     uint32_t fid;
     uint64_t off;
     unsigned int len;
-    uint32_t written;
-    void *buf;
+    uint32_t written = 0;
+    struct iovec iov[2];
+    unsigned int n_iov, i = 0;
     struct p9_fid *fidp;
-    int ret;
+    ssize_t ret;
 
-    ret = fill_data(ring, "ULD", &fid, &off, &len, ring->buffer);
-    if ( ret != 3 )
+    /* Only the fixed part is in the buffer, the data is still in the ring. */
+    ret = fill_data(req, "ULU", &fid, &off, &len);
+    if ( ret != 3 || len != hdr->size - P9_WRITE_HDR_SIZE )
     {
-        p9_error(ring, hdr->tag, EINVAL);
+        p9_error(req, hdr->tag, EINVAL);
         return;
     }
 
     fidp = get_fid_ref(device, fid);
-    if ( !fidp || !fidp->opened || fidp->isdir )
+    if ( !fidp )
+    {
+        p9_error(req, hdr->tag, EBADF);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fidp->lock);
+
+    if ( !fidp->opened || fidp->isdir )
     {
-        p9_error(ring, hdr->tag, EBADF);
+        p9_error(req, hdr->tag, EBADF);
         goto out;
     }
 
-    buf = ring->buffer;
+    n_iov = ring_out_iov(ring, req->payload, len, iov);
 
     while ( len != 0 )
     {
-        ret = pwrite(fidp->fd, buf, len, off);
+        ret = pwritev(fidp->fd, iov + i, n_iov - i, off);
         if ( ret < 0 )
             break;
         len -= ret;
-        buf += ret;
         off += ret;
+        written += ret;
+        for ( ; ret && ret >= iov[i].iov_len; i++ )
+            ret -= iov[i].iov_len;
+        if ( ret )
+        {
+            iov[i].iov_base += ret;
+            iov[i].iov_len -= ret;
+        }
     }
 
-    written = buf - ring->buffer;
     if ( written == 0 )
     {
-        p9_error(ring, hdr->tag, errno);
+        p9_error(req, hdr->tag, errno);
         goto out;
     }
-    fill_buffer(ring, hdr->cmd + 1, hdr->tag, "U", &written);
+    fill_buffer(req, hdr->cmd + 1, hdr->tag, "U", &written);
 
  out:
+    pthread_rwlock_unlock(&fidp->lock);
     free_fid(device, fidp);
 }
 
-void *io_thread(void *arg)
+static void handle_request(struct p9_req *req)
 {
-    struct ring *ring = arg;
-    unsigned int count = 0;
-    struct p9_header hdr = { .size = 0 };
-    bool in_hdr = true;
+    struct ring *ring = req->ring;
+    struct p9_header *hdr = &req->hdr;
 
-    ring->max_size = ring->ring_size;
-    ring->buffer = malloc(ring->max_size);
-    if ( !ring->buffer )
+    req->str_used = 0;
+
+    switch ( hdr->cmd )
     {
-        syslog(LOG_CRIT, "memory allocation failure!");
-        return NULL;
+    case P9_CMD_VERSION:
+        p9_version(req, hdr);
+        break;
+
+    case P9_CMD_ATTACH:
+        p9_attach(req, hdr);
+        break;
+
+    case P9_CMD_WALK:
+        p9_walk(req, hdr);
+        break;
+
+    case P9_CMD_OPEN:
+        p9_open(req, hdr);
+        break;
+
+    case P9_CMD_CREATE:
+        p9_create(req, hdr);
+        break;
+
+    case P9_CMD_READ:
+        p9_read(req, hdr);
+        break;
+
+    case P9_CMD_WRITE:
+        p9_write(req, hdr);
+        break;
+
+    case P9_CMD_CLUNK:
+        p9_clunk(req, hdr);
+        break;
+
+    case P9_CMD_STAT:
+        p9_stat(req, hdr);
+        break;
+
+    default:
+        syslog(LOG_DEBUG, "%u.%u sent unhandled command %u\n",
+               ring->device->domid, ring->device->devid, hdr->cmd);
+        p9_error(req, hdr->tag, EOPNOTSUPP);
+        break;
     }
+}
 
-    while ( !ring->stop_thread )
+/*
+ * Worker threads, shared by all rings.
+ *
+ * A ring's I/O thread queues each request it has read completely, any
+ * worker picks it up, and hands it back to the I/O thread via the ring's
+ * done list.  Without workers the I/O thread processes requests itself.
+ */
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct p9_req *work_head;
+static struct p9_req **work_tail = &work_head;
+static pthread_t *workers;
+static unsigned int n_workers;
+static bool workers_exit;
+
+static void complete_request(struct p9_req *req)
+{
+    struct ring *ring = req->ring;
+
+    pthread_mutex_lock(&ring->mutex);
+
+    req->next = NULL;
+    *ring->done_tail = req;
+    ring->done_tail = &req->next;
+    ring->n_running--;
+    pthread_cond_signal(&ring->cond);
+
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+static void *io_worker(void *arg)
+{
+    struct p9_req *req;
+
+    pthread_mutex_lock(&work_mutex);
+
+    for ( ; ; )
     {
-        pthread_mutex_lock(&ring->mutex);
-        if ( !io_work_pending(ring) )
+        req = work_head;
+        if ( !req )
         {
-            if ( !ring->error && xenevtchn_unmask(xe, ring->evtchn) < 0 )
-                syslog(LOG_WARNING, "xenevtchn_unmask() failed");
-            pthread_cond_wait(&ring->cond, &ring->mutex);
+            if ( workers_exit )
+                break;
+            pthread_cond_wait(&work_cond, &work_mutex);
+            continue;
         }
-        pthread_mutex_unlock(&ring->mutex);
 
-        if ( ring->stop_thread || ring->error )
+        work_head = req->next;
+        if ( !work_head )
+            work_tail = &work_head;
+
+        pthread_mutex_unlock(&work_mutex);
+
+        handle_request(req);
+        complete_request(req);
+
+        pthread_mutex_lock(&work_mutex);
+    }
+
+    pthread_mutex_unlock(&work_mutex);
+
+    return NULL;
+}
+
+void io_workers_start(unsigned int n)
+{
+    sigset_t set, old;
+
+    workers = calloc(n, sizeof(*workers));
+    if ( !workers )
+        return;
+
+    /* Signals are for the main thread. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for ( n_workers = 0; n_workers < n; n_workers++ )
+    {
+        if ( pthread_create(&workers[n_workers], NULL, io_worker, NULL) )
+        {
+            syslog(LOG_WARNING, "could only start %u of %u worker threads",
+                   n_workers, n);
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void io_workers_stop(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&work_mutex);
+    workers_exit = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+
+    for ( i = 0; i < n_workers; i++ )
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    workers = NULL;
+    n_workers = 0;
+    workers_exit = false;
+}
+
+static void queue_request(struct ring *ring, struct p9_req *req)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->n_running++;
+    pthread_mutex_unlock(&ring->mutex);
+
+    /* Tversion changes the ring state, it is run only with the ring idle. */
+    if ( !n_workers || req->hdr.cmd == P9_CMD_VERSION )
+    {
+        handle_request(req);
+        complete_request(req);
+        return;
+    }
+
+    pthread_mutex_lock(&work_mutex);
+    req->next = NULL;
+    *work_tail = req;
+    work_tail = &req->next;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+}
+
+static struct p9_req *get_req(struct ring *ring)
+{
+    struct p9_req *req;
+    unsigned int i;
+
+    for ( i = 0; i < MAX_RING_REQUESTS; i++ )
+    {
+        req = ring->req + i;
+        if ( req->busy )
             continue;
 
-        if ( !ring->handle_response )
+        if ( !req->buffer )
         {
-            if ( in_hdr )
+            req->buffer = malloc(ring->max_size);
+            if ( !req->buffer )
             {
-                count += get_request_bytes(ring, count, sizeof(hdr));
-                if ( count != sizeof(hdr) )
-                    continue;
-                hdr = *(struct p9_header *)ring->buffer;
-                if ( hdr.size > ring->max_size || hdr.size < sizeof(hdr) )
-                {
-                    syslog(LOG_ERR, "%u.%u specified illegal request length %u",
-                           ring->device->domid, ring->device->devid, hdr.size);
-                    ring->error = true;
-                    continue;
-                }
-                in_hdr = false;
+                syslog(LOG_CRIT, "memory allocation failure!");
+                ring->error = true;
+                return NULL;
             }
+        }
 
-            count += get_request_bytes(ring, count, hdr.size);
-            if ( count < hdr.size )
-                continue;
-
-            ring->str_used = 0;
+        req->busy = true;
+        ring->n_busy++;
 
-            switch ( hdr.cmd )
-            {
-            case P9_CMD_VERSION:
-                p9_version(ring, &hdr);
-                break;
+        return req;
+    }
 
-            case P9_CMD_ATTACH:
-                p9_attach(ring, &hdr);
-                break;
+    return NULL;
+}
 
-            case P9_CMD_WALK:
-                p9_walk(ring, &hdr);
-                break;
+static void put_req(struct ring *ring, struct p9_req *req)
+{
+    req->busy = false;
+    ring->n_busy--;
+}
 
-            case P9_CMD_OPEN:
-                p9_open(ring, &hdr);
-                break;
+/* Read as many requests from the ring as possible and queue them. */
+static void get_requests(struct ring *ring)
+{
+    struct p9_req *req;
+    struct p9_header *hdr;
+    unsigned int len;
 
-            case P9_CMD_CREATE:
-                p9_create(ring, &hdr);
-                break;
+    ring->rx_need = 1;
+    ring->rx_wait_idle = false;
 
-            case P9_CMD_READ:
-                p9_read(ring, &hdr);
-                break;
+    while ( !ring->error )
+    {
+        req = ring->rx_req;
+        if ( !req )
+        {
+            req = get_req(ring);
+            if ( !req )
+                return;
+            ring->rx_req = req;
+            ring->rx_count = 0;
+        }
+        hdr = &req->hdr;
 
-            case P9_CMD_WRITE:
-                p9_write(ring, &hdr);
-                break;
+        if ( ring->rx_count < sizeof(*hdr) )
+        {
+            ring->rx_count += get_request_bytes(ring, req->buffer,
+                                                ring->rx_count, sizeof(*hdr));
+            if ( ring->rx_count != sizeof(*hdr) )
+                return;
+            *hdr = *(struct p9_header *)req->buffer;
+            if ( hdr->size > ring->max_size || hdr->size < sizeof(*hdr) )
+            {
+                syslog(LOG_ERR, "%u.%u specified illegal request length %u",
+                       ring->device->domid, ring->device->devid, hdr->size);
+                ring->error = true;
+                return;
+            }
+        }
 
-            case P9_CMD_CLUNK:
-                p9_clunk(ring, &hdr);
-                break;
+        /* Write data is left in the ring and written to the file from there. */
+        len = hdr->size;
+        if ( hdr->cmd == P9_CMD_WRITE && len > P9_WRITE_HDR_SIZE )
+            len = P9_WRITE_HDR_SIZE;
 
-            case P9_CMD_STAT:
-                p9_stat(ring, &hdr);
-                break;
+        if ( ring->rx_count < len )
+        {
+            ring->rx_count += get_request_bytes(ring, req->buffer,
+                                                ring->rx_count, len);
+            if ( ring->rx_count < len )
+                return;
+        }
 
-            default:
-                syslog(LOG_DEBUG, "%u.%u sent unhandled command %u\n",
-                       ring->device->domid, ring->device->devid, hdr.cmd);
-                p9_error(ring, hdr.tag, EOPNOTSUPP);
-                break;
+        if ( ring->rx_count < hdr->size )
+        {
+            if ( ring_out_data(ring) < hdr->size - len )
+            {
+                ring->rx_need = hdr->size - len;
+                return;
             }
+            req->payload = ring->cons_pvt_out;
+            req->payload_held = true;
+            ring->cons_pvt_out += hdr->size - len;
+            ring->rx_count = hdr->size;
+        }
 
-            ring->handle_response = true;
-            hdr.size = ((struct p9_header *)ring->buffer)->size;
-            count = 0;
+        if ( hdr->cmd == P9_CMD_VERSION && ring->n_busy > 1 )
+        {
+            ring->rx_wait_idle = true;
+            return;
         }
 
-        if ( ring->handle_response )
+        ring->rx_req = NULL;
+        queue_request(ring, req);
+    }
+}
+
+/* Write completed responses to the ring, in the order they completed. */
+static void put_responses(struct ring *ring)
+{
+    struct p9_req *req;
+    struct p9_header *hdr;
+    bool sent = false;
+
+    while ( (req = ring->tx_head) != NULL )
+    {
+        hdr = req->buffer;
+        ring->tx_count += put_response_bytes(ring, req->buffer, ring->tx_count,
+                                             hdr->size);
+        if ( ring->tx_count < hdr->size )
+            break;
+
+        ring->tx_head = req->next;
+        if ( !ring->tx_head )
+            ring->tx_tail = &ring->tx_head;
+        ring->tx_count = 0;
+        put_req(ring, req);
+        sent = true;
+    }
+
+    /* Signal presence of responses. */
+    if ( sent )
+        xenevtchn_notify(xe, ring->evtchn);
+}
+
+/* Called with ring->mutex held. */
+static bool io_work_pending(struct ring *ring)
+{
+    if ( ring->stop_thread || ring->done_head )
+        return true;
+    if ( ring->error )
+        return false;
+    if ( ring->tx_head && ring_in_free(ring) )
+        return true;
+    if ( ring->rx_wait_idle || (!ring->rx_req &&
+                                ring->n_busy == MAX_RING_REQUESTS) )
+        return false;
+    return ring_out_data(ring) >= ring->rx_need;
+}
+
+void *io_thread(void *arg)
+{
+    struct ring *ring = arg;
+    struct p9_req *done, *req;
+    unsigned int i;
+
+    ring->max_size = ring->ring_size;
+    ring->rx_need = 1;
+    ring->tx_tail = &ring->tx_head;
+    ring->done_tail = &ring->done_head;
+    for ( i = 0; i < MAX_RING_REQUESTS; i++ )
+        ring->req[i].ring = ring;
+
+    while ( !ring->stop_thread )
+    {
+        pthread_mutex_lock(&ring->mutex);
+        if ( !io_work_pending(ring) )
         {
-            count += put_response_bytes(ring, count, hdr.size);
+            if ( !ring->error && xenevtchn_unmask(xe, ring->evtchn) < 0 )
+                syslog(LOG_WARNING, "xenevtchn_unmask() failed");
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+        done = ring->done_head;
+        ring->done_head = NULL;
+        ring->done_tail = &ring->done_head;
+        pthread_mutex_unlock(&ring->mutex);
 
-            if ( count == hdr.size )
-            {
-                /* Signal presence of response. */
-                xenevtchn_notify(xe, ring->evtchn);
+        if ( ring->stop_thread )
+            continue;
 
-                ring->handle_response = false;
-                in_hdr = true;
-                count = 0;
-            }
+        if ( done )
+        {
+            for ( req = done; req; req = req->next )
+                req->payload_held = false;
+            *ring->tx_tail = done;
+            for ( req = done; req->next; req = req->next )
+                ;
+            ring->tx_tail = &req->next;
+
+            /* The frontend can reuse the space of the write data now. */
+            release_out_data(ring);
         }
+
+        if ( ring->error )
+            continue;
+
+        put_responses(ring);
+        get_requests(ring);
     }
 
-    free(ring->str);
-    free(ring->buffer);
+    /* Workers might still access the ring or the request buffers. */
+    pthread_mutex_lock(&ring->mutex);
+    while ( ring->n_running )
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+    pthread_mutex_unlock(&ring->mutex);
+
+    for ( i = 0; i < MAX_RING_REQUESTS; i++ )
+    {
+        free(ring->req[i].str);
+        free(ring->req[i].buffer);
+    }
 
     ring->thread_active = false;
 
@@ -20,6 +20,10 @@
  * As an additional security measure the maximum file space used by the guest
  * can be limited by the backend Xenstore node "max-size" specifying the size
  * in MBytes. This size includes the size of the root directory of the guest.
+ *
+ * Requests are processed by a pool of worker threads, the number of which can
+ * be set via the XEN_9PFSD_WORKERS environment variable (0 processes requests
+ * in the I/O thread of each ring).
  */
 
 #include <err.h>
@@ -305,7 +309,7 @@ static device *new_device(unsigned int domid, unsigned int devid)
     }
 
     pthread_mutex_init(&device->fid_mutex, NULL);
-    XEN_TAILQ_INIT(&device->fids);
+    init_fids(device);
 
     val = read_backend_node(device, "security_model");
     if ( !val || strcmp(val, "none") )
@@ -656,6 +660,7 @@ static void close_all(void)
 
         remove_all_devices();
     }
+    io_workers_stop();
     if ( xe )
         xenevtchn_close(xe);
     if ( xg )
@@ -756,6 +761,7 @@ int main(int argc, char *argv[])
                       LOG_MASK(LOG_CRIT) | LOG_MASK(LOG_ALERT) |
                       LOG_MASK(LOG_EMERG);
     char **watch;
+    const char *workers;
     struct pollfd p[2] = {
         { .events = POLLIN },
         { .events = POLLIN }
@@ -772,6 +778,9 @@ int main(int argc, char *argv[])
 
     xen_connect();
 
+    workers = getenv("XEN_9PFSD_WORKERS");
+    io_workers_start(workers ? strtoul(workers, NULL, 0) : IO_WORKERS_DEFAULT);
+
     if ( !xs_watch(xs, "backend/xen_9pfs", "main") )
         do_err("xs_watch() in main thread failed");
     p[0].fd = xs_fileno(xs);
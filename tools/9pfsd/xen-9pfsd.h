@@ -14,6 +14,9 @@
 #define MAX_RINGS                4
 #define MAX_RING_ORDER           9
 #define MAX_OPEN_FILES_DEFAULT   5
+#define MAX_RING_REQUESTS        8    /* Requests in flight per ring. */
+#define FID_HASH_SIZE           64    /* Must be a power of 2. */
+#define IO_WORKERS_DEFAULT       4
 
 struct p9_header {
     uint32_t size;
@@ -22,9 +25,11 @@ struct p9_header {
 } __attribute__((packed));
 
 struct p9_fid {
-    XEN_TAILQ_ENTRY(struct p9_fid) list;
+    XEN_LIST_ENTRY(struct p9_fid) list;
     unsigned int fid;
     unsigned int ref;
+    bool clunked;
+    pthread_rwlock_t lock;    /* Shared for file I/O, exclusive otherwise. */
     int fd;
     uint8_t mode;
     bool opened;
@@ -34,6 +39,21 @@ struct p9_fid {
 };
 
 typedef struct device device;
+struct ring;
+
+struct p9_req {
+    struct ring *ring;
+    struct p9_req *next;    /* On the work queue or a ring's done list. */
+    bool busy;              /* From reading the request until the response
+                               has been written to the ring. */
+    bool payload_held;      /* Twrite data still needed in the out ring. */
+    RING_IDX payload;       /* Twrite data position in the out ring. */
+    struct p9_header hdr;
+    void *buffer;           /* Request/response buffer. */
+    char *str;              /* String work space. */
+    unsigned int str_size;  /* Size of *str. */
+    unsigned int str_used;  /* Currently used size of *str. */
+};
 
 struct ring {
     device *device;
@@ -52,15 +72,25 @@ struct ring {
     struct xen_9pfs_data data;
     RING_IDX prod_pvt_in;
     RING_IDX cons_pvt_out;
+    RING_IDX cons_pub_out;  /* Last out_cons made visible to the frontend. */
 
     /* Request and response handling. */
     uint32_t max_size;
     bool error;             /* Protocol error - stop processing. */
-    bool handle_response;   /* Main loop now handling response. */
-    void *buffer;           /* Request/response buffer. */
-    char *str;              /* String work space. */
-    unsigned int str_size;  /* Size of *str. */
-    unsigned int str_used;  /* Currently used size of *str. */
+    struct p9_req req[MAX_RING_REQUESTS];
+    unsigned int n_busy;    /* Number of req[] entries in use. */
+    struct p9_req *rx_req;  /* Request being read from the ring. */
+    unsigned int rx_count;  /* Bytes of *rx_req read so far. */
+    unsigned int rx_need;   /* Bytes needed in the ring to make progress. */
+    bool rx_wait_idle;      /* *rx_req must run with nothing else in flight. */
+    struct p9_req *tx_head; /* Responses to be written to the ring. */
+    struct p9_req **tx_tail;
+    unsigned int tx_count;  /* Bytes of *tx_head written so far. */
+
+    /* Protected by mutex. */
+    unsigned int n_running; /* Requests queued or being processed. */
+    struct p9_req *done_head;
+    struct p9_req **done_tail;
 };
 
 struct device {
@@ -86,7 +116,7 @@ struct device {
 
     /* File system handling. */
     pthread_mutex_t fid_mutex;
-    XEN_TAILQ_HEAD(fidhead, struct p9_fid) fids;
+    XEN_LIST_HEAD(fidhead, struct p9_fid) fids[FID_HASH_SIZE];
     struct p9_fid *root_fid;
     unsigned int n_fids;
 };
@@ -94,6 +124,9 @@ struct device {
 extern xenevtchn_handle *xe;
 
 void *io_thread(void *arg);
+void io_workers_start(unsigned int n);
+void io_workers_stop(void);
+void init_fids(device *device);
 void free_fids(device *device);
 
 #endif /* XEN_9PFSD_H */
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * epoll() based file descriptor event loop for the Xen Console Daemon.
+ *
+ * File descriptors are registered with the kernel once instead of handing
+ * the complete set to poll() in each main loop iteration.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "event.h"
+
+#define EPOLL_MAX_EVENTS 64
+
+struct fd_event {
+	int fd;
+	short events;
+	void (*func)(void *data, short revents);
+	void *data;
+};
+
+static int epoll_fd = -1;
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t ret = 0;
+
+	if (events & POLLIN)
+		ret |= EPOLLIN;
+	if (events & POLLPRI)
+		ret |= EPOLLPRI;
+	if (events & POLLOUT)
+		ret |= EPOLLOUT;
+
+	return ret;
+}
+
+static short epoll_to_poll(uint32_t events)
+{
+	short ret = 0;
+
+	if (events & EPOLLIN)
+		ret |= POLLIN;
+	if (events & EPOLLPRI)
+		ret |= POLLPRI;
+	if (events & EPOLLOUT)
+		ret |= POLLOUT;
+	if (events & EPOLLERR)
+		ret |= POLLERR;
+	if (events & EPOLLHUP)
+		ret |= POLLHUP;
+
+	return ret;
+}
+
+/*
+ * The kernel reports errors and hangups even for an fd with no events
+ * requested, so such an fd is taken out of the epoll set altogether.
+ */
+static int epoll_update(struct fd_event *ev, int op)
+{
+	struct epoll_event eev = {
+		.events = poll_to_epoll(ev->events),
+		.data.ptr = ev,
+	};
+
+	if (epoll_ctl(epoll_fd, op, ev->fd, &eev)) {
+		dolog(LOG_ERR, "epoll_ctl failed for fd %d: %d (%s)",
+		      ev->fd, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+struct fd_event *fd_event_add(int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data)
+{
+	struct fd_event *ev;
+
+	if (epoll_fd == -1) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd == -1) {
+			dolog(LOG_ERR, "epoll_create1 failed: %d (%s)",
+			      errno, strerror(errno));
+			return NULL;
+		}
+	}
+
+	ev = malloc(sizeof(*ev));
+	if (!ev) {
+		dolog(LOG_ERR, "Out of memory adding fd %d to event loop", fd);
+		return NULL;
+	}
+
+	ev->fd = fd;
+	ev->events = events;
+	ev->func = func;
+	ev->data = data;
+
+	if (events && epoll_update(ev, EPOLL_CTL_ADD)) {
+		free(ev);
+		return NULL;
+	}
+
+	return ev;
+}
+
+void fd_event_del(struct fd_event *ev)
+{
+	if (!ev)
+		return;
+
+	/* The fd might have been closed already, which removes it, too. */
+	if (ev->events && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL) &&
+	    errno != EBADF && errno != ENOENT)
+		dolog(LOG_ERR, "epoll_ctl DEL failed for fd %d: %d (%s)",
+		      ev->fd, errno, strerror(errno));
+
+	free(ev);
+}
+
+void fd_event_set(struct fd_event *ev, short events)
+{
+	int op;
+
+	if (ev->events == events)
+		return;
+
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (!ev->events)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	ev->events = events;
+	epoll_update(ev, op);
+}
+
+int fd_events_wait(int timeout)
+{
+	struct epoll_event eevs[EPOLL_MAX_EVENTS];
+	struct fd_event *ev;
+	int i, n;
+
+	if (epoll_fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	n = epoll_wait(epoll_fd, eevs, EPOLL_MAX_EVENTS, timeout);
+
+	for (i = 0; i < n; i++) {
+		ev = eevs[i].data.ptr;
+		ev->func(ev->data, epoll_to_poll(eevs[i].events));
+	}
+
+	return n;
+}
+
+/*
+ * Local variables:
+ *  mode: C
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
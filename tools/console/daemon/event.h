@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * File descriptor event loop for the Xen Console Daemon (epoll.c on Linux,
+ * poll.c elsewhere).
+ *
+ * An fd is registered once and stays registered until fd_event_del().
+ * func is called from fd_events_wait() with the poll() style revents seen.
+ * Handlers must not add or remove fd events themselves.  An fd with no
+ * events requested is not waited for at all.
+ */
+
+#ifndef CONSOLED_EVENT_H
+#define CONSOLED_EVENT_H
+
+struct fd_event;
+
+struct fd_event *fd_event_add(int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data);
+void fd_event_del(struct fd_event *ev);
+void fd_event_set(struct fd_event *ev, short events);
+
+/* Returns the number of events handled, or -1 with errno set. */
+int fd_events_wait(int timeout);
+
+#endif
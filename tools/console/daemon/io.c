@@ -21,6 +21,8 @@
 
 #include "utils.h"
 #include "io.h"
+#include "event.h"
+#include "log.h"
 #include <xenevtchn.h>
 #include <xenforeignmemory.h>
 #include <xengnttab.h>
@@ -67,19 +69,12 @@ extern int log_time_hv;
 extern int log_time_guest;
 extern char *log_dir;
 extern int discard_overflowed_data;
-extern int replace_escape;
 
-static int log_time_hv_needts = 1;
-static int log_time_guest_needts = 1;
-static int log_hv_fd = -1;
+static struct logfile *log_hv_file;
 
 static xengnttab_handle *xgt_handle = NULL;
 static xenforeignmemory_handle *xfm_handle;
 
-static struct pollfd  *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
-
 struct buffer {
 	char *data;
 	size_t consumed;
@@ -91,15 +86,17 @@ struct buffer {
 struct console {
 	const char *ttyname;
 	int master_fd;
-	int master_pollfd_idx;
+	struct fd_event *master_event;
+	short master_revents;
 	int slave_fd;
-	int log_fd;
+	struct logfile *log;
 	struct buffer buffer;
 	char *xspath;
 	const char *log_suffix;
 	int ring_ref;
 	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
+	struct fd_event *xce_event;
+	short xce_revents;
 	int event_count;
 	long long next_period;
 	xenevtchn_port_or_error_t local_port;
@@ -108,6 +105,12 @@ struct console {
 	struct domain *d;
 	bool optional;
 	bool use_gnttab;
+	/* On active_consoles, for events to be handled. */
+	bool active;
+	struct console *next_active;
+	/* On watched_consoles, to be looked at in every main loop pass. */
+	bool watched;
+	struct console *next_watched;
 };
 
 struct console_type {
@@ -149,6 +152,17 @@ struct domain {
 
 static struct domain *dom_head;
 
+/*
+ * Consoles with fd events to handle, and consoles which are rate limited
+ * or have a full input ring.  The state of the latter can change without
+ * any of their fds becoming ready, so they need to be checked regularly.
+ */
+static struct console *active_consoles;
+static struct console *watched_consoles;
+
+/* Set when domains might need shutting down or cleaning up. */
+static bool domains_changed;
+
 typedef void (*VOID_ITER_FUNC_ARG1)(struct console *);
 typedef int (*INT_ITER_FUNC_ARG1)(struct console *);
 typedef void (*VOID_ITER_FUNC_ARG2)(struct console *,  void *);
@@ -226,76 +240,6 @@ static inline int console_iter_int_arg3(struct domain *d,
 	return ret;
 }
 
-static void do_replace_escape(const char *src, char *dest, int len)
-{
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (src[i] == '\033')
-			dest[i] = '.';
-		else
-			dest[i] = src[i];
-	}
-}
-
-static int write_all(int fd, const char* buf, size_t len)
-{
-	while (len) {
-		ssize_t ret;
-		if (replace_escape) {
-			char buf_replaced[1024];
-			size_t this_round;
-
-			if (len > sizeof(buf_replaced))
-				this_round = sizeof(buf_replaced);
-			else
-				this_round = len;
-			do_replace_escape(buf, buf_replaced, this_round);
-			ret = write(fd, buf_replaced, this_round);
-		} else
-			ret = write(fd, buf, len);
-		if (ret == -1 && errno == EINTR)
-			continue;
-		if (ret <= 0)
-			return -1;
-		len -= ret;
-		buf += ret;
-	}
-
-	return 0;
-}
-
-static int write_with_timestamp(int fd, const char *data, size_t sz,
-				int *needts)
-{
-	char ts[32];
-	time_t now = time(NULL);
-	const struct tm *tmnow = localtime(&now);
-	size_t tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
-	const char *last_byte = data + sz - 1;
-
-	while (data <= last_byte) {
-		const char *nl = memchr(data, '\n', last_byte + 1 - data);
-		int found_nl = (nl != NULL);
-		if (!found_nl)
-			nl = last_byte;
-
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
-			return -1;
-
-		*needts = found_nl;
-		data = nl + 1;
-		if (found_nl) {
-			// If we printed a newline, strip all \r following it
-			while (data <= last_byte && *data == '\r')
-				data++;
-		}
-	}
-
-	return 0;
-}
-
 static inline bool buffer_available(struct console *con)
 {
 	if (discard_overflowed_data ||
@@ -309,7 +253,6 @@ static inline bool buffer_available(struct console *con)
 static void buffer_append(struct console *con)
 {
 	struct buffer *buffer = &con->buffer;
-	struct domain *dom = con->d;
 	XENCONS_RING_IDX cons, prod, size;
 	struct xencons_interface *intf = con->interface;
 
@@ -342,24 +285,9 @@ static void buffer_append(struct console *con)
 	 * no one is listening on the console pty then it will fill up
 	 * and handle_tty_write will stop being called.
 	 */
-	if (con->log_fd != -1) {
-		int logret;
-		if (log_time_guest) {
-			logret = write_with_timestamp(
-				con->log_fd,
-				buffer->data + buffer->size - size,
-				size, &log_time_guest_needts);
-		} else {
-			logret = write_all(
-				con->log_fd,
-				buffer->data + buffer->size - size,
-				size);
-		}
-		if (logret < 0)
-			dolog(LOG_ERR, "Write to log failed "
-			      "on domain %d: %d (%s)\n",
-			      dom->domid, errno, strerror(errno));
-	}
+	if (con->log)
+		logfile_write(con->log, buffer->data + buffer->size - size,
+			      size);
 
 	if (discard_overflowed_data && buffer->max_capacity &&
 	    buffer->size > 5 * buffer->max_capacity / 4) {
@@ -408,36 +336,19 @@ static bool domain_is_valid(int domid)
 	return xc_domain_getinfo_single(xc, domid, NULL) == 0;
 }
 
-static int create_hv_log(void)
+static struct logfile *create_hv_log(void)
 {
 	char logfile[PATH_MAX];
-	int fd;
 	snprintf(logfile, PATH_MAX-1, "%s/hypervisor.log", log_dir);
 	logfile[PATH_MAX-1] = '\0';
 
-	fd = open(logfile, O_WRONLY|O_CREAT|O_APPEND, 0644);
-	if (fd == -1)
-		dolog(LOG_ERR, "Failed to open log %s: %d (%s)",
-		      logfile, errno, strerror(errno));
-	if (fd != -1 && log_time_hv) {
-		if (write_with_timestamp(fd, "Logfile Opened\n",
-					 strlen("Logfile Opened\n"),
-					 &log_time_hv_needts) < 0) {
-			dolog(LOG_ERR, "Failed to log opening timestamp "
-				       "in %s: %d (%s)", logfile, errno,
-				       strerror(errno));
-			close(fd);
-			return -1;
-		}
-	}
-	return fd;
+	return logfile_open(logfile, log_time_hv);
 }
 
-static int create_console_log(struct console *con)
+static struct logfile *create_console_log(struct console *con)
 {
 	char logfile[PATH_MAX];
 	char *namepath, *data, *s;
-	int fd;
 	unsigned int len;
 	struct domain *dom = con->d;
 
@@ -445,17 +356,17 @@ static int create_console_log(struct console *con)
 	s = realloc(namepath, strlen(namepath) + 6);
 	if (s == NULL) {
 		free(namepath);
-		return -1;
+		return NULL;
 	}
 	namepath = s;
 	strcat(namepath, "/name");
 	data = xs_read(xs, XBT_NULL, namepath, &len);
 	free(namepath);
 	if (!data)
-		return -1;
+		return NULL;
 	if (!len) {
 		free(data);
-		return -1;
+		return NULL;
 	}
 
 	snprintf(logfile, PATH_MAX-1, "%s/guest-%s%s.log",
@@ -464,26 +375,100 @@ static int create_console_log(struct console *con)
 	free(data);
 	logfile[PATH_MAX-1] = '\0';
 
-	fd = open(logfile, O_WRONLY|O_CREAT|O_APPEND, 0644);
-	if (fd == -1)
-		dolog(LOG_ERR, "Failed to open log %s: %d (%s)",
-		      logfile, errno, strerror(errno));
-	if (fd != -1 && log_time_guest) {
-		if (write_with_timestamp(fd, "Logfile Opened\n",
-					 strlen("Logfile Opened\n"),
-					 &log_time_guest_needts) < 0) {
-			dolog(LOG_ERR, "Failed to log opening timestamp "
-				       "in %s: %d (%s)", logfile, errno,
-				       strerror(errno));
-			close(fd);
-			return -1;
+	return logfile_open(logfile, log_time_guest);
+}
+
+static void console_mark_active(struct console *con)
+{
+	if (!con->active) {
+		con->active = true;
+		con->next_active = active_consoles;
+		active_consoles = con;
+	}
+}
+
+static void console_watch(struct console *con, bool watch)
+{
+	struct console **pp;
+
+	if (watch == con->watched)
+		return;
+
+	con->watched = watch;
+	if (watch) {
+		con->next_watched = watched_consoles;
+		watched_consoles = con;
+		return;
+	}
+
+	for (pp = &watched_consoles; *pp; pp = &(*pp)->next_watched) {
+		if (*pp == con) {
+			*pp = con->next_watched;
+			break;
 		}
 	}
-	return fd;
+}
+
+static void console_xce_event(void *data, short revents)
+{
+	struct console *con = data;
+
+	con->xce_revents |= revents;
+	console_mark_active(con);
+}
+
+static void console_master_event(void *data, short revents)
+{
+	struct console *con = data;
+
+	con->master_revents |= revents;
+	console_mark_active(con);
+}
+
+static int ring_free_bytes(struct console *con);
+
+/*
+ * Bring the events waited for on the console's fds in line with its
+ * state.  To be called whenever that state might have changed.
+ */
+static void console_update_events(struct console *con)
+{
+	bool watch = false;
+	short events;
+
+	if (con->xce_event) {
+		events = 0;
+		if (con->event_count >= RATE_LIMIT_ALLOWANCE)
+			watch = true;
+		else if (buffer_available(con))
+			events = POLLIN|POLLPRI;
+		fd_event_set(con->xce_event, events);
+	}
+
+	if (con->master_event) {
+		events = 0;
+		if (!con->d->is_dead && con->interface) {
+			if (ring_free_bytes(con))
+				events |= POLLIN;
+			else
+				watch = true;
+		}
+
+		if (!buffer_empty(&con->buffer))
+			events |= POLLOUT;
+
+		fd_event_set(con->master_event, events ? events|POLLPRI : 0);
+	}
+
+	console_watch(con, watch);
 }
 
 static void console_close_tty(struct console *con)
 {
+	fd_event_del(con->master_event);
+	con->master_event = NULL;
+	con->master_revents = 0;
+
 	if (con->master_fd != -1) {
 		close(con->master_fd);
 		con->master_fd = -1;
@@ -623,6 +608,12 @@ static int console_create_tty(struct console *con)
 	if (fcntl(con->master_fd, F_SETFL, O_NONBLOCK) == -1)
 		goto out;
 
+	con->master_event = fd_event_add(con->master_fd, 0,
+					 console_master_event, con);
+	if (!con->master_event)
+		goto out;
+	console_update_events(con);
+
 	return 1;
 out:
 	console_close_tty(con);
@@ -676,6 +667,18 @@ static void console_unmap_interface(struct console *con)
 	con->ring_ref = -1;
 }
  
+static void console_close_evtchn(struct console *con)
+{
+	fd_event_del(con->xce_event);
+	con->xce_event = NULL;
+	con->xce_revents = 0;
+
+	if (con->xce_handle != NULL)
+		xenevtchn_close(con->xce_handle);
+
+	con->xce_handle = NULL;
+}
+
 static int console_create_ring(struct console *con)
 {
 	int err, remote_port, ring_ref, rc;
@@ -743,8 +746,7 @@ static int console_create_ring(struct console *con)
 
 	con->local_port = -1;
 	con->remote_port = -1;
-	if (con->xce_handle != NULL)
-		xenevtchn_close(con->xce_handle);
+	console_close_evtchn(con);
 
 	/* Opening evtchn independently for each console is a bit
 	 * wasteful, but that's how the code is structured... */
@@ -759,32 +761,41 @@ static int console_create_ring(struct console *con)
 
 	if (rc == -1) {
 		err = errno;
-		xenevtchn_close(con->xce_handle);
-		con->xce_handle = NULL;
+		console_close_evtchn(con);
 		goto out;
 	}
+
+	con->xce_event = fd_event_add(xenevtchn_fd(con->xce_handle), 0,
+				      console_xce_event, con);
+	if (!con->xce_event) {
+		err = ENOMEM;
+		console_close_evtchn(con);
+		goto out;
+	}
+
 	con->local_port = rc;
 	con->remote_port = remote_port;
 
 	if (con->master_fd == -1) {
 		if (!console_create_tty(con)) {
 			err = errno;
-			xenevtchn_close(con->xce_handle);
-			con->xce_handle = NULL;
+			console_close_evtchn(con);
 			con->local_port = -1;
 			con->remote_port = -1;
 			goto out;
 		}
 	}
 
-	if (log_guest && (con->log_fd == -1))
-		con->log_fd = create_console_log(con);
+	if (log_guest && !con->log)
+		con->log = create_console_log(con);
 
  out:
 	/* Mark the console connected. */
 	if (!err && con->interface)
 		con->interface->connection = XENCONSOLE_CONNECTED;
 
+	console_update_events(con);
+
 	return err;
 }
 
@@ -824,13 +835,10 @@ static int console_init(struct console *con, struct domain *dom, void **data)
 	}
 
 	con->master_fd = -1;
-	con->master_pollfd_idx = -1;
 	con->slave_fd = -1;
-	con->log_fd = -1;
 	con->ring_ref = -1;
 	con->local_port = -1;
 	con->remote_port = -1;
-	con->xce_pollfd_idx = -1;
 	con->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 	con->d = dom;
 	con->ttyname = (*con_type)->ttyname;
@@ -918,10 +926,10 @@ static void remove_domain(struct domain *dom)
 
 static void console_cleanup(struct console *con)
 {
-	if (con->log_fd != -1) {
-		close(con->log_fd);
-		con->log_fd = -1;
-	}
+	console_watch(con, false);
+
+	logfile_close(con->log);
+	con->log = NULL;
 
 	free(con->buffer.data);
 	con->buffer.data = NULL;
@@ -939,17 +947,10 @@ static void cleanup_domain(struct domain *d)
 	remove_domain(d);
 }
 
-static void console_close_evtchn(struct console *con)
-{
-	if (con->xce_handle != NULL)
-		xenevtchn_close(con->xce_handle);
-
-	con->xce_handle = NULL;
-}
-
 static void shutdown_domain(struct domain *d)
 {
 	d->is_dead = true;
+	domains_changed = true;
 	watch_domain(d, false);
 	console_iter_void_arg1(d, console_unmap_interface);
 	console_iter_void_arg1(d, console_close_evtchn);
@@ -969,6 +970,7 @@ static void enum_domains(void)
 	struct domain *dom;
 
 	enum_pass++;
+	domains_changed = true;
 
 	/* Fetch info on every valid domain except for dom0 */
 	ret = xc_domain_getinfolist(xc, 1, DOMID_FIRST_RESERVED - 1, domaininfo);
@@ -1123,19 +1125,20 @@ static void handle_ring_read(struct console *con)
 		(void)xenevtchn_unmask(con->xce_handle, port);
 }
 
-static void handle_console_ring(struct console *con)
+static void handle_console_ring(struct console *con, long long now)
 {
+	short revents = con->xce_revents;
+
+	con->xce_revents = 0;
+
+	console_evtchn_unmask(con, &now);
+
 	if (con->event_count < RATE_LIMIT_ALLOWANCE) {
 		if (con->xce_handle != NULL &&
-		    con->xce_pollfd_idx != -1 &&
-		    !(fds[con->xce_pollfd_idx].revents &
-		      ~(POLLIN|POLLOUT|POLLPRI)) &&
-		    (fds[con->xce_pollfd_idx].revents &
-		     POLLIN))
+		    !(revents & ~(POLLIN|POLLOUT|POLLPRI)) &&
+		    (revents & POLLIN))
 			handle_ring_read(con);
 	}
-
-	con->xce_pollfd_idx = -1;
 }
 
 static void handle_xs(void)
@@ -1175,22 +1178,13 @@ static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 
 	do
 	{
-		int logret;
-
 		size = sizeof(buffer);
 		if (xc_readconsolering(xc, bufptr, &size, 0, 1, &index) != 0 ||
 		    size == 0)
 			break;
 
-		if (log_time_hv)
-			logret = write_with_timestamp(log_hv_fd, buffer, size,
-						      &log_time_hv_needts);
-		else
-			logret = write_all(log_hv_fd, buffer, size);
-
-		if (logret < 0)
-			dolog(LOG_ERR, "Failed to write hypervisor log: "
-				       "%d (%s)", errno, strerror(errno));
+		if (log_hv_file)
+			logfile_write(log_hv_file, buffer, size);
 	} while (size == sizeof(buffer));
 
 	if (port != -1)
@@ -1200,9 +1194,8 @@ static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 static void console_open_log(struct console *con)
 {
 	if (console_enabled(con)) {
-		if (con->log_fd != -1)
-			close(con->log_fd);
-		con->log_fd = create_console_log(con);
+		logfile_close(con->log);
+		con->log = create_console_log(con);
 	}
 }
 
@@ -1216,115 +1209,61 @@ static void handle_log_reload(void)
 	}
 
 	if (log_hv) {
-		if (log_hv_fd != -1)
-			close(log_hv_fd);
-		log_hv_fd = create_hv_log();
+		logfile_close(log_hv_file);
+		log_hv_file = create_hv_log();
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
+static void handle_console_tty(struct console *con)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 1U << 8);
+	short revents = con->master_revents;
 
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
+	con->master_revents = 0;
 
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
+	if (con->master_fd != -1 && con->master_event) {
+		if (revents & ~(POLLIN|POLLOUT|POLLPRI))
+			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
+		else {
+			if (revents & POLLIN)
+				handle_tty_read(con);
+			if (revents & POLLOUT)
+				handle_tty_write(con);
+		}
 	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
 }
 
-static void reset_fds(void)
+static short xs_revents, xce_revents;
+
+static void xs_event(void *data, short revents)
 {
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
+	xs_revents = revents;
 }
 
-static void maybe_add_console_evtchn_fd(struct console *con, void *data)
+static void xce_event(void *data, short revents)
 {
-	long long next_timeout = *((long long *)data);
-
-	if (con->event_count >= RATE_LIMIT_ALLOWANCE) {
-		/* Determine if we're going to be the next time slice to expire */
-		if (!next_timeout ||
-		    con->next_period < next_timeout)
-			next_timeout = con->next_period;
-	} else if (con->xce_handle != NULL) {
-		if (buffer_available(con)) {
-			int evtchn_fd = xenevtchn_fd(con->xce_handle);
-			con->xce_pollfd_idx = set_fds(evtchn_fd,
-						      POLLIN|POLLPRI);
-		}
-	}
-
-	*((long long *)data) = next_timeout;
+	xce_revents = revents;
 }
 
-static void maybe_add_console_tty_fd(struct console *con)
+static long long now_ms(void)
 {
-	if (con->master_fd != -1) {
-		short events = 0;
-		if (!con->d->is_dead && ring_free_bytes(con))
-			events |= POLLIN;
-
-		if (!buffer_empty(&con->buffer))
-			events |= POLLOUT;
+	struct timespec ts;
 
-		if (events)
-			con->master_pollfd_idx =
-				set_fds(con->master_fd, events|POLLPRI);
-	}
-}
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return -1;
 
-static void handle_console_tty(struct console *con)
-{
-	if (con->master_fd != -1 && con->master_pollfd_idx != -1) {
-		if (fds[con->master_pollfd_idx].revents &
-		    ~(POLLIN|POLLOUT|POLLPRI))
-			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
-		else {
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLIN)
-				handle_tty_read(con);
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLOUT)
-				handle_tty_write(con);
-		}
-	}
-	con->master_pollfd_idx = -1;
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 }
 
 void handle_io(void)
 {
 	int ret;
 	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct fd_event *xce_fd_event = NULL;
+	struct fd_event *xs_fd_event = NULL;
 	xenevtchn_handle *xce_handle = NULL;
 
+	logfile_writer_start();
+
 	if (log_hv) {
 		xce_handle = xenevtchn_open(NULL, 0);
 		if (xce_handle == NULL) {
@@ -1332,8 +1271,8 @@ void handle_io(void)
 			      errno, strerror(errno));
 			goto out;
 		}
-		log_hv_fd = create_hv_log();
-		if (log_hv_fd == -1)
+		log_hv_file = create_hv_log();
+		if (!log_hv_file)
 			goto out;
 		log_hv_evtchn = xenevtchn_bind_virq(xce_handle, VIRQ_CON_RING);
 		if (log_hv_evtchn == -1) {
@@ -1343,6 +1282,11 @@ void handle_io(void)
 		}
 		/* Log the boot dmesg even if VIRQ_CON_RING isn't pending. */
 		handle_hv_logs(xce_handle, true);
+
+		xce_fd_event = fd_event_add(xenevtchn_fd(xce_handle),
+					    POLLIN|POLLPRI, xce_event, NULL);
+		if (!xce_fd_event)
+			goto out;
 	}
 
 	xgt_handle = xengnttab_open(NULL, 0);
@@ -1359,36 +1303,39 @@ void handle_io(void)
 		goto out;
 	}
 
+	xs_fd_event = fd_event_add(xs_fileno(xs), POLLIN|POLLPRI,
+				   xs_event, NULL);
+	if (!xs_fd_event)
+		goto out;
+
 	enum_domains();
 
 	for (;;) {
 		struct domain *d, *n;
+		struct console *con, *next;
 		int poll_timeout; /* timeout in milliseconds */
-		struct timespec ts;
 		long long now, next_timeout = 0;
 
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
-
-		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
-
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		now = now_ms();
+		if (now < 0)
 			break;
-		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
 		/* Re-calculate any event counter allowances & unblock
-		   domains with new allowance */
-		for (d = dom_head; d; d = d->next) {
-
-			console_iter_void_arg2(d, console_evtchn_unmask, (void *)&now);
-
-			console_iter_void_arg2(d, maybe_add_console_evtchn_fd, 
-					       (void *)&next_timeout);
-
-			console_iter_void_arg1(d, maybe_add_console_tty_fd);
+		   consoles with new allowance.  Also re-check the ones
+		   waiting for room in their input ring. */
+		con = watched_consoles;
+		watched_consoles = NULL;
+		for (; con; con = next) {
+			next = con->next_watched;
+			con->watched = false;
+
+			console_evtchn_unmask(con, &now);
+			console_update_events(con);
+
+			/* Work out when the next time slice expires */
+			if (con->event_count >= RATE_LIMIT_ALLOWANCE &&
+			    (!next_timeout || con->next_period < next_timeout))
+				next_timeout = con->next_period;
 		}
 
 		/* If any domain has been rate limited, we need to work
@@ -1400,7 +1347,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = fd_events_wait(next_timeout ? poll_timeout : -1);
 
 		if (log_reload) {
 			int saved_errno = errno;
@@ -1421,40 +1368,55 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		if (xce_revents) {
+			if (xce_revents & ~(POLLIN|POLLOUT|POLLPRI)) {
 				dolog(LOG_ERR,
 				      "Failure in poll xce_handle: %d (%s)",
 				      errno, strerror(errno));
 				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
+			} else if (xce_revents & POLLIN)
 				handle_hv_logs(xce_handle, false);
 
-			xce_pollfd_idx = -1;
+			xce_revents = 0;
 		}
 
 		if (ret <= 0)
 			continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		now = now_ms();
+
+		if (xs_revents) {
+			if (xs_revents & ~(POLLIN|POLLOUT|POLLPRI)) {
 				dolog(LOG_ERR,
 				      "Failure in poll xs_handle: %d (%s)",
 				      errno, strerror(errno));
 				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
+			} else if (xs_revents & POLLIN)
 				handle_xs();
 
-			xs_pollfd_idx = -1;
+			xs_revents = 0;
 		}
 
-		for (d = dom_head; d; d = n) {
+		con = active_consoles;
+		active_consoles = NULL;
+		for (; con; con = next) {
+			next = con->next_active;
+			con->active = false;
 
-			n = d->next;
+			handle_console_ring(con, now);
+
+			handle_console_tty(con);
+
+			console_update_events(con);
+		}
+
+		if (!domains_changed)
+			continue;
+		domains_changed = false;
 
-			console_iter_void_arg1(d, handle_console_ring);
+		for (d = dom_head; d; d = n) {
 
-			console_iter_void_arg1(d, handle_console_tty);
+			n = d->next;
 
 			if (d->last_seen != enum_pass)
 				shutdown_domain(d);
@@ -1464,14 +1426,11 @@ void handle_io(void)
 		}
 	}
 
-	free(fds);
-	current_array_size = 0;
-
  out:
-	if (log_hv_fd != -1) {
-		close(log_hv_fd);
-		log_hv_fd = -1;
-	}
+	fd_event_del(xs_fd_event);
+	fd_event_del(xce_fd_event);
+	logfile_close(log_hv_file);
+	log_hv_file = NULL;
 	if (xce_handle != NULL) {
 		xenevtchn_close(xce_handle);
 		xce_handle = NULL;
@@ -1485,6 +1444,7 @@ void handle_io(void)
 		xfm_handle = NULL;
 	}
 	log_hv_evtchn = -1;
+	logfile_writer_stop();
 }
 
 /*
@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * Console and hypervisor log files for the Xen Console Daemon.
+ *
+ * Each log file has a fixed size ring buffer.  The main loop formats data
+ * into it (adding timestamps and replacing escape characters as needed)
+ * and puts the file on the pending list, from which the writer thread
+ * takes it to write out one contiguous chunk at a time.  The writer owns
+ * the chunk it is writing, the main loop only ever fills the free part of
+ * the ring, so neither has to wait for the other's I/O.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include <xen-tools/common-macros.h>
+
+/* Output buffered per log file before it gets dropped. */
+#define LOGFILE_BUFFER_SIZE (64 * 1024)
+
+extern int replace_escape;
+
+struct logfile {
+	int fd;
+	char *path;
+	bool timestamps;
+
+	/* All of the following is protected by log_lock. */
+	char *buf;		/* Allocated on first use. */
+	size_t head;		/* Offset of the oldest byte queued. */
+	size_t len;		/* Number of bytes queued. */
+	size_t dropped;		/* Bytes lost since the last ones queued. */
+	bool bol;		/* Queued data ends at the beginning of a line. */
+	bool queued;		/* On the pending list. */
+	bool busy;		/* The writer is writing part of buf. */
+	bool closing;
+	bool failed;		/* The last write failed (and was reported). */
+	struct logfile *next;
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static struct logfile *pending_head;
+static struct logfile **pending_tail = &pending_head;
+static pthread_t writer;
+static bool writer_running;
+static bool writer_exit;
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		len -= ret;
+		buf += ret;
+	}
+
+	return 0;
+}
+
+static void logfile_free(struct logfile *lf)
+{
+	close(lf->fd);
+	free(lf->buf);
+	free(lf->path);
+	free(lf);
+}
+
+/*
+ * Write out the oldest contiguous chunk of queued data.  Called, and
+ * returns, with log_lock held, which is dropped during the write.
+ */
+static void logfile_write_chunk(struct logfile *lf)
+{
+	size_t n = min(lf->len, LOGFILE_BUFFER_SIZE - lf->head);
+	const char *data = lf->buf + lf->head;
+	int ret;
+
+	lf->busy = true;
+	pthread_mutex_unlock(&log_lock);
+
+	ret = write_all(lf->fd, data, n);
+	if (ret < 0 && !lf->failed)
+		dolog(LOG_ERR, "Write to log %s failed: %d (%s)",
+		      lf->path, errno, strerror(errno));
+
+	pthread_mutex_lock(&log_lock);
+	lf->busy = false;
+	lf->failed = ret < 0;
+
+	/* On failure the chunk is lost, there is no point in retrying. */
+	lf->head = (lf->head + n) % LOGFILE_BUFFER_SIZE;
+	lf->len -= n;
+}
+
+/* Hand @lf to the writer thread, or write it out now without one. */
+static void logfile_kick(struct logfile *lf)
+{
+	if (!writer_running) {
+		while (lf->len)
+			logfile_write_chunk(lf);
+		return;
+	}
+
+	/* A busy file is looked at again by the writer when it's done. */
+	if (lf->queued || lf->busy)
+		return;
+
+	lf->queued = true;
+	lf->next = NULL;
+	*pending_tail = lf;
+	pending_tail = &lf->next;
+	pthread_cond_signal(&log_cond);
+}
+
+static void *logfile_writer(void *arg)
+{
+	struct logfile *lf;
+
+	pthread_mutex_lock(&log_lock);
+
+	for (;;) {
+		lf = pending_head;
+		if (!lf) {
+			if (writer_exit)
+				break;
+			pthread_cond_wait(&log_cond, &log_lock);
+			continue;
+		}
+
+		pending_head = lf->next;
+		if (!pending_head)
+			pending_tail = &pending_head;
+		lf->queued = false;
+
+		/* One chunk at a time, so a busy file can't starve others. */
+		if (lf->len)
+			logfile_write_chunk(lf);
+
+		if (lf->len)
+			logfile_kick(lf);
+		else if (lf->closing)
+			logfile_free(lf);
+	}
+
+	pthread_mutex_unlock(&log_lock);
+
+	return NULL;
+}
+
+void logfile_writer_start(void)
+{
+	sigset_t set, old;
+	int ret;
+
+	/* Leave signals, in particular SIGHUP, to the main loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&writer, NULL, logfile_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		dolog(LOG_ERR, "Failed to start log writer thread: %d (%s)",
+		      ret, strerror(ret));
+		return;
+	}
+
+	writer_running = true;
+}
+
+void logfile_writer_stop(void)
+{
+	if (!writer_running)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	writer_exit = true;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(writer, NULL);
+
+	writer_running = false;
+	writer_exit = false;
+}
+
+/* Copy @len bytes into the free part of the ring.  log_lock held. */
+static void logfile_queue(struct logfile *lf, const char *data, size_t len)
+{
+	size_t tail = (lf->head + lf->len) % LOGFILE_BUFFER_SIZE;
+	size_t i, n;
+
+	while (len) {
+		n = min(len, LOGFILE_BUFFER_SIZE - tail);
+
+		if (replace_escape) {
+			for (i = 0; i < n; i++)
+				lf->buf[tail + i] = data[i] == '\033' ? '.'
+								      : data[i];
+		} else
+			memcpy(lf->buf + tail, data, n);
+
+		lf->len += n;
+		data += n;
+		len -= n;
+		tail = (tail + n) % LOGFILE_BUFFER_SIZE;
+	}
+}
+
+void logfile_write(struct logfile *lf, const char *data, size_t sz)
+{
+	char ts[32], note[64];
+	size_t tslen = 0, notelen, n, need;
+	const char *last_byte = data + sz - 1;
+
+	if (lf->timestamps) {
+		time_t now = time(NULL);
+		const struct tm *tmnow = localtime(&now);
+
+		tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
+	}
+
+	pthread_mutex_lock(&log_lock);
+
+	if (!lf->buf) {
+		lf->buf = malloc(LOGFILE_BUFFER_SIZE);
+		if (!lf->buf) {
+			lf->dropped += sz;
+			goto out;
+		}
+	}
+
+	while (data <= last_byte) {
+		const char *nl = memchr(data, '\n', last_byte + 1 - data);
+		bool found_nl = (nl != NULL);
+
+		if (!found_nl)
+			nl = last_byte;
+		n = nl + 1 - data;
+
+		notelen = 0;
+		if (lf->dropped)
+			notelen = snprintf(note, sizeof(note),
+					   "%s[xenconsoled: %zu bytes lost]\n",
+					   lf->bol ? "" : "\n", lf->dropped);
+
+		need = n + (lf->timestamps ? 2 * tslen : 0) + notelen;
+		if (need > LOGFILE_BUFFER_SIZE - lf->len) {
+			lf->dropped += n;
+		} else {
+			if (notelen) {
+				if (lf->timestamps)
+					logfile_queue(lf, ts, tslen);
+				logfile_queue(lf, note, notelen);
+				lf->dropped = 0;
+				lf->bol = true;
+			}
+			if (lf->timestamps && lf->bol)
+				logfile_queue(lf, ts, tslen);
+			logfile_queue(lf, data, n);
+			lf->bol = found_nl;
+		}
+
+		data = nl + 1;
+		if (found_nl) {
+			/* If we printed a newline, strip all \r following it */
+			while (data <= last_byte && *data == '\r')
+				data++;
+		}
+	}
+
+	logfile_kick(lf);
+
+ out:
+	pthread_mutex_unlock(&log_lock);
+}
+
+struct logfile *logfile_open(const char *path, bool timestamps)
+{
+	struct logfile *lf;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (fd == -1) {
+		dolog(LOG_ERR, "Failed to open log %s: %d (%s)",
+		      path, errno, strerror(errno));
+		return NULL;
+	}
+
+	lf = calloc(1, sizeof(*lf));
+	if (lf)
+		lf->path = strdup(path);
+	if (!lf || !lf->path) {
+		dolog(LOG_ERR, "Out of memory opening log %s", path);
+		free(lf);
+		close(fd);
+		return NULL;
+	}
+
+	lf->fd = fd;
+	lf->timestamps = timestamps;
+	lf->bol = true;
+
+	if (timestamps)
+		logfile_write(lf, "Logfile Opened\n", strlen("Logfile Opened\n"));
+
+	return lf;
+}
+
+void logfile_close(struct logfile *lf)
+{
+	if (!lf)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+
+	if (writer_running) {
+		lf->closing = true;
+		logfile_kick(lf);
+		lf = NULL;
+	}
+
+	pthread_mutex_unlock(&log_lock);
+
+	if (lf)
+		logfile_free(lf);
+}
+
+/*
+ * Local variables:
+ *  mode: C
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
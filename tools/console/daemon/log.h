@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * Console and hypervisor log files for the Xen Console Daemon.
+ *
+ * Writes are queued in a bounded per-file buffer and written out by a
+ * separate thread, so a slow disk can't stall console I/O.  When a file's
+ * buffer is full, new output for it is dropped and a note saying how much
+ * was lost is written once there is room again.
+ */
+
+#ifndef CONSOLED_LOG_H
+#define CONSOLED_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct logfile;
+
+/* Start the writer thread.  Without it, writes are done synchronously. */
+void logfile_writer_start(void);
+/* Write out everything queued and stop the writer thread. */
+void logfile_writer_stop(void);
+
+struct logfile *logfile_open(const char *path, bool timestamps);
+void logfile_write(struct logfile *lf, const char *data, size_t len);
+/* Close the file once all data queued for it has been written. */
+void logfile_close(struct logfile *lf);
+
+#endif
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * poll() based file descriptor event loop for the Xen Console Daemon.
+ *
+ * Used where epoll() isn't available.  The pollfd array is kept across
+ * main loop iterations and only modified when fds are added or removed.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "event.h"
+
+#include <xen-tools/common-macros.h>
+
+struct fd_event {
+	unsigned int idx;
+	short events;
+	void (*func)(void *data, short revents);
+	void *data;
+};
+
+static struct pollfd *poll_fds;
+static struct fd_event **poll_evs;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+struct fd_event *fd_event_add(int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data)
+{
+	struct fd_event *ev;
+
+	if (current_array_size < nr_fds + 1) {
+		struct pollfd *new_fds;
+		struct fd_event **new_evs;
+		unsigned long newsize;
+
+		/* Round up to 2^8 boundary, in practice this just
+		 * make newsize larger than current_array_size.
+		 */
+		newsize = ROUNDUP(nr_fds + 1, 1U << 8);
+
+		new_fds = realloc(poll_fds, sizeof(*poll_fds) * newsize);
+		if (!new_fds)
+			goto fail;
+		poll_fds = new_fds;
+
+		new_evs = realloc(poll_evs, sizeof(*poll_evs) * newsize);
+		if (!new_evs)
+			goto fail;
+		poll_evs = new_evs;
+
+		current_array_size = newsize;
+	}
+
+	ev = malloc(sizeof(*ev));
+	if (!ev)
+		goto fail;
+
+	ev->idx = nr_fds++;
+	ev->events = events;
+	ev->func = func;
+	ev->data = data;
+
+	/* A negative fd is ignored by poll(). */
+	poll_fds[ev->idx].fd = events ? fd : -1 - fd;
+	poll_fds[ev->idx].events = events;
+	poll_fds[ev->idx].revents = 0;
+	poll_evs[ev->idx] = ev;
+
+	return ev;
+
+ fail:
+	dolog(LOG_ERR, "Failed to add fd %d to event loop", fd);
+	return NULL;
+}
+
+void fd_event_del(struct fd_event *ev)
+{
+	unsigned int last;
+
+	if (!ev)
+		return;
+
+	/* Fill the hole with the last entry. */
+	last = --nr_fds;
+	if (ev->idx != last) {
+		poll_fds[ev->idx] = poll_fds[last];
+		poll_evs[ev->idx] = poll_evs[last];
+		poll_evs[ev->idx]->idx = ev->idx;
+	}
+
+	free(ev);
+}
+
+void fd_event_set(struct fd_event *ev, short events)
+{
+	struct pollfd *pfd = &poll_fds[ev->idx];
+
+	if ((pfd->fd < 0) != !events)
+		pfd->fd = -1 - pfd->fd;
+	pfd->events = events;
+	ev->events = events;
+}
+
+int fd_events_wait(int timeout)
+{
+	unsigned int i;
+	int ret;
+
+	ret = poll(poll_fds, nr_fds, timeout);
+
+	for (i = 0; ret > 0 && i < nr_fds; i++)
+		if (poll_fds[i].revents)
+			poll_evs[i]->func(poll_evs[i]->data,
+					  poll_fds[i].revents);
+
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  mode: C
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
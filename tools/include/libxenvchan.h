@@ -42,6 +42,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/xen.h>
 #include <xen/sys/evtchn.h>
@@ -91,6 +92,12 @@ struct libxenvchan {
 	 * during cleanup.
 	 * */
 	char *xs_path;
+	/**
+	 * Blocking operations poll the ring for up to this many microseconds
+	 * before asking the peer for a notification and sleeping.  0 (the
+	 * default) sleeps right away.
+	 */
+	unsigned int spin_usec;
 };
 
 /**
@@ -158,6 +165,66 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Stream-based scatter/gather receive: reads as much data as possible into
+ * the buffers, notifying the peer once.
+ * @param ctrl The vchan control structure
+ * @param iov The buffers for data that was read
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov,
+                      int iovcnt);
+/**
+ * Stream-based gather send: sends as much data as possible from the buffers,
+ * notifying the peer once for all data fitting into the ring.
+ * @param ctrl The vchan control structure
+ * @param iov The buffers of data to send
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov,
+                       int iovcnt);
+/**
+ * Zero-copy send, first step: get space in the ring to put data into.  The
+ * space is described by two segments, the second one being used only when
+ * the space wraps around the end of the ring.  Nothing is sent before
+ * libxenvchan_write_commit() is called.
+ * @param ctrl The vchan control structure
+ * @param size Amount of space wanted, at most the ring size when blocking
+ * @param iov Filled with the segments making up the space
+ * @return -1 on error, otherwise the amount of space obtained, which is $size
+ *         if blocking, and may be less (including zero) if nonblocking
+ */
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size,
+                              struct iovec iov[2]);
+/**
+ * Zero-copy send, second step: send the first $size bytes of the space
+ * obtained by libxenvchan_write_reserve().
+ * @return -1 on error, or $size
+ */
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * Zero-copy receive, first step: get access to data in the ring.  The data
+ * is described by two segments, the second one being used only when the data
+ * wraps around the end of the ring.  It stays in the ring until
+ * libxenvchan_read_release() is called.
+ * @param ctrl The vchan control structure
+ * @param size Maximum amount of data wanted
+ * @param iov Filled with the segments making up the data
+ * @return -1 on error, otherwise the amount of data available (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_read_acquire(struct libxenvchan *ctrl, size_t size,
+                             struct iovec iov[2]);
+/**
+ * Zero-copy receive, second step: give the first $size bytes of the data
+ * obtained by libxenvchan_read_acquire() back to the peer.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
@@ -1549,6 +1549,16 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_XENSTORE_QUOTA
 
+/*
+ * LIBXL_HAVE_SUSPEND_COMPRESS
+ *
+ * If this is defined libxl_domain_suspend() accepts the
+ * LIBXL_SUSPEND_COMPRESS flag, requesting compressed page data in the
+ * migration stream.  The receiving side must know about compressed
+ * page data records, too.
+ */
+#define LIBXL_HAVE_SUSPEND_COMPRESS
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1908,6 +1918,7 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_COMPRESS 4
 
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
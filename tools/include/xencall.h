@@ -127,6 +127,34 @@ void xencall_free_buffer_pages(xencall_handle *xcall, void *p, size_t nr_pages);
 void *xencall_alloc_buffer(xencall_handle *xcall, size_t size);
 void xencall_free_buffer(xencall_handle *xcall, void *p);
 
+/*
+ * Buffers of up to 256 pages freed with the functions above are kept in a
+ * cache, per thread and per handle, for reuse by later allocations.  The
+ * number of pages held in the cache of a handle is limited, by default to
+ * the value of the XENCALL_BUFFER_CACHE_PAGES environment variable at the
+ * time the handle was opened, or 256.  Setting the limit to 0 disables
+ * the cache.
+ */
+void xencall_set_buffer_cache_limit(xencall_handle *xcall, size_t nr_pages);
+
+/*
+ * Statistics about the hypercall buffers of a handle.  Counts of calls
+ * are since the handle was opened.
+ */
+struct xencall_buffer_stats {
+    unsigned long allocations;   /* Buffers allocated. */
+    unsigned long releases;      /* Buffers freed. */
+    unsigned long current;       /* Buffers currently allocated. */
+    unsigned long maximum;       /* Most buffers allocated at once. */
+    unsigned long cache_hits;    /* Allocations served from the cache. */
+    unsigned long cache_misses;  /* Allocations the cache couldn't serve. */
+    unsigned long cache_toobig;  /* Allocations too big to be cached. */
+    unsigned long cache_pages;   /* Pages currently held in the cache. */
+    unsigned long cache_limit;   /* Limit on cache_pages. */
+};
+void xencall_buffer_stats(xencall_handle *xcall,
+                          struct xencall_buffer_stats *stats);
+
 /*
  * Are allocated hypercall buffers safe to be accessed by the hypervisor all
  * the time?
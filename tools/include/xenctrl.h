@@ -2078,6 +2078,14 @@ int xc_vm_event_get_version(xc_interface *xch);
  * Caller has to unmap this page when done.
  */
 void *xc_monitor_enable(xc_interface *xch, uint32_t domain_id, uint32_t *port);
+/*
+ * Like xc_monitor_enable(), but with nr_rings rings, one per vCPU at most:
+ * vCPU n puts its events on ring n % nr_rings.  The rings are returned
+ * mapped as nr_rings consecutive pages, their event channels in ports.
+ * Caller has to unmap the nr_rings pages when done.
+ */
+void *xc_monitor_enable_rings(xc_interface *xch, uint32_t domain_id,
+                              unsigned int nr_rings, uint32_t *ports);
 int xc_monitor_disable(xc_interface *xch, uint32_t domain_id);
 int xc_monitor_resume(xc_interface *xch, uint32_t domain_id);
 /*
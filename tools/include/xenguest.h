@@ -26,6 +26,8 @@
 
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
+/* Compress page data.  Needs a restorer knowing PAGE_DATA_COMPRESSED. */
+#define XCFLAGS_COMPRESS  (1 << 2)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -541,6 +543,21 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
                    xc_stream_type_t stream_type, int recv_fd);
 
+/**
+ * As xc_domain_save(), sending the guest's memory contents on nr_data_fds
+ * additional streams in parallel, one thread per stream.  The restorer has
+ * to be handed the data streams in the same order.  Only supported for
+ * XC_STREAM_PLAIN.
+ *
+ * @param data_fds the file descriptors of the data streams
+ * @param nr_data_fds the number of data streams, may be 0
+ */
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t flags,
+                           struct save_callbacks *callbacks,
+                           xc_stream_type_t stream_type, int recv_fd);
+
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
     /*
@@ -626,6 +643,25 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       struct restore_callbacks *callbacks, int send_back_fd,
                       unsigned int memflags);
 
+/**
+ * As xc_domain_restore(), for a stream saved by xc_domain_save_streams().
+ * Pages from the data streams are processed in parallel.
+ *
+ * @param data_fds the file descriptors of the data streams, in the order
+ *        used by the saver
+ * @param nr_data_fds the number of data streams, may be 0
+ */
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, uint32_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_mfn,
+                              uint32_t console_domid,
+                              xc_stream_type_t stream_type,
+                              struct restore_callbacks *callbacks,
+                              int send_back_fd, unsigned int memflags);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
@@ -128,6 +128,40 @@ bool xs_mkdir(struct xs_handle *h, xs_transaction_t t,
 bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	   const char *path);
 
+/* A single operation of xs_multi(). */
+struct xs_multi_op {
+	/* XS_READ, XS_DIRECTORY, XS_GET_PERMS, XS_WRITE, XS_MKDIR or XS_RM.
+	 * Other types fail with EINVAL.
+	 */
+	enum xsd_sockmsg_type type;
+	const char *path;
+	/* Data to write for XS_WRITE. */
+	const void *data;
+	unsigned int len;
+
+	/* Results: errno value of the operation, or 0 on success. */
+	int err;
+	/* For XS_READ, XS_DIRECTORY and XS_GET_PERMS the value as returned
+	 * by xs_read(), xs_directory() or xs_get_permissions(), with its
+	 * length or number of entries in num. Call free() on it after use.
+	 */
+	void *value;
+	unsigned int num;
+};
+
+/* Perform multiple operations in order, using as few requests to the
+ * daemon as possible (this needs XENSTORE_SERVER_FEATURE_MULTI (16),
+ * otherwise each operation is sent individually). The result of each
+ * operation is stored in its struct xs_multi_op.
+ * Once an operation has failed, no further requests are sent, and the
+ * operations not sent yet fail with ECANCELED. Operations sent in the same
+ * request as the failed one have been performed.
+ * Returns false on failure of the communication with the daemon, in this
+ * case some of the operations might have been performed.
+ */
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num);
+
 /* Fake function which will always return false (required to let
  * libxenstore remain at 3.0 version.
  */
@@ -14,6 +14,8 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <xen-tools/common-macros.h>
@@ -23,8 +25,33 @@
 #define DBGPRINTF(_m...) \
     xtl_log(xcall->logger, XTL_DEBUG, -1, "xencall:buffer", _m)
 
+#define stat_inc(_s) __atomic_add_fetch(&(_s), 1, __ATOMIC_RELAXED)
+#define stat_dec(_s) __atomic_sub_fetch(&(_s), 1, __ATOMIC_RELAXED)
+#define stat_read(_s) __atomic_load_n(&(_s), __ATOMIC_RELAXED)
+
 pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Per-thread cache of hypercall buffers.  A thread caches buffers for a
+ * single handle at a time, the first one it frees a buffer to; buffers of
+ * any other handle go to that handle's shared cache.  Only the owning
+ * thread touches buf[] and nr[] while xcall is set, except for
+ * buffer_release_cache() which may only be called once no other thread
+ * uses the handle.  xcall and next are protected by cache_mutex.
+ */
+#define BUFFER_TCACHE_SIZE 2
+
+struct buffer_tcache {
+    xencall_handle *xcall;
+    struct buffer_tcache *next;
+    int nr[BUFFER_CACHE_CLASSES];
+    void *buf[BUFFER_CACHE_CLASSES][BUFFER_TCACHE_SIZE];
+};
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static bool tcache_key_valid;
+
 static void cache_lock(xencall_handle *xcall)
 {
     int saved_errno = errno;
@@ -45,103 +72,343 @@ static void cache_unlock(xencall_handle *xcall)
     errno = saved_errno;
 }
 
-static void *cache_alloc(xencall_handle *xcall, size_t nr_pages)
+/* Size class of a buffer, BUFFER_CACHE_CLASSES if it is too big to cache. */
+static unsigned int cache_class(size_t nr_pages)
 {
-    void *p = NULL;
+    unsigned int class = 0;
 
-    if ( nr_pages == 0 )
+    if ( nr_pages > BUFFER_CACHE_MAXPAGES )
+        return BUFFER_CACHE_CLASSES;
+
+    while ( (1UL << class) < nr_pages )
+        class++;
+
+    return class;
+}
+
+/* Number of pages actually mapped for a buffer of nr_pages. */
+static size_t cache_pages(size_t nr_pages)
+{
+    unsigned int class = cache_class(nr_pages);
+
+    if ( nr_pages == 0 || class >= BUFFER_CACHE_CLASSES )
+        return nr_pages;
+
+    return 1UL << class;
+}
+
+/* Account for @nr_pages more cached pages, if within the limit. */
+static bool cache_reserve(xencall_handle *xcall, size_t nr_pages)
+{
+    unsigned long limit = stat_read(xcall->buffer_cache_limit);
+
+    if ( __atomic_add_fetch(&xcall->buffer_cache_pages, nr_pages,
+                            __ATOMIC_RELAXED) <= limit )
+        return true;
+
+    __atomic_sub_fetch(&xcall->buffer_cache_pages, nr_pages, __ATOMIC_RELAXED);
+    return false;
+}
+
+static void cache_unreserve(xencall_handle *xcall, size_t nr_pages)
+{
+    __atomic_sub_fetch(&xcall->buffer_cache_pages, nr_pages, __ATOMIC_RELAXED);
+}
+
+/* Free the buffers of @tc and detach it from its handle.  Lock held. */
+static void tcache_release(struct buffer_tcache *tc)
+{
+    xencall_handle *xcall = tc->xcall;
+    struct buffer_tcache **pp;
+
+    for ( unsigned int i = 0; i < BUFFER_CACHE_CLASSES; ++i )
+    {
+        while ( tc->nr[i] > 0 )
+        {
+            osdep_free_pages(xcall, tc->buf[i][--tc->nr[i]], 1UL << i);
+            cache_unreserve(xcall, 1UL << i);
+        }
+    }
+
+    for ( pp = &xcall->buffer_tcaches; *pp; pp = &(*pp)->next )
+    {
+        if ( *pp == tc )
+        {
+            *pp = tc->next;
+            break;
+        }
+    }
+
+    __atomic_store_n(&tc->xcall, NULL, __ATOMIC_RELAXED);
+    tc->next = NULL;
+}
+
+static void tcache_destroy(void *arg)
+{
+    struct buffer_tcache *tc = arg;
+    int saved_errno = errno;
+
+    pthread_mutex_lock(&cache_mutex);
+    if ( tc->xcall )
+        tcache_release(tc);
+    pthread_mutex_unlock(&cache_mutex);
+
+    free(tc);
+    errno = saved_errno;
+}
+
+static void tcache_init(void)
+{
+    tcache_key_valid = !pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * The calling thread's cache for @xcall, or NULL if it has none.  With
+ * @create, give the thread a cache for @xcall if it has none for any
+ * handle yet.
+ */
+static struct buffer_tcache *tcache_get(xencall_handle *xcall, bool create)
+{
+    struct buffer_tcache *tc;
+    int saved_errno = errno;
+
+    /* Non re-entrant handles get by without locking anyway. */
+    if ( xcall->flags & XENCALL_OPENFLAG_NON_REENTRANT )
         return NULL;
 
-    cache_lock(xcall);
+    if ( pthread_once(&tcache_once, tcache_init) || !tcache_key_valid )
+        return NULL;
 
-    xcall->buffer_total_allocations++;
-    xcall->buffer_current_allocations++;
-    if ( xcall->buffer_current_allocations > xcall->buffer_maximum_allocations )
-        xcall->buffer_maximum_allocations = xcall->buffer_current_allocations;
+    tc = pthread_getspecific(tcache_key);
+    if ( tc && __atomic_load_n(&tc->xcall, __ATOMIC_RELAXED) == xcall )
+        return tc;
+    if ( !create || (tc && __atomic_load_n(&tc->xcall, __ATOMIC_RELAXED)) )
+        return NULL;
 
-    if ( nr_pages > ARRAY_SIZE(xcall->buffer_cache) )
+    if ( !tc )
     {
-        xcall->buffer_cache_toobig++;
+        tc = calloc(1, sizeof(*tc));
+        if ( !tc || pthread_setspecific(tcache_key, tc) )
+        {
+            free(tc);
+            errno = saved_errno;
+            return NULL;
+        }
     }
-    else if ( xcall->buffer_cache_nr[nr_pages-1] > 0 )
+
+    pthread_mutex_lock(&cache_mutex);
+    tc->xcall = xcall;
+    tc->next = xcall->buffer_tcaches;
+    xcall->buffer_tcaches = tc;
+    pthread_mutex_unlock(&cache_mutex);
+
+    errno = saved_errno;
+    return tc;
+}
+
+void buffer_init_cache(xencall_handle *xcall)
+{
+    const char *env = getenv("XENCALL_BUFFER_CACHE_PAGES");
+    char *end;
+    unsigned long limit = BUFFER_CACHE_LIMIT_DEFAULT;
+
+    if ( env && *env )
     {
-        p = xcall->buffer_cache[nr_pages-1][--xcall->buffer_cache_nr[nr_pages-1]];
-        xcall->buffer_cache_hits++;
+        limit = strtoul(env, &end, 0);
+        if ( *end )
+            limit = BUFFER_CACHE_LIMIT_DEFAULT;
     }
+
+    memset(xcall->buffer_cache_nr, 0, sizeof(xcall->buffer_cache_nr));
+    xcall->buffer_tcaches = NULL;
+    xcall->buffer_cache_limit = limit;
+    xcall->buffer_cache_pages = 0;
+
+    xcall->buffer_total_allocations = 0;
+    xcall->buffer_total_releases = 0;
+    xcall->buffer_current_allocations = 0;
+    xcall->buffer_maximum_allocations = 0;
+    memset(xcall->buffer_cache_hits, 0, sizeof(xcall->buffer_cache_hits));
+    memset(xcall->buffer_cache_misses, 0, sizeof(xcall->buffer_cache_misses));
+    xcall->buffer_cache_toobig = 0;
+}
+
+static void *cache_alloc(xencall_handle *xcall, size_t nr_pages)
+{
+    struct buffer_tcache *tc;
+    unsigned long cur, max;
+    unsigned int class;
+    void *p = NULL;
+
+    if ( nr_pages == 0 )
+        return NULL;
+
+    stat_inc(xcall->buffer_total_allocations);
+    cur = stat_inc(xcall->buffer_current_allocations);
+    max = stat_read(xcall->buffer_maximum_allocations);
+    while ( cur > max &&
+            !__atomic_compare_exchange_n(&xcall->buffer_maximum_allocations,
+                                         &max, cur, false, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED) )
+        ;
+
+    class = cache_class(nr_pages);
+    if ( class >= BUFFER_CACHE_CLASSES )
+    {
+        stat_inc(xcall->buffer_cache_toobig);
+        return NULL;
+    }
+
+    tc = tcache_get(xcall, false);
+    if ( tc && tc->nr[class] > 0 )
+        p = tc->buf[class][--tc->nr[class]];
     else
     {
-        xcall->buffer_cache_misses++;
+        cache_lock(xcall);
+        if ( xcall->buffer_cache_nr[class] > 0 )
+            p = xcall->buffer_cache[class][--xcall->buffer_cache_nr[class]];
+        cache_unlock(xcall);
     }
 
-    cache_unlock(xcall);
+    if ( p )
+    {
+        cache_unreserve(xcall, 1UL << class);
+        stat_inc(xcall->buffer_cache_hits[class]);
+    }
+    else
+        stat_inc(xcall->buffer_cache_misses[class]);
 
     return p;
 }
 
 static int cache_free(xencall_handle *xcall, void *p, size_t nr_pages)
 {
+    struct buffer_tcache *tc;
+    unsigned int class;
     int rc = 0;
 
     if ( nr_pages == 0 )
         return 0;
 
-    cache_lock(xcall);
+    stat_inc(xcall->buffer_total_releases);
+    stat_dec(xcall->buffer_current_allocations);
 
-    xcall->buffer_total_releases++;
-    xcall->buffer_current_allocations--;
+    class = cache_class(nr_pages);
+    if ( class >= BUFFER_CACHE_CLASSES || !cache_reserve(xcall, 1UL << class) )
+        return 0;
 
-    if ( nr_pages && nr_pages <= ARRAY_SIZE(xcall->buffer_cache) &&
-         xcall->buffer_cache_nr[nr_pages-1] < BUFFER_CACHE_SIZE )
+    tc = tcache_get(xcall, true);
+    if ( tc && tc->nr[class] < BUFFER_TCACHE_SIZE )
     {
-        xcall->buffer_cache[nr_pages-1][xcall->buffer_cache_nr[nr_pages-1]++] = p;
-        rc = 1;
+        tc->buf[class][tc->nr[class]++] = p;
+        return 1;
     }
 
+    cache_lock(xcall);
+    if ( xcall->buffer_cache_nr[class] < BUFFER_CACHE_SIZE )
+    {
+        xcall->buffer_cache[class][xcall->buffer_cache_nr[class]++] = p;
+        rc = 1;
+    }
     cache_unlock(xcall);
 
+    if ( !rc )
+        cache_unreserve(xcall, 1UL << class);
+
     return rc;
 }
 
 void buffer_release_cache(xencall_handle *xcall)
 {
+    unsigned long hits = 0, misses = 0;
     void *p;
 
     cache_lock(xcall);
 
-    DBGPRINTF("total allocations:%d total releases:%d",
+    DBGPRINTF("total allocations:%lu total releases:%lu",
               xcall->buffer_total_allocations,
               xcall->buffer_total_releases);
-    DBGPRINTF("current allocations:%d maximum allocations:%d",
+    DBGPRINTF("current allocations:%lu maximum allocations:%lu",
               xcall->buffer_current_allocations,
               xcall->buffer_maximum_allocations);
     for ( unsigned int i = 0; i < ARRAY_SIZE(xcall->buffer_cache_nr); ++i )
     {
-        DBGPRINTF("cache current size[%u pages]:%d", i+1,
-                xcall->buffer_cache_nr[i]);
+        DBGPRINTF("cache[%u pages]: size:%d hits:%lu misses:%lu", 1U << i,
+                  xcall->buffer_cache_nr[i], xcall->buffer_cache_hits[i],
+                  xcall->buffer_cache_misses[i]);
+        hits += xcall->buffer_cache_hits[i];
+        misses += xcall->buffer_cache_misses[i];
     }
-    DBGPRINTF("cache hits:%d misses:%d toobig:%d",
-              xcall->buffer_cache_hits,
-              xcall->buffer_cache_misses,
+    DBGPRINTF("cache hits:%lu misses:%lu (%lu%% hit rate) toobig:%lu",
+              hits, misses, hits + misses ? hits * 100 / (hits + misses) : 0,
               xcall->buffer_cache_toobig);
+    DBGPRINTF("cached pages:%lu limit:%lu",
+              xcall->buffer_cache_pages, xcall->buffer_cache_limit);
+
+    while ( xcall->buffer_tcaches )
+        tcache_release(xcall->buffer_tcaches);
 
     for ( unsigned int i = 0; i < ARRAY_SIZE(xcall->buffer_cache_nr); ++i )
     {
         while ( xcall->buffer_cache_nr[i] > 0 )
         {
             p = xcall->buffer_cache[i][--xcall->buffer_cache_nr[i]];
-            osdep_free_pages(xcall, p, i + 1);
+            osdep_free_pages(xcall, p, 1UL << i);
         }
     }
 
     cache_unlock(xcall);
 }
 
+void xencall_buffer_stats(xencall_handle *xcall,
+                          struct xencall_buffer_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    stats->allocations = stat_read(xcall->buffer_total_allocations);
+    stats->releases = stat_read(xcall->buffer_total_releases);
+    stats->current = stat_read(xcall->buffer_current_allocations);
+    stats->maximum = stat_read(xcall->buffer_maximum_allocations);
+    for ( unsigned int i = 0; i < BUFFER_CACHE_CLASSES; ++i )
+    {
+        stats->cache_hits += stat_read(xcall->buffer_cache_hits[i]);
+        stats->cache_misses += stat_read(xcall->buffer_cache_misses[i]);
+    }
+    stats->cache_toobig = stat_read(xcall->buffer_cache_toobig);
+    stats->cache_pages = stat_read(xcall->buffer_cache_pages);
+    stats->cache_limit = stat_read(xcall->buffer_cache_limit);
+}
+
+void xencall_set_buffer_cache_limit(xencall_handle *xcall, size_t nr_pages)
+{
+    __atomic_store_n(&xcall->buffer_cache_limit, nr_pages, __ATOMIC_RELAXED);
+
+    /*
+     * Trim the shared cache, largest buffers first.  Per-thread caches
+     * drain as their buffers get reused, and are not refilled beyond the
+     * new limit.
+     */
+    cache_lock(xcall);
+    for ( unsigned int i = BUFFER_CACHE_CLASSES; i-- > 0; )
+    {
+        while ( xcall->buffer_cache_nr[i] > 0 &&
+                stat_read(xcall->buffer_cache_pages) > nr_pages )
+        {
+            void *p = xcall->buffer_cache[i][--xcall->buffer_cache_nr[i]];
+
+            osdep_free_pages(xcall, p, 1UL << i);
+            cache_unreserve(xcall, 1UL << i);
+        }
+    }
+    cache_unlock(xcall);
+}
+
 void *xencall_alloc_buffer_pages(xencall_handle *xcall, size_t nr_pages)
 {
     void *p = cache_alloc(xcall, nr_pages);
 
     if ( !p )
-        p = osdep_alloc_pages(xcall, nr_pages);
+        p = osdep_alloc_pages(xcall, cache_pages(nr_pages));
 
     if (!p)
         return NULL;
@@ -157,7 +424,7 @@ void xencall_free_buffer_pages(xencall_handle *xcall, void *p, size_t nr_pages)
         return;
 
     if ( !cache_free(xcall, p, nr_pages) )
-        osdep_free_pages(xcall, p, nr_pages);
+        osdep_free_pages(xcall, p, cache_pages(nr_pages));
 }
 
 struct allocation_header {
@@ -45,15 +45,8 @@ xencall_handle *xencall_open(xentoollog_logger *logger, unsigned open_flags)
     xentoolcore__register_active_handle(&xcall->tc_ah);
 
     xcall->flags = open_flags;
-    memset(xcall->buffer_cache_nr, 0, sizeof(xcall->buffer_cache_nr));
-
-    xcall->buffer_total_allocations = 0;
-    xcall->buffer_total_releases = 0;
-    xcall->buffer_current_allocations = 0;
-    xcall->buffer_maximum_allocations = 0;
-    xcall->buffer_cache_hits = 0;
-    xcall->buffer_cache_misses = 0;
-    xcall->buffer_cache_toobig = 0;
+    buffer_init_cache(xcall);
+
     xcall->logger = logger;
     xcall->logger_tofree = NULL;
 
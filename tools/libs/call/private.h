@@ -31,27 +31,41 @@ struct xencall_handle {
     Xentoolcore__Active_Handle tc_ah;
 
     /*
-     * A simple cache of unused, small, hypercall buffers
-     * buffer_cache[i]'s size is (i+1) pages
+     * A cache of unused hypercall buffers, by size class: buffer_cache[i]
+     * holds buffers of (1 << i) pages.  Requests of up to
+     * BUFFER_CACHE_MAXPAGES pages are rounded up to their class so that
+     * buffers can be reused for any request of the same class; larger ones
+     * are never cached.
      *
-     * Protected by a global lock.
+     * Protected by a global lock.  Threads also keep a few buffers of each
+     * class of their own, see struct buffer_tcache in buffer.c, which are
+     * reached through buffer_tcaches (also under the global lock).
      */
 #define BUFFER_CACHE_SIZE 4
-#define BUFFER_CACHE_NRPAGES 4
-    int buffer_cache_nr[BUFFER_CACHE_NRPAGES];
-    void *buffer_cache[BUFFER_CACHE_NRPAGES][BUFFER_CACHE_SIZE];
+#define BUFFER_CACHE_CLASSES 9
+#define BUFFER_CACHE_MAXPAGES (1U << (BUFFER_CACHE_CLASSES - 1))
+    int buffer_cache_nr[BUFFER_CACHE_CLASSES];
+    void *buffer_cache[BUFFER_CACHE_CLASSES][BUFFER_CACHE_SIZE];
+    struct buffer_tcache *buffer_tcaches;
 
     /*
-     * Hypercall buffer statistics. All protected by the global
-     * buffer_cache lock.
+     * Upper bound on the number of pages held in all the caches of the
+     * handle, and the number currently held.  Atomic.
      */
-    int buffer_total_allocations;
-    int buffer_total_releases;
-    int buffer_current_allocations;
-    int buffer_maximum_allocations;
-    int buffer_cache_hits;
-    int buffer_cache_misses;
-    int buffer_cache_toobig;
+#define BUFFER_CACHE_LIMIT_DEFAULT 256
+    unsigned long buffer_cache_limit;
+    unsigned long buffer_cache_pages;
+
+    /*
+     * Hypercall buffer statistics.  All updated atomically.
+     */
+    unsigned long buffer_total_allocations;
+    unsigned long buffer_total_releases;
+    unsigned long buffer_current_allocations;
+    unsigned long buffer_maximum_allocations;
+    unsigned long buffer_cache_hits[BUFFER_CACHE_CLASSES];
+    unsigned long buffer_cache_misses[BUFFER_CACHE_CLASSES];
+    unsigned long buffer_cache_toobig;
 };
 
 int osdep_xencall_open(xencall_handle *xcall);
@@ -62,6 +76,7 @@ long osdep_hypercall(xencall_handle *xcall, privcmd_hypercall_t *hypercall);
 void *osdep_alloc_pages(xencall_handle *xcall, size_t nr_pages);
 void osdep_free_pages(xencall_handle *xcall, void *p, size_t nr_pages);
 
+void buffer_init_cache(xencall_handle *xcall);
 void buffer_release_cache(xencall_handle *xcall);
 
 #define PERROR(_f...) xtl_log(xcall->logger, XTL_ERROR, errno, "xencall", _f)
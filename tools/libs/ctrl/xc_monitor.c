@@ -28,6 +28,14 @@ void *xc_monitor_enable(xc_interface *xch, uint32_t domain_id, uint32_t *port)
                               port);
 }
 
+void *xc_monitor_enable_rings(xc_interface *xch, uint32_t domain_id,
+                              unsigned int nr_rings, uint32_t *ports)
+{
+    return xc_vm_event_enable_rings(xch, domain_id,
+                                    XEN_DOMCTL_VM_EVENT_OP_MONITOR,
+                                    nr_rings, ports);
+}
+
 int xc_monitor_disable(xc_interface *xch, uint32_t domain_id)
 {
     return xc_vm_event_control(xch, domain_id,
@@ -405,6 +405,14 @@ int xc_vm_event_control(xc_interface *xch, uint32_t domain_id, unsigned int op,
  */
 void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
                          uint32_t *port);
+/*
+ * Enables vm_event for mode (XEN_DOMCTL_VM_EVENT_OP_*) with nr_rings rings,
+ * and returns them mapped as consecutive pages, their event channels in
+ * ports[nr_rings].
+ */
+void *xc_vm_event_enable_rings(xc_interface *xch, uint32_t domain_id,
+                               unsigned int mode, unsigned int nr_rings,
+                               uint32_t *ports);
 
 int do_dm_op(xc_interface *xch, uint32_t domid, unsigned int nr_bufs, ...);
 
@@ -156,6 +156,154 @@ void *xc_vm_event_enable(xc_interface *xch, uint32_t domain_id, int param,
     return ring_page;
 }
 
+void *xc_vm_event_enable_rings(xc_interface *xch, uint32_t domain_id,
+                               unsigned int mode, unsigned int nr_rings,
+                               uint32_t *ports)
+{
+    struct xen_domctl domctl = {};
+    void *ring_pages = NULL;
+    xc_domaininfo_t info;
+    xen_pfn_t max_gpfn, *pfns = NULL;
+    unsigned int i;
+    bool maxmem_raised = false, populated = false;
+    int rc1, rc2, saved_errno;
+    DECLARE_HYPERCALL_BUFFER(uint64_t, gfns);
+    DECLARE_HYPERCALL_BOUNCE(ports, nr_rings * sizeof(*ports),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( !nr_rings || !ports )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pfns = calloc(nr_rings, sizeof(*pfns));
+    gfns = xc_hypercall_buffer_alloc(xch, gfns, nr_rings * sizeof(*gfns));
+    if ( !pfns || !gfns || xc_hypercall_bounce_pre(xch, ports) )
+    {
+        PERROR("Could not allocate ring setup buffers\n");
+        free(pfns);
+        xc_hypercall_buffer_free(xch, gfns);
+        return NULL;
+    }
+
+    /* Pause the domain for ring page setup */
+    rc1 = xc_domain_pause(xch, domain_id);
+    if ( rc1 != 0 )
+    {
+        PERROR("Unable to pause domain\n");
+        goto free;
+    }
+
+    /*
+     * There is one HVM param per ring type only, so the rings go into
+     * otherwise unused gfns above the guest's memory for the time it takes
+     * Xen to pick them up.
+     */
+    rc1 = xc_domain_maximum_gpfn(xch, domain_id, &max_gpfn);
+    if ( rc1 < 0 )
+    {
+        PERROR("Failed to get the maximum gpfn\n");
+        goto out;
+    }
+
+    for ( i = 0; i < nr_rings; i++ )
+        gfns[i] = pfns[i] = max_gpfn + 1 + i;
+
+    /*
+     * Unlike the HVM param ring pages, these pages aren't part of the memory
+     * the domain was built with.  They stay allocated to it as long as Xen
+     * uses them as rings, so raise its memory limit accordingly.
+     */
+    rc1 = xc_domain_getinfo_single(xch, domain_id, &info);
+    if ( rc1 < 0 )
+    {
+        PERROR("Failed to get domain info\n");
+        goto out;
+    }
+
+    rc1 = xc_domain_setmaxmem(xch, domain_id,
+                              (info.max_pages + nr_rings) <<
+                              (XC_PAGE_SHIFT - 10));
+    if ( rc1 != 0 )
+    {
+        PERROR("Failed to raise the domain's memory limit\n");
+        goto out;
+    }
+    maxmem_raised = true;
+
+    rc1 = xc_domain_populate_physmap_exact(xch, domain_id, nr_rings, 0, 0,
+                                           pfns);
+    if ( rc1 != 0 )
+    {
+        PERROR("Failed to populate ring pfns\n");
+        goto out;
+    }
+    populated = true;
+
+    ring_pages = xc_map_foreign_pages(xch, domain_id, PROT_READ | PROT_WRITE,
+                                      pfns, nr_rings);
+    if ( !ring_pages )
+    {
+        rc1 = -1;
+        PERROR("Could not map the ring pages\n");
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_vm_event_op;
+    domctl.domain = domain_id;
+    domctl.u.vm_event_op.op = XEN_VM_EVENT_ENABLE_RINGS;
+    domctl.u.vm_event_op.mode = mode;
+    domctl.u.vm_event_op.u.enable_rings.nr_rings = nr_rings;
+    set_xen_guest_handle(domctl.u.vm_event_op.u.enable_rings.gfns, gfns);
+    set_xen_guest_handle(domctl.u.vm_event_op.u.enable_rings.ports, ports);
+
+    rc1 = do_domctl(xch, &domctl);
+    if ( rc1 != 0 )
+        PERROR("Failed to enable vm_event rings\n");
+
+ out:
+    saved_errno = errno;
+
+    /* Remove the ring pfns from the guest's physmap */
+    if ( populated &&
+         xc_domain_decrease_reservation_exact(xch, domain_id, nr_rings, 0,
+                                              pfns) )
+        PERROR("Failed to remove ring pages from guest physmap");
+
+    /* The rings aren't used: they were freed by removing them above. */
+    if ( rc1 != 0 && maxmem_raised &&
+         xc_domain_setmaxmem(xch, domain_id,
+                             info.max_pages << (XC_PAGE_SHIFT - 10)) )
+        PERROR("Failed to restore the domain's memory limit");
+
+    rc2 = xc_domain_unpause(xch, domain_id);
+    if ( rc1 != 0 || rc2 != 0 )
+    {
+        if ( rc2 != 0 )
+        {
+            if ( rc1 == 0 )
+                saved_errno = errno;
+            PERROR("Unable to unpause domain");
+        }
+
+        if ( ring_pages )
+            xenforeignmemory_unmap(xch->fmem, ring_pages, nr_rings);
+        ring_pages = NULL;
+
+        errno = saved_errno;
+    }
+
+ free:
+    saved_errno = errno;
+    xc_hypercall_bounce_post(xch, ports);
+    xc_hypercall_buffer_free(xch, gfns);
+    free(pfns);
+    errno = saved_errno;
+
+    return ring_pages;
+}
+
 int xc_vm_event_get_version(xc_interface *xch)
 {
     struct xen_domctl domctl = {};
@@ -1,6 +1,7 @@
 #ifndef __COMMON__H
 #define __COMMON__H
 
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "xg_private.h"
@@ -209,6 +210,55 @@ static inline int update_blob(struct xc_sr_blob *blob,
     return 0;
 }
 
+/*
+ * A stream carrying page data on the save side.  Either just the main
+ * stream, or one per data stream, each sending its own shard of the guest's
+ * pfns from a worker thread.
+ */
+struct xc_sr_save_stream
+{
+    struct xc_sr_context *ctx;
+    int fd;
+    unsigned int idx;
+    pthread_t thread;
+    int rc;
+
+    /* Pages sent and deferred in the current pass. */
+    unsigned long written;
+    unsigned long nr_deferred_pages;
+
+    unsigned int nr_batch_pfns;
+    struct xc_sr_save_buffers
+    {
+        xen_pfn_t batch_pfns[MAX_BATCH_SIZE];
+        xen_pfn_t mfns[MAX_BATCH_SIZE];
+        xen_pfn_t types[MAX_BATCH_SIZE];
+        void *local_pages[MAX_BATCH_SIZE];
+        struct iovec iov[MAX_BATCH_SIZE + 2]; /* Headers + data. */
+        uint64_t rec_pfns[MAX_BATCH_SIZE];
+        int errors[MAX_BATCH_SIZE];
+        void *data_pages[MAX_BATCH_SIZE]; /* For compression. */
+    } *buffers;
+
+    struct xc_sr_compress *compress;
+};
+
+/*
+ * A stream being restored from.  The main stream, or a data stream which is
+ * drained up to its next STREAM_SYNC record by a worker thread.
+ */
+struct xc_sr_restore_stream
+{
+    struct xc_sr_context *ctx;
+    int fd;
+    pthread_t thread;
+    int rc;
+
+    /* Decompression state for PAGE_DATA_COMPRESSED records. */
+    struct z_stream_s *zstream;
+    void *page_buf;
+};
+
 struct xc_sr_context
 {
     xc_interface *xch;
@@ -235,24 +285,27 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Send page data as PAGE_DATA_COMPRESSED records. */
+            bool compressed;
+
             unsigned long p2m_size;
 
             struct precopy_stats stats;
 
-            unsigned int nr_batch_pfns;
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
-            struct xc_sr_context_save_buffers
-            {
-                xen_pfn_t batch_pfns[MAX_BATCH_SIZE];
-                xen_pfn_t mfns[MAX_BATCH_SIZE];
-                xen_pfn_t types[MAX_BATCH_SIZE];
-                void *local_pages[MAX_BATCH_SIZE];
-                struct iovec iov[MAX_BATCH_SIZE + 2]; /* Headers + data. */
-                uint64_t rec_pfns[MAX_BATCH_SIZE];
-                int errors[MAX_BATCH_SIZE];
-            } *buffers;
+
+            /*
+             * Extra streams to send page data on.  If there are any, all
+             * page data goes to them, and streams[] holds one entry per
+             * data stream.  Otherwise streams[] is just the main stream.
+             */
+            const int *data_fds;
+            unsigned int nr_data_fds;
+            struct xc_sr_save_stream *streams;
+            unsigned int nr_streams;
+            uint32_t sync_seq;
         } save;
 
         struct /* Restore data. */
@@ -307,6 +360,23 @@ struct xc_sr_context
 
             /* memflags to pass to xc_domain_populate_physmap{_exact}(). */
             unsigned int memflags;
+
+            /*
+             * The main stream, followed by the extra data streams, if any.
+             * Data streams are only looked at when the main stream reaches
+             * a STREAM_SYNC record.
+             */
+            const int *data_fds;
+            unsigned int nr_data_fds;
+            struct xc_sr_restore_stream *streams;
+            unsigned int nr_streams;
+            uint32_t sync_seq;
+
+            /*
+             * Serialises populating the physmap, and tracking and localising
+             * pages, between data streams.
+             */
+            pthread_mutex_t lock;
         } restore;
     };
 
@@ -465,6 +535,30 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
 /* Handle a STATIC_DATA_END record. */
 int handle_static_data_end(struct xc_sr_context *ctx);
 
+/*
+ * Compression of page data (xg_sr_compress.c).
+ *
+ * compress_batch() takes over the current batch of a stream, with
+ * data_pages[], rec_pfns[] and local_pages[] filled in by write_batch(), and
+ * the mapping backing them.  It is written out asynchronously, by the next
+ * call to compress_batch() or by compress_flush().
+ */
+int compress_setup(struct xc_sr_context *ctx, struct xc_sr_save_stream *s);
+void compress_cleanup(struct xc_sr_save_stream *s);
+int compress_batch(struct xc_sr_context *ctx, struct xc_sr_save_stream *s,
+                   unsigned int nr_pages, void *guest_mapping,
+                   unsigned int nr_pages_mapped);
+int compress_flush(struct xc_sr_context *ctx, struct xc_sr_save_stream *s);
+
+/*
+ * Decode one page of a PAGE_DATA_COMPRESSED record into page.  old_page is
+ * the current contents of the page, used for delta encodings.
+ */
+int decompress_page(struct xc_sr_restore_stream *s,
+                    const struct xc_sr_rec_page_data_enc *enc,
+                    const void *data, const void *old_page, void *page);
+void decompress_cleanup(struct xc_sr_restore_stream *s);
+
 /* Page type known to the migration logic? */
 static inline bool is_known_page_type(uint32_t type)
 {
@@ -0,0 +1,612 @@
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "xg_sr_common.h"
+
+#include <xen-tools/common-macros.h>
+
+/*
+ * Compression of the PAGE_DATA_COMPRESSED records.
+ *
+ * On the save side each stream carrying page data has a pool of worker
+ * threads, encoding the pages of one batch while the stream's sender maps
+ * the next one.  Two batches are in use: the one
+ * being compressed, and the one being filled (and then written).  Pages are
+ * encoded as ZERO, DEFLATE (zlib), or XOR_DEFLATE against the copy of the
+ * page sent last time, if still held in a direct mapped cache.  Anything not
+ * getting smaller is sent RAW.  A pfn is always sent on the same stream, so
+ * per stream caches are fine.
+ *
+ * Sending deltas relies on the restore side holding the previously sent
+ * contents of a page, so only NOTAB pages in plain streams are cached: page
+ * tables are altered by the restorer, and with COLO the secondary runs.
+ */
+
+#define COMPRESS_MAX_WORKERS    4
+/* Pages handed to a worker at a time. */
+#define COMPRESS_CHUNK          16
+/* Size of the delta cache in pages (64MB), shared out between streams. */
+#define COMPRESS_CACHE_PAGES    (1U << 14)
+
+struct xc_sr_compress_batch
+{
+    unsigned int nr_pfns;
+    unsigned int nr_pages;
+
+    /* Guest mapping and locally normalised pages backing pages[]. */
+    void *guest_mapping;
+    unsigned int nr_pages_mapped;
+    void *local_pages[MAX_BATCH_SIZE];
+
+    uint64_t rec_pfns[MAX_BATCH_SIZE];
+
+    /* Per page with data. */
+    void *pages[MAX_BATCH_SIZE];
+    xen_pfn_t pfns[MAX_BATCH_SIZE];
+    int cache_slot[MAX_BATCH_SIZE];
+    struct xc_sr_rec_page_data_enc encs[MAX_BATCH_SIZE];
+    /* Encoded data, one page worth of space per page. */
+    uint8_t *data;
+
+    struct iovec iov[MAX_BATCH_SIZE + 4];
+};
+
+struct xc_sr_compress
+{
+    xc_interface *xch;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned int nr_workers;
+    pthread_t workers[COMPRESS_MAX_WORKERS];
+    bool quit;
+
+    /* Batch being compressed, and progress on it.  Protected by lock. */
+    struct xc_sr_compress_batch *active;
+    unsigned int next_page;
+    unsigned int pages_done;
+
+    /* Batch being written out, if any. */
+    struct xc_sr_compress_batch *pending;
+    struct xc_sr_compress_batch batch[2];
+    unsigned int next_batch;
+
+    /*
+     * Direct mapped cache of the last sent contents of pages, indexed by
+     * pfn modulo cache_slots.  Only modified for the active batch, for
+     * which each slot is used by at most one page.
+     */
+    unsigned int cache_slots;
+    xen_pfn_t *cache_pfns;
+    uint8_t *cache_data;
+    unsigned int *cache_seq;
+    unsigned int seq;
+};
+
+struct compress_worker
+{
+    z_stream zs;
+    bool zs_ok;
+    uint8_t page[PAGE_SIZE];
+    uint8_t delta[PAGE_SIZE];
+};
+
+static bool page_is_zero(const uint8_t *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+/*
+ * Deflate a page into out.  Returns the compressed length, or 0 if the
+ * result wouldn't be smaller than a page.
+ */
+static unsigned int deflate_page(struct compress_worker *w,
+                                 const uint8_t *in, uint8_t *out)
+{
+    if ( !w->zs_ok || deflateReset(&w->zs) != Z_OK )
+        return 0;
+
+    w->zs.next_in = (Bytef *)in;
+    w->zs.avail_in = PAGE_SIZE;
+    w->zs.next_out = out;
+    w->zs.avail_out = PAGE_SIZE - 1;
+
+    if ( deflate(&w->zs, Z_FINISH) != Z_STREAM_END )
+        return 0;
+
+    return w->zs.total_out;
+}
+
+static void compress_page(struct xc_sr_compress *c,
+                          struct compress_worker *w,
+                          struct xc_sr_compress_batch *b, unsigned int i)
+{
+    struct xc_sr_rec_page_data_enc *enc = &b->encs[i];
+    uint8_t *out = b->data + (size_t)i * PAGE_SIZE;
+    int slot = b->cache_slot[i];
+    uint8_t *cached = NULL;
+    unsigned int j;
+
+    /*
+     * Take a snapshot, the guest might still be running.  What is sent must
+     * be exactly what is cached.
+     */
+    memcpy(w->page, b->pages[i], PAGE_SIZE);
+
+    if ( slot >= 0 )
+    {
+        cached = c->cache_data + (size_t)slot * PAGE_SIZE;
+        if ( c->cache_pfns[slot] != b->pfns[i] )
+        {
+            c->cache_pfns[slot] = b->pfns[i];
+            slot = -1;
+        }
+    }
+
+    if ( page_is_zero(w->page) )
+    {
+        enc->encoding = PAGE_DATA_ENC_ZERO;
+        enc->length = 0;
+    }
+    else if ( slot >= 0 )
+    {
+        for ( j = 0; j < PAGE_SIZE; j++ )
+            w->delta[j] = w->page[j] ^ cached[j];
+
+        enc->encoding = PAGE_DATA_ENC_XOR_DEFLATE;
+        enc->length = deflate_page(w, w->delta, out);
+    }
+    else
+    {
+        enc->encoding = PAGE_DATA_ENC_DEFLATE;
+        enc->length = deflate_page(w, w->page, out);
+    }
+
+    if ( !enc->length && enc->encoding != PAGE_DATA_ENC_ZERO )
+    {
+        enc->encoding = PAGE_DATA_ENC_RAW;
+        enc->length = PAGE_SIZE;
+        memcpy(out, w->page, PAGE_SIZE);
+    }
+
+    if ( cached )
+        memcpy(cached, w->page, PAGE_SIZE);
+}
+
+static void *compress_worker(void *arg)
+{
+    struct xc_sr_compress *c = arg;
+    struct xc_sr_compress_batch *b;
+    struct compress_worker *w;
+    unsigned int i, start, end;
+
+    w = calloc(1, sizeof(*w));
+    if ( w )
+        w->zs_ok = deflateInit(&w->zs, Z_BEST_SPEED) == Z_OK;
+
+    pthread_mutex_lock(&c->lock);
+
+    for ( ;; )
+    {
+        while ( !c->quit &&
+                (!c->active || c->next_page >= c->active->nr_pages) )
+            pthread_cond_wait(&c->work_cond, &c->lock);
+
+        if ( c->quit )
+            break;
+
+        b = c->active;
+        start = c->next_page;
+        end = min(start + COMPRESS_CHUNK, b->nr_pages);
+        c->next_page = end;
+
+        pthread_mutex_unlock(&c->lock);
+
+        for ( i = start; i < end; i++ )
+        {
+            if ( w )
+                compress_page(c, w, b, i);
+            else
+            {
+                /* No memory for our state, send raw. */
+                b->encs[i].encoding = PAGE_DATA_ENC_RAW;
+                b->encs[i].length = PAGE_SIZE;
+                memcpy(b->data + (size_t)i * PAGE_SIZE, b->pages[i],
+                       PAGE_SIZE);
+                if ( b->cache_slot[i] >= 0 )
+                    c->cache_pfns[b->cache_slot[i]] = INVALID_PFN;
+            }
+        }
+
+        pthread_mutex_lock(&c->lock);
+
+        c->pages_done += end - start;
+        if ( c->pages_done == b->nr_pages )
+            pthread_cond_signal(&c->done_cond);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    if ( w )
+    {
+        if ( w->zs_ok )
+            deflateEnd(&w->zs);
+        free(w);
+    }
+
+    return NULL;
+}
+
+/* Wait for the workers to finish the active batch, and make it pending. */
+static void compress_wait(struct xc_sr_compress *c)
+{
+    pthread_mutex_lock(&c->lock);
+
+    while ( c->active && c->pages_done < c->active->nr_pages )
+        pthread_cond_wait(&c->done_cond, &c->lock);
+
+    assert(!c->pending || !c->active);
+    if ( c->active )
+        c->pending = c->active;
+    c->active = NULL;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void compress_release_batch(struct xc_sr_compress *c,
+                                   struct xc_sr_compress_batch *b)
+{
+    unsigned int i;
+
+    if ( b->guest_mapping )
+        xenforeignmemory_unmap(c->xch->fmem, b->guest_mapping,
+                               b->nr_pages_mapped);
+    b->guest_mapping = NULL;
+
+    for ( i = 0; i < b->nr_pfns; ++i )
+    {
+        free(b->local_pages[i]);
+        b->local_pages[i] = NULL;
+    }
+}
+
+/* Write the pending batch as a PAGE_DATA_COMPRESSED record. */
+static int compress_write_pending(struct xc_sr_context *ctx,
+                                  struct xc_sr_save_stream *s)
+{
+    static const char zeroes[REC_ALIGN] = {};
+
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_compress *c = s->compress;
+    struct xc_sr_compress_batch *b = c->pending;
+    struct {
+        struct xc_sr_rhdr rec;
+        struct xc_sr_rec_page_data_header page_data;
+    } hdrs = {
+        .rec = {
+            .type = REC_TYPE_PAGE_DATA_COMPRESSED,
+        },
+    };
+    struct iovec *iov;
+    unsigned int i, iovcnt = 0;
+    size_t length;
+    int rc;
+
+    if ( !b )
+        return 0;
+
+    iov = b->iov;
+    hdrs.page_data.count = b->nr_pfns;
+    length = sizeof(hdrs.page_data) + b->nr_pfns * sizeof(*b->rec_pfns) +
+             b->nr_pages * sizeof(*b->encs);
+
+    iov[iovcnt].iov_base = &hdrs;
+    iov[iovcnt++].iov_len = sizeof(hdrs);
+    iov[iovcnt].iov_base = b->rec_pfns;
+    iov[iovcnt++].iov_len = b->nr_pfns * sizeof(*b->rec_pfns);
+    if ( b->nr_pages )
+    {
+        iov[iovcnt].iov_base = b->encs;
+        iov[iovcnt++].iov_len = b->nr_pages * sizeof(*b->encs);
+    }
+
+    for ( i = 0; i < b->nr_pages; ++i )
+    {
+        if ( !b->encs[i].length )
+            continue;
+
+        iov[iovcnt].iov_base = b->data + (size_t)i * PAGE_SIZE;
+        iov[iovcnt++].iov_len = b->encs[i].length;
+        length += b->encs[i].length;
+    }
+
+    hdrs.rec.length = length;
+    iov[iovcnt].iov_base = (void *)zeroes;
+    iov[iovcnt++].iov_len = ROUNDUP(length, REC_ALIGN) - length;
+
+    rc = writev_exact(s->fd, iov, iovcnt);
+    if ( rc )
+        PERROR("Failed to write compressed page data to stream");
+
+    compress_release_batch(c, b);
+    c->pending = NULL;
+
+    return rc;
+}
+
+int compress_batch(struct xc_sr_context *ctx, struct xc_sr_save_stream *s,
+                   unsigned int nr_pages, void *guest_mapping,
+                   unsigned int nr_pages_mapped)
+{
+    struct xc_sr_compress *c = s->compress;
+    struct xc_sr_compress_batch *b = &c->batch[c->next_batch];
+    struct xc_sr_save_buffers *bufs = s->buffers;
+    unsigned int i, p, nr_pfns = s->nr_batch_pfns;
+    xen_pfn_t pfn;
+    uint32_t type;
+    int slot;
+
+    /* The previous batch must be done before the cache is touched. */
+    compress_wait(c);
+
+    b->nr_pfns = nr_pfns;
+    b->nr_pages = nr_pages;
+    b->guest_mapping = guest_mapping;
+    b->nr_pages_mapped = nr_pages_mapped;
+    memcpy(b->rec_pfns, bufs->rec_pfns, nr_pfns * sizeof(*b->rec_pfns));
+    memcpy(b->pages, bufs->data_pages, nr_pages * sizeof(*b->pages));
+
+    c->seq++;
+    for ( i = 0, p = 0; i < nr_pfns; ++i )
+    {
+        b->local_pages[i] = bufs->local_pages[i];
+        bufs->local_pages[i] = NULL;
+
+        pfn = b->rec_pfns[i] & PAGE_DATA_PFN_MASK;
+        type = b->rec_pfns[i] >> 32;
+        slot = c->cache_slots ? pfn % c->cache_slots : -1;
+
+        if ( type != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            /* Not usable for deltas, drop what the cache might hold. */
+            if ( slot >= 0 && c->cache_pfns[slot] == pfn )
+                c->cache_pfns[slot] = INVALID_PFN;
+            if ( page_type_has_stream_data(type) )
+            {
+                b->pfns[p] = pfn;
+                b->cache_slot[p++] = -1;
+            }
+            continue;
+        }
+
+        if ( slot >= 0 )
+        {
+            if ( c->cache_seq[slot] == c->seq )
+            {
+                /* Slot used by another page of this batch already. */
+                if ( c->cache_pfns[slot] == pfn )
+                    c->cache_pfns[slot] = INVALID_PFN;
+                slot = -1;
+            }
+            else
+                c->cache_seq[slot] = c->seq;
+        }
+
+        b->pfns[p] = pfn;
+        b->cache_slot[p++] = slot;
+    }
+    assert(p == nr_pages);
+
+    pthread_mutex_lock(&c->lock);
+    c->active = b;
+    c->next_page = 0;
+    c->pages_done = 0;
+    pthread_cond_broadcast(&c->work_cond);
+    pthread_mutex_unlock(&c->lock);
+
+    c->next_batch ^= 1;
+
+    /* Write out the previous batch while the workers are busy. */
+    return compress_write_pending(ctx, s);
+}
+
+int compress_flush(struct xc_sr_context *ctx, struct xc_sr_save_stream *s)
+{
+    compress_wait(s->compress);
+
+    return compress_write_pending(ctx, s);
+}
+
+int compress_setup(struct xc_sr_context *ctx, struct xc_sr_save_stream *s)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_compress *c;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN) / ctx->save.nr_streams;
+    unsigned int i;
+
+    c = calloc(1, sizeof(*c));
+    if ( !c )
+        goto enomem;
+    s->compress = c;
+
+    c->xch = xch;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work_cond, NULL);
+    pthread_cond_init(&c->done_cond, NULL);
+
+    for ( i = 0; i < ARRAY_SIZE(c->batch); i++ )
+    {
+        c->batch[i].data = malloc((size_t)MAX_BATCH_SIZE * PAGE_SIZE);
+        if ( !c->batch[i].data )
+            goto enomem;
+    }
+
+    if ( ctx->stream_type == XC_STREAM_PLAIN )
+    {
+        c->cache_slots = min_t(unsigned long,
+                               COMPRESS_CACHE_PAGES / ctx->save.nr_streams,
+                               ctx->save.p2m_size);
+        c->cache_pfns = malloc(c->cache_slots * sizeof(*c->cache_pfns));
+        c->cache_seq = calloc(c->cache_slots, sizeof(*c->cache_seq));
+        c->cache_data = malloc((size_t)c->cache_slots * PAGE_SIZE);
+        if ( !c->cache_pfns || !c->cache_seq || !c->cache_data )
+            goto enomem;
+        for ( i = 0; i < c->cache_slots; i++ )
+            c->cache_pfns[i] = INVALID_PFN;
+    }
+
+    c->nr_workers = min_t(long, max_t(long, cpus, 1), COMPRESS_MAX_WORKERS);
+    for ( i = 0; i < c->nr_workers; i++ )
+    {
+        errno = pthread_create(&c->workers[i], NULL, compress_worker, c);
+        if ( errno )
+        {
+            c->nr_workers = i;
+            PERROR("Unable to create compression thread");
+            return -1;
+        }
+    }
+
+    DPRINTF("Compressing page data on fd %d: %u worker threads, "
+            "%u pages delta cache", s->fd, c->nr_workers, c->cache_slots);
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for page compression");
+    errno = ENOMEM;
+    return -1;
+}
+
+void compress_cleanup(struct xc_sr_save_stream *s)
+{
+    struct xc_sr_compress *c = s->compress;
+    unsigned int i;
+
+    if ( !c )
+        return;
+
+    compress_wait(c);
+    if ( c->pending )
+        compress_release_batch(c, c->pending);
+
+    pthread_mutex_lock(&c->lock);
+    c->quit = true;
+    pthread_cond_broadcast(&c->work_cond);
+    pthread_mutex_unlock(&c->lock);
+
+    for ( i = 0; i < c->nr_workers; i++ )
+        pthread_join(c->workers[i], NULL);
+
+    pthread_cond_destroy(&c->done_cond);
+    pthread_cond_destroy(&c->work_cond);
+    pthread_mutex_destroy(&c->lock);
+
+    for ( i = 0; i < ARRAY_SIZE(c->batch); i++ )
+        free(c->batch[i].data);
+    free(c->cache_data);
+    free(c->cache_seq);
+    free(c->cache_pfns);
+    free(c);
+
+    s->compress = NULL;
+}
+
+int decompress_page(struct xc_sr_restore_stream *s,
+                    const struct xc_sr_rec_page_data_enc *enc,
+                    const void *data, const void *old_page, void *page)
+{
+    xc_interface *xch = s->ctx->xch;
+    z_stream *zs = s->zstream;
+    uint8_t *p = page;
+    const uint8_t *old = old_page;
+    unsigned int i;
+
+    switch ( enc->encoding )
+    {
+    case PAGE_DATA_ENC_RAW:
+        memcpy(page, data, PAGE_SIZE);
+        return 0;
+
+    case PAGE_DATA_ENC_ZERO:
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+
+    case PAGE_DATA_ENC_DEFLATE:
+    case PAGE_DATA_ENC_XOR_DEFLATE:
+        break;
+
+    default:
+        ERROR("Unknown page encoding %#x", enc->encoding);
+        return -1;
+    }
+
+    if ( !zs )
+    {
+        zs = calloc(1, sizeof(*zs));
+        if ( !zs || inflateInit(zs) != Z_OK )
+        {
+            free(zs);
+            ERROR("Unable to set up page decompression");
+            return -1;
+        }
+        s->zstream = zs;
+    }
+
+    if ( inflateReset(zs) != Z_OK )
+    {
+        ERROR("Unable to reset page decompression");
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = enc->length;
+    zs->next_out = page;
+    zs->avail_out = PAGE_SIZE;
+
+    if ( inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out ||
+         zs->avail_in )
+    {
+        ERROR("Corrupt compressed page data (encoding %#x, length %u)",
+              enc->encoding, enc->length);
+        return -1;
+    }
+
+    if ( enc->encoding == PAGE_DATA_ENC_XOR_DEFLATE )
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            p[i] ^= old[i];
+
+    return 0;
+}
+
+void decompress_cleanup(struct xc_sr_restore_stream *s)
+{
+    z_stream *zs = s->zstream;
+
+    if ( zs )
+    {
+        inflateEnd(zs);
+        free(zs);
+        s->zstream = NULL;
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -250,16 +250,22 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  If encs is not NULL, the page data is encoded as
+ * described by it (from a PAGE_DATA_COMPRESSED record).
+ *
+ * May run for several data streams in parallel.  Only the mapping and
+ * copying are done without holding ctx->restore.lock.
  */
-static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+static int process_page_data(struct xc_sr_context *ctx,
+                             struct xc_sr_restore_stream *s, unsigned int count,
+                             xen_pfn_t *pfns, uint32_t *types, void *page_data,
+                             const struct xc_sr_rec_page_data_enc *encs)
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
     int *map_errs = malloc(count * sizeof(*map_errs));
     int rc;
-    void *mapping = NULL, *guest_page = NULL;
+    void *mapping = NULL, *guest_page = NULL, *page;
     unsigned int nr_pages = 0;
 
     if ( !mfns || !map_errs )
@@ -270,9 +276,12 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         goto err;
     }
 
+    pthread_mutex_lock(&ctx->restore.lock);
+
     rc = populate_pfns(ctx, count, pfns, types);
     if ( rc )
     {
+        pthread_mutex_unlock(&ctx->restore.lock);
         ERROR("Failed to populate pfns for batch of %u pages", count);
         goto err;
     }
@@ -290,6 +299,8 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         nr_pages++;
     }
 
+    pthread_mutex_unlock(&ctx->restore.lock);
+
     /* Nothing to do? */
     if ( nr_pages == 0 )
         goto done;
@@ -315,8 +326,28 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
             goto err;
         }
 
+        if ( encs )
+        {
+            /* Decode into the bounce buffer, deltas apply to guest_page. */
+            page = s->page_buf;
+            rc = decompress_page(s, &encs[i], page_data, guest_page, page);
+            if ( rc )
+            {
+                ERROR("Failed to decode pfn %#"PRIpfn, pfns[i]);
+                goto err;
+            }
+            page_data += encs[i].length;
+        }
+        else
+        {
+            page = page_data;
+            page_data += PAGE_SIZE;
+        }
+
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        pthread_mutex_lock(&ctx->restore.lock);
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page);
+        pthread_mutex_unlock(&ctx->restore.lock);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -327,18 +358,17 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, page, PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
         else
         {
             /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            memcpy(guest_page, page, PAGE_SIZE);
         }
 
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
     }
 
  done:
@@ -355,14 +385,18 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate a PAGE_DATA or PAGE_DATA_COMPRESSED record from a stream, and
+ * pass the results to process_page_data() to actually perform the legwork.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int handle_page_data(struct xc_sr_context *ctx,
+                            struct xc_sr_restore_stream *s,
+                            struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
+    struct xc_sr_rec_page_data_enc *encs = NULL;
     unsigned int i, pages_of_data = 0;
+    size_t length;
     int rc = -1;
 
     xen_pfn_t *pfns = NULL, pfn;
@@ -448,18 +482,85 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         types[i] = type;
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    if ( rec->type == REC_TYPE_PAGE_DATA_COMPRESSED )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
-        goto err;
+        length = sizeof(*pages) + (sizeof(uint64_t) * pages->count) +
+                 (sizeof(*encs) * pages_of_data);
+        if ( rec->length < length )
+        {
+            ERROR("PAGE_DATA_COMPRESSED record (length %u) too short to "
+                  "contain %u encodings", rec->length, pages_of_data);
+            goto err;
+        }
+
+        encs = (void *)&pages->pfn[pages->count];
+        for ( i = 0; i < pages_of_data; ++i )
+        {
+            bool valid;
+
+            switch ( encs[i].encoding )
+            {
+            case PAGE_DATA_ENC_RAW:
+                valid = encs[i].length == PAGE_SIZE;
+                break;
+
+            case PAGE_DATA_ENC_ZERO:
+                valid = encs[i].length == 0;
+                break;
+
+            case PAGE_DATA_ENC_DEFLATE:
+            case PAGE_DATA_ENC_XOR_DEFLATE:
+                valid = encs[i].length && encs[i].length < PAGE_SIZE;
+                break;
+
+            default:
+                valid = false;
+                break;
+            }
+
+            if ( !valid )
+            {
+                ERROR("Bad encoding %#x (length %u) for page %u",
+                      encs[i].encoding, encs[i].length, i);
+                goto err;
+            }
+
+            length += encs[i].length;
+        }
+
+        if ( rec->length != length )
+        {
+            ERROR("PAGE_DATA_COMPRESSED record wrong size: length %u, "
+                  "expected %zu", rec->length, length);
+            goto err;
+        }
+
+        if ( !s->page_buf && !(s->page_buf = malloc(PAGE_SIZE)) )
+        {
+            ERROR("Unable to allocate page decode buffer");
+            goto err;
+        }
+
+        rc = process_page_data(ctx, s, pages->count, pfns, types,
+                               &encs[pages_of_data], encs);
+    }
+    else
+    {
+        if ( rec->length != (sizeof(*pages) +
+                             (sizeof(uint64_t) * pages->count) +
+                             (PAGE_SIZE * pages_of_data)) )
+        {
+            ERROR("PAGE_DATA record wrong size: length %u, expected "
+                  "%zu + %zu + %lu", rec->length, sizeof(*pages),
+                  (sizeof(uint64_t) * pages->count),
+                  (PAGE_SIZE * pages_of_data));
+            goto err;
+        }
+
+        rc = process_page_data(ctx, s, pages->count, pfns, types,
+                               &pages->pfn[pages->count], NULL);
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
  err:
     free(types);
     free(pfns);
@@ -694,6 +795,154 @@ int handle_static_data_end(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Process the records of a data stream up to its next STREAM_SYNC record,
+ * which has to match the one seen in the main stream.
+ */
+static int drain_data_stream(struct xc_sr_context *ctx,
+                             struct xc_sr_restore_stream *s)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct xc_sr_rec_stream_sync *sync;
+    int rc;
+
+    for ( ;; )
+    {
+        rc = read_record(ctx, s->fd, &rec);
+        if ( rc )
+            return rc;
+
+        switch ( rec.type )
+        {
+        case REC_TYPE_PAGE_DATA:
+        case REC_TYPE_PAGE_DATA_COMPRESSED:
+            rc = handle_page_data(ctx, s, &rec);
+            break;
+
+        case REC_TYPE_STREAM_SYNC:
+            sync = rec.data;
+            if ( rec.length != sizeof(*sync) ||
+                 sync->seq != ctx->restore.sync_seq )
+            {
+                ERROR("Data stream on fd %d out of sync: expected %u",
+                      s->fd, ctx->restore.sync_seq);
+                rc = -1;
+            }
+            else
+                rc = 1;
+            break;
+
+        default:
+            ERROR("Unexpected record %#x (%s) in data stream on fd %d",
+                  rec.type, rec_type_to_str(rec.type), s->fd);
+            rc = -1;
+            break;
+        }
+
+        free(rec.data);
+
+        if ( rc )
+            return rc < 0 ? rc : 0;
+    }
+}
+
+static void *drain_data_stream_thread(void *arg)
+{
+    struct xc_sr_restore_stream *s = arg;
+
+    s->rc = drain_data_stream(s->ctx, s);
+
+    return NULL;
+}
+
+/*
+ * The main stream announces a pass over the guest's memory.  The page data
+ * of the pass is in the data streams, up to their matching STREAM_SYNC
+ * records.  Process it, in parallel, before anything which follows in the
+ * main stream.
+ */
+static int handle_stream_sync(struct xc_sr_context *ctx,
+                              struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_stream_sync *sync = rec->data;
+    struct xc_sr_restore_stream *s;
+    unsigned int i, nr_threads = 1;
+    int rc = 0;
+
+    if ( !ctx->restore.nr_data_fds )
+    {
+        ERROR("STREAM_SYNC record without data streams");
+        return -1;
+    }
+
+    if ( rec->length != sizeof(*sync) )
+    {
+        ERROR("STREAM_SYNC record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*sync));
+        return -1;
+    }
+
+    if ( sync->seq != ctx->restore.sync_seq + 1 )
+    {
+        ERROR("STREAM_SYNC out of order: got %u, expected %u",
+              sync->seq, ctx->restore.sync_seq + 1);
+        return -1;
+    }
+
+    ctx->restore.sync_seq = sync->seq;
+
+    for ( ; nr_threads < ctx->restore.nr_streams; ++nr_threads )
+    {
+        s = &ctx->restore.streams[nr_threads];
+        errno = pthread_create(&s->thread, NULL, drain_data_stream_thread, s);
+        if ( errno )
+        {
+            PERROR("Unable to create thread for data stream on fd %d", s->fd);
+            rc = -1;
+            break;
+        }
+    }
+
+    for ( i = 1; i < nr_threads; ++i )
+    {
+        pthread_join(ctx->restore.streams[i].thread, NULL);
+        if ( !rc )
+            rc = ctx->restore.streams[i].rc;
+    }
+
+    return rc;
+}
+
+/*
+ * The main stream has ended, and so must the data streams.
+ */
+static int handle_end(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    unsigned int i;
+
+    for ( i = 1; i < ctx->restore.nr_streams; ++i )
+    {
+        if ( read_record(ctx, ctx->restore.streams[i].fd, &rec) )
+            return -1;
+
+        free(rec.data);
+
+        if ( rec.type != REC_TYPE_END )
+        {
+            ERROR("Expected END in data stream on fd %d, got %#x (%s)",
+                  ctx->restore.streams[i].fd, rec.type,
+                  rec_type_to_str(rec.type));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
@@ -702,10 +951,16 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     switch ( rec->type )
     {
     case REC_TYPE_END:
+        rc = handle_end(ctx);
         break;
 
     case REC_TYPE_PAGE_DATA:
-        rc = handle_page_data(ctx, rec);
+    case REC_TYPE_PAGE_DATA_COMPRESSED:
+        rc = handle_page_data(ctx, &ctx->restore.streams[0], rec);
+        break;
+
+    case REC_TYPE_STREAM_SYNC:
+        rc = handle_stream_sync(ctx, rec);
         break;
 
     case REC_TYPE_VERIFY:
@@ -735,10 +990,13 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    unsigned int i;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    pthread_mutex_init(&ctx->restore.lock, NULL);
+
     if ( ctx->stream_type == XC_STREAM_COLO )
     {
         dirty_bitmap = xc_hypercall_buffer_alloc_pages(
@@ -776,6 +1034,23 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    ctx->restore.nr_streams = 1 + ctx->restore.nr_data_fds;
+    ctx->restore.streams = calloc(ctx->restore.nr_streams,
+                                  sizeof(*ctx->restore.streams));
+    if ( !ctx->restore.streams )
+    {
+        ERROR("Unable to allocate memory for streams");
+        rc = -1;
+        goto err;
+    }
+
+    for ( i = 0; i < ctx->restore.nr_streams; ++i )
+    {
+        ctx->restore.streams[i].ctx = ctx;
+        ctx->restore.streams[i].fd =
+            i ? ctx->restore.data_fds[i - 1] : ctx->fd;
+    }
+
  err:
     return rc;
 }
@@ -797,6 +1072,14 @@ static void cleanup(struct xc_sr_context *ctx)
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
 
+    for ( i = 0; ctx->restore.streams && i < ctx->restore.nr_streams; i++ )
+    {
+        free(ctx->restore.streams[i].page_buf);
+        decompress_cleanup(&ctx->restore.streams[i]);
+    }
+    free(ctx->restore.streams);
+    pthread_mutex_destroy(&ctx->restore.lock);
+
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 }
@@ -896,13 +1179,16 @@ static int restore(struct xc_sr_context *ctx)
     return rc;
 }
 
-int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
-                      unsigned int store_evtchn, unsigned long *store_mfn,
-                      uint32_t store_domid, unsigned int console_evtchn,
-                      unsigned long *console_gfn, uint32_t console_domid,
-                      xc_stream_type_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd,
-                      unsigned int memflags)
+int xc_domain_restore_streams(xc_interface *xch, int io_fd,
+                              const int *data_fds, unsigned int nr_data_fds,
+                              uint32_t dom, unsigned int store_evtchn,
+                              unsigned long *store_mfn, uint32_t store_domid,
+                              unsigned int console_evtchn,
+                              unsigned long *console_gfn,
+                              uint32_t console_domid,
+                              xc_stream_type_t stream_type,
+                              struct restore_callbacks *callbacks,
+                              int send_back_fd, unsigned int memflags)
 {
     bool hvm;
     xen_pfn_t nr_pfns;
@@ -920,6 +1206,15 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
     ctx.restore.memflags = memflags;
+    ctx.restore.data_fds = data_fds;
+    ctx.restore.nr_data_fds = nr_data_fds;
+
+    if ( nr_data_fds && stream_type != XC_STREAM_PLAIN )
+    {
+        ERROR("Data streams are not supported for checkpointed streams");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
 
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
@@ -948,8 +1243,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     }
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
-    DPRINTF("fd %d, dom %u, hvm %u, stream_type %d",
-            io_fd, dom, hvm, stream_type);
+    DPRINTF("fd %d, data fds %u, dom %u, hvm %u, stream_type %d",
+            io_fd, nr_data_fds, dom, hvm, stream_type);
 
     ctx.domid = dom;
 
@@ -984,6 +1279,20 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return 0;
 }
 
+int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                      unsigned int store_evtchn, unsigned long *store_mfn,
+                      uint32_t store_domid, unsigned int console_evtchn,
+                      unsigned long *console_gfn, uint32_t console_domid,
+                      xc_stream_type_t stream_type,
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      unsigned int memflags)
+{
+    return xc_domain_restore_streams(xch, io_fd, NULL, 0, dom, store_evtchn,
+                                     store_mfn, store_domid, console_evtchn,
+                                     console_gfn, console_domid, stream_type,
+                                     callbacks, send_back_fd, memflags);
+}
+
 /*
  * Local variables:
  * mode: C
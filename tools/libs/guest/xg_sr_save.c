@@ -3,6 +3,15 @@
 
 #include "xg_sr_common.h"
 
+#include <xen-tools/common-macros.h>
+
+/*
+ * With data streams, each stream sends the pfns of interleaved shards of
+ * this many pfns.  A multiple of the bitmap word size, so the deferred_pages
+ * bitmap can be updated by the streams without locking.
+ */
+#define DATA_STREAM_SHARD MAX_BATCH_SIZE
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -44,11 +53,23 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
 }
 
 /*
- * Writes an END record into the stream.
+ * Writes an END record into the stream, and into each data stream.
  */
 static int write_end_record(struct xc_sr_context *ctx)
 {
+    xc_interface *xch = ctx->xch;
     struct xc_sr_record end = { .type = REC_TYPE_END };
+    struct xc_sr_rhdr rhdr = { .type = REC_TYPE_END };
+    unsigned int i;
+
+    for ( i = 0; i < ctx->save.nr_data_fds; ++i )
+    {
+        if ( write_exact(ctx->save.data_fds[i], &rhdr, sizeof(rhdr)) )
+        {
+            PERROR("Unable to write END record to data stream %u", i);
+            return -1;
+        }
+    }
 
     return write_record(ctx, &end);
 }
@@ -63,6 +84,35 @@ static int write_static_data_end_record(struct xc_sr_context *ctx)
     return write_record(ctx, &end);
 }
 
+/*
+ * Writes a STREAM_SYNC record into the main stream, starting a pass over the
+ * guest's memory, or into a data stream, ending it.
+ */
+static int write_stream_sync_record(struct xc_sr_context *ctx, int fd)
+{
+    xc_interface *xch = ctx->xch;
+    struct {
+        struct xc_sr_rhdr rec;
+        struct xc_sr_rec_stream_sync sync;
+    } sync = {
+        .rec = {
+            .type = REC_TYPE_STREAM_SYNC,
+            .length = sizeof(sync.sync),
+        },
+        .sync = {
+            .seq = ctx->save.sync_seq,
+        },
+    };
+
+    if ( write_exact(fd, &sync, sizeof(sync)) )
+    {
+        PERROR("Unable to write STREAM_SYNC record to fd %d", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Writes a CHECKPOINT record into the stream.
  */
@@ -74,25 +124,26 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.buffers->batch_pfns.
+ * Writes a batch of memory as a PAGE_DATA record into a stream.  The batch
+ * is constructed in s->buffers->batch_pfns.
  *
  * This function:
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * - construct and writes a PAGE_DATA record into the stream, or hands the
+ *   batch over for compression.
  */
-static int write_batch(struct xc_sr_context *ctx)
+static int write_batch(struct xc_sr_context *ctx, struct xc_sr_save_stream *s)
 {
     xc_interface *xch = ctx->xch;
     void *guest_mapping = NULL;
     int rc = -1;
     unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned int nr_pfns = ctx->save.nr_batch_pfns;
+    unsigned int nr_pfns = s->nr_batch_pfns;
     void *page, *orig_page;
     int iovcnt = 0;
-    xen_pfn_t *const batch_pfns = ctx->save.buffers->batch_pfns;
+    xen_pfn_t *const batch_pfns = s->buffers->batch_pfns;
     struct {
         struct xc_sr_rhdr rec;
         struct xc_sr_rec_page_data_header page_data;
@@ -108,17 +159,20 @@ static int write_batch(struct xc_sr_context *ctx)
     };
 
     /* Mfns of the batch pfns. */
-    xen_pfn_t *const mfns = ctx->save.buffers->mfns;
+    xen_pfn_t *const mfns = s->buffers->mfns;
     /* Types of the batch pfns. */
-    xen_pfn_t *const types = ctx->save.buffers->types;
+    xen_pfn_t *const types = s->buffers->types;
     /* Errors from attempting to map the gfns. */
-    int *const errors = ctx->save.buffers->errors;
+    int *const errors = s->buffers->errors;
     /* Pointers to locally allocated pages.  Need freeing. */
-    void **const local_pages = ctx->save.buffers->local_pages;
+    void **const local_pages = s->buffers->local_pages;
     /* iovec[] for writev(). */
-    struct iovec *const iov = ctx->save.buffers->iov;
+    struct iovec *const iov = s->buffers->iov;
     /* page_data record PFNs list */
-    uint64_t *const rec_pfns = ctx->save.buffers->rec_pfns;
+    uint64_t *const rec_pfns = s->buffers->rec_pfns;
+    /* Pages with data, for compression. */
+    void **const data_pages = s->buffers->data_pages;
+    unsigned int nr_data_pages = 0;
 
     assert(nr_pfns != 0);
     assert(nr_pfns <= MAX_BATCH_SIZE);
@@ -139,7 +193,7 @@ static int write_batch(struct xc_sr_context *ctx)
         if ( mfns[i] == INVALID_MFN )
         {
             set_bit(batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
+            ++s->nr_deferred_pages;
         }
     }
 
@@ -199,13 +253,17 @@ static int write_batch(struct xc_sr_context *ctx)
                 if ( rc == -1 && errno == EAGAIN )
                 {
                     set_bit(batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    ++s->nr_deferred_pages;
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
                 else
                     goto err;
             }
+            else if ( s->compress )
+            {
+                data_pages[nr_data_pages++] = page;
+            }
             else if ( iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len !=
                       page )
             {
@@ -228,13 +286,22 @@ static int write_batch(struct xc_sr_context *ctx)
     for ( i = 0; i < nr_pfns; ++i )
         rec_pfns[i] = ((uint64_t)(types[i]) << 32) | batch_pfns[i];
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    if ( s->compress )
+    {
+        /* The mapping and local pages now belong to the compressor. */
+        rc = compress_batch(ctx, s, nr_data_pages, guest_mapping,
+                            nr_pages_mapped);
+        guest_mapping = NULL;
+        if ( rc )
+            goto err;
+    }
+    else if ( writev_exact(s->fd, iov, iovcnt) )
     {
         PERROR("Failed to write page data to stream");
         goto err;
     }
 
-    rc = ctx->save.nr_batch_pfns = 0;
+    rc = s->nr_batch_pfns = 0;
 
  err:
     if ( guest_mapping )
@@ -251,20 +318,20 @@ static int write_batch(struct xc_sr_context *ctx)
 /*
  * Flush a batch of pfns into the stream.
  */
-static int flush_batch(struct xc_sr_context *ctx)
+static int flush_batch(struct xc_sr_context *ctx, struct xc_sr_save_stream *s)
 {
     int rc = 0;
 
-    if ( ctx->save.nr_batch_pfns == 0 )
+    if ( s->nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    rc = write_batch(ctx, s);
 
     if ( !rc )
     {
-        VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.buffers->batch_pfns,
+        VALGRIND_MAKE_MEM_UNDEFINED(s->buffers->batch_pfns,
                                     MAX_BATCH_SIZE *
-                                    sizeof(*ctx->save.buffers->batch_pfns));
+                                    sizeof(*s->buffers->batch_pfns));
     }
 
     return rc;
@@ -273,15 +340,16 @@ static int flush_batch(struct xc_sr_context *ctx)
 /*
  * Add a single pfn to the batch, flushing the batch if full.
  */
-static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
+static int add_to_batch(struct xc_sr_context *ctx, struct xc_sr_save_stream *s,
+                        xen_pfn_t pfn)
 {
     int rc = 0;
 
-    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
-        rc = flush_batch(ctx);
+    if ( s->nr_batch_pfns == MAX_BATCH_SIZE )
+        rc = flush_batch(ctx, s);
 
     if ( rc == 0 )
-        ctx->save.buffers->batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+        s->buffers->batch_pfns[s->nr_batch_pfns++] = pfn;
 
     return rc;
 }
@@ -325,39 +393,122 @@ static int suspend_domain(struct xc_sr_context *ctx)
     return 0;
 }
 
+/*
+ * Send the dirty pages of one stream's shard of the guest's p2m, which is
+ * all of it without data streams.  Ends the pass on a data stream with a
+ * STREAM_SYNC record.
+ */
+static int send_stream_pages(struct xc_sr_context *ctx,
+                             struct xc_sr_save_stream *s,
+                             unsigned long entries)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t p, start, end;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( start = s->idx * DATA_STREAM_SHARD; start < ctx->save.p2m_size;
+          start += ctx->save.nr_streams * DATA_STREAM_SHARD )
+    {
+        end = min_t(xen_pfn_t, start + DATA_STREAM_SHARD, ctx->save.p2m_size);
+
+        for ( p = start; p < end; ++p )
+        {
+            if ( !test_bit(p, dirty_bitmap) )
+                continue;
+
+            rc = add_to_batch(ctx, s, p);
+            if ( rc )
+                return rc;
+
+            /* Update progress every 4MB worth of memory sent. */
+            if ( !ctx->save.nr_data_fds &&
+                 (s->written & ((1U << (22 - 12)) - 1)) == 0 )
+                xc_report_progress_step(xch, s->written, entries);
+
+            ++s->written;
+        }
+    }
+
+    rc = flush_batch(ctx, s);
+    if ( !rc && s->compress )
+        rc = compress_flush(ctx, s);
+    if ( !rc && ctx->save.nr_data_fds )
+        rc = write_stream_sync_record(ctx, s->fd);
+
+    return rc;
+}
+
+static void *send_stream_pages_thread(void *arg)
+{
+    struct xc_sr_save_stream *s = arg;
+
+    s->rc = send_stream_pages(s->ctx, s, 0);
+
+    return NULL;
+}
+
 /*
  * Send a subset of pages in the guests p2m, according to the dirty bitmap.
  * Used for each subsequent iteration of the live migration loop.
  *
+ * With data streams, the pass is announced with a STREAM_SYNC record in the
+ * main stream, and each data stream then sends its shard from its own
+ * thread.  Nothing is written to the main stream until all are done, so the
+ * restorer can drain the data streams in parallel without deadlocking.
+ *
  * Bitmap is bounded by p2m_size.
  */
 static int send_dirty_pages(struct xc_sr_context *ctx,
                             unsigned long entries)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t p;
-    unsigned long written;
-    int rc;
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->save.dirty_bitmap_hbuf);
+    struct xc_sr_save_stream *s;
+    unsigned long written = 0;
+    unsigned int i, nr_threads = 0;
+    int rc = 0;
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+        ctx->save.streams[i].written = 0;
 
-    for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
+    if ( !ctx->save.nr_data_fds )
+        rc = send_stream_pages(ctx, &ctx->save.streams[0], entries);
+    else
     {
-        if ( !test_bit(p, dirty_bitmap) )
-            continue;
+        ctx->save.sync_seq++;
+        rc = write_stream_sync_record(ctx, ctx->fd);
 
-        rc = add_to_batch(ctx, p);
-        if ( rc )
-            return rc;
+        for ( ; !rc && nr_threads < ctx->save.nr_streams; ++nr_threads )
+        {
+            s = &ctx->save.streams[nr_threads];
+            errno = pthread_create(&s->thread, NULL,
+                                   send_stream_pages_thread, s);
+            if ( errno )
+            {
+                PERROR("Unable to create thread for data stream %u",
+                       nr_threads);
+                rc = -1;
+                break;
+            }
+        }
 
-        /* Update progress every 4MB worth of memory sent. */
-        if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
-            xc_report_progress_step(xch, written, entries);
+        for ( i = 0; i < nr_threads; ++i )
+        {
+            pthread_join(ctx->save.streams[i].thread, NULL);
+            if ( !rc )
+                rc = ctx->save.streams[i].rc;
+        }
+    }
 
-        ++written;
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        s = &ctx->save.streams[i];
+        written += s->written;
+        ctx->save.nr_deferred_pages += s->nr_deferred_pages;
+        s->nr_deferred_pages = 0;
     }
 
-    rc = flush_batch(ctx);
     if ( rc )
         return rc;
 
@@ -762,6 +913,7 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    unsigned int i;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
@@ -773,18 +925,44 @@ static int setup(struct xc_sr_context *ctx)
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
         xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
     ctx->save.deferred_pages = bitmap_alloc(ctx->save.p2m_size);
-    ctx->save.buffers = calloc(1, sizeof(*ctx->save.buffers));
+    ctx->save.nr_streams = ctx->save.nr_data_fds ?: 1;
+    ctx->save.streams = calloc(ctx->save.nr_streams,
+                               sizeof(*ctx->save.streams));
 
-    if ( !ctx->save.buffers || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !ctx->save.streams || !dirty_bitmap || !ctx->save.deferred_pages )
+        goto enomem;
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
     {
-        ERROR("Unable to allocate memory for dirty bitmaps, deferred pages"
-              " and various batch buffers");
-        rc = -1;
-        errno = ENOMEM;
-        goto err;
+        struct xc_sr_save_stream *s = &ctx->save.streams[i];
+
+        s->ctx = ctx;
+        s->idx = i;
+        s->fd = ctx->save.nr_data_fds ? ctx->save.data_fds[i] : ctx->fd;
+        s->buffers = calloc(1, sizeof(*s->buffers));
+        if ( !s->buffers )
+            goto enomem;
+
+        if ( ctx->save.compressed )
+        {
+            rc = compress_setup(ctx, s);
+            if ( rc )
+                goto err;
+        }
     }
 
+    if ( ctx->save.nr_data_fds )
+        DPRINTF("Sending page data on %u data streams",
+                ctx->save.nr_data_fds);
+
     rc = 0;
+    goto err;
+
+ enomem:
+    ERROR("Unable to allocate memory for dirty bitmaps, deferred pages"
+          " and various batch buffers");
+    rc = -1;
+    errno = ENOMEM;
 
  err:
     return rc;
@@ -793,9 +971,15 @@ static int setup(struct xc_sr_context *ctx)
 static void cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    unsigned int i;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    for ( i = 0; ctx->save.streams && i < ctx->save.nr_streams; ++i )
+    {
+        compress_cleanup(&ctx->save.streams[i]);
+        free(ctx->save.streams[i].buffers);
+    }
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
@@ -806,7 +990,7 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
     free(ctx->save.deferred_pages);
-    free(ctx->save.buffers);
+    free(ctx->save.streams);
 }
 
 /*
@@ -947,9 +1131,11 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     return rc;
 };
 
-int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
-                   uint32_t flags, struct save_callbacks *callbacks,
-                   xc_stream_type_t stream_type, int recv_fd)
+int xc_domain_save_streams(xc_interface *xch, int io_fd,
+                           const int *data_fds, unsigned int nr_data_fds,
+                           uint32_t dom, uint32_t flags,
+                           struct save_callbacks *callbacks,
+                           xc_stream_type_t stream_type, int recv_fd)
 {
     struct xc_sr_context ctx = {
         .xch = xch,
@@ -962,7 +1148,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compressed = !!(flags & XCFLAGS_COMPRESS);
     ctx.save.recv_fd = recv_fd;
+    ctx.save.data_fds = data_fds;
+    ctx.save.nr_data_fds = nr_data_fds;
+
+    if ( nr_data_fds && stream_type != XC_STREAM_PLAIN )
+    {
+        ERROR("Data streams are not supported for checkpointed streams");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
 
     if ( xc_domain_getinfo_single(xch, dom, &ctx.dominfo) < 0 )
     {
@@ -991,8 +1187,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
         break;
     }
 
-    DPRINTF("fd %d, dom %u, flags %u, hvm %d",
-            io_fd, dom, flags, hvm);
+    DPRINTF("fd %d, data fds %u, dom %u, flags %u, hvm %d",
+            io_fd, nr_data_fds, dom, flags, hvm);
 
     ctx.domid = dom;
 
@@ -1008,6 +1204,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     }
 }
 
+int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
+                   uint32_t flags, struct save_callbacks *callbacks,
+                   xc_stream_type_t stream_type, int recv_fd)
+{
+    return xc_domain_save_streams(xch, io_fd, NULL, 0, dom, flags, callbacks,
+                                  stream_type, recv_fd);
+}
+
 /*
  * Local variables:
  * mode: C
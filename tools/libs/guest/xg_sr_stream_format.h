@@ -76,6 +76,8 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_PAGE_DATA_COMPRESSED       0x00000013U
+#define REC_TYPE_STREAM_SYNC                0x00000014U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +92,23 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/*
+ * PAGE_DATA_COMPRESSED.  The PAGE_DATA header and pfn list, followed by one
+ * encoding entry per page with data, followed by the encoded data.
+ */
+struct xc_sr_rec_page_data_enc
+{
+    uint32_t length;
+    uint16_t encoding;
+    uint16_t _res1;
+};
+
+#define PAGE_DATA_ENC_RAW         0x0000U /* Plain page contents. */
+#define PAGE_DATA_ENC_ZERO        0x0001U /* Page of zeros, no data. */
+#define PAGE_DATA_ENC_DEFLATE     0x0002U /* zlib stream of the contents. */
+#define PAGE_DATA_ENC_XOR_DEFLATE 0x0003U /* zlib stream of the contents XOR
+                                           * the previously sent contents. */
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -138,6 +157,13 @@ struct xc_sr_rec_hvm_params
     struct xc_sr_rec_hvm_params_entry param[0];
 };
 
+/* STREAM_SYNC */
+struct xc_sr_rec_stream_sync
+{
+    uint32_t seq;
+    uint32_t _res1;
+};
+
 #endif
 /*
  * Local variables:
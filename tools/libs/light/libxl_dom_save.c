@@ -269,7 +269,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (rc) goto out;
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
-          | (debug ? XCFLAGS_DEBUG : 0);
+          | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->compress ? XCFLAGS_COMPRESS : 0);
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
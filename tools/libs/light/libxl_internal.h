@@ -3598,6 +3598,7 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int compress;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
@@ -77,7 +77,54 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
 int libxl__xs_writev(libxl__gc *gc, xs_transaction_t t,
                      const char *dir, char *kvs[])
 {
-    return libxl__xs_writev_perms(gc, t, dir, kvs, NULL, 0);
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_multi_op *ops;
+    unsigned int i, nr = 0;
+    size_t length;
+
+    if (!kvs)
+        return 0;
+
+    /*
+     * xs_multi() performs the writes sent in the same request as a failed
+     * one. Outside a transaction they would stay, so stop at the first
+     * failure by writing one node at a time.
+     */
+    if (t == XBT_NULL)
+        return libxl__xs_writev_perms(gc, t, dir, kvs, NULL, 0);
+
+    /*
+     * Send all writes in as few requests to xenstored as possible. No
+     * more requests are sent once a write has failed.
+     */
+    for (i = 0; kvs[i] != NULL; i += 2)
+        nr++;
+    GCNEW_ARRAY(ops, nr);
+
+    for (i = 0, nr = 0; kvs[i] != NULL; i += 2) {
+        if (!kvs[i + 1])
+            continue;
+        length = strlen(kvs[i + 1]);
+        if (length > UINT_MAX)
+            return ERROR_FAIL;
+        ops[nr].type = XS_WRITE;
+        ops[nr].path = GCSPRINTF("%s/%s", dir, kvs[i]);
+        ops[nr].data = kvs[i + 1];
+        ops[nr].len = length;
+        nr++;
+    }
+
+    if (!xs_multi(ctx->xsh, t, ops, nr))
+        return ERROR_FAIL;
+
+    for (i = 0; i < nr; i++) {
+        if (ops[i].err) {
+            errno = ops[i].err;
+            return ERROR_FAIL;
+        }
+    }
+
+    return 0;
 }
 
 int libxl__xs_writev_atonce(libxl__gc *gc,
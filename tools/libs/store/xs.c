@@ -901,6 +901,244 @@ bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_RM, path, NULL));
 }
 
+/* Perform a single operation of xs_multi() with a request of its own. */
+static void xs_multi_single(struct xs_handle *h, xs_transaction_t t,
+			    struct xs_multi_op *op)
+{
+	bool ok;
+
+	switch (op->type) {
+	case XS_READ:
+		op->value = xs_read(h, t, op->path, &op->num);
+		ok = op->value;
+		break;
+	case XS_DIRECTORY:
+		op->value = xs_directory(h, t, op->path, &op->num);
+		ok = op->value;
+		break;
+	case XS_GET_PERMS:
+		op->value = xs_get_permissions(h, t, op->path, &op->num);
+		ok = op->value;
+		break;
+	case XS_WRITE:
+		ok = xs_write(h, t, op->path, op->data, op->len);
+		break;
+	case XS_MKDIR:
+		ok = xs_mkdir(h, t, op->path);
+		break;
+	case XS_RM:
+		ok = xs_rm(h, t, op->path);
+		break;
+	default:
+		errno = EINVAL;
+		ok = false;
+		break;
+	}
+
+	op->err = ok ? 0 : errno;
+}
+
+/*
+ * Check whether one of the operations from start to end failed. If so, the
+ * operations from end on fail with ECANCELED without being sent.
+ */
+static bool xs_multi_failed(struct xs_multi_op *ops, unsigned int start,
+			    unsigned int end, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = start; i < end; i++)
+		if (ops[i].err)
+			break;
+	if (i == end)
+		return false;
+
+	for (i = end; i < num; i++)
+		ops[i].err = ECANCELED;
+
+	return true;
+}
+
+/* Store the result of a MULTI sub-request in op. */
+static bool xs_multi_result(struct xs_multi_op *op,
+			    const struct xsd_sockmsg *hdr, const char *body)
+{
+	char *strings;
+
+	if (hdr->type == XS_ERROR) {
+		op->err = get_error(body);
+		return true;
+	}
+
+	if (hdr->type != op->type) {
+		errno = EIO;
+		return false;
+	}
+
+	switch (op->type) {
+	case XS_READ:
+		/* Add a nul terminator, like xs_read(). */
+		op->value = malloc(hdr->len + 1);
+		if (!op->value)
+			break;
+		memcpy(op->value, body, hdr->len);
+		((char *)op->value)[hdr->len] = 0;
+		op->num = hdr->len;
+		break;
+	case XS_DIRECTORY:
+		strings = malloc(hdr->len);
+		if (!strings)
+			break;
+		memcpy(strings, body, hdr->len);
+		op->value = xs_directory_common(strings, hdr->len, &op->num);
+		break;
+	case XS_GET_PERMS:
+		/* Each string is one permission, like xs_get_permissions(). */
+		op->num = xenstore_count_strings(body, hdr->len);
+		op->value = malloc(op->num * sizeof(struct xs_permissions));
+		if (op->value &&
+		    !xenstore_strings_to_perms(op->value, op->num, body)) {
+			free_no_errno(op->value);
+			op->value = NULL;
+		}
+		break;
+	default:
+		return true;
+	}
+
+	if (!op->value)
+		op->err = errno;
+
+	return true;
+}
+
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num)
+{
+	struct xsd_sockmsg msg = { .type = XS_MULTI, .tx_id = t };
+	struct xsd_sockmsg *subs = NULL, hdr;
+	struct iovec *iov = NULL;
+	unsigned int features, i, first, done, len, oplen, nr, off, reply_len;
+	char *reply;
+	bool ret = false;
+
+	for (i = 0; i < num; i++) {
+		ops[i].err = 0;
+		ops[i].value = NULL;
+		ops[i].num = 0;
+	}
+
+	if (!xs_get_features_supported(h, &features) ||
+	    !(features & XENSTORE_SERVER_FEATURE_MULTI)) {
+		for (i = 0; i < num && h->fd != -1; i++) {
+			xs_multi_single(h, t, ops + i);
+			if (xs_multi_failed(ops, i, i + 1, num))
+				break;
+		}
+		return h->fd != -1;
+	}
+
+	subs = calloc(num, sizeof(*subs));
+	iov = calloc(1 + 3 * num, sizeof(*iov));
+	if (!subs || !iov)
+		goto out;
+
+	for (first = 0; first < num; first += done) {
+		/* Put as many operations into one request as possible. */
+		iov[0].iov_base = &msg;
+		iov[0].iov_len  = sizeof(msg);
+		nr = 1;
+		len = 0;
+		for (i = first; i < num; i++) {
+			oplen = strlen(ops[i].path) + 1;
+			if (ops[i].type == XS_WRITE)
+				oplen += ops[i].len;
+			if (len + sizeof(subs[i]) + oplen > XENSTORE_PAYLOAD_MAX)
+				break;
+			len += sizeof(subs[i]) + oplen;
+
+			subs[i].type = ops[i].type;
+			subs[i].len = oplen;
+			iov[nr].iov_base = subs + i;
+			iov[nr++].iov_len = sizeof(subs[i]);
+			iov[nr].iov_base = (void *)ops[i].path;
+			iov[nr++].iov_len = strlen(ops[i].path) + 1;
+			if (ops[i].type == XS_WRITE && ops[i].len) {
+				iov[nr].iov_base = (void *)ops[i].data;
+				iov[nr++].iov_len = ops[i].len;
+			}
+		}
+
+		/* An operation too large for a MULTI request is sent alone. */
+		if (i == first) {
+			xs_multi_single(h, t, ops + first);
+			if (h->fd == -1)
+				goto out;
+			done = 1;
+			if (xs_multi_failed(ops, first, first + 1, num))
+				break;
+			continue;
+		}
+
+		reply = xs_talkv(h, iov, nr, &reply_len);
+		if (!reply) {
+			if (errno == EINVAL || errno == ENOSYS) {
+				/* Let the daemon decide on each operation. */
+				for (; first < i && h->fd != -1; first++) {
+					xs_multi_single(h, t, ops + first);
+					if (xs_multi_failed(ops, first,
+							    first + 1, num))
+						break;
+				}
+				if (h->fd == -1)
+					goto out;
+				if (first < i)
+					break;
+				done = 0;
+				continue;
+			}
+			goto out;
+		}
+
+		/*
+		 * The daemon might have performed only the first operations,
+		 * the remaining ones are sent again.
+		 */
+		for (off = 0, done = 0;
+		     first + done < i && reply_len - off >= sizeof(hdr);
+		     off += sizeof(hdr) + hdr.len, done++) {
+			memcpy(&hdr, reply + off, sizeof(hdr));
+			if (hdr.len > reply_len - off - sizeof(hdr) ||
+			    !xs_multi_result(ops + first + done, &hdr,
+					     reply + off + sizeof(hdr))) {
+				free(reply);
+				errno = EIO;
+				goto out;
+			}
+
+			/* Too large for a MULTI reply, so retry it alone. */
+			if (ops[first + done].err == E2BIG)
+				xs_multi_single(h, t, ops + first + done);
+		}
+		free(reply);
+
+		if (!done) {
+			errno = EIO;
+			goto out;
+		}
+
+		if (xs_multi_failed(ops, first, first + done, num))
+			break;
+	}
+
+	ret = true;
+
+ out:
+	free_no_errno(subs);
+	free_no_errno(iov);
+	return ret;
+}
+
 /* Get permissions of node (first element is owner).
  * Returns malloced array, or NULL: call free() after use.
  */
@@ -1487,6 +1725,7 @@ bool xs_get_features_supported(struct xs_handle *h, unsigned int *features)
 {
 	static unsigned int own_features = 0;
 	static bool features_valid = false;
+	static int features_err = 0;
 	struct xsd_sockmsg msg = { .type = XS_GET_FEATURE };
 	struct iovec iov[1];
 
@@ -1495,11 +1734,20 @@ bool xs_get_features_supported(struct xs_handle *h, unsigned int *features)
 		return true;
 	}
 
+	/* The daemon doesn't know the request, don't ask it again. */
+	if (features_err) {
+		errno = features_err;
+		return false;
+	}
+
 	iov[0].iov_base = &msg;
 	iov[0].iov_len  = sizeof(msg);
 
-	if (!xs_uint(xs_talkv(h, iov, ARRAY_SIZE(iov), NULL), &own_features))
+	if (!xs_uint(xs_talkv(h, iov, ARRAY_SIZE(iov), NULL), &own_features)) {
+		if (errno == EINVAL || errno == ENOSYS)
+			features_err = errno;
 		return false;
+	}
 
 	features_valid = true;
 	*features = own_features;
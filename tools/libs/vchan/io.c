@@ -34,7 +34,9 @@
 #include <sys/uio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xenctrl.h>
@@ -50,6 +52,13 @@
 #define PAGE_SIZE 4096
 #endif
 
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() asm volatile ("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax() asm volatile ("yield" ::: "memory")
+#else
+#define cpu_relax() asm volatile ("" ::: "memory")
+#endif
 
 static inline uint32_t rd_prod(struct libxenvchan *ctrl)
 {
@@ -105,6 +114,13 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 	uint8_t *notify, prev;
 	xen_mb(); /* caller updates indexes /before/ we decode to notify */
 	notify = ctrl->is_server ? &ctrl->ring->srv_notify : &ctrl->ring->cli_notify;
+	/*
+	 * The peer sets the bit /before/ re-reading the indexes, so if it is
+	 * clear now the peer will see our update without being notified.
+	 * Skip the locked operation on the shared page in this common case.
+	 */
+	if (!(*(volatile uint8_t *)notify & bit))
+		return 0;
 	prev = __sync_fetch_and_and(notify, ~bit);
 	if (prev & bit)
 		return xenevtchn_notify(ctrl->event, ctrl->event_port);
@@ -127,6 +143,34 @@ static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 	return ready;
 }
 
+/**
+ * Poll the ring for up to spin_usec microseconds until get() returns at least
+ * request bytes.  When the peer is active this avoids both asking it for a
+ * notification and our wakeup latency.
+ */
+static int spin_for(struct libxenvchan *ctrl, int (*get)(struct libxenvchan *),
+                    size_t request)
+{
+	struct timespec start, now;
+	unsigned int i;
+	int ready;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		/* Don't read the clock for every poll of the ring. */
+		for (i = 0; i < 64; i++) {
+			ready = get(ctrl);
+			if (ready >= request || !libxenvchan_is_open(ctrl))
+				return ready;
+			cpu_relax();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000L +
+		    (now.tv_nsec - start.tv_nsec) / 1000 >= ctrl->spin_usec)
+			return ready;
+	}
+}
+
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
@@ -135,6 +179,11 @@ static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request)
 	int ready = raw_get_data_ready(ctrl);
 	if (ready >= request)
 		return ready;
+	if (ctrl->blocking && ctrl->spin_usec) {
+		ready = spin_for(ctrl, raw_get_data_ready, request);
+		if (ready >= request)
+			return ready;
+	}
 	/* We plan to consume all data; please tell us if you send more */
 	request_notify(ctrl, VCHAN_NOTIFY_WRITE);
 	/*
@@ -177,6 +226,11 @@ static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request
 	int ready = raw_get_buffer_space(ctrl);
 	if (ready >= request)
 		return ready;
+	if (ctrl->blocking && ctrl->spin_usec) {
+		ready = spin_for(ctrl, raw_get_buffer_space, request);
+		if (ready >= request)
+			return ready;
+	}
 	/* We plan to fill the buffer; please tell us when you've read it */
 	request_notify(ctrl, VCHAN_NOTIFY_READ);
 	/*
@@ -205,24 +259,88 @@ int libxenvchan_wait(struct libxenvchan *ctrl)
 	return 0;
 }
 
+/*
+ * Describe size bytes of a ring starting at index idx: two segments when
+ * they wrap around the end of the ring, otherwise the second one is empty.
+ */
+static int ring_iov(void *ring, uint32_t ring_size, uint32_t idx, size_t size,
+                    struct iovec *iov)
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+
+	iov[0].iov_base = ring + real_idx;
+	iov[1].iov_base = ring;
+	if (avail_contig >= size) {
+		iov[0].iov_len = size;
+		iov[1].iov_len = 0;
+		return 1;
+	}
+	iov[0].iov_len = avail_contig;
+	iov[1].iov_len = size - avail_contig;
+	return 2;
+}
+
+/*
+ * Copy size bytes between the ring segments ring_iov and the caller's iov,
+ * skipping the first skip bytes of the latter.
+ */
+static void copy_iov(const struct iovec *ring_iov, const struct iovec *iov,
+                     size_t skip, size_t size, int to_ring)
+{
+	size_t ring_off = 0, n;
+
+	while (size && skip >= iov->iov_len) {
+		skip -= iov->iov_len;
+		iov++;
+	}
+
+	while (size) {
+		n = iov->iov_len - skip;
+		if (n > ring_iov->iov_len - ring_off)
+			n = ring_iov->iov_len - ring_off;
+		if (n > size)
+			n = size;
+		if (to_ring)
+			memcpy(ring_iov->iov_base + ring_off, iov->iov_base + skip, n);
+		else
+			memcpy(iov->iov_base + skip, ring_iov->iov_base + ring_off, n);
+		size -= n;
+		skip += n;
+		ring_off += n;
+		if (skip == iov->iov_len) {
+			iov++;
+			skip = 0;
+		}
+		if (ring_off == ring_iov->iov_len) {
+			ring_iov++;
+			ring_off = 0;
+		}
+	}
+}
+
+static ssize_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	if (iovcnt < 0)
+		return -1;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+		/* The result has to fit into the int we return. */
+		if (iov[i].iov_len > INT_MAX || len > INT_MAX)
+			return -1;
+	}
+	return len;
+}
+
 /**
+ * Make size bytes written to the ring visible to the peer.
  * returns -1 on error, or size on success
- *
- * caller must have checked that enough space is available
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+static int do_commit(struct libxenvchan *ctrl, size_t size)
 {
-	int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
-	int avail_contig = wr_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
-	xen_mb(); /* read indexes /then/ write data */
-	memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
-	}
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
@@ -230,6 +348,29 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	return size;
 }
 
+/**
+ * returns -1 on error, or size on success
+ *
+ * caller must have checked that enough space is available
+ */
+static int do_sendv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    size_t skip, size_t size)
+{
+	struct iovec ring[2];
+
+	ring_iov(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, ring);
+	xen_mb(); /* read indexes /then/ write data */
+	copy_iov(ring, iov, skip, size, 1);
+	return do_commit(ctrl, size);
+}
+
+static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+
+	return do_sendv(ctrl, &iov, 0, size);
+}
+
 /**
  * returns 0 if no buffer space is available, -1 on error, or size on success
  */
@@ -282,23 +423,11 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 }
 
 /**
+ * Give size bytes read from the ring back to the peer.
  * returns -1 on error, or size on success
- *
- * caller must have checked that enough data is available
  */
-static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+static int do_release(struct libxenvchan *ctrl, size_t size)
 {
-	int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-	int avail_contig = rd_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
-	xen_rmb(); /* data read must happen /after/ rd_cons read */
-	memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
-	}
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
@@ -306,6 +435,30 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	return size;
 }
 
+/**
+ * returns -1 on error, or size on success
+ *
+ * caller must have checked that enough data is available
+ */
+static int do_recvv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    size_t skip, size_t size)
+{
+	struct iovec ring[2];
+
+	ring_iov((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), size,
+	         ring);
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	copy_iov(ring, iov, skip, size, 0);
+	return do_release(ctrl, size);
+}
+
+static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+
+	return do_recvv(ctrl, &iov, 0, size);
+}
+
 /**
  * reads exactly size bytes from the vchan.
  * returns 0 if insufficient data is available, -1 on error, or size on success
@@ -330,7 +483,8 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 {
 	while (1) {
-		int avail = fast_get_data_ready(ctrl, size);
+		/* Any data will do, only ask for a notification if there is none. */
+		int avail = fast_get_data_ready(ctrl, 1);
 		if (avail && size > avail)
 			size = avail;
 		if (avail)
@@ -344,6 +498,120 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov,
+                       int iovcnt)
+{
+	ssize_t size = iov_length(iov, iovcnt);
+	size_t pos = 0;
+	int avail;
+
+	if (size < 0 || !libxenvchan_is_open(ctrl))
+		return -1;
+	while (1) {
+		avail = fast_get_buffer_space(ctrl, size - pos);
+		if (pos + avail > size)
+			avail = size - pos;
+		/* One notification for all the data which fits. */
+		if (avail) {
+			if (do_sendv(ctrl, iov, pos, avail) < 0)
+				return -1;
+			pos += avail;
+		}
+		if (pos == size || !ctrl->blocking)
+			return pos;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov,
+                      int iovcnt)
+{
+	ssize_t size = iov_length(iov, iovcnt);
+	int avail;
+
+	if (size < 0)
+		return -1;
+	while (1) {
+		avail = fast_get_data_ready(ctrl, 1);
+		if (avail && size > avail)
+			size = avail;
+		if (avail)
+			return do_recvv(ctrl, iov, 0, size);
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size,
+                              struct iovec iov[2])
+{
+	int avail;
+
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size);
+		if (size <= avail || (avail && !ctrl->blocking))
+			break;
+		if (!ctrl->blocking)
+			return 0;
+		if (size > wr_ring_size(ctrl))
+			return -1;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_iov(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, iov);
+	xen_mb(); /* read indexes /then/ let the caller write data */
+	return size;
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_buffer_space(ctrl))
+		return -1;
+	return do_commit(ctrl, size);
+}
+
+int libxenvchan_read_acquire(struct libxenvchan *ctrl, size_t size,
+                             struct iovec iov[2])
+{
+	int avail;
+
+	while (1) {
+		avail = fast_get_data_ready(ctrl, 1);
+		if (avail)
+			break;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_iov((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), size,
+	         iov);
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	return size;
+}
+
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_data_ready(ctrl))
+		return -1;
+	return do_release(ctrl, size);
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -0,0 +1,484 @@
+/*
+ * memshare-dedup.c
+ *
+ * Content index used by xen-memshared to find guest pages to share.
+ *
+ * Every page scanned is hashed and looked up in an open addressing table
+ * keyed by the hash.  The first page seen with a given hash becomes the
+ * source for that content, and later pages with the same hash are shared
+ * with it.
+ *
+ * Xen does not compare the pages it shares, so the contents have to be
+ * checked here.  A page can't be mapped any more once it has been
+ * nominated, so a private copy of each source is taken just before its
+ * nomination, with its domain paused.  The clients are compared against
+ * the copy, also with their domain paused, and nominated before it is
+ * unpaused.  Writes after nomination change the handle of the page, which
+ * makes the share operation fail, so nothing the guest writes gets lost.
+ *
+ * The copies are the memory cost of the index: one page for every distinct
+ * content being shared.  When there are more than max_copies of them, the
+ * copies of the sources which had no candidates for the longest are freed,
+ * going round the table like a clock.  Their pages stay shared, and the
+ * next candidate for the same content becomes the new source.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xen/memory.h>
+
+#include "memshare-dedup.h"
+
+#define DEDUP_MIN_SIZE 1024
+
+struct dedup_entry {
+    uint64_t hash;
+    xen_pfn_t gfn;
+    uint64_t handle;  /* 0 until nominated */
+    void *copy;       /* Contents of the page, once nominated */
+    domid_t domid;    /* DOMID_INVALID for free entries */
+    bool recent;      /* Had candidates since the clock hand passed */
+};
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t w)
+{
+    return rotl64(acc + w * PRIME2, 31) * PRIME1;
+}
+
+/*
+ * 64-bit hash of a page, in the style of xxHash64.  The page is consumed in
+ * four independent lanes, which lets the compiler keep them in vector
+ * registers and the CPU overlap the multiplications.
+ */
+uint64_t dedup_hash_page(const void *page)
+{
+    const uint64_t *w = page;
+    uint64_t acc[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+    uint64_t h;
+    unsigned int i, j;
+
+    for ( i = 0; i < DEDUP_PAGE_SIZE / sizeof(*w); i += 4 )
+        for ( j = 0; j < 4; j++ )
+            acc[j] = hash_round(acc[j], w[i + j]);
+
+    h = rotl64(acc[0], 1) + rotl64(acc[1], 7) +
+        rotl64(acc[2], 12) + rotl64(acc[3], 18);
+    for ( j = 0; j < 4; j++ )
+        h = (h ^ hash_round(0, acc[j])) * PRIME1 + PRIME4;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static struct dedup_entry *table_alloc(unsigned long size)
+{
+    struct dedup_entry *table = malloc(size * sizeof(*table));
+    unsigned long i;
+
+    if ( !table )
+        return NULL;
+
+    for ( i = 0; i < size; i++ )
+        table[i].domid = DOMID_INVALID;
+
+    return table;
+}
+
+static struct dedup_entry *table_slot(struct dedup_entry *table,
+                                      unsigned long size, uint64_t hash)
+{
+    unsigned long i = hash & (size - 1);
+
+    while ( table[i].domid != DOMID_INVALID && table[i].hash != hash )
+        i = (i + 1) & (size - 1);
+
+    return &table[i];
+}
+
+static struct dedup_entry *lookup(struct dedup *dd, uint64_t hash)
+{
+    struct dedup_entry *e = table_slot(dd->table, dd->size, hash);
+
+    return e->domid == DOMID_INVALID ? NULL : e;
+}
+
+/* Move the entries to a table of the given size, except those of domid. */
+static int rebuild(struct dedup *dd, unsigned long size, domid_t domid)
+{
+    struct dedup_entry *table = table_alloc(size);
+    unsigned long i;
+
+    if ( !table )
+        return -1;
+
+    dd->used = 0;
+    for ( i = 0; i < dd->size; i++ )
+    {
+        struct dedup_entry *e = &dd->table[i];
+
+        if ( e->domid == DOMID_INVALID )
+            continue;
+
+        if ( e->domid == domid )
+        {
+            if ( e->copy )
+            {
+                free(e->copy);
+                dd->stats.copies--;
+            }
+            continue;
+        }
+
+        *table_slot(table, size, e->hash) = *e;
+        dd->used++;
+    }
+
+    free(dd->table);
+    dd->table = table;
+    dd->size = size;
+    dd->hand = 0;
+
+    return 0;
+}
+
+static int insert(struct dedup *dd, uint64_t hash, domid_t domid,
+                  xen_pfn_t gfn)
+{
+    struct dedup_entry *e;
+
+    /* Keep the load below 3/4 */
+    if ( (dd->used + 1) * 4 > dd->size * 3 &&
+         rebuild(dd, dd->size * 2, DOMID_INVALID) )
+        return -1;
+
+    e = table_slot(dd->table, dd->size, hash);
+    e->hash = hash;
+    e->gfn = gfn;
+    e->handle = 0;
+    e->copy = NULL;
+    e->domid = domid;
+    e->recent = false;
+    dd->used++;
+
+    return 0;
+}
+
+/* Make e point to a page which has the same hash, but isn't nominated. */
+static void replace(struct dedup *dd, struct dedup_entry *e, domid_t domid,
+                    xen_pfn_t gfn)
+{
+    if ( e->copy )
+    {
+        free(e->copy);
+        dd->stats.copies--;
+    }
+
+    e->domid = domid;
+    e->gfn = gfn;
+    e->handle = 0;
+    e->copy = NULL;
+    e->recent = false;
+}
+
+/* Free copies until there are no more than max_copies of them. */
+static void evict_copies(struct dedup *dd)
+{
+    while ( dd->max_copies && dd->stats.copies > dd->max_copies )
+    {
+        struct dedup_entry *e = &dd->table[dd->hand];
+
+        dd->hand = (dd->hand + 1) & (dd->size - 1);
+
+        if ( e->domid == DOMID_INVALID || !e->copy )
+            continue;
+
+        /* Give the sources still in use another round */
+        if ( e->recent )
+        {
+            e->recent = false;
+            continue;
+        }
+
+        /* The page stays nominated, and shared with its clients */
+        free(e->copy);
+        e->copy = NULL;
+        dd->stats.copies--;
+        dd->stats.evicted++;
+    }
+}
+
+int dedup_init(struct dedup *dd, const struct dedup_ops *ops, void *opaque)
+{
+    memset(dd, 0, sizeof(*dd));
+    dd->ops = ops;
+    dd->opaque = opaque;
+    dd->size = DEDUP_MIN_SIZE;
+    dd->table = table_alloc(dd->size);
+
+    return dd->table ? 0 : -1;
+}
+
+void dedup_destroy(struct dedup *dd)
+{
+    unsigned long i;
+
+    for ( i = 0; i < dd->size; i++ )
+        if ( dd->table[i].domid != DOMID_INVALID )
+            free(dd->table[i].copy);
+
+    free(dd->table);
+    dd->table = NULL;
+}
+
+int dedup_forget_domain(struct dedup *dd, domid_t domid)
+{
+    return rebuild(dd, dd->size, domid);
+}
+
+/*
+ * Copy and nominate the page of a source entry.  domid is paused already.
+ * Returns -1 if the page can't be used as source any more.
+ */
+static int nominate_source(struct dedup *dd, struct dedup_entry *e,
+                           domid_t domid)
+{
+    const struct dedup_ops *ops = dd->ops;
+    bool pause = e->domid != domid;
+    void *page, *copy = NULL;
+    int err;
+
+    if ( pause && ops->pause(dd->opaque, e->domid) )
+        return -1;
+
+    page = ops->map(dd->opaque, e->domid, &e->gfn, &err, 1);
+    if ( page )
+    {
+        if ( !err && dedup_hash_page(page) == e->hash &&
+             (copy = malloc(DEDUP_PAGE_SIZE)) != NULL )
+            memcpy(copy, page, DEDUP_PAGE_SIZE);
+        ops->unmap(dd->opaque, page, 1);
+    }
+
+    if ( copy && ops->nominate(dd->opaque, e->domid, e->gfn, &e->handle) )
+    {
+        dd->stats.busy++;
+        free(copy);
+        copy = NULL;
+    }
+
+    if ( pause )
+        ops->unpause(dd->opaque, e->domid);
+
+    if ( !copy )
+        return -1;
+
+    e->copy = copy;
+    dd->stats.copies++;
+
+    return 0;
+}
+
+/* Share the gfns of domid whose hashes are in the index. */
+static void share_batch(struct dedup *dd, domid_t domid, xen_pfn_t *gfns,
+                        const uint64_t *hashes, unsigned int nr)
+{
+    const struct dedup_ops *ops = dd->ops;
+    struct dedup_entry *src[DEDUP_BATCH];
+    uint64_t handles[DEDUP_BATCH];
+    int err[DEDUP_BATCH];
+    uint8_t *pages;
+    unsigned int i, n = 0;
+
+    dd->stats.candidates += nr;
+
+    if ( ops->pause(dd->opaque, domid) )
+        return;
+
+    /* Every source needs to be nominated, and a copy of it taken */
+    for ( i = 0; i < nr; i++ )
+    {
+        struct dedup_entry *e = lookup(dd, hashes[i]);
+
+        /* The copy of the source was evicted, this page takes its place */
+        if ( !e->copy && e->handle )
+        {
+            replace(dd, e, domid, gfns[i]);
+            continue;
+        }
+
+        if ( !e->copy && nominate_source(dd, e, domid) )
+        {
+            /* The source changed, this page takes its place */
+            replace(dd, e, domid, gfns[i]);
+            dd->stats.stale++;
+            continue;
+        }
+
+        e->recent = true;
+        src[n] = e;
+        gfns[n] = gfns[i];
+        n++;
+    }
+
+    /* Compare the candidates against the sources while they can't change */
+    pages = n ? ops->map(dd->opaque, domid, gfns, err, n) : NULL;
+    nr = n;
+    n = 0;
+    for ( i = 0; pages && i < nr; i++ )
+    {
+        if ( err[i] )
+        {
+            dd->stats.unmapped++;
+            continue;
+        }
+
+        if ( memcmp(pages + i * DEDUP_PAGE_SIZE, src[i]->copy,
+                    DEDUP_PAGE_SIZE) )
+        {
+            dd->stats.mismatched++;
+            continue;
+        }
+
+        src[n] = src[i];
+        gfns[n] = gfns[i];
+        n++;
+    }
+    if ( pages )
+        ops->unmap(dd->opaque, pages, nr);
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( ops->nominate(dd->opaque, domid, gfns[i], &handles[i]) )
+        {
+            dd->stats.busy++;
+            src[i] = NULL;
+        }
+    }
+
+    ops->unpause(dd->opaque, domid);
+
+    for ( i = 0; i < n; i++ )
+    {
+        /* Already shared with the source */
+        if ( !src[i] || handles[i] == src[i]->handle )
+            continue;
+
+        if ( !ops->share(dd->opaque, src[i]->domid, src[i]->gfn,
+                         src[i]->handle, domid, gfns[i], handles[i]) )
+        {
+            dd->stats.shared++;
+            continue;
+        }
+
+        if ( errno == -XENMEM_SHARING_OP_S_HANDLE_INVALID || errno == ESRCH )
+        {
+            /*
+             * The source was written to or went away.  This page has the
+             * same contents as the copy, and is nominated, so it becomes
+             * the source for the rest of the batch.
+             */
+            dd->stats.stale++;
+            src[i]->domid = domid;
+            src[i]->gfn = gfns[i];
+            src[i]->handle = handles[i];
+            continue;
+        }
+
+        dd->stats.failed++;
+    }
+
+    /* Only now that src[] is done with */
+    evict_copies(dd);
+}
+
+int dedup_scan_batch(struct dedup *dd, domid_t domid, const xen_pfn_t *gfns,
+                     unsigned int nr)
+{
+    const struct dedup_ops *ops = dd->ops;
+    xen_pfn_t candidates[DEDUP_BATCH];
+    uint64_t hashes[DEDUP_BATCH];
+    int err[DEDUP_BATCH];
+    uint8_t *pages;
+    unsigned int i, n = 0;
+    int rc = 0;
+
+    if ( nr > DEDUP_BATCH )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pages = ops->map(dd->opaque, domid, gfns, err, nr);
+    if ( !pages )
+        return -1;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct dedup_entry *e;
+        uint64_t hash;
+
+        if ( err[i] )
+        {
+            dd->stats.unmapped++;
+            continue;
+        }
+
+        hash = dedup_hash_page(pages + i * DEDUP_PAGE_SIZE);
+        dd->stats.scanned++;
+
+        e = lookup(dd, hash);
+        if ( !e )
+        {
+            if ( insert(dd, hash, domid, gfns[i]) )
+            {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        /* This page is the source */
+        if ( e->domid == domid && e->gfn == gfns[i] )
+            continue;
+
+        candidates[n] = gfns[i];
+        hashes[n] = hash;
+        n++;
+    }
+
+    /* Nomination fails while the pages are mapped */
+    ops->unmap(dd->opaque, pages, nr);
+
+    if ( n )
+        share_batch(dd, domid, candidates, hashes, n);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
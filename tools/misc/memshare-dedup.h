@@ -0,0 +1,93 @@
+/*
+ * memshare-dedup.h
+ *
+ * Content index used by xen-memshared to find guest pages to share.
+ */
+
+#ifndef MEMSHARE_DEDUP_H
+#define MEMSHARE_DEDUP_H
+
+#include <stdint.h>
+#include <xen/xen.h>
+
+/* Largest number of gfns handed to dedup_scan_batch() */
+#define DEDUP_BATCH 64
+
+#define DEDUP_PAGE_SIZE 4096
+
+/*
+ * Accessors for guest memory.  They follow the libxc conventions: -1 and
+ * errno on failure.  map() returns contiguous read-only copies of, or
+ * mappings of, the nr gfns, with per-gfn errors in err[].
+ */
+struct dedup_ops {
+    void *(*map)(void *opaque, domid_t domid, const xen_pfn_t *gfns,
+                 int *err, unsigned int nr);
+    void (*unmap)(void *opaque, void *addr, unsigned int nr);
+    int (*nominate)(void *opaque, domid_t domid, xen_pfn_t gfn,
+                    uint64_t *handle);
+    int (*share)(void *opaque, domid_t sdomid, xen_pfn_t sgfn, uint64_t sh,
+                 domid_t cdomid, xen_pfn_t cgfn, uint64_t ch);
+    int (*pause)(void *opaque, domid_t domid);
+    void (*unpause)(void *opaque, domid_t domid);
+};
+
+struct dedup_stats {
+    uint64_t scanned;     /* Pages hashed */
+    uint64_t unmapped;    /* Pages which could not be read, e.g. shared */
+    uint64_t candidates;  /* Pages whose hash was already in the index */
+    uint64_t mismatched;  /* Candidates whose contents differ */
+    uint64_t stale;       /* Indexed pages which changed */
+    uint64_t busy;        /* Pages Xen refused to nominate */
+    uint64_t shared;      /* Pages shared */
+    uint64_t failed;      /* Share operations which failed */
+    uint64_t copies;      /* Private copies held of shared pages */
+    uint64_t evicted;     /* Private copies dropped to stay within the cap */
+};
+
+struct dedup_entry;
+
+struct dedup {
+    const struct dedup_ops *ops;
+    void *opaque;
+
+    struct dedup_entry *table;
+    unsigned long size;   /* Power of 2 */
+    unsigned long used;
+
+    /*
+     * Most private copies to hold, 0 for no limit.  Each one costs
+     * DEDUP_PAGE_SIZE bytes.  Set it after dedup_init().
+     */
+    unsigned long max_copies;
+    unsigned long hand;   /* Next entry to consider for eviction */
+
+    struct dedup_stats stats;
+};
+
+uint64_t dedup_hash_page(const void *page);
+
+int dedup_init(struct dedup *dd, const struct dedup_ops *ops, void *opaque);
+void dedup_destroy(struct dedup *dd);
+
+/*
+ * Hash nr gfns of domid and share the ones whose contents are already in
+ * the index.  Returns 0, or -1 with errno set if the domain can't be read.
+ */
+int dedup_scan_batch(struct dedup *dd, domid_t domid, const xen_pfn_t *gfns,
+                     unsigned int nr);
+
+/* Drop the index entries of a domain which went away. */
+int dedup_forget_domain(struct dedup *dd, domid_t domid);
+
+#endif /* MEMSHARE_DEDUP_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
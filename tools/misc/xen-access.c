@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <poll.h>
+#include <pthread.h>
 
 #define XC_WANT_COMPAT_DEVICEMODEL_API
 #include <xenctrl.h>
@@ -65,23 +66,39 @@
 
 typedef struct vm_event {
     domid_t domain_id;
+    xc_interface *xc_handle;
     xenevtchn_handle *xce_handle;
     int port;
+    bool evtchn_bind;
     vm_event_back_ring_t back_ring;
     uint32_t evtchn_port;
     void *ring_page;
+    pthread_t thread;
+    bool thread_running;
 } vm_event_t;
 
 typedef struct xenaccess {
     xc_interface *xc_handle;
+    domid_t domain_id;
 
     xen_pfn_t max_gpfn;
 
-    vm_event_t vm_event;
+    /* The rings, mapped as consecutive pages */
+    void *ring_pages;
+    unsigned int nr_rings;
+    vm_event_t *vm_event;
 } xenaccess_t;
 
-static int interrupted;
-bool evtchn_bind = 0, evtchn_open = 0, mem_access_enable = 0;
+static volatile int interrupted;
+bool mem_access_enable = 0;
+
+/* How to handle the events, set up by main() before any arrives */
+static xenmem_access_t default_access = XENMEM_access_rwx;
+static xenmem_access_t after_first_access = XENMEM_access_rwx;
+static int altp2m = 0;
+static int altp2m_write_no_gpt = 0;
+static uint16_t altp2m_view_id = 0;
+static volatile int shutting_down = 0;
 
 static void close_handler(int sig)
 {
@@ -131,19 +148,19 @@ int xc_wait_for_event_or_timeout(xc_interface *xch, xenevtchn_handle *xce, unsig
 
 int xenaccess_teardown(xc_interface *xch, xenaccess_t *xenaccess)
 {
+    unsigned int i;
     int rc;
 
     if ( xenaccess == NULL )
         return 0;
 
     /* Tear down domain xenaccess in Xen */
-    if ( xenaccess->vm_event.ring_page )
-        munmap(xenaccess->vm_event.ring_page, XC_PAGE_SIZE);
+    if ( xenaccess->ring_pages )
+        munmap(xenaccess->ring_pages, xenaccess->nr_rings * XC_PAGE_SIZE);
 
     if ( mem_access_enable )
     {
-        rc = xc_monitor_disable(xenaccess->xc_handle,
-                                xenaccess->vm_event.domain_id);
+        rc = xc_monitor_disable(xenaccess->xc_handle, xenaccess->domain_id);
         if ( rc != 0 )
         {
             ERROR("Error tearing down domain xenaccess in xen");
@@ -151,26 +168,30 @@ int xenaccess_teardown(xc_interface *xch, xenaccess_t *xenaccess)
         }
     }
 
-    /* Unbind VIRQ */
-    if ( evtchn_bind )
+    for ( i = 0; xenaccess->vm_event && i < xenaccess->nr_rings; i++ )
     {
-        rc = xenevtchn_unbind(xenaccess->vm_event.xce_handle,
-                              xenaccess->vm_event.port);
-        if ( rc != 0 )
+        vm_event_t *vm_event = &xenaccess->vm_event[i];
+
+        /* Unbind VIRQ */
+        if ( vm_event->evtchn_bind )
         {
-            ERROR("Error unbinding event port");
-            return rc;
+            rc = xenevtchn_unbind(vm_event->xce_handle, vm_event->port);
+            if ( rc != 0 )
+            {
+                ERROR("Error unbinding event port");
+                return rc;
+            }
         }
-    }
 
-    /* Close event channel */
-    if ( evtchn_open )
-    {
-        rc = xenevtchn_close(xenaccess->vm_event.xce_handle);
-        if ( rc != 0 )
+        /* Close event channel */
+        if ( vm_event->xce_handle )
         {
-            ERROR("Error closing event channel");
-            return rc;
+            rc = xenevtchn_close(vm_event->xce_handle);
+            if ( rc != 0 )
+            {
+                ERROR("Error closing event channel");
+                return rc;
+            }
         }
     }
 
@@ -183,15 +204,23 @@ int xenaccess_teardown(xc_interface *xch, xenaccess_t *xenaccess)
     }
     xenaccess->xc_handle = NULL;
 
+    free(xenaccess->vm_event);
     free(xenaccess);
 
     return 0;
 }
 
-xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
+/*
+ * With nr_rings 0, the single ring set up through the HVM param is used.
+ * Otherwise, the events of the domain's vCPUs are spread over nr_rings rings.
+ */
+xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id,
+                            unsigned int nr_rings)
 {
     xenaccess_t *xenaccess = 0;
     xc_interface *xch;
+    uint32_t *ports = NULL;
+    unsigned int i;
     int rc;
 
     xch = xc_interface_open(NULL, NULL, 0);
@@ -209,14 +238,26 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     xenaccess->xc_handle = xch;
 
     /* Set domain id */
-    xenaccess->vm_event.domain_id = domain_id;
+    xenaccess->domain_id = domain_id;
+
+    xenaccess->nr_rings = nr_rings ?: 1;
+    xenaccess->vm_event = calloc(xenaccess->nr_rings, sizeof(vm_event_t));
+    ports = calloc(xenaccess->nr_rings, sizeof(*ports));
+    if ( !xenaccess->vm_event || !ports )
+    {
+        ERROR("Failed to allocate the rings");
+        goto err;
+    }
 
     /* Enable mem_access */
-    xenaccess->vm_event.ring_page =
-            xc_monitor_enable(xenaccess->xc_handle,
-                              xenaccess->vm_event.domain_id,
-                              &xenaccess->vm_event.evtchn_port);
-    if ( xenaccess->vm_event.ring_page == NULL )
+    if ( nr_rings )
+        xenaccess->ring_pages =
+            xc_monitor_enable_rings(xenaccess->xc_handle, domain_id,
+                                    nr_rings, ports);
+    else
+        xenaccess->ring_pages =
+            xc_monitor_enable(xenaccess->xc_handle, domain_id, &ports[0]);
+    if ( xenaccess->ring_pages == NULL )
     {
         switch ( errno ) {
             case EBUSY:
@@ -233,36 +274,48 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     }
     mem_access_enable = 1;
 
-    /* Open event channel */
-    xenaccess->vm_event.xce_handle = xenevtchn_open(NULL, 0);
-    if ( xenaccess->vm_event.xce_handle == NULL )
+    for ( i = 0; i < xenaccess->nr_rings; i++ )
     {
-        ERROR("Failed to open event channel");
-        goto err;
-    }
-    evtchn_open = 1;
+        vm_event_t *vm_event = &xenaccess->vm_event[i];
 
-    /* Bind event notification */
-    rc = xenevtchn_bind_interdomain(xenaccess->vm_event.xce_handle,
-                                    xenaccess->vm_event.domain_id,
-                                    xenaccess->vm_event.evtchn_port);
-    if ( rc < 0 )
-    {
-        ERROR("Failed to bind event channel");
-        goto err;
+        vm_event->domain_id = domain_id;
+        vm_event->xc_handle = xch;
+        vm_event->evtchn_port = ports[i];
+        vm_event->ring_page = (char *)xenaccess->ring_pages + i * XC_PAGE_SIZE;
+
+        /* Open event channel, one per ring for its thread to wait on */
+        vm_event->xce_handle = xenevtchn_open(NULL, 0);
+        if ( vm_event->xce_handle == NULL )
+        {
+            ERROR("Failed to open event channel");
+            goto err;
+        }
+
+        /* Bind event notification */
+        rc = xenevtchn_bind_interdomain(vm_event->xce_handle,
+                                        vm_event->domain_id,
+                                        vm_event->evtchn_port);
+        if ( rc < 0 )
+        {
+            ERROR("Failed to bind event channel");
+            goto err;
+        }
+        vm_event->evtchn_bind = 1;
+        vm_event->port = rc;
+
+        /* Initialise ring */
+        SHARED_RING_INIT((vm_event_sring_t *)vm_event->ring_page);
+        BACK_RING_INIT(&vm_event->back_ring,
+                       (vm_event_sring_t *)vm_event->ring_page,
+                       XC_PAGE_SIZE);
     }
-    evtchn_bind = 1;
-    xenaccess->vm_event.port = rc;
 
-    /* Initialise ring */
-    SHARED_RING_INIT((vm_event_sring_t *)xenaccess->vm_event.ring_page);
-    BACK_RING_INIT(&xenaccess->vm_event.back_ring,
-                   (vm_event_sring_t *)xenaccess->vm_event.ring_page,
-                   XC_PAGE_SIZE);
+    free(ports);
+    ports = NULL;
 
     /* Get max_gpfn */
     rc = xc_domain_maximum_gpfn(xenaccess->xc_handle,
-                                xenaccess->vm_event.domain_id,
+                                xenaccess->domain_id,
                                 &xenaccess->max_gpfn);
 
     if ( rc )
@@ -276,6 +329,7 @@ xenaccess_t *xenaccess_init(xc_interface **xch_r, domid_t domain_id)
     return xenaccess;
 
  err:
+    free(ports);
     rc = xenaccess_teardown(xch, xenaccess);
     if ( rc )
     {
@@ -357,9 +411,292 @@ static void put_response(vm_event_t *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
+/*
+ * Wait for events on a ring, handle the ones there, and tell Xen about the
+ * responses.  Each ring is handled by one thread only.
+ */
+static int handle_ring(vm_event_t *vm_event)
+{
+    xc_interface *xch = vm_event->xc_handle;
+    domid_t domain_id = vm_event->domain_id;
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+    int rc;
+
+    rc = xc_wait_for_event_or_timeout(xch, vm_event->xce_handle, 100);
+    if ( rc < -1 )
+    {
+        ERROR("Error getting event");
+        interrupted = -1;
+        return rc;
+    }
+    else if ( rc != -1 )
+    {
+        DPRINTF("Got event from Xen\n");
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&vm_event->back_ring) )
+    {
+        get_request(vm_event, &req);
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION )
+        {
+            ERROR("Error: vm_event interface version mismatch!\n");
+            interrupted = -1;
+            continue;
+        }
+
+        memset( &rsp, 0, sizeof (rsp) );
+        rsp.version = VM_EVENT_INTERFACE_VERSION;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = (req.flags & VM_EVENT_FLAG_VCPU_PAUSED);
+        rsp.reason = req.reason;
+
+        switch (req.reason) {
+        case VM_EVENT_REASON_MEM_ACCESS:
+            if ( !shutting_down )
+            {
+                /*
+                 * This serves no other purpose here then demonstrating the use of the API.
+                 * At shutdown we have already reset all the permissions so really no use getting it again.
+                 */
+                xenmem_access_t access;
+                rc = xc_get_mem_access(xch, domain_id, req.u.mem_access.gfn, &access);
+                if (rc < 0)
+                {
+                    ERROR("Error %d getting mem_access event\n", rc);
+                    interrupted = -1;
+                    continue;
+                }
+            }
+
+            printf("PAGE ACCESS: %c%c%c for GFN %"PRIx64" (offset %06"
+                   PRIx64") gla %016"PRIx64" (valid: %c; fault in gpt: %c; fault with gla: %c) (vcpu %u [%c], altp2m view %u)\n",
+                   (req.u.mem_access.flags & MEM_ACCESS_R) ? 'r' : '-',
+                   (req.u.mem_access.flags & MEM_ACCESS_W) ? 'w' : '-',
+                   (req.u.mem_access.flags & MEM_ACCESS_X) ? 'x' : '-',
+                   req.u.mem_access.gfn,
+                   req.u.mem_access.offset,
+                   req.u.mem_access.gla,
+                   (req.u.mem_access.flags & MEM_ACCESS_GLA_VALID) ? 'y' : 'n',
+                   (req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT) ? 'y' : 'n',
+                   (req.u.mem_access.flags & MEM_ACCESS_FAULT_WITH_GLA) ? 'y': 'n',
+                   req.vcpu_id,
+                   (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ? 'p' : 'r',
+                   req.altp2m_idx);
+
+            if ( altp2m && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M)
+            {
+                DPRINTF("\tSwitching back to default view!\n");
+
+                rsp.flags |= (VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP);
+                rsp.altp2m_idx = 0;
+            }
+            else if ( default_access != after_first_access )
+            {
+                rc = xc_set_mem_access(xch, domain_id, after_first_access,
+                                       req.u.mem_access.gfn, 1);
+                if (rc < 0)
+                {
+                    ERROR("Error %d setting gfn to access_type %d\n", rc,
+                          after_first_access);
+                    interrupted = -1;
+                    continue;
+                }
+            }
+
+            rsp.u.mem_access = req.u.mem_access;
+            break;
+        case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
+            printf("Breakpoint: rip=%016"PRIx64", gfn=%"PRIx64" (vcpu %d)\n",
+                   req.data.regs.x86.rip,
+                   req.u.software_breakpoint.gfn,
+                   req.vcpu_id);
+
+            /* Reinject */
+            rc = xc_hvm_inject_trap(xch, domain_id, req.vcpu_id,
+                                    X86_TRAP_INT3,
+                                    req.u.software_breakpoint.type, -1,
+                                    req.u.software_breakpoint.insn_length, 0);
+            if (rc < 0)
+            {
+                ERROR("Error %d injecting breakpoint\n", rc);
+                interrupted = -1;
+                continue;
+            }
+            break;
+        case VM_EVENT_REASON_PRIVILEGED_CALL:
+            printf("Privileged call: pc=%"PRIx64" (vcpu %d)\n",
+                   req.data.regs.arm.pc,
+                   req.vcpu_id);
+
+            rsp.data.regs.arm = req.data.regs.arm;
+            rsp.data.regs.arm.pc += 4;
+            rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
+            break;
+        case VM_EVENT_REASON_SINGLESTEP:
+            printf("Singlestep: rip=%016"PRIx64", vcpu %d, altp2m %u\n",
+                   req.data.regs.x86.rip,
+                   req.vcpu_id,
+                   req.altp2m_idx);
+
+            if ( altp2m )
+            {
+                printf("\tSwitching altp2m to view %u!\n", altp2m_view_id);
+
+                rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M;
+                rsp.altp2m_idx = altp2m_view_id;
+            }
+
+            rsp.flags |= VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+
+            break;
+        case VM_EVENT_REASON_DEBUG_EXCEPTION:
+            printf("Debug exception: rip=%016"PRIx64", vcpu %d. Type: %u. Length: %u. Pending dbg 0x%08"PRIx64"\n",
+                   req.data.regs.x86.rip,
+                   req.vcpu_id,
+                   req.u.debug_exception.type,
+                   req.u.debug_exception.insn_length,
+                   req.u.debug_exception.pending_dbg);
+
+            /* Reinject */
+            rc = xc_hvm_inject_trap(xch, domain_id, req.vcpu_id,
+                                    X86_TRAP_DEBUG,
+                                    req.u.debug_exception.type, -1,
+                                    req.u.debug_exception.insn_length,
+                                    req.u.debug_exception.pending_dbg);
+            if (rc < 0)
+            {
+                ERROR("Error %d injecting breakpoint\n", rc);
+                interrupted = -1;
+                continue;
+            }
+
+            break;
+        case VM_EVENT_REASON_CPUID:
+            printf("CPUID executed: rip=%016"PRIx64", vcpu %d. Insn length: %"PRIu32" " \
+                   "0x%"PRIx32" 0x%"PRIx32": EAX=0x%"PRIx64" EBX=0x%"PRIx64" ECX=0x%"PRIx64" EDX=0x%"PRIx64"\n",
+                   req.data.regs.x86.rip,
+                   req.vcpu_id,
+                   req.u.cpuid.insn_length,
+                   req.u.cpuid.leaf,
+                   req.u.cpuid.subleaf,
+                   req.data.regs.x86.rax,
+                   req.data.regs.x86.rbx,
+                   req.data.regs.x86.rcx,
+                   req.data.regs.x86.rdx);
+            rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
+            rsp.data = req.data;
+            rsp.data.regs.x86.rip += req.u.cpuid.insn_length;
+            break;
+        case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
+            printf("Descriptor access: rip=%016"PRIx64", vcpu %d: "\
+                   "VMExit info=0x%"PRIx32", descriptor=%d, is write=%d\n",
+                   req.data.regs.x86.rip,
+                   req.vcpu_id,
+                   req.u.desc_access.arch.vmx.instr_info,
+                   req.u.desc_access.descriptor,
+                   req.u.desc_access.is_write);
+            rsp.flags |= VM_EVENT_FLAG_EMULATE;
+            break;
+        case VM_EVENT_REASON_WRITE_CTRLREG:
+            printf("Control register written: rip=%016"PRIx64", vcpu %d: "
+                   "reg=%s, old_value=%016"PRIx64", new_value=%016"PRIx64"\n",
+                   req.data.regs.x86.rip,
+                   req.vcpu_id,
+                   get_x86_ctrl_reg_name(req.u.write_ctrlreg.index),
+                   req.u.write_ctrlreg.old_value,
+                   req.u.write_ctrlreg.new_value);
+            break;
+        case VM_EVENT_REASON_EMUL_UNIMPLEMENTED:
+            if ( altp2m_write_no_gpt && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M )
+            {
+                DPRINTF("\tSwitching back to default view!\n");
+
+                rsp.flags |= (VM_EVENT_FLAG_ALTERNATE_P2M |
+                              VM_EVENT_FLAG_TOGGLE_SINGLESTEP);
+                rsp.altp2m_idx = 0;
+            }
+            break;
+        default:
+            fprintf(stderr, "UNKNOWN REASON CODE %d\n", req.reason);
+        }
+
+        /* Put the response on the ring */
+        put_response(vm_event, &rsp);
+    }
+
+    /* Tell Xen page is ready */
+    rc = xenevtchn_notify(vm_event->xce_handle, vm_event->port);
+
+    if ( rc != 0 )
+    {
+        ERROR("Error resuming page");
+        interrupted = -1;
+    }
+
+    return rc;
+}
+
+/* Rings other than the first one get a thread each. */
+static void *ring_thread(void *arg)
+{
+    vm_event_t *vm_event = arg;
+    bool last;
+
+    /* Like main(), go through the ring once more when shutting down. */
+    do {
+        last = shutting_down;
+        handle_ring(vm_event);
+    } while ( !last );
+
+    return NULL;
+}
+
+static int start_ring_threads(xenaccess_t *xenaccess)
+{
+    sigset_t set, old;
+    unsigned int i;
+    int rc = 0;
+
+    /* Leave the signals to the main thread. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for ( i = 1; i < xenaccess->nr_rings && !rc; i++ )
+    {
+        vm_event_t *vm_event = &xenaccess->vm_event[i];
+
+        rc = pthread_create(&vm_event->thread, NULL, ring_thread, vm_event);
+        vm_event->thread_running = !rc;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Failed to start ring thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void stop_ring_threads(xenaccess_t *xenaccess)
+{
+    unsigned int i;
+
+    shutting_down = 1;
+
+    for ( i = 1; i < xenaccess->nr_rings; i++ )
+        if ( xenaccess->vm_event[i].thread_running )
+            pthread_join(xenaccess->vm_event[i].thread, NULL);
+}
+
 void usage(char* progname)
 {
-    fprintf(stderr, "Usage: %s [-m] <domain_id> write|exec", progname);
+    fprintf(stderr, "Usage: %s [-m] [-r <rings>] <domain_id> write|exec", progname);
 #if defined(__i386__) || defined(__x86_64__)
             fprintf(stderr, "|breakpoint|altp2m_write|altp2m_exec|debug|cpuid|desc_access|write_ctrlreg_cr4|altp2m_write_no_gpt");
 #elif defined(__arm__) || defined(__aarch64__)
@@ -369,7 +706,9 @@ void usage(char* progname)
             "\n"
             "Logs first page writes, execs, or breakpoint traps that occur on the domain.\n"
             "\n"
-            "-m requires this program to run, or else the domain may pause\n");
+            "-m requires this program to run, or else the domain may pause\n"
+            "-r spreads the events of the vCPUs over that many rings, each\n"
+            "   handled by a thread of its own\n");
 }
 
 int main(int argc, char *argv[])
@@ -377,34 +716,33 @@ int main(int argc, char *argv[])
     struct sigaction act;
     domid_t domain_id;
     xenaccess_t *xenaccess;
-    vm_event_request_t req;
-    vm_event_response_t rsp;
     int rc = -1;
     int rc1;
     xc_interface *xch;
-    xenmem_access_t default_access = XENMEM_access_rwx;
-    xenmem_access_t after_first_access = XENMEM_access_rwx;
     int memaccess = 0;
     int required = 0;
     int breakpoint = 0;
-    int shutting_down = 0;
     int privcall = 0;
-    int altp2m = 0;
     int debug = 0;
     int cpuid = 0;
     int desc_access = 0;
     int write_ctrlreg_cr4 = 0;
-    int altp2m_write_no_gpt = 0;
-    uint16_t altp2m_view_id = 0;
+    unsigned int nr_rings = 0;
 
     char* progname = argv[0];
     argv++;
     argc--;
 
-    if ( argc == 3 && argv[0][0] == '-' )
+    while ( argc > 2 && argv[0][0] == '-' )
     {
         if ( !strcmp(argv[0], "-m") )
             required = 1;
+        else if ( !strcmp(argv[0], "-r") && argc > 3 )
+        {
+            nr_rings = atoi(argv[1]);
+            argv++;
+            argc--;
+        }
         else
         {
             usage(progname);
@@ -488,7 +826,7 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    xenaccess = xenaccess_init(&xch, domain_id);
+    xenaccess = xenaccess_init(&xch, domain_id, nr_rings);
     if ( xenaccess == NULL )
     {
         ERROR("Error initialising xenaccess");
@@ -647,6 +985,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    rc = start_ring_threads(xenaccess);
+    if ( rc < 0 )
+        goto exit;
+
     /* Wait for access */
     for (;;)
     {
@@ -684,218 +1026,7 @@ int main(int argc, char *argv[])
             shutting_down = 1;
         }
 
-        rc = xc_wait_for_event_or_timeout(xch, xenaccess->vm_event.xce_handle, 100);
-        if ( rc < -1 )
-        {
-            ERROR("Error getting event");
-            interrupted = -1;
-            continue;
-        }
-        else if ( rc != -1 )
-        {
-            DPRINTF("Got event from Xen\n");
-        }
-
-        while ( RING_HAS_UNCONSUMED_REQUESTS(&xenaccess->vm_event.back_ring) )
-        {
-            get_request(&xenaccess->vm_event, &req);
-
-            if ( req.version != VM_EVENT_INTERFACE_VERSION )
-            {
-                ERROR("Error: vm_event interface version mismatch!\n");
-                interrupted = -1;
-                continue;
-            }
-
-            memset( &rsp, 0, sizeof (rsp) );
-            rsp.version = VM_EVENT_INTERFACE_VERSION;
-            rsp.vcpu_id = req.vcpu_id;
-            rsp.flags = (req.flags & VM_EVENT_FLAG_VCPU_PAUSED);
-            rsp.reason = req.reason;
-
-            switch (req.reason) {
-            case VM_EVENT_REASON_MEM_ACCESS:
-                if ( !shutting_down )
-                {
-                    /*
-                     * This serves no other purpose here then demonstrating the use of the API.
-                     * At shutdown we have already reset all the permissions so really no use getting it again.
-                     */
-                    xenmem_access_t access;
-                    rc = xc_get_mem_access(xch, domain_id, req.u.mem_access.gfn, &access);
-                    if (rc < 0)
-                    {
-                        ERROR("Error %d getting mem_access event\n", rc);
-                        interrupted = -1;
-                        continue;
-                    }
-                }
-
-                printf("PAGE ACCESS: %c%c%c for GFN %"PRIx64" (offset %06"
-                       PRIx64") gla %016"PRIx64" (valid: %c; fault in gpt: %c; fault with gla: %c) (vcpu %u [%c], altp2m view %u)\n",
-                       (req.u.mem_access.flags & MEM_ACCESS_R) ? 'r' : '-',
-                       (req.u.mem_access.flags & MEM_ACCESS_W) ? 'w' : '-',
-                       (req.u.mem_access.flags & MEM_ACCESS_X) ? 'x' : '-',
-                       req.u.mem_access.gfn,
-                       req.u.mem_access.offset,
-                       req.u.mem_access.gla,
-                       (req.u.mem_access.flags & MEM_ACCESS_GLA_VALID) ? 'y' : 'n',
-                       (req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT) ? 'y' : 'n',
-                       (req.u.mem_access.flags & MEM_ACCESS_FAULT_WITH_GLA) ? 'y': 'n',
-                       req.vcpu_id,
-                       (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ? 'p' : 'r',
-                       req.altp2m_idx);
-
-                if ( altp2m && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M)
-                {
-                    DPRINTF("\tSwitching back to default view!\n");
-
-                    rsp.flags |= (VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP);
-                    rsp.altp2m_idx = 0;
-                }
-                else if ( default_access != after_first_access )
-                {
-                    rc = xc_set_mem_access(xch, domain_id, after_first_access,
-                                           req.u.mem_access.gfn, 1);
-                    if (rc < 0)
-                    {
-                        ERROR("Error %d setting gfn to access_type %d\n", rc,
-                              after_first_access);
-                        interrupted = -1;
-                        continue;
-                    }
-                }
-
-                rsp.u.mem_access = req.u.mem_access;
-                break;
-            case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
-                printf("Breakpoint: rip=%016"PRIx64", gfn=%"PRIx64" (vcpu %d)\n",
-                       req.data.regs.x86.rip,
-                       req.u.software_breakpoint.gfn,
-                       req.vcpu_id);
-
-                /* Reinject */
-                rc = xc_hvm_inject_trap(xch, domain_id, req.vcpu_id,
-                                        X86_TRAP_INT3,
-                                        req.u.software_breakpoint.type, -1,
-                                        req.u.software_breakpoint.insn_length, 0);
-                if (rc < 0)
-                {
-                    ERROR("Error %d injecting breakpoint\n", rc);
-                    interrupted = -1;
-                    continue;
-                }
-                break;
-            case VM_EVENT_REASON_PRIVILEGED_CALL:
-                printf("Privileged call: pc=%"PRIx64" (vcpu %d)\n",
-                       req.data.regs.arm.pc,
-                       req.vcpu_id);
-
-                rsp.data.regs.arm = req.data.regs.arm;
-                rsp.data.regs.arm.pc += 4;
-                rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
-                break;
-            case VM_EVENT_REASON_SINGLESTEP:
-                printf("Singlestep: rip=%016"PRIx64", vcpu %d, altp2m %u\n",
-                       req.data.regs.x86.rip,
-                       req.vcpu_id,
-                       req.altp2m_idx);
-
-                if ( altp2m )
-                {
-                    printf("\tSwitching altp2m to view %u!\n", altp2m_view_id);
-
-                    rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M;
-                    rsp.altp2m_idx = altp2m_view_id;
-                }
-
-                rsp.flags |= VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
-
-                break;
-            case VM_EVENT_REASON_DEBUG_EXCEPTION:
-                printf("Debug exception: rip=%016"PRIx64", vcpu %d. Type: %u. Length: %u. Pending dbg 0x%08"PRIx64"\n",
-                       req.data.regs.x86.rip,
-                       req.vcpu_id,
-                       req.u.debug_exception.type,
-                       req.u.debug_exception.insn_length,
-                       req.u.debug_exception.pending_dbg);
-
-                /* Reinject */
-                rc = xc_hvm_inject_trap(xch, domain_id, req.vcpu_id,
-                                        X86_TRAP_DEBUG,
-                                        req.u.debug_exception.type, -1,
-                                        req.u.debug_exception.insn_length,
-                                        req.u.debug_exception.pending_dbg);
-                if (rc < 0)
-                {
-                    ERROR("Error %d injecting breakpoint\n", rc);
-                    interrupted = -1;
-                    continue;
-                }
-
-                break;
-            case VM_EVENT_REASON_CPUID:
-                printf("CPUID executed: rip=%016"PRIx64", vcpu %d. Insn length: %"PRIu32" " \
-                       "0x%"PRIx32" 0x%"PRIx32": EAX=0x%"PRIx64" EBX=0x%"PRIx64" ECX=0x%"PRIx64" EDX=0x%"PRIx64"\n",
-                       req.data.regs.x86.rip,
-                       req.vcpu_id,
-                       req.u.cpuid.insn_length,
-                       req.u.cpuid.leaf,
-                       req.u.cpuid.subleaf,
-                       req.data.regs.x86.rax,
-                       req.data.regs.x86.rbx,
-                       req.data.regs.x86.rcx,
-                       req.data.regs.x86.rdx);
-                rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
-                rsp.data = req.data;
-                rsp.data.regs.x86.rip += req.u.cpuid.insn_length;
-                break;
-            case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
-                printf("Descriptor access: rip=%016"PRIx64", vcpu %d: "\
-                       "VMExit info=0x%"PRIx32", descriptor=%d, is write=%d\n",
-                       req.data.regs.x86.rip,
-                       req.vcpu_id,
-                       req.u.desc_access.arch.vmx.instr_info,
-                       req.u.desc_access.descriptor,
-                       req.u.desc_access.is_write);
-                rsp.flags |= VM_EVENT_FLAG_EMULATE;
-                break;
-            case VM_EVENT_REASON_WRITE_CTRLREG:
-                printf("Control register written: rip=%016"PRIx64", vcpu %d: "
-                       "reg=%s, old_value=%016"PRIx64", new_value=%016"PRIx64"\n",
-                       req.data.regs.x86.rip,
-                       req.vcpu_id,
-                       get_x86_ctrl_reg_name(req.u.write_ctrlreg.index),
-                       req.u.write_ctrlreg.old_value,
-                       req.u.write_ctrlreg.new_value);
-                break;
-            case VM_EVENT_REASON_EMUL_UNIMPLEMENTED:
-                if ( altp2m_write_no_gpt && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M )
-                {
-                    DPRINTF("\tSwitching back to default view!\n");
-
-                    rsp.flags |= (VM_EVENT_FLAG_ALTERNATE_P2M |
-                                  VM_EVENT_FLAG_TOGGLE_SINGLESTEP);
-                    rsp.altp2m_idx = 0;
-                }
-                break;
-            default:
-                fprintf(stderr, "UNKNOWN REASON CODE %d\n", req.reason);
-            }
-
-            /* Put the response on the ring */
-            put_response(&xenaccess->vm_event, &rsp);
-        }
-
-        /* Tell Xen page is ready */
-        rc = xenevtchn_notify(xenaccess->vm_event.xce_handle,
-                              xenaccess->vm_event.port);
-
-        if ( rc != 0 )
-        {
-            ERROR("Error resuming page");
-            interrupted = -1;
-        }
+        rc = handle_ring(&xenaccess->vm_event[0]);
 
         if ( shutting_down )
             break;
@@ -903,6 +1034,8 @@ int main(int argc, char *argv[])
     DPRINTF("xenaccess shut down on signal %d\n", interrupted);
 
 exit:
+    stop_ring_threads(xenaccess);
+
     if ( altp2m )
     {
         uint32_t vcpu_id;
@@ -0,0 +1,348 @@
+/*
+ * xen-memshared.c
+ *
+ * Scans the memory of guests and shares the pages with identical contents,
+ * see memshare-dedup.c.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+
+#include "memshare-dedup.h"
+
+#define MAX_DOMAINS 1024
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+
+static volatile sig_atomic_t interrupted;
+static volatile sig_atomic_t report;
+
+static void *dom_map(void *opaque, domid_t domid, const xen_pfn_t *gfns,
+                     int *err, unsigned int nr)
+{
+    return xenforeignmemory_map(fmem, domid, PROT_READ, nr, gfns, err);
+}
+
+static void dom_unmap(void *opaque, void *addr, unsigned int nr)
+{
+    xenforeignmemory_unmap(fmem, addr, nr);
+}
+
+static int dom_nominate(void *opaque, domid_t domid, xen_pfn_t gfn,
+                        uint64_t *handle)
+{
+    return xc_memshr_nominate_gfn(xch, domid, gfn, handle);
+}
+
+static int dom_share(void *opaque, domid_t sdomid, xen_pfn_t sgfn,
+                     uint64_t sh, domid_t cdomid, xen_pfn_t cgfn, uint64_t ch)
+{
+    return xc_memshr_share_gfns(xch, sdomid, sgfn, sh, cdomid, cgfn, ch);
+}
+
+static int dom_pause(void *opaque, domid_t domid)
+{
+    return xc_domain_pause(xch, domid);
+}
+
+static void dom_unpause(void *opaque, domid_t domid)
+{
+    xc_domain_unpause(xch, domid);
+}
+
+static const struct dedup_ops dom_ops = {
+    .map      = dom_map,
+    .unmap    = dom_unmap,
+    .nominate = dom_nominate,
+    .share    = dom_share,
+    .pause    = dom_pause,
+    .unpause  = dom_unpause,
+};
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] [domid...]\n\n", prog);
+    printf("Share identical pages of the given domains, or of all HVM guests.\n\n");
+    printf("options:\n");
+    printf(" -r <pages>  --rate=<pages>      pages to scan per second (default 25600).\n");
+    printf(" -s <secs>   --stats=<secs>      print statistics every <secs> seconds, and on SIGUSR1.\n");
+    printf(" -c <pages>  --copies=<pages>    most distinct shared contents to keep a private copy of\n");
+    printf("                                 (default 65536, 0 for no limit).  Each copy costs 4KiB\n");
+    printf("                                 of memory in this process; the copies of the contents\n");
+    printf("                                 with the fewest recent matches are dropped first.\n");
+    printf(" -e          --enable            enable sharing on the domains.\n");
+    printf(" -o          --once              exit after scanning every domain once.\n");
+    printf(" -h          --help              this output.\n");
+}
+
+static void handle_signal(int sig)
+{
+    if ( sig == SIGUSR1 )
+        report = 1;
+    else
+        interrupted = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep as long as needed to scan no more than rate pages a second. */
+static void throttle(unsigned int rate, unsigned int pages)
+{
+    static uint64_t deadline;
+    uint64_t now = now_ns();
+
+    /* Don't save up credit while idle */
+    if ( deadline < now )
+        deadline = now;
+
+    deadline += pages * 1000000000ULL / rate;
+    if ( deadline > now )
+    {
+        struct timespec ts = {
+            .tv_sec = (deadline - now) / 1000000000ULL,
+            .tv_nsec = (deadline - now) % 1000000000ULL,
+        };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void print_stats(const struct dedup *dd)
+{
+    const struct dedup_stats *s = &dd->stats;
+
+    printf("scanned %"PRIu64" unmapped %"PRIu64" candidates %"PRIu64
+           " mismatched %"PRIu64" stale %"PRIu64" busy %"PRIu64
+           " shared %"PRIu64" failed %"PRIu64" copies %"PRIu64
+           " evicted %"PRIu64" index %lu\n",
+           s->scanned, s->unmapped, s->candidates, s->mismatched, s->stale,
+           s->busy, s->shared, s->failed, s->copies, s->evicted, dd->used);
+    printf("freed %ld used %ld\n",
+           xc_sharing_freed_pages(xch), xc_sharing_used_frames(xch));
+    fflush(stdout);
+}
+
+static bool in_list(domid_t domid, const domid_t *domids, int nr)
+{
+    int i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( domids[i] == domid )
+            return true;
+
+    return false;
+}
+
+/* Fill domids with the HVM guests, returns their number or -1. */
+static int list_domains(domid_t *domids)
+{
+    static xc_domaininfo_t info[MAX_DOMAINS];
+    int i, n, nr = 0;
+
+    n = xc_domain_getinfolist(xch, 1, MAX_DOMAINS, info);
+    if ( n < 0 )
+        return -1;
+
+    for ( i = 0; i < n; i++ )
+        if ( (info[i].flags & XEN_DOMINF_hvm_guest) &&
+             !(info[i].flags & XEN_DOMINF_dying) )
+            domids[nr++] = info[i].domain;
+
+    return nr;
+}
+
+/* Scan all gfns of a domain, returns -1 if it went away. */
+static int scan_domain(struct dedup *dd, domid_t domid, unsigned int rate)
+{
+    xen_pfn_t gfns[DEDUP_BATCH], max_gpfn, gfn = 0;
+    unsigned int i;
+
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gpfn) < 0 )
+        return -1;
+
+    while ( gfn <= max_gpfn && !interrupted )
+    {
+        for ( i = 0; i < DEDUP_BATCH && gfn <= max_gpfn; i++ )
+            gfns[i] = gfn++;
+
+        if ( dedup_scan_batch(dd, domid, gfns, i) )
+        {
+            if ( errno == ENOMEM )
+                fprintf(stderr, "Index full, not adding pages\n");
+            else
+                return -1;
+        }
+
+        throttle(rate, i);
+
+        if ( report )
+        {
+            report = 0;
+            print_stats(dd);
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char sopts[] = "hr:s:c:eo";
+    static const struct option lopts[] = {
+        {"help", 0, NULL, 'h'},
+        {"rate", 1, NULL, 'r'},
+        {"stats", 1, NULL, 's'},
+        {"copies", 1, NULL, 'c'},
+        {"enable", 0, NULL, 'e'},
+        {"once", 0, NULL, 'o'},
+        { }
+    };
+    static domid_t domids[MAX_DOMAINS], prev[MAX_DOMAINS];
+    struct sigaction act = { .sa_handler = handle_signal };
+    struct dedup dd;
+    unsigned int rate = 25600, stats = 0;
+    unsigned long copies = 65536;
+    bool enable = false, once = false;
+    uint64_t last_stats;
+    int ch, i, nr = 0, nr_prev = 0, rc = 1;
+
+    while ( (ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            stats = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            copies = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            enable = true;
+            break;
+        case 'o':
+            once = true;
+            break;
+        default:
+            usage(argv[0]);
+            return ch != 'h';
+        }
+    }
+
+    if ( !rate || argc - optind > MAX_DOMAINS )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !xch || !fmem )
+    {
+        perror("Failed to open Xen interfaces");
+        goto out;
+    }
+
+    if ( dedup_init(&dd, &dom_ops, NULL) )
+    {
+        perror("Failed to allocate the index");
+        goto out;
+    }
+    dd.max_copies = copies;
+
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGUSR1, &act, NULL);
+
+    last_stats = now_ns();
+
+    while ( !interrupted )
+    {
+        if ( optind < argc )
+        {
+            for ( nr = 0; optind + nr < argc; nr++ )
+                domids[nr] = strtoul(argv[optind + nr], NULL, 0);
+        }
+        else if ( (nr = list_domains(domids)) < 0 )
+        {
+            perror("Failed to list domains");
+            goto out_dedup;
+        }
+
+        /* Forget about the domains which went away */
+        for ( i = 0; i < nr_prev; i++ )
+            if ( !in_list(prev[i], domids, nr) )
+                dedup_forget_domain(&dd, prev[i]);
+
+        for ( i = 0; i < nr && !interrupted; i++ )
+        {
+            if ( enable && !in_list(domids[i], prev, nr_prev) &&
+                 xc_memshr_control(xch, domids[i], 1) )
+                fprintf(stderr, "Failed to enable sharing on domain %u: %s\n",
+                        domids[i], strerror(errno));
+
+            if ( scan_domain(&dd, domids[i], rate) )
+                dedup_forget_domain(&dd, domids[i]);
+
+            if ( stats && now_ns() - last_stats >= stats * 1000000000ULL )
+            {
+                last_stats = now_ns();
+                print_stats(&dd);
+            }
+        }
+
+        memcpy(prev, domids, nr * sizeof(*domids));
+        nr_prev = nr;
+
+        if ( once )
+            break;
+
+        /* Nothing to scan, wait for guests */
+        if ( !nr )
+            throttle(1, 1);
+    }
+
+    print_stats(&dd);
+    rc = 0;
+
+ out_dedup:
+    dedup_destroy(&dd);
+ out:
+    if ( fmem )
+        xenforeignmemory_close(fmem);
+    if ( xch )
+        xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
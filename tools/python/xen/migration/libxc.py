@@ -9,7 +9,7 @@ verification routines.
 
 import sys
 
-from struct import calcsize, unpack
+from struct import calcsize, unpack, unpack_from
 
 from xen.migration.verify import StreamError, RecordError, VerifyBase
 
@@ -58,6 +58,8 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_page_data_compressed       = 0x00000013
+REC_TYPE_stream_sync                = 0x00000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -79,6 +81,8 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_page_data_compressed       : "Page data compressed",
+    REC_TYPE_stream_sync                : "Stream sync",
 }
 
 # page_data
@@ -101,6 +105,16 @@ PAGE_DATA_TYPE_BROKEN        = (0xd << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (0xe << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (0xf << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# page_data_compressed
+PAGE_DATA_ENC_FORMAT         = "IHH"
+PAGE_DATA_ENC_RAW            = 0x0000
+PAGE_DATA_ENC_ZERO           = 0x0001
+PAGE_DATA_ENC_DEFLATE        = 0x0002
+PAGE_DATA_ENC_XOR_DEFLATE    = 0x0003
+
+# stream_sync
+STREAM_SYNC_FORMAT           = "II"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -217,7 +231,7 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_page_data_compressed):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together" %
@@ -251,7 +265,7 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
+    def verify_record_page_data(self, content, compressed = False):
         """ Page Data record """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
@@ -288,12 +302,54 @@ class VerifyLibxc(VerifyBase):
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
 
+        if compressed:
+            self.verify_page_data_encodings(content[minsz + pfnsz:], nr_pages)
+            return
+
         pagesz = nr_pages * 4096
         if len(content) != minsz + pfnsz + pagesz:
             raise RecordError("Expected %u + %u + %u, got %u" %
                               (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_page_data_encodings(self, content, nr_pages):
+        """ Encoding entries and data of a Page Data Compressed record """
+        entsz = calcsize(PAGE_DATA_ENC_FORMAT)
+        encsz = nr_pages * entsz
+        if len(content) < encsz:
+            raise RecordError("PAGE_DATA_COMPRESSED record must contain an "
+                              "encoding for each page of data")
+
+        datasz = 0
+        for idx in range(nr_pages):
+            length, enc, res1 = unpack_from(PAGE_DATA_ENC_FORMAT, content,
+                                            idx * entsz)
+
+            if res1 != 0:
+                raise RecordError("Reserved bits set in encoding[%d]: 0x%04x"
+                                  % (idx, res1))
+
+            if enc == PAGE_DATA_ENC_RAW:
+                valid = length == 4096
+            elif enc == PAGE_DATA_ENC_ZERO:
+                valid = length == 0
+            elif enc in (PAGE_DATA_ENC_DEFLATE, PAGE_DATA_ENC_XOR_DEFLATE):
+                valid = 0 < length < 4096
+            else:
+                raise RecordError("Unknown encoding %d for page %d" %
+                                  (enc, idx))
+
+            if not valid:
+                raise RecordError("Bad length %d for encoding %d of page %d"
+                                  % (length, enc, idx))
+
+            datasz += length
+
+        if len(content) != encsz + datasz:
+            raise RecordError("Expected %u + %u bytes of encoded data, got %u" %
+                              (encsz, datasz, len(content)))
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -476,6 +532,25 @@ class VerifyLibxc(VerifyBase):
                               (contentsz, sz))
 
 
+    def verify_record_stream_sync(self, content):
+        """ Stream sync record """
+
+        sz = calcsize(STREAM_SYNC_FORMAT)
+
+        if len(content) != sz:
+            raise RecordError("Length expected to be %d bytes, not %d" %
+                              (sz, len(content)))
+
+        seq, res1 = unpack(STREAM_SYNC_FORMAT, content)
+
+        if seq == 0:
+            raise RecordError("Stream sync sequence number must be non-zero")
+
+        if res1 != 0:
+            raise RecordError("Reserved bits set in stream sync record: 0x%08x"
+                              % (res1, ))
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -525,4 +600,10 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_page_data_compressed:
+        lambda s, x:
+        VerifyLibxc.verify_record_page_data(s, x, True),
+    REC_TYPE_stream_sync:
+        VerifyLibxc.verify_record_stream_sync,
     }
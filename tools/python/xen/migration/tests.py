@@ -19,6 +19,8 @@ class TestLibxc(unittest.TestCase):
                          (libxc.RH_FORMAT, 8),
 
                          (libxc.PAGE_DATA_FORMAT, 8),
+                         (libxc.PAGE_DATA_ENC_FORMAT, 8),
+                         (libxc.STREAM_SYNC_FORMAT, 8),
                          (libxc.X86_PV_INFO_FORMAT, 8),
                          (libxc.X86_PV_P2M_FRAMES_FORMAT, 8),
                          (libxc.X86_PV_VCPU_HDR_FORMAT, 8),
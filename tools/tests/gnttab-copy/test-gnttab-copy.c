@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Grant copy microbenchmark.
+ *
+ * Shares a few pages of our own memory with a domain (by default dom0,
+ * i.e. ourselves when run there) and then issues GNTTABOP_copy batches
+ * made of many small segments spread round-robin over those pages, the
+ * way netback and blkback do.  The data copied is checked once before
+ * timing starts.
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xengnttab.h>
+
+#include <xen-tools/common-macros.h>
+
+#define PAGE_SIZE 4096
+
+static unsigned int domid;
+static unsigned int nr_pages = 8;
+static unsigned int seg_size = 64;
+static unsigned int batch = 256;
+static unsigned long iterations = 10000;
+static bool to_grant;
+
+static xengnttab_handle *xgt;
+static xengntshr_handle *xgs;
+static uint32_t *refs;
+static uint8_t *shared;
+static uint8_t *local;
+static xengnttab_grant_copy_segment_t *segs;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d, --domid <id>        domain the pages are granted to [%u]\n"
+            "  -p, --pages <n>         number of granted pages [%u]\n"
+            "  -s, --size <bytes>      size of each segment [%u]\n"
+            "  -b, --batch <n>         segments per call [%u]\n"
+            "  -n, --iterations <n>    number of calls [%lu]\n"
+            "  -w, --write             copy into the grants, not out of them\n",
+            prog, domid, nr_pages, seg_size, batch, iterations);
+    exit(2);
+}
+
+/* Segment @i of a batch: which page, and where in it and in local. */
+static void setup_segs(void)
+{
+    unsigned int per_page = PAGE_SIZE / seg_size, i;
+
+    for ( i = 0; i < batch; i++ )
+    {
+        xengnttab_grant_copy_segment_t *seg = &segs[i];
+        unsigned int page = i % nr_pages;
+        unsigned int offset = (i / nr_pages % per_page) * seg_size;
+        union xengnttab_copy_ptr *gref, *virt;
+
+        memset(seg, 0, sizeof(*seg));
+        if ( to_grant )
+        {
+            gref = &seg->dest;
+            virt = &seg->source;
+            seg->flags = GNTCOPY_dest_gref;
+        }
+        else
+        {
+            gref = &seg->source;
+            virt = &seg->dest;
+            seg->flags = GNTCOPY_source_gref;
+        }
+
+        gref->foreign.ref = refs[page];
+        gref->foreign.offset = offset;
+        gref->foreign.domid = domid;
+        virt->virt = local + (size_t)i * seg_size;
+        seg->len = seg_size;
+    }
+}
+
+static void do_copy(void)
+{
+    unsigned int i;
+
+    if ( xengnttab_grant_copy(xgt, batch, segs) )
+        err(1, "xengnttab_grant_copy");
+
+    for ( i = 0; i < batch; i++ )
+        if ( segs[i].status != GNTST_okay )
+            errx(1, "segment %u failed: status %d", i, segs[i].status);
+}
+
+static void check_copy(void)
+{
+    unsigned int per_page = PAGE_SIZE / seg_size, i = 0;
+
+    /* When writing, segments sharing a destination: the last one wins. */
+    if ( to_grant && batch > nr_pages * per_page )
+        i = batch - nr_pages * per_page;
+
+    for ( ; i < batch; i++ )
+    {
+        unsigned int page = i % nr_pages;
+        unsigned int offset = (i / nr_pages % per_page) * seg_size;
+
+        if ( memcmp(shared + (size_t)page * PAGE_SIZE + offset,
+                    local + (size_t)i * seg_size, seg_size) )
+            errx(1, "segment %u: data mismatch", i);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "domid", 1, NULL, 'd' },
+        { "pages", 1, NULL, 'p' },
+        { "size", 1, NULL, 's' },
+        { "batch", 1, NULL, 'b' },
+        { "iterations", 1, NULL, 'n' },
+        { "write", 0, NULL, 'w' },
+        { "help", 0, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned long i;
+    uint64_t ns;
+    int c;
+
+    while ( (c = getopt_long(argc, argv, "d:p:s:b:n:wh", options,
+                             NULL)) != -1 )
+    {
+        switch ( c )
+        {
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            to_grant = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc || !nr_pages || !batch || !iterations ||
+         !seg_size || seg_size > PAGE_SIZE )
+        usage(argv[0]);
+
+    xgt = xengnttab_open(NULL, 0);
+    if ( !xgt )
+        err(1, "xengnttab_open");
+    xgs = xengntshr_open(NULL, 0);
+    if ( !xgs )
+        err(1, "xengntshr_open");
+
+    refs = calloc(nr_pages, sizeof(*refs));
+    local = calloc(batch, seg_size);
+    segs = calloc(batch, sizeof(*segs));
+    if ( !refs || !local || !segs )
+        err(1, "calloc");
+
+    shared = xengntshr_share_pages(xgs, domid, nr_pages, refs, 1);
+    if ( !shared )
+        err(1, "xengntshr_share_pages");
+
+    for ( i = 0; i < (unsigned long)nr_pages * PAGE_SIZE; i++ )
+        shared[i] = i * 7 + (i >> 12);
+    if ( to_grant )
+        for ( i = 0; i < (unsigned long)batch * seg_size; i++ )
+            local[i] = i * 13 + 1;
+
+    setup_segs();
+    do_copy();
+    check_copy();
+
+    ns = now_ns();
+    for ( i = 0; i < iterations; i++ )
+        do_copy();
+    ns = now_ns() - ns;
+
+    printf("%s %u x %u bytes over %u pages: %.1f ns/segment, %.1f MB/s\n",
+           to_grant ? "write" : "read", batch, seg_size, nr_pages,
+           (double)ns / (iterations * batch),
+           (double)iterations * batch * seg_size * 1000 / ns);
+
+    xengntshr_unshare(xgs, shared, nr_pages);
+    xengntshr_close(xgs);
+    xengnttab_close(xgt);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
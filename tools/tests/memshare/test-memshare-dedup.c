@@ -0,0 +1,392 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Unit tests for the content index of xen-memshared.
+ *
+ * The guests are arrays of synthetic pages.  Nomination and sharing follow
+ * Xen's rules: nominated pages can't be mapped any more, and a write to
+ * one unshares it and invalidates its handle.  Every share is checked to
+ * merge pages with the same contents.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xen/memory.h>
+
+#include "memshare-dedup.h"
+
+#define NR_DOMS  5
+#define NR_PAGES 256
+
+struct fake_dom {
+    uint8_t pages[NR_PAGES][DEDUP_PAGE_SIZE];
+    uint64_t handle[NR_PAGES];
+    unsigned int paused;
+    bool gone;
+};
+
+static struct fake_dom doms[NR_DOMS];
+static uint64_t next_handle;
+static unsigned int nr_shared;
+
+/* Called when a domain gets paused, to race with the scanner. */
+static void (*pause_hook)(domid_t domid);
+
+static void fill(domid_t domid, xen_pfn_t gfn, unsigned int seed)
+{
+    uint32_t *p = (uint32_t *)doms[domid].pages[gfn];
+    unsigned int i;
+
+    for ( i = 0; i < DEDUP_PAGE_SIZE / sizeof(*p); i++ )
+        p[i] = seed * 2654435761U + i;
+}
+
+/* A guest write: unshares the page. */
+static void guest_write(domid_t domid, xen_pfn_t gfn, unsigned int seed)
+{
+    fill(domid, gfn, seed);
+    doms[domid].handle[gfn] = 0;
+}
+
+static void *fake_map(void *opaque, domid_t domid, const xen_pfn_t *gfns,
+                      int *err, unsigned int nr)
+{
+    uint8_t *buf;
+    unsigned int i;
+
+    if ( domid >= NR_DOMS || doms[domid].gone )
+    {
+        errno = ESRCH;
+        return NULL;
+    }
+
+    buf = malloc(nr * DEDUP_PAGE_SIZE);
+    assert(buf);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        assert(gfns[i] < NR_PAGES);
+        err[i] = doms[domid].handle[gfns[i]] ? -EINVAL : 0;
+        if ( !err[i] )
+            memcpy(buf + i * DEDUP_PAGE_SIZE, doms[domid].pages[gfns[i]],
+                   DEDUP_PAGE_SIZE);
+    }
+
+    return buf;
+}
+
+static void fake_unmap(void *opaque, void *addr, unsigned int nr)
+{
+    free(addr);
+}
+
+static int fake_nominate(void *opaque, domid_t domid, xen_pfn_t gfn,
+                         uint64_t *handle)
+{
+    assert(doms[domid].paused);
+
+    if ( doms[domid].gone )
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    if ( !doms[domid].handle[gfn] )
+        doms[domid].handle[gfn] = ++next_handle;
+    *handle = doms[domid].handle[gfn];
+
+    return 0;
+}
+
+static int fake_share(void *opaque, domid_t sdomid, xen_pfn_t sgfn,
+                      uint64_t sh, domid_t cdomid, xen_pfn_t cgfn,
+                      uint64_t ch)
+{
+    if ( doms[sdomid].gone )
+    {
+        errno = ESRCH;
+        return -1;
+    }
+    if ( doms[sdomid].handle[sgfn] != sh )
+    {
+        errno = -XENMEM_SHARING_OP_S_HANDLE_INVALID;
+        return -1;
+    }
+    if ( doms[cdomid].handle[cgfn] != ch )
+    {
+        errno = -XENMEM_SHARING_OP_C_HANDLE_INVALID;
+        return -1;
+    }
+
+    /* Xen trusts the caller, this must never merge different pages */
+    assert(!memcmp(doms[sdomid].pages[sgfn], doms[cdomid].pages[cgfn],
+                   DEDUP_PAGE_SIZE));
+
+    doms[cdomid].handle[cgfn] = sh;
+    nr_shared++;
+
+    return 0;
+}
+
+static int fake_pause(void *opaque, domid_t domid)
+{
+    if ( doms[domid].gone )
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    doms[domid].paused++;
+    if ( pause_hook )
+        pause_hook(domid);
+
+    return 0;
+}
+
+static void fake_unpause(void *opaque, domid_t domid)
+{
+    assert(doms[domid].paused);
+    doms[domid].paused--;
+}
+
+static const struct dedup_ops fake_ops = {
+    .map      = fake_map,
+    .unmap    = fake_unmap,
+    .nominate = fake_nominate,
+    .share    = fake_share,
+    .pause    = fake_pause,
+    .unpause  = fake_unpause,
+};
+
+static void scan(struct dedup *dd, domid_t domid)
+{
+    xen_pfn_t gfns[DEDUP_BATCH];
+    xen_pfn_t gfn = 0;
+    unsigned int i, d;
+
+    while ( gfn < NR_PAGES )
+    {
+        for ( i = 0; i < DEDUP_BATCH && gfn < NR_PAGES; i++ )
+            gfns[i] = gfn++;
+        assert(!dedup_scan_batch(dd, domid, gfns, i));
+    }
+
+    for ( d = 0; d < NR_DOMS; d++ )
+        assert(!doms[d].paused);
+}
+
+static void test_hash(void)
+{
+    static uint8_t page[DEDUP_PAGE_SIZE], same[DEDUP_PAGE_SIZE];
+    uint64_t hash;
+    unsigned int bit;
+
+    fill(0, 0, 1);
+    memcpy(page, doms[0].pages[0], DEDUP_PAGE_SIZE);
+    memcpy(same, page, DEDUP_PAGE_SIZE);
+
+    hash = dedup_hash_page(page);
+    assert(hash == dedup_hash_page(same));
+
+    for ( bit = 0; bit < DEDUP_PAGE_SIZE * 8; bit++ )
+    {
+        page[bit / 8] ^= 1 << (bit % 8);
+        assert(dedup_hash_page(page) != hash);
+        page[bit / 8] ^= 1 << (bit % 8);
+    }
+
+    printf("hash: OK\n");
+}
+
+/* Guest 2 has the same first half as guest 1. */
+static void test_share(struct dedup *dd)
+{
+    xen_pfn_t gfn;
+
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+    {
+        fill(1, gfn, gfn);
+        fill(2, gfn, gfn < NR_PAGES / 2 ? gfn : gfn + 1000);
+    }
+
+    scan(dd, 1);
+    assert(!nr_shared && dd->stats.scanned == NR_PAGES);
+
+    scan(dd, 2);
+    assert(nr_shared == NR_PAGES / 2);
+    assert(dd->stats.shared == NR_PAGES / 2);
+    assert(dd->stats.copies == NR_PAGES / 2);
+
+    for ( gfn = 0; gfn < NR_PAGES / 2; gfn++ )
+        assert(doms[2].handle[gfn] == doms[1].handle[gfn]);
+    for ( ; gfn < NR_PAGES; gfn++ )
+        assert(!doms[2].handle[gfn]);
+
+    /* Shared pages can't be read, so nothing happens the second time */
+    scan(dd, 2);
+    assert(nr_shared == NR_PAGES / 2);
+
+    printf("share: OK\n");
+}
+
+/* A write lands between the hashing of a page and the pause. */
+static void write_on_pause(domid_t domid)
+{
+    if ( domid == 3 )
+    {
+        guest_write(3, 7, 5000);
+        pause_hook = NULL;
+    }
+}
+
+static void test_race(struct dedup *dd)
+{
+    unsigned int shared = nr_shared;
+    uint64_t mismatched = dd->stats.mismatched;
+    xen_pfn_t gfn;
+
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+        fill(3, gfn, gfn);
+
+    pause_hook = write_on_pause;
+    scan(dd, 3);
+
+    assert(dd->stats.mismatched == mismatched + 1);
+    assert(nr_shared == shared + NR_PAGES - 1);
+    assert(!doms[3].handle[7]);
+
+    printf("race: OK\n");
+}
+
+/* The source is written to after it got nominated. */
+static void test_stale(struct dedup *dd)
+{
+    uint64_t stale = dd->stats.stale;
+    unsigned int shared = nr_shared;
+    xen_pfn_t gfn;
+
+    guest_write(1, 5, 6000);
+
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+        fill(4, gfn, 2000 + gfn);
+    fill(4, 5, 5);
+
+    scan(dd, 4);
+    assert(dd->stats.stale == stale + 1);
+    assert(nr_shared == shared);
+    assert(doms[4].handle[5]);
+
+    /* Guest 4 is the source of that content now */
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+        fill(0, gfn, 3000 + gfn);
+    fill(0, 5, 5);
+    scan(dd, 0);
+    assert(nr_shared == shared + 1);
+    assert(doms[0].handle[5] == doms[4].handle[5]);
+
+    printf("stale: OK\n");
+}
+
+static void test_forget(struct dedup *dd)
+{
+    unsigned long used = dd->used;
+    uint64_t copies = dd->stats.copies;
+
+    doms[4].gone = true;
+    assert(dedup_scan_batch(dd, 4, NULL, 0) && errno == ESRCH);
+    assert(!dedup_forget_domain(dd, 4));
+
+    assert(dd->used == used - NR_PAGES);
+    assert(dd->stats.copies == copies - 1);
+
+    printf("forget: OK\n");
+}
+
+/*
+ * With a cap on the private copies, sharing goes on, but only the sources
+ * which keep having candidates hold on to their copies.
+ */
+static void test_evict(void)
+{
+    struct dedup dd;
+    bool sources[NR_PAGES];
+    unsigned int shared, nr_sources = 0;
+    xen_pfn_t gfn;
+    domid_t d;
+
+    assert(!dedup_init(&dd, &fake_ops, NULL));
+    dd.max_copies = 8;
+
+    for ( d = 1; d <= 3; d++ )
+    {
+        memset(&doms[d], 0, sizeof(doms[d]));
+        for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+            fill(d, gfn, 10000 + gfn);
+    }
+
+    scan(&dd, 1);
+    shared = nr_shared;
+
+    /* Every batch gets shared before the copies of its sources go */
+    scan(&dd, 2);
+    assert(nr_shared == shared + NR_PAGES);
+    assert(dd.stats.copies == dd.max_copies);
+    assert(dd.stats.evicted == NR_PAGES - dd.max_copies);
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+        assert(doms[2].handle[gfn] == doms[1].handle[gfn]);
+
+    /*
+     * The contents whose copies were dropped get guest 3's pages as their
+     * new sources, the others are shared as before.  None of that is stale.
+     */
+    shared = nr_shared;
+    scan(&dd, 3);
+    assert(dd.stats.copies <= dd.max_copies);
+    assert(nr_shared > shared && nr_shared < shared + NR_PAGES);
+    assert(!dd.stats.stale && !dd.stats.mismatched);
+
+    /* Guest 3's new sources get nominated and shared with guest 4 */
+    memset(&doms[4], 0, sizeof(doms[4]));
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+    {
+        fill(4, gfn, 10000 + gfn);
+        sources[gfn] = !doms[3].handle[gfn];
+        nr_sources += sources[gfn];
+    }
+    assert(nr_sources && nr_sources < NR_PAGES);
+    scan(&dd, 4);
+    for ( gfn = 0; gfn < NR_PAGES; gfn++ )
+        if ( sources[gfn] )
+            assert(doms[3].handle[gfn] &&
+                   doms[4].handle[gfn] == doms[3].handle[gfn]);
+    assert(dd.stats.copies == dd.max_copies);
+    assert(!dd.stats.stale && !dd.stats.mismatched);
+
+    dedup_destroy(&dd);
+
+    printf("evict: OK\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct dedup dd;
+
+    assert(!dedup_init(&dd, &fake_ops, NULL));
+
+    test_hash();
+    test_share(&dd);
+    test_race(&dd);
+    test_stale(&dd);
+    test_forget(&dd);
+
+    dedup_destroy(&dd);
+
+    test_evict();
+
+    return 0;
+}
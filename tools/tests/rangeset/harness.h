@@ -27,6 +27,7 @@
 #define ASSERT(x) assert(x)
 
 #include "list.h"
+#include "rbtree.h"
 #include "rangeset.h"
 
 typedef bool rwlock_t;
@@ -5,6 +5,8 @@
  * Copyright (C) 2025 Cloud Software Group
  */
 
+#include <time.h>
+
 #include "harness.h"
 
 struct range {
@@ -140,12 +142,145 @@ static void print_both(struct rangeset *r, const struct range *expected,
         printf("[%ld, %ld]\n", expected[i].start, expected[i].end);
 }
 
+/*
+ * Apply random additions and removals, checking the set against a plain
+ * bitmap of [0, RANDOM_SPACE) after every operation.
+ */
+#define RANDOM_SPACE 2048
+#define RANDOM_OPS   20000
+
+static int random_test(struct rangeset *r)
+{
+    static bool map[RANDOM_SPACE];
+    unsigned int i, j;
+
+    rangeset_purge(r);
+    memset(map, 0, sizeof(map));
+    srand(0);
+
+    for ( i = 0; i < RANDOM_OPS; i++ )
+    {
+        unsigned long s = rand() % RANDOM_SPACE;
+        unsigned long e = s + rand() % (i % 4 ? 8 : 64);
+        bool add = rand() % 2;
+        int rc;
+
+        if ( e >= RANDOM_SPACE )
+            e = RANDOM_SPACE - 1;
+
+        rc = add ? rangeset_add_range(r, s, e)
+                 : rangeset_remove_range(r, s, e);
+        if ( rc )
+        {
+            printf("Random op %u failed to %s range [%ld, %ld]\n",
+                   i, add ? "add" : "remove", s, e);
+            return -1;
+        }
+
+        for ( j = s; j <= e; j++ )
+            map[j] = add;
+
+        /* Check a random range, and every single value now and then. */
+        s = rand() % RANDOM_SPACE;
+        e = s + rand() % 16;
+        if ( e >= RANDOM_SPACE )
+            e = RANDOM_SPACE - 1;
+        for ( j = s; j <= e && map[j]; j++ )
+            continue;
+        if ( rangeset_contains_range(r, s, e) != (j > e) )
+        {
+            printf("Random op %u: wrong containment of [%ld, %ld]\n",
+                   i, s, e);
+            return -1;
+        }
+
+        for ( j = s; j <= e && !map[j]; j++ )
+            continue;
+        if ( rangeset_overlaps_range(r, s, e) != (j <= e) )
+        {
+            printf("Random op %u: wrong overlap of [%ld, %ld]\n", i, s, e);
+            return -1;
+        }
+
+        if ( i % 256 )
+            continue;
+
+        for ( j = 0; j < RANDOM_SPACE; j++ )
+            if ( rangeset_contains_singleton(r, j) != map[j] )
+            {
+                printf("Random op %u: wrong membership of %u\n", i, j);
+                return -1;
+            }
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time insertions and lookups for sets of increasingly many disjoint ranges,
+ * as e.g. registered by a device model on an ioreq server.
+ */
+#define BENCH_LOOKUPS (1U << 20)
+
+static void benchmark(void)
+{
+    unsigned int nr;
+
+    printf("%8s %14s %14s\n", "ranges", "add (ns/op)", "lookup (ns/op)");
+
+    for ( nr = 16; nr <= (1U << 16); nr <<= 2 )
+    {
+        struct rangeset *r = rangeset_new(NULL, NULL, 0);
+        unsigned int i, hits = 0;
+        uint64_t t_add, t_lookup;
+
+        ASSERT(r);
+        srand(nr);
+
+        t_add = now_ns();
+        for ( i = 0; i < nr; i++ )
+            if ( rangeset_add_range(r, i * 16UL, i * 16UL + 7) )
+                abort();
+        t_add = now_ns() - t_add;
+
+        t_lookup = now_ns();
+        for ( i = 0; i < BENCH_LOOKUPS; i++ )
+        {
+            unsigned long s = rand() % (nr * 16UL);
+
+            hits += rangeset_contains_range(r, s, s);
+        }
+        t_lookup = now_ns() - t_lookup;
+
+        printf("%8u %14.1f %14.1f (%u hits)\n", nr, (double)t_add / nr,
+               (double)t_lookup / BENCH_LOOKUPS, hits);
+
+        rangeset_destroy(r);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    struct rangeset *r = rangeset_new(NULL, NULL, 0);
+    struct rangeset *r;
     unsigned int i;
     int ret_code = 0;
 
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+    {
+        benchmark();
+        return 0;
+    }
+
+    r = rangeset_new(NULL, NULL, 0);
     ASSERT(r);
 
     for ( i = 0 ; i < ARRAY_SIZE(tests); i++ )
@@ -215,6 +350,9 @@ int main(int argc, char **argv)
         }
     }
 
+    if ( random_test(r) )
+        ret_code = EXIT_FAILURE;
+
     return ret_code;
 }
 
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Unit tests for the timer heap and wheel.
+ *
+ * timer.c runs on a single simulated CPU, with a clock which only moves
+ * when the test says so.
+ */
+
+#ifndef _TEST_HARNESS_
+#define _TEST_HARNESS_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#define CONFIG_NR_CPUS 1
+
+#define smp_wmb()
+#define cf_check
+#define __init
+#define __read_mostly
+#define __cacheline_aligned
+
+#define likely(x)   (x)
+#define unlikely(x) (x)
+
+#define BUG() assert(0)
+#define BUG_ON(x) assert(!(x))
+#define WARN_ON(x) assert(!(x))
+#define ASSERT(x) assert(x)
+
+#define integer_param(name, var)
+
+typedef int64_t s_time_t;
+#define STIME_MAX INT64_MAX
+
+extern s_time_t test_now;
+#define NOW() test_now
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) per_cpu__##name
+#define per_cpu(name, cpu) (*((void)(cpu), &per_cpu__##name))
+#define this_cpu(name) per_cpu__##name
+
+#include "list.h"
+#include "timer.h"
+
+typedef bool spinlock_t;
+#define spin_lock_init(l)              (*(l) = false)
+#define _spin_lock(l)                  (assert(!*(l)), *(l) = true)
+#define spin_lock(l)                   _spin_lock(l)
+#define spin_unlock(l)                 (assert(*(l)), *(l) = false)
+#define spin_lock_irq(l)               spin_lock(l)
+#define spin_unlock_irq(l)             spin_unlock(l)
+#define spin_lock_irqsave(l, f)        ((f) = 0, spin_lock(l))
+#define spin_unlock_irqrestore(l, f)   ((void)(f), spin_unlock(l))
+#define local_irq_save(f)              ((f) = 0)
+#define local_irq_restore(f)           ((void)(f))
+#define block_lock_speculation()
+
+#define DEFINE_RCU_READ_LOCK(x) int x
+#define rcu_read_lock(x)   ((void)(x))
+#define rcu_read_unlock(x) ((void)(x))
+
+#define read_atomic(p)     (*(p))
+#define write_atomic(p, v) (*(p) = (v))
+
+#define ffs64(x) __builtin_ffsll(x)
+
+#define xmalloc_array(type, num) ((type *)malloc(sizeof(type) * (num)))
+#define xfree free
+
+#define printk printf
+#define printk_once printf
+#define XENLOG_WARNING
+
+#define smp_processor_id() 0
+#define cpu_relax()
+#define for_each_online_cpu(cpu) for ( (cpu) = 0; (cpu) < 1; (cpu)++ )
+#define cpumask_any(m) ((void)(m), 0)
+#define cpu_online(cpu) ((cpu) == 0)
+extern int cpu_online_map;
+
+#define park_offline_cpus false
+#define system_state 0
+#define SYS_STATE_suspend 1
+
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *nfb, unsigned long action,
+                         void *hcpu);
+    int priority;
+};
+
+#define NOTIFY_DONE 0
+enum {
+    CPU_UP_PREPARE,
+    CPU_UP_CANCELED,
+    CPU_DEAD,
+    CPU_RESUME_FAILED,
+    CPU_REMOVE,
+};
+#define register_cpu_notifier(nb) ((void)(nb))
+
+#define register_keyhandler(key, fn, desc, irq) ((void)(fn))
+
+#define TIMER_SOFTIRQ 0
+extern void (*test_softirq_action)(void);
+extern bool test_softirq_pending;
+#define open_softirq(nr, fn) (test_softirq_action = (fn))
+#define raise_softirq(nr) (test_softirq_pending = true)
+#define cpu_raise_softirq(cpu, nr) ((void)(cpu), raise_softirq(nr))
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
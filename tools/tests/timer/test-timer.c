@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Unit tests for the timer heap and wheel.
+ *
+ * Timers are armed and stopped at random, and the clock is moved to the
+ * deadlines timer.c programs.  Every timer has to fire after it expired,
+ * and at the first run of the timer softirq after that.
+ */
+
+#include "timer.c"
+
+#define NR_TIMERS 256
+#define NR_STEPS  200000
+#define TICK      (1LL << WHEEL_SHIFT)
+
+s_time_t test_now = 1LL << 40;
+int cpu_online_map;
+void (*test_softirq_action)(void);
+bool test_softirq_pending;
+
+int reprogram_timer(s_time_t timeout)
+{
+    return 1;
+}
+
+static struct test_timer {
+    struct timer timer;
+    s_time_t expires;     /* 0 when not armed */
+} timers[NR_TIMERS];
+
+/* NOW() at the last run of the timer softirq. */
+static s_time_t last_run;
+
+static uint64_t rnd(void)
+{
+    static uint64_t x = 88172645463325252ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return x;
+}
+
+static void timer_fn(void *data)
+{
+    struct test_timer *tt = data;
+
+    assert(tt->expires && tt->expires == tt->timer.expires);
+    /* Not early */
+    assert(tt->expires < test_now);
+    /* Not missed by the previous run */
+    assert(tt->expires >= last_run);
+
+    tt->expires = 0;
+}
+
+/* The programmed deadline must not be later than the first expiry. */
+static void check_deadline(void)
+{
+    s_time_t first = STIME_MAX, deadline = this_cpu(timer_deadline);
+    unsigned int i;
+
+    for ( i = 0; i < NR_TIMERS; i++ )
+        if ( timers[i].expires )
+            first = min(first, timers[i].expires);
+
+    if ( first == STIME_MAX )
+        assert(!deadline);
+    else
+        assert(deadline && deadline <= max(first, test_now + timer_slop));
+}
+
+/* Above level 0, the current slot is only in use when about to be processed. */
+static void check_wheel(const struct timers *ts)
+{
+    unsigned int level;
+
+    for ( level = 1; level < WHEEL_LEVELS; level++ )
+        if ( ts->wheel_clk & ((1LL << (level * WHEEL_LEVEL_BITS)) - 1) )
+            assert(!(ts->wheel_map[level] &
+                     (1ULL << wheel_index(ts->wheel_clk, level))));
+}
+
+static void run_softirq(void)
+{
+    test_softirq_pending = false;
+    test_softirq_action();
+    last_run = test_now;
+
+    check_deadline();
+    check_wheel(&this_cpu(timers));
+}
+
+static s_time_t random_delay(void)
+{
+    switch ( rnd() % 4 )
+    {
+    case 0:  return rnd() % (4 * TICK);
+    case 1:  return rnd() % (TICK << (2 * WHEEL_LEVEL_BITS));
+    case 2:  return rnd() % (TICK << (WHEEL_LEVELS * WHEEL_LEVEL_BITS));
+    default: return rnd() % (TICK << (WHEEL_LEVELS * WHEEL_LEVEL_BITS + 2));
+    }
+}
+
+/* Move the clock to, or towards, the programmed deadline. */
+static void advance(void)
+{
+    s_time_t deadline = this_cpu(timer_deadline);
+
+    if ( !deadline )
+        return;
+
+    if ( rnd() % 2 || deadline <= test_now )
+        test_now = max(test_now, deadline);
+    else
+        test_now += rnd() % (deadline - test_now);
+
+    if ( test_now >= deadline )
+        test_softirq_pending = true;
+}
+
+/*
+ * Place timers at every distance from wheel clocks all over the slots, and
+ * check that the slot is processed in time but never a revolution late.
+ */
+static void test_placement(void)
+{
+    static struct timers ts;
+    static const s_time_t clks[] = {
+        1LL << 30,
+        (1LL << 30) + 1,
+        (1LL << 30) + WHEEL_SIZE - 1,
+        (1LL << 30) + WHEEL_SIZE * WHEEL_SIZE - 5,
+        (1LL << 30) + (1LL << 18) + (1LL << 12) + (1LL << 6) + 3,
+    };
+    struct timer t = {};
+    unsigned int i, c;
+
+    for ( i = 0; i < ARRAY_SIZE(ts.wheel); i++ )
+        INIT_LIST_HEAD(&ts.wheel[i]);
+
+    for ( c = 0; c < ARRAY_SIZE(clks); c++ )
+    {
+        for ( i = 0; i < 100000; i++ )
+        {
+            s_time_t dist = i < 20000 ? i : random_delay() >> WHEEL_SHIFT;
+            s_time_t tick = clks[c] + dist, due;
+            unsigned int level, idx;
+
+            ts.wheel_clk = clks[c];
+            t.expires = tick << WHEEL_SHIFT;
+            assert(add_to_wheel(&ts, &t, &due));
+
+            level = t.wheel_slot / WHEEL_SIZE;
+            idx = t.wheel_slot % WHEEL_SIZE;
+
+            assert(due >= ts.wheel_clk && due <= tick);
+            assert(!(due & ((1LL << (level * WHEEL_LEVEL_BITS)) - 1)));
+            assert(idx == wheel_index(due, level));
+            assert(!level || due > ts.wheel_clk);
+            assert(wheel_next_tick(&ts) == due);
+            check_wheel(&ts);
+
+            remove_from_wheel(&ts, &t);
+            assert(!ts.wheel_count && !ts.wheel_map[level]);
+        }
+    }
+
+    /* Due before the wheel clock */
+    ts.wheel_clk = clks[0];
+    t.expires = (clks[0] - 1) << WHEEL_SHIFT;
+    assert(!add_to_wheel(&ts, &t, NULL));
+
+    printf("placement: OK\n");
+}
+
+static void test_random(void)
+{
+    unsigned int i, step, armed = 0;
+
+    for ( i = 0; i < NR_TIMERS; i++ )
+        init_timer(&timers[i].timer, timer_fn, &timers[i], 0);
+
+    for ( step = 0; step < NR_STEPS; step++ )
+    {
+        struct test_timer *tt = &timers[rnd() % NR_TIMERS];
+
+        switch ( rnd() % 4 )
+        {
+        case 0:
+        case 1:
+            tt->expires = test_now + random_delay();
+            set_timer(&tt->timer, tt->expires);
+            armed++;
+            break;
+
+        case 2:
+            stop_timer(&tt->timer);
+            tt->expires = 0;
+            break;
+
+        default:
+            advance();
+            break;
+        }
+
+        if ( test_softirq_pending )
+            run_softirq();
+    }
+
+    /* Let everything fire */
+    while ( this_cpu(timer_deadline) )
+    {
+        advance();
+        if ( test_softirq_pending )
+            run_softirq();
+    }
+
+    for ( i = 0; i < NR_TIMERS; i++ )
+    {
+        assert(!timers[i].expires);
+        kill_timer(&timers[i].timer);
+    }
+    assert(!this_cpu(timers).wheel_count);
+
+    printf("random: OK (%u timers armed)\n", armed);
+}
+
+int main(int argc, char **argv)
+{
+    test_placement();
+
+    timer_init();
+    test_random();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Unit tests for the trace buffer.
+ */
+
+#ifndef _TEST_HARNESS_
+#define _TEST_HARNESS_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#include <xen/xen.h>
+#include <xen/sysctl.h>
+#include <xen/trace.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define NR_CPUS 1
+#define nr_cpu_ids 1
+#define smp_processor_id() 0
+#define for_each_online_cpu(c) for ( (c) = 0; (c) < nr_cpu_ids; (c)++ )
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1UL << PAGE_SHIFT)
+#define PAGE_MASK  (~(PAGE_SIZE - 1))
+#define PFN_UP(x)  (((x) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define __init
+#define __constructor __attribute__((__constructor__))
+#define __read_mostly
+#define cf_check
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define BUG_ON(x)  assert(!(x))
+#define ASSERT(x)  assert(x)
+#define WARN_ON(x) assert(!(x))
+
+#define printk(fmt, args...) ((void)fprintf(stderr, fmt, ## args))
+#define printk_once printk
+#define XENLOG_INFO
+#define XENLOG_WARNING
+
+#define integer_param(name, var)
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__ ## name
+#define DEFINE_PER_CPU_READ_MOSTLY DEFINE_PER_CPU
+#define per_cpu(name, cpu) (*((void)(cpu), &per_cpu__ ## name))
+#define this_cpu(name) per_cpu__ ## name
+
+/*
+ * test_interrupt() may call back into trace() to model a record being
+ * logged from interrupt context at the most awkward points of the insertion
+ * path: just before the reservation, and while filling in a record.
+ */
+void test_interrupt(void);
+
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define barrier()      asm volatile ( "" ::: "memory" )
+#define smp_mb()       __sync_synchronize()
+#define smp_wmb()      barrier()
+#define cpu_relax()    barrier()
+#define cmpxchg(p, o, n) \
+    ({ test_interrupt(); __sync_val_compare_and_swap(p, o, n); })
+#define xchg(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define arch_fetch_and_add(p, v) __sync_fetch_and_add(p, v)
+
+uint64_t get_cycles(void);
+
+typedef bool spinlock_t;
+#define DEFINE_SPINLOCK(l) spinlock_t l
+#define spin_lock(l)       (assert(!*(l)), *(l) = true)
+#define spin_unlock(l)     (assert(*(l)), *(l) = false)
+
+typedef struct { unsigned long bits; } cpumask_t;
+typedef cpumask_t *cpumask_var_t;
+#define cpumask_setall(m)        ((m)->bits = ~0UL)
+#define cpumask_test_cpu(c, m)   (((m)->bits >> (c)) & 1)
+#define cpumask_copy(d, s)       (*(d) = *(s))
+#define free_cpumask_var(m)      ((void)(m))
+#define xenctl_bitmap_to_cpumask(m, b) ((void)(m), (void)(b), -EOPNOTSUPP)
+
+/* Trace pages come from a static arena, so that mfns fit in 32 bits. */
+struct page_info {
+    unsigned long count_info;
+};
+#define PGC_allocated 1UL
+#define MEMF_bits(b) 0
+#define SHARE_rw 0
+#define SHARE_ro 1
+
+typedef unsigned long mfn_t;
+#define _mfn(m) (m)
+
+void *alloc_xenheap_pages(unsigned int order, unsigned int memflags);
+void free_xenheap_pages(void *v, unsigned int order);
+unsigned int get_order_from_pages(unsigned long nr);
+unsigned long virt_to_mfn(const void *v);
+void *mfn_to_virt(unsigned long mfn);
+struct page_info *mfn_to_page(mfn_t mfn);
+struct page_info *virt_to_page(const void *v);
+#define share_xen_page_with_privileged_guests(pg, t) ((void)(pg))
+
+struct tasklet {
+    void (*func)(void *data);
+    unsigned int scheduled;
+};
+#define DECLARE_SOFTIRQ_TASKLET(name, fn, data) \
+    struct tasklet name = { .func = (fn) }
+#define tasklet_schedule(t) ((t)->scheduled++)
+#define send_global_virq(v) ((void)(v))
+
+struct domain {
+    domid_t domain_id;
+};
+
+struct vcpu {
+    unsigned int vcpu_id;
+    struct domain *domain;
+};
+
+extern struct vcpu *current;
+
+/* From xen/trace.h */
+extern bool tb_init_done;
+int tb_control(struct xen_sysctl_tbuf_op *tbc);
+int trace_will_trace_event(uint32_t event);
+void trace(uint32_t event, unsigned int extra, const void *extra_data);
+void __trace_hypercall(uint32_t event, unsigned long op,
+                       const xen_ulong_t *args);
+
+static inline void trace_time(
+    uint32_t event, unsigned int extra, const void *extra_data)
+{
+    trace(event | TRC_HD_CYCLE_FLAG, extra, extra_data);
+}
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
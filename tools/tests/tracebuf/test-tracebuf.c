@@ -0,0 +1,430 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Unit tests for the trace buffer.
+ *
+ * The hypervisor's trace.c is built against a mocked environment with a
+ * single CPU.  Records are read back the way xentrace does it, from the
+ * shared t_info and t_buf pages, and checked for completeness, including
+ * when "interrupts" log records in the middle of trace().
+ */
+
+#include <time.h>
+
+#include "harness.h"
+
+#define TEST_PAGES  4
+#define ARENA_PAGES 16
+#define MAX_SEQ     (1U << 20)
+
+#define TEST_EVENT  (TRC_HW | 0x100)
+
+static uint8_t arena[ARENA_PAGES][PAGE_SIZE]
+    __attribute__((__aligned__(PAGE_SIZE)));
+static struct page_info arena_pages[ARENA_PAGES];
+static unsigned int arena_used;
+
+static struct domain test_domain;
+static struct vcpu test_vcpu = { .domain = &test_domain };
+struct vcpu *current = &test_vcpu;
+
+void *alloc_xenheap_pages(unsigned int order, unsigned int memflags)
+{
+    void *p;
+
+    if ( arena_used + (1U << order) > ARENA_PAGES )
+        return NULL;
+
+    p = arena[arena_used];
+    arena_used += 1U << order;
+
+    return p;
+}
+
+void free_xenheap_pages(void *v, unsigned int order)
+{
+}
+
+unsigned int get_order_from_pages(unsigned long nr)
+{
+    unsigned int order = 0;
+
+    while ( (1UL << order) < nr )
+        order++;
+
+    return order;
+}
+
+/* mfn 0 means "not allocated" to trace.c, so offset them by one. */
+unsigned long virt_to_mfn(const void *v)
+{
+    return ((const uint8_t *)v - arena[0]) / PAGE_SIZE + 1;
+}
+
+void *mfn_to_virt(unsigned long mfn)
+{
+    assert(mfn && mfn <= ARENA_PAGES);
+    return arena[mfn - 1];
+}
+
+struct page_info *mfn_to_page(mfn_t mfn)
+{
+    return &arena_pages[mfn - 1];
+}
+
+struct page_info *virt_to_page(const void *v)
+{
+    return mfn_to_page(virt_to_mfn(v));
+}
+
+uint64_t get_cycles(void)
+{
+    test_interrupt();
+
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+#endif
+}
+
+/* Producer side */
+
+static unsigned int next_seq;
+static unsigned int irq_every, irq_tick, irq_depth;
+
+static void emit(void)
+{
+    uint32_t d[TRACE_EXTRA_MAX];
+    unsigned int seq = next_seq++, nr = 1 + seq % TRACE_EXTRA_MAX, i;
+    uint32_t event = TEST_EVENT | (seq & 1 ? TRC_HD_CYCLE_FLAG : 0);
+
+    assert(seq < MAX_SEQ);
+
+    d[0] = seq;
+    for ( i = 1; i < nr; i++ )
+        d[i] = seq * 7 + i;
+
+    trace(event, nr * sizeof(uint32_t), d);
+}
+
+void test_interrupt(void)
+{
+    if ( !irq_every || irq_depth >= 2 || ++irq_tick % irq_every )
+        return;
+
+    irq_depth++;
+    emit();
+    irq_depth--;
+}
+
+/* Consumer side, as xentrace sees the buffer */
+
+static struct t_buf *buf;
+static uint8_t *buf_pages[TEST_PAGES];
+static uint32_t data_size;
+
+static uint8_t seen[MAX_SEQ];
+static unsigned long nr_lost_reported;
+static unsigned int last_seq;
+
+static void map_buffer(void)
+{
+    struct xen_sysctl_tbuf_op op = { .cmd = XEN_SYSCTL_TBUFOP_get_info };
+    const struct t_info *t_info;
+    const uint32_t *mfn_list;
+    unsigned int i;
+
+    assert(!tb_control(&op));
+    t_info = mfn_to_virt(op.buffer_mfn);
+    assert(t_info->tbuf_size == TEST_PAGES);
+
+    mfn_list = (const uint32_t *)t_info + t_info->mfn_offset[0];
+    for ( i = 0; i < TEST_PAGES; i++ )
+        buf_pages[i] = mfn_to_virt(mfn_list[i]);
+
+    buf = (struct t_buf *)buf_pages[0];
+    data_size = TEST_PAGES * PAGE_SIZE - sizeof(*buf);
+}
+
+static void copy_out(void *dst, uint32_t off, unsigned int len)
+{
+    uint8_t *d = dst;
+
+    assert(off + len <= data_size);
+
+    for ( off += sizeof(*buf); len--; off++ )
+        *d++ = buf_pages[off >> PAGE_SHIFT][off & ~PAGE_MASK];
+}
+
+/*
+ * Consume everything published.  With @ordered, records must come out in
+ * the order they were logged, which only holds without nesting.
+ */
+static unsigned int drain(bool ordered)
+{
+    uint32_t cons = buf->cons, prod = ACCESS_ONCE(buf->prod);
+    unsigned int nr = 0;
+
+    while ( cons != prod )
+    {
+        uint32_t off = cons >= data_size ? cons - data_size : cons;
+        struct t_rec rec;
+        const uint32_t *d;
+        unsigned int size, seq, i;
+
+        copy_out(&rec, off, sizeof(uint32_t));
+        size = sizeof(uint32_t) + rec.extra_u32 * sizeof(uint32_t) +
+               (rec.cycles_included ? sizeof(uint64_t) : 0);
+        copy_out(&rec, off, size);
+        d = rec.cycles_included ? rec.u.cycles.extra_u32
+                                : rec.u.nocycles.extra_u32;
+
+        switch ( rec.event )
+        {
+        case TRC_TRACE_WRAP_BUFFER:
+            /* Padding must take us exactly to the end of the buffer. */
+            assert(off + size == data_size);
+            break;
+
+        case TRC_LOST_RECORDS:
+            assert(d[0]);
+            nr_lost_reported += d[0];
+            break;
+
+        default:
+            assert(rec.event == (TEST_EVENT & ~TRC_HD_CYCLE_FLAG));
+            seq = d[0];
+            assert(seq < next_seq && !seen[seq]);
+            assert(rec.extra_u32 == 1 + seq % TRACE_EXTRA_MAX);
+            assert(rec.cycles_included == (seq & 1));
+            for ( i = 1; i < rec.extra_u32; i++ )
+                assert(d[i] == seq * 7 + i);
+            assert(!ordered || !last_seq || seq == last_seq + 1);
+            seen[seq] = 1;
+            last_seq = seq;
+            nr++;
+            break;
+        }
+
+        cons += size;
+        if ( cons >= 2 * data_size )
+            cons -= 2 * data_size;
+    }
+
+    buf->cons = cons;
+
+    return nr;
+}
+
+static void check_accounted(const char *test)
+{
+    unsigned int i, nr_seen = 0;
+
+    for ( i = 0; i < next_seq; i++ )
+        nr_seen += seen[i];
+
+    if ( nr_seen + nr_lost_reported != next_seq )
+    {
+        printf("%s: %u records logged, %u seen, %lu reported lost\n",
+               test, next_seq, nr_seen, nr_lost_reported);
+        exit(1);
+    }
+
+    printf("%s: %u records, %lu lost: OK\n", test, next_seq,
+           nr_lost_reported);
+}
+
+static void reset(void)
+{
+    drain(false);
+    assert(buf->prod == buf->cons);
+    memset(seen, 0, sizeof(seen));
+    next_seq = last_seq = 0;
+    nr_lost_reported = 0;
+    irq_every = irq_tick = 0;
+}
+
+static void test_basic(void)
+{
+    unsigned int i;
+
+    reset();
+    for ( i = 0; i < 100000; i++ )
+    {
+        emit();
+        if ( i % 50 == 49 )
+            drain(true);
+    }
+    drain(true);
+
+    assert(!nr_lost_reported);
+    check_accounted("basic");
+}
+
+static void test_overflow(void)
+{
+    unsigned int i;
+
+    reset();
+    /* Fill the buffer up, and then some. */
+    for ( i = 0; i < 2 * data_size / 16; i++ )
+        emit();
+    drain(true);
+    assert(!nr_lost_reported);
+
+    /* The next record is preceded by the lost_records one. */
+    emit();
+    drain(false);
+    assert(nr_lost_reported);
+    check_accounted("overflow");
+}
+
+static void test_nested(void)
+{
+    unsigned int i;
+
+    reset();
+    irq_every = 3;
+    for ( i = 0; i < 100000; i++ )
+    {
+        emit();
+        if ( i % 20 == 19 )
+            drain(false);
+    }
+    drain(false);
+
+    assert(!nr_lost_reported);
+    check_accounted("nested");
+}
+
+static void test_nested_overflow(void)
+{
+    unsigned int i;
+
+    reset();
+    irq_every = 5;
+    for ( i = 0; i < 100000; i++ )
+    {
+        emit();
+        if ( i % 2000 == 1999 )
+            drain(false);
+    }
+    irq_every = 0;
+    drain(false);
+    /* Flush out any lost records still pending. */
+    emit();
+    drain(false);
+
+    assert(nr_lost_reported);
+    check_accounted("nested overflow");
+}
+
+static void test_disable(void)
+{
+    struct xen_sysctl_tbuf_op op = { .cmd = XEN_SYSCTL_TBUFOP_disable };
+    uint32_t prod;
+
+    reset();
+    assert(!tb_control(&op));
+
+    prod = buf->prod;
+    emit();
+    assert(buf->prod == prod);
+
+    op.cmd = XEN_SYSCTL_TBUFOP_enable;
+    assert(!tb_control(&op));
+    next_seq = 0;
+    emit();
+    assert(drain(true) == 1);
+
+    printf("disable: OK\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time the insertion of records of various sizes into a buffer which is
+ * kept from filling up.  This is the cost of trace() itself, as seen from a
+ * hot path such as VMEXIT handling.
+ */
+#define BENCH_RECORDS (1U << 22)
+
+static void benchmark(void)
+{
+    static const unsigned int words[] = { 0, 1, 3, 7 };
+    uint32_t d[TRACE_EXTRA_MAX] = { 0 };
+    unsigned int i, j;
+
+    printf("%6s %6s %14s %14s\n", "words", "tsc", "ns/record", "cycles/record");
+
+    for ( i = 0; i < ARRAY_SIZE(words) * 2; i++ )
+    {
+        unsigned int nr = words[i / 2];
+        uint32_t event = TEST_EVENT | (i & 1 ? TRC_HD_CYCLE_FLAG : 0);
+        uint64_t ns, cycles;
+
+        ns = now_ns();
+        cycles = get_cycles();
+        for ( j = 0; j < BENCH_RECORDS; j++ )
+        {
+            trace(event, nr * sizeof(uint32_t), d);
+            if ( !(j & 63) )
+                buf->cons = buf->prod;
+        }
+        cycles = get_cycles() - cycles;
+        ns = now_ns() - ns;
+
+        printf("%6u %6s %14.1f %14.1f\n", nr, i & 1 ? "yes" : "no",
+               (double)ns / BENCH_RECORDS, (double)cycles / BENCH_RECORDS);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct xen_sysctl_tbuf_op op = {
+        .cmd = XEN_SYSCTL_TBUFOP_set_size,
+        .size = TEST_PAGES,
+    };
+
+    assert(!tb_control(&op));
+    op.cmd = XEN_SYSCTL_TBUFOP_set_evt_mask;
+    op.evt_mask = TRC_ALL;
+    assert(!tb_control(&op));
+    map_buffer();
+
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+    {
+        benchmark();
+        return 0;
+    }
+
+    test_basic();
+    test_overflow();
+    test_nested();
+    test_nested_overflow();
+    test_disable();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,469 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * libxenvchan throughput and latency benchmark.
+ *
+ * The vchan I/O code is run between two local processes.  Grant sharing is
+ * mocked by a shared anonymous mapping set up the way libxenvchan_server_init()
+ * and libxenvchan_client_init() lay out the rings, and event channels by pipes.
+ *
+ * Throughput modes stream data from the server to the client using the copy
+ * API (libxenvchan_write()/libxenvchan_read()), the scatter/gather one, or
+ * the zero-copy one.  "pingpong" measures the round trip time of messages.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <libxenvchan.h>
+
+#include <xen-tools/common-macros.h>
+
+#define PAGE_SIZE 4096
+
+/* Mocked event channels: a notification is a byte written to a pipe. */
+struct xenevtchn_handle {
+    int rfd;
+    int wfd;
+};
+
+int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    char c = 0;
+
+    return write(xce->wfd, &c, 1) == 1 ? 0 : -1;
+}
+
+xenevtchn_port_or_error_t xenevtchn_pending(xenevtchn_handle *xce)
+{
+    char c;
+
+    return read(xce->rfd, &c, 1) == 1 ? 1 : -1;
+}
+
+int xenevtchn_unmask(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    return 0;
+}
+
+int xenevtchn_fd(xenevtchn_handle *xce)
+{
+    return xce->rfd;
+}
+
+int xenevtchn_close(xenevtchn_handle *xce)
+{
+    return 0;
+}
+
+/* Only referenced by libxenvchan_close(), which isn't used. */
+int xengntshr_unshare(xengntshr_handle *xgs, void *start_address,
+                      uint32_t count)
+{
+    return 0;
+}
+
+int xengnttab_unmap(xengnttab_handle *xgt, void *start_address,
+                    uint32_t count)
+{
+    return 0;
+}
+
+int xengntshr_close(xengntshr_handle *xgs)
+{
+    return 0;
+}
+
+int xengnttab_close(xengnttab_handle *xgt)
+{
+    return 0;
+}
+
+void close_xs_srv(struct libxenvchan *ctrl)
+{
+}
+
+enum mode { MODE_COPY, MODE_VEC, MODE_ZEROCOPY, MODE_PINGPONG };
+
+static const char *const mode_names[] = {
+    [MODE_COPY] = "copy",
+    [MODE_VEC] = "vec",
+    [MODE_ZEROCOPY] = "zerocopy",
+    [MODE_PINGPONG] = "pingpong",
+};
+
+static enum mode mode;
+static unsigned int order = 16;
+static size_t msg_size = 4096;
+static unsigned long long total = 1ULL << 30;
+static unsigned long iterations = 100000;
+static unsigned int spin_usec;
+static bool check;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m, --mode <mode>       copy, vec, zerocopy or pingpong [%s]\n"
+            "  -o, --order <n>         log2 of the ring size [%u]\n"
+            "  -s, --size <bytes>      message size [%zu]\n"
+            "  -t, --total <MiB>       data streamed [%llu]\n"
+            "  -n, --iterations <n>    pingpong round trips [%lu]\n"
+            "  -p, --spin <usec>       poll before sleeping [%u]\n"
+            "  -c, --check             check the data streamed\n",
+            prog, mode_names[mode], order, msg_size, total >> 20, iterations,
+            spin_usec);
+    exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Set up both ends of a vchan with server -> client ring "right" and
+ * client -> server ring "left", both of size 1 << order, in shared memory.
+ */
+static void setup(struct libxenvchan *srv, struct libxenvchan *cli)
+{
+    size_t ring_size = 1UL << order;
+    struct vchan_interface *intf;
+    void *left, *right;
+    int s2c[2], c2s[2];
+
+    intf = mmap(NULL, PAGE_SIZE + 2 * ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( intf == MAP_FAILED )
+        err(1, "mmap");
+    left = (void *)intf + PAGE_SIZE;
+    right = left + ring_size;
+
+    intf->left_order = intf->right_order = order;
+    intf->cli_live = intf->srv_live = 1;
+    intf->cli_notify = intf->srv_notify = VCHAN_NOTIFY_WRITE;
+
+    if ( pipe(s2c) || pipe(c2s) )
+        err(1, "pipe");
+
+    memset(srv, 0, sizeof(*srv));
+    srv->ring = intf;
+    srv->is_server = 1;
+    srv->blocking = 1;
+    srv->spin_usec = spin_usec;
+    srv->read.shr = &intf->left;
+    srv->read.buffer = left;
+    srv->read.order = order;
+    srv->write.shr = &intf->right;
+    srv->write.buffer = right;
+    srv->write.order = order;
+
+    memset(cli, 0, sizeof(*cli));
+    cli->ring = intf;
+    cli->blocking = 1;
+    cli->spin_usec = spin_usec;
+    cli->read.shr = &intf->right;
+    cli->read.buffer = right;
+    cli->read.order = order;
+    cli->write.shr = &intf->left;
+    cli->write.buffer = left;
+    cli->write.order = order;
+
+    srv->event = malloc(sizeof(*srv->event));
+    cli->event = malloc(sizeof(*cli->event));
+    if ( !srv->event || !cli->event )
+        err(1, "malloc");
+    srv->event->rfd = c2s[0];
+    srv->event->wfd = s2c[1];
+    cli->event->rfd = s2c[0];
+    cli->event->wfd = c2s[1];
+}
+
+static uint8_t pattern(unsigned long long off)
+{
+    return off * 7 + (off >> 12);
+}
+
+static void fill(uint8_t *p, size_t len, unsigned long long off)
+{
+    size_t i;
+
+    if ( !check )
+    {
+        memset(p, 0x5a, len);
+        return;
+    }
+
+    for ( i = 0; i < len; i++ )
+        p[i] = pattern(off + i);
+}
+
+/* Touch all data received, as a consumer would. */
+static uint64_t consume(const uint8_t *p, size_t len, unsigned long long off)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        if ( check && p[i] != pattern(off + i) )
+            errx(1, "data mismatch at offset %llu", off + i);
+        sum += p[i];
+    }
+
+    return sum;
+}
+
+static void send_stream(struct libxenvchan *ctrl)
+{
+    uint8_t *buf = malloc(msg_size);
+    unsigned long long off = 0;
+    struct iovec iov[4];
+    size_t len, part;
+    unsigned int i;
+    int ret;
+
+    if ( !buf )
+        err(1, "malloc");
+
+    for ( off = 0; off < total; off += len )
+    {
+        len = min_t(unsigned long long, msg_size, total - off);
+
+        switch ( mode )
+        {
+        case MODE_COPY:
+            fill(buf, len, off);
+            if ( libxenvchan_write(ctrl, buf, len) != len )
+                errx(1, "libxenvchan_write failed");
+            break;
+
+        case MODE_VEC:
+            fill(buf, len, off);
+            part = (len + ARRAY_SIZE(iov) - 1) / ARRAY_SIZE(iov);
+            for ( i = 0; i < ARRAY_SIZE(iov); i++ )
+            {
+                iov[i].iov_base = buf + min(i * part, len);
+                iov[i].iov_len = min(part, len - min(i * part, len));
+            }
+            if ( libxenvchan_writev(ctrl, iov, ARRAY_SIZE(iov)) != len )
+                errx(1, "libxenvchan_writev failed");
+            break;
+
+        case MODE_ZEROCOPY:
+            ret = libxenvchan_write_reserve(ctrl, len, iov);
+            if ( ret != len )
+                errx(1, "libxenvchan_write_reserve failed");
+            fill(iov[0].iov_base, iov[0].iov_len, off);
+            fill(iov[1].iov_base, iov[1].iov_len, off + iov[0].iov_len);
+            if ( libxenvchan_write_commit(ctrl, len) != len )
+                errx(1, "libxenvchan_write_commit failed");
+            break;
+
+        default:
+            abort();
+        }
+    }
+
+    free(buf);
+}
+
+static void receive_stream(struct libxenvchan *ctrl)
+{
+    uint8_t *buf = malloc(msg_size);
+    unsigned long long off;
+    struct iovec iov[2];
+    uint64_t sum = 0;
+    int ret;
+
+    if ( !buf )
+        err(1, "malloc");
+
+    for ( off = 0; off < total; off += ret )
+    {
+        switch ( mode )
+        {
+        case MODE_COPY:
+            ret = libxenvchan_read(ctrl, buf, msg_size);
+            if ( ret <= 0 )
+                errx(1, "libxenvchan_read failed");
+            sum += consume(buf, ret, off);
+            break;
+
+        case MODE_VEC:
+            iov[0].iov_base = buf;
+            iov[0].iov_len = msg_size / 2;
+            iov[1].iov_base = buf + msg_size / 2;
+            iov[1].iov_len = msg_size - msg_size / 2;
+            ret = libxenvchan_readv(ctrl, iov, ARRAY_SIZE(iov));
+            if ( ret <= 0 )
+                errx(1, "libxenvchan_readv failed");
+            sum += consume(buf, ret, off);
+            break;
+
+        case MODE_ZEROCOPY:
+            ret = libxenvchan_read_acquire(ctrl, msg_size, iov);
+            if ( ret <= 0 )
+                errx(1, "libxenvchan_read_acquire failed");
+            sum += consume(iov[0].iov_base, iov[0].iov_len, off);
+            sum += consume(iov[1].iov_base, iov[1].iov_len,
+                           off + iov[0].iov_len);
+            if ( libxenvchan_read_release(ctrl, ret) != ret )
+                errx(1, "libxenvchan_read_release failed");
+            break;
+
+        default:
+            abort();
+        }
+    }
+
+    /* Tell the sender we're done. */
+    if ( libxenvchan_send(ctrl, &sum, sizeof(sum)) != sizeof(sum) )
+        errx(1, "libxenvchan_send failed");
+
+    free(buf);
+}
+
+static void pingpong(struct libxenvchan *ctrl, bool server)
+{
+    uint8_t *buf = calloc(1, msg_size);
+    unsigned long i;
+
+    if ( !buf )
+        err(1, "calloc");
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        if ( server && libxenvchan_send(ctrl, buf, msg_size) != msg_size )
+            errx(1, "libxenvchan_send failed");
+        if ( libxenvchan_recv(ctrl, buf, msg_size) != msg_size )
+            errx(1, "libxenvchan_recv failed");
+        if ( !server && libxenvchan_send(ctrl, buf, msg_size) != msg_size )
+            errx(1, "libxenvchan_send failed");
+    }
+
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "mode", 1, NULL, 'm' },
+        { "order", 1, NULL, 'o' },
+        { "size", 1, NULL, 's' },
+        { "total", 1, NULL, 't' },
+        { "iterations", 1, NULL, 'n' },
+        { "spin", 1, NULL, 'p' },
+        { "check", 0, NULL, 'c' },
+        { "help", 0, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct libxenvchan srv, cli;
+    uint64_t ns, sum;
+    unsigned int i;
+    int c, status;
+    pid_t pid;
+
+    while ( (c = getopt_long(argc, argv, "m:o:s:t:n:p:ch", options,
+                             NULL)) != -1 )
+    {
+        switch ( c )
+        {
+        case 'm':
+            for ( i = 0; i < ARRAY_SIZE(mode_names); i++ )
+                if ( !strcmp(optarg, mode_names[i]) )
+                    break;
+            if ( i == ARRAY_SIZE(mode_names) )
+                usage(argv[0]);
+            mode = i;
+            break;
+        case 'o':
+            order = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            msg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            total = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            spin_usec = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            check = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc || order < 12 || order > 20 || !msg_size ||
+         msg_size > (1UL << order) || !total || !iterations )
+        usage(argv[0]);
+
+    setup(&srv, &cli);
+
+    pid = fork();
+    if ( pid < 0 )
+        err(1, "fork");
+    if ( !pid )
+    {
+        if ( mode == MODE_PINGPONG )
+            pingpong(&cli, false);
+        else
+            receive_stream(&cli);
+        exit(0);
+    }
+
+    ns = now_ns();
+    if ( mode == MODE_PINGPONG )
+        pingpong(&srv, true);
+    else
+    {
+        send_stream(&srv);
+        if ( libxenvchan_recv(&srv, &sum, sizeof(sum)) != sizeof(sum) )
+            errx(1, "libxenvchan_recv failed");
+    }
+    ns = now_ns() - ns;
+
+    if ( waitpid(pid, &status, 0) < 0 )
+        err(1, "waitpid");
+    if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+        errx(1, "client failed");
+
+    if ( mode == MODE_PINGPONG )
+        printf("%s %zu bytes, spin %u us: %.2f us/round trip\n",
+               mode_names[mode], msg_size, spin_usec,
+               (double)ns / iterations / 1000);
+    else
+        printf("%s %zu bytes, ring %u KiB, spin %u us: %.1f MB/s\n",
+               mode_names[mode], msg_size, 1U << (order - 10), spin_usec,
+               (double)total * 1000 / ns);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -16,6 +16,9 @@
  * License along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+#include <time.h>
+
 #include "emul.h"
 
 /* Single vcpu (current), and single domain with a single PCI device. */
@@ -175,6 +178,72 @@ void multiwrite4_check(unsigned int reg)
     multiread4_check(reg, val);
 }
 
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time config space accesses to a device with BENCH_REGS 4 byte registers
+ * spread evenly over the extended config space, the way long capability
+ * chains make it look, and some pass-through gaps in between.
+ */
+#define BENCH_REGS     256
+#define BENCH_ACCESSES (1U << 22)
+#define BENCH_STRIDE   (PCI_CFG_SPACE_EXP_SIZE / BENCH_REGS)
+
+static void benchmark(void)
+{
+    static uint32_t regs[BENCH_REGS];
+    static const struct {
+        const char *name;
+        bool write;
+        unsigned int first, nr, offset;
+    } tests[] = {
+        { "read first",       false, 0,              1,          0 },
+        { "read last",        false, BENCH_REGS - 1, 1,          0 },
+        { "read all",         false, 0,              BENCH_REGS, 0 },
+        { "read passthrough", false, 0,              BENCH_REGS, 8 },
+        { "write all",        true,  0,              BENCH_REGS, 0 },
+    };
+    volatile uint32_t sink;
+    unsigned int i, j, reg;
+    uint64_t ns;
+
+    VPCI_REMOVE_REG(0, PCI_CFG_SPACE_EXP_SIZE);
+    for ( i = 0; i < BENCH_REGS; i++ )
+    {
+        regs[i] = i;
+        VPCI_ADD_REG(vpci_read32, vpci_write32, i * BENCH_STRIDE, 4, regs[i]);
+    }
+
+    VPCI_READ_CHECK((BENCH_REGS - 1) * BENCH_STRIDE, 4, BENCH_REGS - 1);
+    VPCI_READ_CHECK(BENCH_STRIDE + 8, 4, 0xffffffffU);
+
+    printf("%-20s %12s\n", "access", "ns/access");
+
+    for ( i = 0; i < ARRAY_SIZE(tests); i++ )
+    {
+        ns = now_ns();
+        for ( j = 0; j < BENCH_ACCESSES; j++ )
+        {
+            reg = (tests[i].first + j % tests[i].nr) * BENCH_STRIDE +
+                  tests[i].offset;
+            if ( tests[i].write )
+                VPCI_WRITE(reg, 4, j);
+            else
+                VPCI_READ(reg, 4, sink);
+        }
+        ns = now_ns() - ns;
+
+        printf("%-20s %12.1f\n", tests[i].name, (double)ns / BENCH_ACCESSES);
+    }
+}
+
 int
 main(int argc, char **argv)
 {
@@ -405,6 +474,20 @@ main(int argc, char **argv)
 
     VPCI_REMOVE_INVALID_REG(20, 1);
 
+    /* Registers in the extended config space, and at its very end. */
+    VPCI_ADD_REG(vpci_read32, vpci_write32, 0x100, 4, r24);
+    VPCI_ADD_REG(vpci_read16, vpci_write16, 0xffe, 2, r12);
+    VPCI_WRITE_CHECK(0x100, 4, 0x12345678);
+    VPCI_WRITE_CHECK(0xffc, 4, 0xabcdffff);
+    assert(r12 == 0xabcd);
+    VPCI_READ_CHECK(0x104, 4, 0xffffffff);
+    VPCI_REMOVE_REG(0x100, 4);
+    VPCI_READ_CHECK(0x100, 4, 0xffffffff);
+    VPCI_READ_CHECK(0xffe, 2, 0xabcd);
+
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+        benchmark();
+
     return 0;
 }
 
@@ -52,6 +52,8 @@ static char *path;
 static char *paths[WRITE_BUFFERS_N];
 static char write_buffers[WRITE_BUFFERS_N][WRITE_BUFFERS_SIZE];
 static int ta_loops;
+static bool allocs;
+static unsigned long allocs_chunks_ovhd, allocs_mallocs_ovhd;
 
 static struct option options[] = {
     { "list-tests", 0, NULL, 'l' },
@@ -59,14 +61,54 @@ static struct option options[] = {
     { "random", 1, NULL, 'r' },
     { "help", 0, NULL, 'h' },
     { "iterations", 1, NULL, 'i' },
+    { "allocs", 0, NULL, 'a' },
     { NULL, 0, NULL, 0 }
 };
 
+/*
+ * Query the allocation counters of xenstored. The values include the
+ * allocations done for the query itself, see allocs_chunks_ovhd and
+ * allocs_mallocs_ovhd.
+ */
+static int get_allocs(unsigned long *chunks, unsigned long *mallocs)
+{
+    char *resp;
+    int ret = 0;
+
+    resp = xs_control_command(xsh, "allocstats", NULL, 0);
+    if ( !resp )
+        return errno;
+    if ( sscanf(resp, "chunks %lu mallocs %lu", chunks, mallocs) != 2 )
+        ret = EINVAL;
+    free(resp);
+
+    return ret;
+}
+
+static int init_allocs(void)
+{
+    unsigned long chunks1, mallocs1, chunks2, mallocs2;
+    int ret;
+
+    ret = get_allocs(&chunks1, &mallocs1);
+    if ( !ret )
+        ret = get_allocs(&chunks2, &mallocs2);
+    if ( ret )
+        return ret;
+
+    allocs_chunks_ovhd = chunks2 - chunks1;
+    allocs_mallocs_ovhd = mallocs2 - mallocs1;
+
+    return 0;
+}
+
 static int call_test(struct test *tst, int iters, bool no_clock)
 {
     char *stage = "?";
     struct timespec tp1, tp2;
     uint64_t nsec, nsec_min, nsec_max, nsec_sum;
+    unsigned long chunks1, mallocs1, chunks2, mallocs2;
+    unsigned long chunks_sum = 0, mallocs_sum = 0;
     int i, ret = 0;
 
     nsec_min = -1;
@@ -86,6 +128,9 @@ static int call_test(struct test *tst, int iters, bool no_clock)
         ret = tst->func_init(tst->par);
         if ( ret )
             break;
+        stage = "allocstats";
+        if ( allocs && (ret = get_allocs(&chunks1, &mallocs1)) )
+            break;
         if ( clock_gettime(CLOCK_REALTIME, &tp1) )
             no_clock = true;
         stage = "run";
@@ -94,6 +139,15 @@ static int call_test(struct test *tst, int iters, bool no_clock)
             break;
         if ( clock_gettime(CLOCK_REALTIME, &tp2) )
             no_clock = true;
+        stage = "allocstats";
+        if ( allocs )
+        {
+            ret = get_allocs(&chunks2, &mallocs2);
+            if ( ret )
+                break;
+            chunks_sum += chunks2 - chunks1 - allocs_chunks_ovhd;
+            mallocs_sum += mallocs2 - mallocs1 - allocs_mallocs_ovhd;
+        }
         if ( !no_clock )
         {
             nsec = tp2.tv_sec * 1000000000 + tp2.tv_nsec -
@@ -120,6 +174,9 @@ static int call_test(struct test *tst, int iters, bool no_clock)
                    nsec_sum / iters, nsec_min, nsec_max);
         else
             printf(" %"PRIu64" ns", nsec_sum);
+        if ( allocs )
+            printf(", allocs: %lu (%lu malloc)",
+                   chunks_sum / iters, mallocs_sum / iters);
         printf("\n");
     }
 
@@ -134,6 +191,7 @@ static void usage(int ret)
 
     fprintf(out, "usage: xs-test [<options>]\n");
     fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -a|--allocs          show xenstored allocations per test run\n");
     fprintf(out, "  -i|--iterations <i>  perform each test <i> times (default 1)\n");
     fprintf(out, "  -l|--list-tests      list available tests\n");
     fprintf(out, "  -r|--random <time>   perform random tests for <time> seconds\n");
@@ -199,6 +257,49 @@ static int test_write_deinit(uintptr_t par)
     return verify_node(paths[0], write_buffers[0], par);
 }
 
+static int test_write_watch_init(uintptr_t par)
+{
+    unsigned int i;
+    char *wpath;
+    bool ok;
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( asprintf(&wpath, "%s/w/%u", path, i) < 0 )
+            return ENOMEM;
+        ok = xs_watch(xsh, wpath, TEST_PATH);
+        free(wpath);
+        if ( !ok )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int test_write_watch(uintptr_t par)
+{
+    return xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ? 0 : errno;
+}
+
+static int test_write_watch_deinit(uintptr_t par)
+{
+    unsigned int i;
+    char *wpath;
+    bool ok;
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( asprintf(&wpath, "%s/w/%u", path, i) < 0 )
+            return ENOMEM;
+        ok = xs_unwatch(xsh, wpath, TEST_PATH);
+        free(wpath);
+        if ( !ok )
+            return errno;
+    }
+
+    return verify_node(paths[0], write_buffers[0], 1);
+}
+
 static int test_dir_init(uintptr_t par)
 {
     unsigned int i;
@@ -247,6 +348,58 @@ static int test_dir_deinit(uintptr_t par)
     return rc;
 }
 
+#define test_multi_init test_dir_init
+
+static const enum xsd_sockmsg_type multi_types[] = {
+    XS_READ, XS_WRITE, XS_GET_PERMS,
+};
+
+static int test_multi(uintptr_t par)
+{
+    struct xs_multi_op ops[WRITE_BUFFERS_N];
+    unsigned int i;
+    int ret = 0;
+
+    for ( i = 0; i < WRITE_BUFFERS_N; i++ )
+    {
+        ops[i].type = multi_types[par];
+        ops[i].path = paths[i];
+        ops[i].data = write_buffers[i];
+        ops[i].len = 2;
+    }
+
+    if ( !xs_multi(xsh, XBT_NULL, ops, WRITE_BUFFERS_N) )
+        return errno;
+
+    for ( i = 0; i < WRITE_BUFFERS_N; i++ )
+    {
+        if ( ops[i].err && !ret )
+            ret = ops[i].err;
+        /* Every node has an owner */
+        if ( !ret && ops[i].type == XS_GET_PERMS && !ops[i].num )
+            ret = ENOENT;
+        free(ops[i].value);
+    }
+
+    return ret;
+}
+
+static int test_multi_deinit(uintptr_t par)
+{
+    unsigned int i;
+    int ret;
+
+    for ( i = 0; i < WRITE_BUFFERS_N; i++ )
+    {
+        ret = verify_node(paths[i], write_buffers[i],
+                          multi_types[par] == XS_WRITE ? 2 : 1);
+        if ( ret )
+            return ret;
+    }
+
+    return 0;
+}
+
 static int test_rm_init(uintptr_t par)
 {
     unsigned int i;
@@ -405,13 +558,94 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+#define test_ta4_init ret0
+
+/* Create par nodes, reading each one first, in a single transaction. */
+static int test_ta4(uintptr_t par)
+{
+    xs_transaction_t t;
+    char *buf, *tpath;
+    unsigned int i, len;
+    int ret;
+    int l;
+
+    for ( l = 0; l < MAX_TA_LOOPS; l++ )
+    {
+        t = xs_transaction_start(xsh);
+        if ( t == XBT_NULL )
+            return errno;
+        for ( i = 0; i < par; i++ )
+        {
+            if ( asprintf(&tpath, "%s/t/%u", path, i) < 0 )
+            {
+                errno = ENOMEM;
+                goto out;
+            }
+            buf = xs_read(xsh, t, tpath, &len);
+            free(buf);
+            if ( buf || errno != ENOENT ||
+                 !xs_write(xsh, t, tpath, write_buffers[i % WRITE_BUFFERS_N],
+                           1) )
+            {
+                errno = buf ? EEXIST : errno;
+                free(tpath);
+                goto out;
+            }
+            free(tpath);
+        }
+        if ( xs_transaction_end(xsh, t, false) )
+            return 0;
+        if ( errno != EAGAIN )
+            return errno;
+    }
+
+    ta_loops++;
+    return 0;
+
+ out:
+    ret = errno;
+    xs_transaction_end(xsh, t, true);
+    return ret;
+}
+
+static int test_ta4_deinit(uintptr_t par)
+{
+    char **dir, *tpath;
+    unsigned int num;
+    int ret;
+
+    if ( asprintf(&tpath, "%s/t", path) < 0 )
+        return ENOMEM;
+    dir = xs_directory(xsh, XBT_NULL, tpath, &num);
+    free(tpath);
+    if ( !dir )
+        return errno;
+    free(dir);
+    if ( num != par )
+        return ENOENT;
+
+    if ( asprintf(&tpath, "%s/t/%u", path, (unsigned int)par - 1) < 0 )
+        return ENOMEM;
+    ret = verify_node(tpath, write_buffers[(par - 1) % WRITE_BUFFERS_N], 1);
+    free(tpath);
+
+    return ret;
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
 TEST("read 2000", test_read, 2000, "Read node with 2000 bytes data"),
 TEST("write 1", test_write, 1, "Write node with 1 byte data"),
 TEST("write 2000", test_write, 2000, "Write node with 2000 bytes data"),
+TEST("write w100", test_write_watch, 100, "Write node with 100 other watches"),
+TEST("write w10k", test_write_watch, 10000,
+     "Write node with 10000 other watches"),
 TEST("dir", test_dir, 0, "List directory"),
+TEST("multi read", test_multi, 0, "Read 10 nodes with one request"),
+TEST("multi write", test_multi, 1, "Write 10 nodes with one request"),
+TEST("multi perms", test_multi, 2,
+     "Get permissions of 10 nodes with one request"),
 TEST("rm node", test_rm, 0, "Remove single node"),
 TEST("rm dir", test_rm, WRITE_BUFFERS_N, "Remove node with sub-nodes"),
 TEST("ta empty", test_ta1, 0, "Empty transaction"),
@@ -419,6 +653,8 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("ta 1k", test_ta4, 1000, "Transaction creating 1000 nodes"),
+TEST("ta 10k", test_ta4, 10000, "Transaction creating 10000 nodes"),
 };
 
 static void cleanup(void)
@@ -452,11 +688,14 @@ int main(int argc, char *argv[])
     bool list = false;
     time_t stop;
 
-    while ( (opt = getopt_long(argc, argv, "lr:t:hi:", options,
+    while ( (opt = getopt_long(argc, argv, "alr:t:hi:", options,
                                NULL)) != -1 )
     {
         switch ( opt )
         {
+        case 'a':
+            allocs = true;
+            break;
         case 'i':
             iters = atoi(optarg);
             break;
@@ -501,6 +740,12 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
+    if ( allocs && init_allocs() )
+    {
+        fprintf(stderr, "could not get xenstored allocation statistics\n");
+        exit(2);
+    }
+
     if ( randtime )
     {
         stop = time(NULL) + randtime;
@@ -60,6 +60,38 @@ int write_page(int fd, void *page, int i)
     return file_op(fd, page, i, &my_write);
 }
 
+/*
+ * Write nr pages, which follow each other in memory, to the given slots.
+ * Each run of consecutive slots is written with a single call.
+ */
+int write_pages(int fd, void *pages, const int *slots, int nr)
+{
+    int i, n;
+
+    for ( i = 0; i < nr; i += n )
+    {
+        char *buf = (char *)pages + ((size_t)i << XC_PAGE_SHIFT);
+        off_t offset = (off_t)slots[i] << XC_PAGE_SHIFT;
+        size_t len, total = 0;
+        ssize_t bytes;
+
+        for ( n = 1; i + n < nr && slots[i + n] == slots[i] + n; n++ )
+            ;
+        len = (size_t)n << XC_PAGE_SHIFT;
+
+        while ( total < len )
+        {
+            bytes = pwrite(fd, buf + total, len - total, offset + total);
+            if ( bytes <= 0 )
+                return -1;
+
+            total += bytes;
+        }
+    }
+
+    return 0;
+}
+
 
 /*
  * Local variables:
@@ -0,0 +1,94 @@
+/******************************************************************************
+ *
+ * Xen domain paging policy selection.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+
+#include "policy.h"
+
+
+static const struct xenpaging_policy *const policies[] = {
+    &policy_default,
+    &policy_clock,
+};
+
+static const struct xenpaging_policy *policy;
+
+
+int policy_init(struct xenpaging *paging)
+{
+    const char *name = paging->policy_name ?: policies[0]->name;
+    unsigned int i;
+
+    for ( i = 0; i < sizeof(policies) / sizeof(policies[0]); i++ )
+    {
+        if ( strcmp(policies[i]->name, name) )
+            continue;
+
+        policy = policies[i];
+        DPRINTF("using paging policy %s\n", name);
+
+        return policy->init(paging);
+    }
+
+    ERROR("Unknown paging policy %s", name);
+    errno = EINVAL;
+
+    return -EINVAL;
+}
+
+void policy_teardown(struct xenpaging *paging)
+{
+    if ( policy && policy->teardown )
+        policy->teardown(paging);
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    return policy->choose_victim(paging);
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    policy->notify_paged_out(gfn);
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    policy->notify_paged_in(gfn);
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    policy->notify_paged_in_nomru(gfn);
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    policy->notify_dropped(gfn);
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -27,7 +27,23 @@
 #include "xenpaging.h"
 
 
+struct xenpaging_policy {
+    const char *name;
+    int (*init)(struct xenpaging *paging);
+    void (*teardown)(struct xenpaging *paging);
+    unsigned long (*choose_victim)(struct xenpaging *paging);
+    void (*notify_paged_out)(unsigned long gfn);
+    void (*notify_paged_in)(unsigned long gfn);
+    void (*notify_paged_in_nomru)(unsigned long gfn);
+    void (*notify_dropped)(unsigned long gfn);
+};
+
+extern const struct xenpaging_policy policy_default;
+extern const struct xenpaging_policy policy_clock;
+
+/* Selects the policy named by paging->policy_name, "default" if none. */
 int policy_init(struct xenpaging *paging);
+void policy_teardown(struct xenpaging *paging);
 unsigned long policy_choose_victim(struct xenpaging *paging);
 void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
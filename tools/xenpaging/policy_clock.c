@@ -0,0 +1,266 @@
+/******************************************************************************
+ *
+ * Xen domain paging clock (second chance) policy.
+ *
+ * The gfns form a circle swept by a clock hand.  Each gfn has a referenced
+ * bit, set when the gfn gets paged back in and, if the domain's dirty log
+ * may be used, when the guest writes to it.  The hand clears the
+ * bit of the referenced gfns it passes and picks the first unreferenced one,
+ * so the pages in use are the last ones to be paged out.
+ *
+ * The dirty log is sampled at most every SAMPLE_INTERVAL_MS, and the number
+ * of gfns written since the previous sample is the estimate of the guest's
+ * working set.  Reads are not seen, so it is a lower bound.
+ *
+ * Log-dirty mode is a single per-domain state.  Migration and the device
+ * model's VRAM tracking rely on it too, and the hypervisor can't tell the
+ * users apart: turning it off or cleaning the log behind their back loses
+ * dirty pages.  So the dirty log is only used when asked for with
+ * --logdirty, and only if log-dirty mode was off until this policy turned
+ * it on.  VRAM tracking can't be detected from here, it is up to the
+ * administrator not to ask for the dirty log of such guests.  Once the log
+ * can't be sampled any more, the policy falls back to page-ins only,
+ * without touching log-dirty mode again unless it still owns it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "policy.h"
+
+
+#define SAMPLE_INTERVAL_MS 1000
+
+
+static unsigned char *paged_out;
+static unsigned char *referenced;
+static unsigned char *unconsumed;
+static unsigned int unconsumed_cleared;
+static unsigned long hand;
+static unsigned long max_pages;
+
+static xc_hypercall_buffer_t dirty_hbuf;
+static unsigned int dirty_nr_pages;
+static bool logdirty;
+static uint64_t last_sample;
+
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Stop sampling, and turn log-dirty mode off if owned. */
+static void clock_logdirty_off(struct xenpaging *paging, bool owned)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned char, dirty, &dirty_hbuf);
+
+    if ( logdirty && owned )
+        xc_shadow_control(xch, paging->vm_event.domain_id,
+                          XEN_DOMCTL_SHADOW_OP_OFF, NULL, 0);
+    logdirty = false;
+
+    /* Called again on teardown after a failure */
+    if ( dirty )
+        xc_hypercall_buffer_free_pages(xch, dirty, dirty_nr_pages);
+    dirty_hbuf.hbuf = NULL;
+    dirty_nr_pages = 0;
+}
+
+static int clock_init(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned char, dirty, &dirty_hbuf);
+
+    max_pages = paging->max_pages;
+
+    paged_out = bitmap_alloc(max_pages);
+    referenced = bitmap_alloc(max_pages);
+    unconsumed = bitmap_alloc(max_pages);
+    if ( !paged_out || !referenced || !unconsumed )
+        return -ENOMEM;
+
+    /* Don't page out page 0 */
+    set_bit(0, paged_out);
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    hand = max_pages / 2;
+
+    if ( !paging->use_logdirty )
+        return 0;
+
+    /* Enabling fails if someone else has log-dirty mode on already */
+    dirty_nr_pages = (bitmap_size(max_pages) + XC_PAGE_SIZE - 1) >>
+                     XC_PAGE_SHIFT;
+    dirty = xc_hypercall_buffer_alloc_pages(xch, dirty, dirty_nr_pages);
+    if ( dirty &&
+         xc_shadow_control(xch, paging->vm_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                           NULL, 0) == 0 )
+        logdirty = true;
+    else
+    {
+        ERROR("dirty log not available (%d = %s), sampling page-ins only",
+              errno, strerror(errno));
+        clock_logdirty_off(paging, false);
+    }
+
+    return 0;
+}
+
+static void clock_teardown(struct xenpaging *paging)
+{
+    clock_logdirty_off(paging, true);
+
+    free(paged_out);
+    free(referenced);
+    free(unconsumed);
+}
+
+/* Mark the gfns written since the last sample as referenced. */
+static void clock_sample(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned char, dirty, &dirty_hbuf);
+    uint64_t now = now_ms();
+    unsigned long i, nr = 0;
+
+    if ( !logdirty || now - last_sample < SAMPLE_INTERVAL_MS )
+        return;
+
+    if ( xc_logdirty_control(xch, paging->vm_event.domain_id,
+                             XEN_DOMCTL_SHADOW_OP_CLEAN, &dirty_hbuf,
+                             max_pages, 0, NULL) < 0 )
+    {
+        /* Someone else may have turned log-dirty mode off and on again */
+        PERROR("Failed to sample the dirty log, sampling page-ins only");
+        clock_logdirty_off(paging, false);
+        return;
+    }
+
+    for ( i = 0; i < bitmap_size(max_pages); i++ )
+    {
+        referenced[i] |= dirty[i];
+        nr += __builtin_popcount(dirty[i]);
+    }
+
+    if ( last_sample && paging->working_set != nr )
+        DPRINTF("working set: %lu pages written in %"PRIu64" ms\n",
+                nr, now - last_sample);
+
+    paging->working_set = nr;
+    last_sample = now;
+}
+
+static unsigned long clock_choose_victim(struct xenpaging *paging)
+{
+    unsigned long i;
+
+    clock_sample(paging);
+
+    /* The first revolution may do nothing but clear referenced bits. */
+    for ( i = 0; i < 2 * max_pages; i++ )
+    {
+        /* Restart on wrap */
+        if ( ++hand >= max_pages )
+            hand = 0;
+
+        /* All gfns busy */
+        if ( (hand & 7) == 0 &&
+             (paged_out[hand / 8] | unconsumed[hand / 8]) == 0xff )
+        {
+            hand += 7;
+            i += 7;
+            continue;
+        }
+
+        /* gfn busy, or already tested */
+        if ( test_bit(hand, paged_out) || test_bit(hand, unconsumed) )
+            continue;
+
+        /* gfn in use, give it a second chance */
+        if ( test_and_clear_bit(hand, referenced) )
+            continue;
+
+        set_bit(hand, unconsumed);
+        return hand;
+    }
+
+    /* Could not nominate any gfn, wait in poll */
+    paging->use_poll_timeout = 1;
+    /* Force retry of unconsumed gfns every few seconds */
+    if ( ++unconsumed_cleared > 123 )
+    {
+        bitmap_clear(unconsumed, max_pages);
+        unconsumed_cleared = 0;
+        DPRINTF("clearing unconsumed, hand %lx", hand);
+    }
+
+    return INVALID_MFN;
+}
+
+static void clock_notify_paged_out(unsigned long gfn)
+{
+    set_bit(gfn, paged_out);
+    clear_bit(gfn, unconsumed);
+    clear_bit(gfn, referenced);
+}
+
+static void clock_notify_paged_in(unsigned long gfn)
+{
+    clear_bit(gfn, paged_out);
+    /* It was needed, so keep it for at least a revolution. */
+    set_bit(gfn, referenced);
+}
+
+static void clock_notify_paged_in_nomru(unsigned long gfn)
+{
+    clear_bit(gfn, paged_out);
+}
+
+static void clock_notify_dropped(unsigned long gfn)
+{
+    clear_bit(gfn, paged_out);
+}
+
+const struct xenpaging_policy policy_clock = {
+    .name                  = "clock",
+    .init                  = clock_init,
+    .teardown              = clock_teardown,
+    .choose_victim         = clock_choose_victim,
+    .notify_paged_out      = clock_notify_paged_out,
+    .notify_paged_in       = clock_notify_paged_in,
+    .notify_paged_in_nomru = clock_notify_paged_in_nomru,
+    .notify_dropped        = clock_notify_dropped,
+};
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -208,6 +208,9 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -p <name>      --policy=<name>          paging policy to use: default or clock.\n");
+    printf(" -l             --logdirty               let the clock policy track writes with the dirty log.\n");
+    printf("                                         The guest can't be migrated, and must not use VRAM tracking.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -215,13 +218,15 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:p:l";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"policy", 1, NULL, 'p'},
+        {"logdirty", 0, NULL, 'l'},
         { }
     };
 
@@ -242,6 +247,13 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 'p':
+            free(paging->policy_name);
+            paging->policy_name = strdup(optarg);
+            break;
+        case 'l':
+            paging->use_logdirty = 1;
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -507,6 +519,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         free(paging->slot_to_gfn);
         free(paging->gfn_to_slot);
         free(paging->bitmap);
+        free(paging->policy_name);
         free(paging);
     }
 
@@ -521,6 +534,9 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xs_unwatch(paging->xs_handle, watch_target_tot_pages, "");
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
+    /* Release policy state, this may still need the Xen connection */
+    policy_teardown(paging);
+
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
     munmap(paging->vm_event.ring_page, XC_PAGE_SIZE);
@@ -589,82 +605,101 @@ static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Evict a batch of gfns and write them to the given slots
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of evicted gfns otherwise, the gfns which can not be
+ * evicted are set to INVALID_MFN
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int xenpaging_evict_pages(struct xenpaging *paging, unsigned long *gfns,
+                                 const int *slots, int nr)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
-    struct xen_domctl domctl;
+    void *pages;
+    xen_pfn_t victims[XENPAGING_EVICT_BATCH];
+    int victim_slots[XENPAGING_EVICT_BATCH];
+    int i, ret, n = 0, num = 0;
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Nominate pages */
+    for ( i = 0; i < nr; i++ )
     {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
+        ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfns[i]);
+        if ( ret < 0 )
+        {
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error nominating page %lx", gfns[i]);
+                return -1;
+            }
+            gfns[i] = INVALID_MFN;
+            continue;
+        }
+        victims[n] = gfns[i];
+        victim_slots[n] = slots[i];
+        n++;
     }
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    if ( n == 0 )
+        return 0;
+
+    /* Map all nominated pages at once */
+    pages = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ,
+                                 victims, n);
+    if ( pages == NULL )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        PERROR("Error mapping %d pages", n);
+        return -1;
     }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
+    /* Copy pages, the data must be in the file before Xen drops them */
+    ret = write_pages(paging->fd, pages, victim_slots, n);
+
+    /* Release pages */
+    munmap(pages, n * XC_PAGE_SIZE);
+
     if ( ret < 0 )
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, XC_PAGE_SIZE);
-        ret = -1;
-        goto out;
+        PERROR("Error copying %d pages", n);
+        return -1;
     }
 
-    /* Release page */
-    munmap(page, XC_PAGE_SIZE);
-
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Tell Xen to evict pages */
+    for ( i = 0; i < nr; i++ )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
+        if ( gfns[i] == INVALID_MFN )
+            continue;
+
+        ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfns[i]);
+        if ( ret < 0 )
         {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
-    }
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error evicting page %lx", gfns[i]);
+                return -1;
+            }
+            DPRINTF("Nominated page %lx busy", gfns[i]);
+            gfns[i] = INVALID_MFN;
+            continue;
+        }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfns[i], slots[i]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfns[i]);
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+        /* Update index */
+        paging->slot_to_gfn[slots[i]] = gfns[i];
+        paging->gfn_to_slot[gfns[i]] = slots[i];
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+        num++;
 
-    ret = 0;
+        if ( test_and_set_bit(gfns[i], paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfns[i]);
+    }
 
- out:
-    return ret;
+    return num;
 }
 
 static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
@@ -754,60 +789,29 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
- * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
+/* Pick a free slot in the paging file
+ * Returns < 0 if all slots are allocated
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int get_free_slot(struct xenpaging *paging, int *scan)
 {
-    xc_interface *xch = paging->xc_handle;
-    unsigned long gfn;
-    static int num_paged_out;
-    int ret;
+    /* Reuse known free slots */
+    if ( paging->stack_count > 0 )
+        return paging->free_slot_stack[--paging->stack_count];
 
-    do
+    /* Scan all slots for remainders */
+    for ( ; *scan < paging->max_pages; (*scan)++ )
     {
-        gfn = policy_choose_victim(paging);
-        if ( gfn == INVALID_MFN )
-        {
-            /* If the number did not change after last flush command then
-             * the command did not reach qemu yet, or qemu still processes
-             * the command, or qemu has nothing to release.
-             * Right now there is no need to issue the command again.
-             */
-            if ( num_paged_out != paging->num_paged_out )
-            {
-                DPRINTF("Flushing qemu cache\n");
-                xenpaging_mem_paging_flush_ioemu_cache(paging);
-                num_paged_out = paging->num_paged_out;
-            }
-            ret = ENOSPC;
-            goto out;
-        }
-
-        if ( interrupted )
-        {
-            ret = EINTR;
-            goto out;
-        }
+        /* Slot is allocated */
+        if ( paging->slot_to_gfn[*scan] )
+            continue;
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
+        return (*scan)++;
     }
-    while ( ret );
 
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
-
- out:
-    return ret;
+    return -1;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
+/* Evict pages in batches and write them to free slots in the paging file
  * Returns < 0 on fatal error
  * Returns 0 if no gfn can be evicted
  * Returns > 0 on successful evict
@@ -815,37 +819,71 @@ static int evict_victim(struct xenpaging *paging, int slot)
 static int evict_pages(struct xenpaging *paging, int num_pages)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    unsigned long gfns[XENPAGING_EVICT_BATCH];
+    int slots[XENPAGING_EVICT_BATCH];
+    static int num_paged_out;
+    int i, n, rc = 0, scan = 0, num = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    while ( !rc && num < num_pages )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        /* Pair up victims with free slots */
+        for ( n = 0; n < XENPAGING_EVICT_BATCH && num + n < num_pages; n++ )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            if ( interrupted )
+            {
+                rc = EINTR;
+                break;
+            }
+
+            slots[n] = get_free_slot(paging, &scan);
+            if ( slots[n] < 0 )
+            {
+                rc = ENOSPC;
+                break;
+            }
+
+            gfns[n] = policy_choose_victim(paging);
+            if ( gfns[n] == INVALID_MFN )
+            {
+                /* If the number did not change after last flush command then
+                 * the command did not reach qemu yet, or qemu still processes
+                 * the command, or qemu has nothing to release.
+                 * Right now there is no need to issue the command again.
+                 */
+                if ( num_paged_out != paging->num_paged_out )
+                {
+                    DPRINTF("Flushing qemu cache\n");
+                    xenpaging_mem_paging_flush_ioemu_cache(paging);
+                    num_paged_out = paging->num_paged_out;
+                }
+                paging->free_slot_stack[paging->stack_count++] = slots[n];
+                rc = ENOSPC;
+                break;
+            }
+
+            /* Reserve the slot, so the scan does not pick it again */
+            paging->slot_to_gfn[slots[n]] = gfns[n];
         }
-        num++;
-    }
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
-    {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        if ( n == 0 )
+            break;
+
+        i = xenpaging_evict_pages(paging, gfns, slots, n);
+        if ( i < 0 )
+            return -1;
+        num += i;
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        /* Release the slots of gfns which could not be evicted */
+        for ( i = 0; i < n; i++ )
         {
-            num = rc < 0 ? -1 : num;
-            break;
-        }
+            if ( gfns[i] != INVALID_MFN )
+                continue;
 
-        num++;
+            paging->slot_to_gfn[slots[i]] = 0;
+            paging->free_slot_stack[paging->stack_count++] = slots[i];
+        }
     }
+
     return num;
 }
 
@@ -1028,13 +1066,16 @@ int main(int argc, char *argv[])
             if ( num != prev_num )
             {
                 DPRINTF("Need to evict %d pages to reach %d target_tot_pages\n", num, paging->target_tot_pages);
+                if ( paging->target_tot_pages < paging->working_set )
+                    ERROR("target_tot_pages %d is below the working set of %lu pages, expect page-in storms",
+                          paging->target_tot_pages, paging->working_set);
                 prev_num = num;
             }
             /* Limit the number of evicts to be able to process page-in requests */
-            if ( num > 42 )
+            if ( num > XENPAGING_EVICT_BATCH )
             {
                 paging->use_poll_timeout = 0;
-                num = 42;
+                num = XENPAGING_EVICT_BATCH;
             }
             if ( evict_pages(paging, num) < 0 )
                 goto out;
@@ -38,6 +38,7 @@
 #include <xen/vm_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+#define XENPAGING_EVICT_BATCH 64
 
 struct vm_event {
     domid_t domain_id;
@@ -67,6 +68,11 @@ struct xenpaging {
     int num_paged_out;
     int target_tot_pages;
     int policy_mru_size;
+    char *policy_name;
+    /* The policy may use the domain's dirty log */
+    int use_logdirty;
+    /* Pages the guest is estimated to use, 0 if unknown */
+    unsigned long working_set;
     int use_poll_timeout;
     int debug;
     int stack_count;
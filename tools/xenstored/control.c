@@ -262,6 +262,24 @@ static int do_control_memreport(const void *ctx, struct connection *conn,
 	return 0;
 }
 
+static int do_control_allocstats(const void *ctx, struct connection *conn,
+				 const char **vec, int num)
+{
+	unsigned long chunks, mallocs;
+	char *resp;
+
+	if (num)
+		return EINVAL;
+
+	talloc_alloc_stats(&chunks, &mallocs);
+	resp = talloc_asprintf(ctx, "chunks %lu mallocs %lu", chunks, mallocs);
+	if (!resp)
+		return ENOMEM;
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp) + 1);
+	return 0;
+}
+
 static int do_control_print(const void *ctx, struct connection *conn,
 			    const char **vec, int num)
 {
@@ -278,6 +296,7 @@ static int do_control_help(const void *, struct connection *, const char **,
 			   int);
 
 static struct cmd_s cmds[] = {
+	{ "allocstats", do_control_allocstats, "" },
 	{ "check", do_control_check, "" },
 	{ "log", do_control_log, "[on|off|+<switch>|-<switch>]" },
 
@@ -49,16 +49,14 @@
 #include "control.h"
 #include "lu.h"
 
-static int xce_pollfd_idx = -1;
-struct pollfd *poll_fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
 static unsigned int delayed_requests;
 
 int orig_argc;
 char **orig_argv;
 
 LIST_HEAD(connections);
+/* Connections which might need attention in the next main loop pass. */
+static LIST_HEAD(active_conns);
 int tracefd = -1;
 bool keep_orphans = false;
 const char *tracefile = NULL;
@@ -417,6 +415,7 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		talloc_free(conn->fd_event);
 		close(conn->fd);
 	}
 
@@ -428,6 +427,7 @@ static int destroy_conn(void *_conn)
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->active_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
@@ -455,82 +455,95 @@ static bool conn_can_write(struct connection *conn)
 	return !conn->is_ignored && conn->funcs->can_write(conn);
 }
 
-/* This function returns index inside the array if succeed, -1 if fail */
-int set_fd(int fd, short events)
+void conn_mark_active(struct connection *conn)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 1U << 8);
+	if (list_empty(&conn->active_list))
+		list_add_tail(&conn->active_list, &active_conns);
+}
 
-		new_fds = realloc(poll_fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		poll_fds = new_fds;
+static void conn_fd_event(void *data, short revents)
+{
+	struct connection *conn = data;
 
-		memset(&poll_fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
+	conn->revents |= revents;
+	conn_mark_active(conn);
+}
 
-	poll_fds[nr_fds].fd = fd;
-	poll_fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
+bool conn_add_fd_event(struct connection *conn)
+{
+	conn->fd_event = fd_event_add(conn, conn->fd, POLLIN|POLLPRI,
+				      conn_fd_event, conn);
 
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
+	return conn->fd_event;
 }
 
-static void initialize_fds(int *ptimeout)
+static void xce_fd_event(void *data, short revents)
 {
-	struct connection *conn;
-	uint64_t msecs;
+	if (revents & ~POLLIN)
+		barf_perror("xce_handle poll failed");
+	else if (revents & POLLIN)
+		handle_event();
+}
 
-	if (poll_fds)
-		memset(poll_fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
+static void initialize_fds(void)
+{
+	set_special_fds();
 
-	/* In case of delayed requests pause for max 1 second. */
-	*ptimeout = delayed_requests ? 1000 : -1;
+	if (xce_handle != NULL &&
+	    !fd_event_add(NULL, xenevtchn_fd(xce_handle), POLLIN|POLLPRI,
+			  xce_fd_event, NULL))
+		barf("Failed to watch event channel fd");
+}
 
-	set_special_fds();
+/*
+ * Find the poll timeout and drop all connections from the active list
+ * which have nothing to do until they get an event from outside.
+ */
+static int prepare_active_conns(void)
+{
+	struct connection *conn, *tmp;
+	uint64_t msecs;
+	int timeout;
+	bool busy;
 
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
+	/* In case of delayed requests pause for max 1 second. */
+	timeout = delayed_requests ? 1000 : -1;
 
 	msecs = get_now_msec();
 	wrl_log_periodic(msecs);
 
-	list_for_each_entry(conn, &connections, list) {
+	list_for_each_entry_safe(conn, tmp, &active_conns, active_list) {
 		if (conn->domain) {
-			wrl_check_timeout(conn->domain, msecs, ptimeout);
-			check_event_timeout(conn, msecs, ptimeout);
+			wrl_check_timeout(conn->domain, msecs, &timeout);
+			check_event_timeout(conn, msecs, &timeout);
 			if (conn_can_read(conn) ||
 			    (conn_can_write(conn) &&
 			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
+				timeout = 0;
+			busy = !conn->is_ignored &&
+			       (domain_has_input(conn) ||
+				!list_empty(&conn->out_list) ||
+				conn->is_stalled);
 		} else {
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
+			fd_event_set(conn->fd_event, events);
 			/*
 			 * For stalled connection, we want to process the
 			 * pending command as soon as live-update has aborted.
 			 */
 			if (conn->is_stalled && !lu_is_pending())
-				*ptimeout = 0;
+				timeout = 0;
+			busy = conn->is_stalled ||
+			       !list_empty(&conn->out_list);
 		}
+
+		if (!busy)
+			list_del_init(&conn->active_list);
 	}
+
+	return timeout;
 }
 
 static size_t calc_node_acc_size(const struct node_hdr *hdr)
@@ -688,22 +701,20 @@ static struct node *read_node_alloc(struct connection *conn, const void *ctx,
 				    const char *name,
 				    const struct node_hdr **hdr)
 {
-	size_t size;
+	size_t size, name_len = strlen(name) + 1;
 	struct node *node;
 	const char *db_name;
 	int err;
 
-	node = talloc(ctx, struct node);
+	/* Allocate the name together with the node to save a talloc chunk. */
+	node = talloc_size(ctx, sizeof(*node) + name_len);
 	if (!node) {
 		errno = ENOMEM;
 		return NULL;
 	}
+	talloc_set_name_const(node, "struct node");
 
-	node->name = talloc_strdup(node, name);
-	if (!node->name) {
-		errno = ENOMEM;
-		goto error;
-	}
+	node->name = memcpy(node + 1, name, name_len);
 
 	db_name = transaction_prepend(conn, name);
 	*hdr = db_fetch(db_name, &size);
@@ -1055,6 +1066,48 @@ unsigned int get_strings(struct buffered_data *data,
 	return i;
 }
 
+/*
+ * Results of the sub-requests of a MULTI request, each consisting of a
+ * struct xsd_sockmsg header and the payload of the result.
+ */
+struct multi_reply {
+	char buf[XENSTORE_PAYLOAD_MAX];
+	unsigned int len;	/* Used space in buf. */
+	unsigned int nr;	/* Number of results in buf. */
+	bool full;		/* Last result didn't fit into buf. */
+};
+
+/* Space needed for any "OK" or error result of a MULTI sub-request. */
+#define MULTI_RESULT_MIN	(sizeof(struct xsd_sockmsg) + 16)
+
+static void send_error(struct connection *conn, int error);
+
+static void multi_add_result(struct connection *conn,
+			     enum xsd_sockmsg_type type,
+			     const void *data, unsigned int len)
+{
+	struct multi_reply *multi = conn->multi;
+	struct xsd_sockmsg hdr = { .type = type, .len = len };
+
+	if (sizeof(hdr) + len > sizeof(multi->buf) - multi->len) {
+		/*
+		 * Only results of read-only sub-requests can be that large, so
+		 * the client can just repeat the sub-request. If it is the
+		 * first one it won't fit in any case, though.
+		 */
+		if (!multi->nr)
+			send_error(conn, E2BIG);
+		else
+			multi->full = true;
+		return;
+	}
+
+	memcpy(multi->buf + multi->len, &hdr, sizeof(hdr));
+	memcpy(multi->buf + multi->len + sizeof(hdr), data, len);
+	multi->len += sizeof(hdr) + len;
+	multi->nr++;
+}
+
 static void send_error(struct connection *conn, int error)
 {
 	unsigned int i;
@@ -1088,6 +1141,11 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		return;
 	}
 
+	if (conn->multi) {
+		multi_add_result(conn, type, data, len);
+		return;
+	}
+
 	if (!bdata)
 		return;
 	bdata->inhdr = true;
@@ -1120,6 +1178,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
 	bdata->on_out_list = true;
+	conn_mark_active(conn);
 	domain_outstanding_inc(conn);
 }
 
@@ -1188,6 +1247,7 @@ void send_event(struct buffered_data *req, struct connection *conn,
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
 	bdata->on_out_list = true;
+	conn_mark_active(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -2002,6 +2062,91 @@ int walk_node_tree(const void *ctx, struct connection *conn, const char *root,
 	return ret < 0 ? ret : WALK_TREE_OK;
 }
 
+typedef int (*multi_func_t)(const void *ctx, struct connection *conn,
+			    struct buffered_data *in);
+
+/* Request types allowed as sub-requests of MULTI. */
+static multi_func_t multi_func(uint32_t type)
+{
+	switch (type) {
+	case XS_DIRECTORY:	return send_directory;
+	case XS_READ:		return do_read;
+	case XS_GET_PERMS:	return do_get_perms;
+	case XS_WRITE:		return do_write;
+	case XS_MKDIR:		return do_mkdir;
+	case XS_RM:		return do_rm;
+	}
+
+	return NULL;
+}
+
+/*
+ * <sub-request>+, each being a struct xsd_sockmsg header followed by the
+ * sub-request payload. The sub-requests are processed in order, their
+ * results are returned in the same format.
+ */
+static int do_multi(const void *ctx, struct connection *conn,
+		    struct buffered_data *in)
+{
+	struct multi_reply *multi;
+	struct buffered_data *sub;
+	struct xsd_sockmsg hdr;
+	unsigned int off;
+	void *subctx;
+	int ret;
+
+	if (!feature_available(conn, XENSTORE_SERVER_FEATURE_MULTI))
+		return ENOSYS;
+
+	/* Check all sub-requests before performing any of them. */
+	if (!in->used)
+		return EINVAL;
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr))
+			return EINVAL;
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    !multi_func(hdr.type))
+			return EINVAL;
+	}
+
+	multi = talloc_zero(ctx, struct multi_reply);
+	sub = talloc_zero(ctx, struct buffered_data);
+	if (!multi || !sub)
+		return ENOMEM;
+
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		/*
+		 * Stop if the result might not fit. The client will send the
+		 * remaining sub-requests again.
+		 */
+		if (sizeof(multi->buf) - multi->len < MULTI_RESULT_MIN)
+			break;
+
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		sub->hdr.msg = hdr;
+		sub->hdr.msg.req_id = in->hdr.msg.req_id;
+		sub->hdr.msg.tx_id = in->hdr.msg.tx_id;
+		sub->buffer = in->buffer + off + sizeof(hdr);
+		sub->used = hdr.len;
+
+		conn->multi = multi;
+		subctx = talloc_new(ctx);
+		ret = subctx ? multi_func(hdr.type)(subctx, conn, sub) : ENOMEM;
+		if (ret)
+			send_error(conn, ret);
+		talloc_free(subctx);
+		conn->multi = NULL;
+
+		if (multi->full)
+			break;
+	}
+
+	send_reply(conn, XS_MULTI, multi->buf, multi->len);
+
+	return 0;
+}
+
 static struct {
 	const char *str;
 	int (*func)(const void *ctx, struct connection *conn,
@@ -2009,12 +2154,16 @@ static struct {
 	unsigned int flags;
 #define XS_FLAG_NOTID		(1U << 0)	/* Ignore transaction id. */
 #define XS_FLAG_PRIV		(1U << 1)	/* Privileged domain only. */
+#define XS_FLAG_POOL		(1U << 2)	/* Scratch memory from a pool. */
 } const wire_funcs[XS_TYPE_COUNT] = {
 	[XS_CONTROL]           =
 	    { "CONTROL",       do_control,      XS_FLAG_PRIV },
-	[XS_DIRECTORY]         = { "DIRECTORY",         send_directory },
-	[XS_READ]              = { "READ",              do_read },
-	[XS_GET_PERMS]         = { "GET_PERMS",         do_get_perms },
+	[XS_DIRECTORY]         =
+	    { "DIRECTORY",     send_directory,  XS_FLAG_POOL },
+	[XS_READ]              =
+	    { "READ",          do_read,         XS_FLAG_POOL },
+	[XS_GET_PERMS]         =
+	    { "GET_PERMS",     do_get_perms,    XS_FLAG_POOL },
 	[XS_WATCH]             =
 	    { "WATCH",         do_watch,        XS_FLAG_NOTID },
 	[XS_UNWATCH]           =
@@ -2039,7 +2188,8 @@ static struct {
 	[XS_SET_TARGET]        =
 	    { "SET_TARGET",    do_set_target,   XS_FLAG_PRIV },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
-	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_DIRECTORY_PART]    =
+	    { "DIRECTORY_PART", send_directory_part, XS_FLAG_POOL },
 	[XS_GET_FEATURE]       = { "GET_FEATURE",       do_get_feature },
 	[XS_SET_FEATURE]       =
 	    { "SET_FEATURE",   do_set_feature,  XS_FLAG_PRIV },
@@ -2047,6 +2197,7 @@ static struct {
 	    { "GET_QUOTA",     do_get_quota,    XS_FLAG_PRIV },
 	[XS_SET_QUOTA]         =
 	    { "SET_QUOTA",     do_set_quota,    XS_FLAG_PRIV },
+	[XS_MULTI]             = { "MULTI",             do_multi },
 };
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -2057,6 +2208,13 @@ static const char *sockmsg_string(enum xsd_sockmsg_type type)
 	return "**UNKNOWN**";
 }
 
+/*
+ * Size of the memory pool for temporary allocations of read-only requests.
+ * Large enough for a node read with a maximum length path, larger needs are
+ * satisfied via malloc().
+ */
+#define REQUEST_POOL_SIZE	8192
+
 /* Process "in" for conn: "in" will vanish after this conversation, so
  * we can talloc off it for temporary variables.  May free "conn".
  */
@@ -2090,7 +2248,15 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		return;
 	}
 
-	ctx = talloc_new(NULL);
+	/*
+	 * Read-only requests don't create any objects outliving the request,
+	 * so their temporary memory can be carved from a pool which is
+	 * released with a single free() at the end.
+	 */
+	if (wire_funcs[type].flags & XS_FLAG_POOL)
+		ctx = talloc_pool(NULL, REQUEST_POOL_SIZE);
+	else
+		ctx = talloc_new(NULL);
 	if (!ctx) {
 		send_error(conn, ENOMEM);
 		return;
@@ -2250,10 +2416,10 @@ struct connection *new_connection(const struct interface_funcs *funcs)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
 	new->funcs = funcs;
 	new->is_ignored = false;
 	new->is_stalled = false;
+	INIT_LIST_HEAD(&new->active_list);
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->acc_list);
 	INIT_LIST_HEAD(&new->ref_list);
@@ -2262,6 +2428,7 @@ struct connection *new_connection(const struct interface_funcs *funcs)
 	INIT_LIST_HEAD(&new->delayed);
 
 	list_add_tail(&new->list, &connections);
+	conn_mark_active(new);
 	talloc_set_destructor(new, destroy_conn);
 	trace_create(new, "connection");
 	return new;
@@ -2309,7 +2476,7 @@ static void manual_node(const char *name, const char *child)
 	manual_node_perms(name, child, &perms, 1);
 }
 
-static unsigned int hash_from_key_fn(const void *k)
+unsigned int hash_from_key_fn(const void *k)
 {
 	const char *str = k;
 	unsigned int hash = 5381;
@@ -2321,7 +2488,7 @@ static unsigned int hash_from_key_fn(const void *k)
 	return hash;
 }
 
-static int keys_equal_fn(const void *key1, const void *key2)
+int keys_equal_fn(const void *key1, const void *key2)
 {
 	return 0 == strcmp(key1, key2);
 }
@@ -2709,7 +2876,6 @@ int main(int argc, char *argv[])
 	bool dofork = true;
 	bool live_update = false;
 	const char *pidfile = NULL;
-	int timeout;
 
 	orig_argc = argc;
 	orig_argv = argv;
@@ -2820,49 +2986,28 @@ int main(int argc, char *argv[])
 	check_store();
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(&timeout);
+	initialize_fds();
 
 	late_init(live_update);
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (poll(poll_fds, nr_fds, timeout) < 0) {
-			if (errno == EINTR)
-				continue;
-			barf_perror("Poll failed");
-		}
-
-		handle_special_fds();
+		struct connection *conn;
+		LIST_HEAD(work);
 
-		if (xce_pollfd_idx != -1) {
-			if (poll_fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (poll_fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
+		fd_events_wait(prepare_active_conns());
 
 		/*
-		 * list_for_each_entry_safe is not suitable here because
-		 * handle_input may delete entries besides the current one, but
-		 * those may be in the temporary next which would trigger a
-		 * use-after-free.  list_for_each_entry_safe is only safe for
-		 * deleting the current entry.
+		 * Connections can be deleted by the processing of any other
+		 * connection, so always take the first one from the list of
+		 * connections still to look at. destroy_conn() will unlink
+		 * a deleted connection from that list.
 		 */
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
+		list_splice_init(&active_conns, &work);
+		while ((conn = list_top(&work, struct connection,
+					active_list))) {
+			list_move_tail(&conn->active_list, &active_conns);
+			talloc_increase_ref_count(conn);
 
 			if (conn_can_read(conn))
 				handle_input(conn);
@@ -2876,7 +3021,7 @@ int main(int argc, char *argv[])
 			if (talloc_free(conn) == 0)
 				continue;
 
-			conn->pollfd_idx = -1;
+			conn->revents = 0;
 		}
 
 		if (delayed_requests) {
@@ -2888,8 +3033,6 @@ int main(int argc, char *argv[])
 					call_delayed(req);
 			}
 		}
-
-		initialize_fds(&timeout);
 	}
 }
 
@@ -3167,6 +3310,7 @@ static void add_buffered_data(struct buffered_data *bdata,
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
 	bdata->on_out_list = true;
+	conn_mark_active(conn);
 	/*
 	 * Watch events are never "outstanding", but the request causing them
 	 * are instead kept "outstanding" until all watch events caused by that
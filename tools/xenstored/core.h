@@ -109,6 +109,7 @@ struct delayed_request {
 };
 
 struct connection;
+struct fd_event;
 
 struct interface_funcs {
 	int (*write)(struct connection *, const void *, unsigned int);
@@ -123,8 +124,12 @@ struct connection
 
 	/* The file descriptor we came in on. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	/* Its registration in the fd event loop and the last events seen. */
+	struct fd_event *fd_event;
+	short revents;
+
+	/* Entry in the list of connections to look at in the main loop. */
+	struct list_head active_list;
 
 	/* Who am I? Domid of connection. */
 	unsigned int id;
@@ -151,6 +156,9 @@ struct connection
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
+	/* Collected results of current MULTI request (NULL if none). */
+	struct multi_reply *multi;
+
 	/* List of in-progress transactions. */
 	struct list_head transaction_list;
 	uint32_t next_transaction_id;
@@ -168,6 +176,10 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Result of the watch permission check for fire_watches() call. */
+	uint64_t watch_fire_seq;
+	bool watch_fire_permitted;
+
 	/* Methods for communicating over this connection. */
 	const struct interface_funcs *funcs;
 
@@ -316,6 +328,10 @@ void corrupt(struct connection *conn, const char *fmt, ...);
 /* Get name of parent node. */
 char *get_parent(const void *ctx, const char *node);
 
+/* Hashtable helpers for string keys. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
+
 /* Delay a request. */
 int delay_request(struct connection *conn, struct buffered_data *in,
 		  bool (*func)(struct delayed_request *), void *data,
@@ -371,8 +387,6 @@ extern int priv_domid;
 extern domid_t stub_domid;
 extern bool keep_orphans;
 
-extern struct pollfd *poll_fds;
-
 extern unsigned int timeout_watch_event_msec;
 
 /* Get internal time in milliseconds. */
@@ -399,9 +413,25 @@ evtchn_port_t get_domain_evtchn(unsigned int domid);
 void early_init(bool live_update, bool dofork, const char *pidfile);
 void late_init(bool live_update);
 
-int set_fd(int fd, short events);
 void set_special_fds(void);
-void handle_special_fds(void);
+
+/*
+ * File descriptor event loop (epoll.c on Linux, poll.c elsewhere).
+ * An fd is registered once and stays registered until the returned
+ * fd_event is talloc_free()d. func is called from fd_events_wait() with
+ * the poll() style revents seen. A handler may free its own fd_event,
+ * but no other one.
+ */
+struct fd_event *fd_event_add(const void *ctx, int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data);
+void fd_event_set(struct fd_event *ev, short events);
+void fd_events_wait(int timeout);
+
+/* Register a socket connection's fd with the event loop. */
+bool conn_add_fd_event(struct connection *conn);
+/* Have the main loop look at conn in its next pass. */
+void conn_mark_active(struct connection *conn);
 
 int get_socket_fd(void);
 void set_socket_fd(int fd);
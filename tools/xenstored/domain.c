@@ -45,7 +45,8 @@
 
 #define XENSTORE_FEATURES	(XENSTORE_SERVER_FEATURE_ERROR |	\
 				 XENSTORE_SERVER_FEATURE_WATCHDEPTH |	\
-				 XENSTORE_SERVER_FEATURE_DOMID_ANY)
+				 XENSTORE_SERVER_FEATURE_DOMID_ANY |	\
+				 XENSTORE_SERVER_FEATURE_MULTI)
 
 static xenmanage_handle *xm_handle;
 xengnttab_handle **xgt_handle;
@@ -162,7 +163,11 @@ struct domain
 
 struct changed_domain
 {
-	/* List of all changed domains. */
+	/*
+	 * List of all changed domains of a request.  Transactions keep them
+	 * in a hashtable keyed by domid instead, see
+	 * acc_create_changed_domains().
+	 */
 	struct list_head list;
 
 	/* Identifier of the changed domain. */
@@ -173,6 +178,8 @@ struct changed_domain
 };
 
 static struct hashtable *domhash;
+/* Introduced domains by event channel port. */
+static struct hashtable *porthash;
 
 /* Write rate limiting */
 
@@ -523,6 +530,13 @@ static bool domain_can_write(struct connection *conn)
 	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
 }
 
+bool domain_has_input(struct connection *conn)
+{
+	struct xenstore_domain_interface *intf = conn->domain->interface;
+
+	return intf && intf->req_cons != intf->req_prod;
+}
+
 static bool domain_can_read(struct connection *conn)
 {
 	struct domain *domain = conn->domain;
@@ -663,6 +677,24 @@ static void fire_special_watches(const char *name, unsigned int domid,
 	talloc_free(ctx);
 }
 
+static int domain_set_port(struct domain *domain, evtchn_port_t port)
+{
+	if (domain->port &&
+	    hashtable_search(porthash, &domain->port) == domain)
+		hashtable_remove(porthash, &domain->port);
+
+	domain->port = port;
+	if (!port)
+		return 0;
+
+	errno = hashtable_add(porthash, &domain->port, domain);
+	if (errno)
+		eprintf("> Failed to track port %u of domain %u\n", port,
+			domain->domid);
+
+	return errno;
+}
+
 static int destroy_domain(void *_domain)
 {
 	struct domain *domain = _domain;
@@ -677,6 +709,7 @@ static int destroy_domain(void *_domain)
 	if (domain->port) {
 		if (xenevtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
+		domain_set_port(domain, 0);
 	}
 
 	if (domain->interface)
@@ -781,16 +814,22 @@ static void do_check_domains(void)
 		fire_special_watches("@releaseDomain", 0, WATCH_NODOM);
 }
 
-/* We scan all domains rather than use the information given here. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xenevtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
 	if (port == virq_port)
 		do_check_domains();
+	else {
+		/* Have a look at the ring of the signalling domain. */
+		domain = hashtable_search(porthash, &port);
+		if (domain && domain->conn)
+			conn_mark_active(domain->conn);
+	}
 
 	if (xenevtchn_unmask(xce_handle, port) == -1)
 		barf_perror("Failed to write to event fd");
@@ -948,15 +987,16 @@ static int new_domain(struct domain *domain, int port, bool restore)
 			errno = ENOMEM;
 			return errno;
 		}
-		domain->port = port;
 	} else {
 		/* Tell kernel we're interested in this event. */
 		rc = xenevtchn_bind_interdomain(xce_handle, domain->domid,
 						port);
 		if (rc == -1)
 			return errno;
-		domain->port = rc;
+		port = rc;
 	}
+	if (domain_set_port(domain, port))
+		return errno;
 
 	domain->introduced = true;
 
@@ -988,28 +1028,41 @@ do {						\
 		trace("acc: " __VA_ARGS__);	\
 } while (0)
 
-int acc_fix_domains(struct list_head *head, bool chk_quota, bool update)
+struct acc_fix_data {
+	bool chk_quota;
+	bool update;
+};
+
+static int acc_fix_domain(const void *k, void *v, void *arg)
 {
+	struct changed_domain *cd = v;
+	struct acc_fix_data *data = arg;
 	struct domain *d;
-	struct changed_domain *cd;
 
-	list_for_each_entry(cd, head, list) {
-		if (update) {
-			domain_nbentry_fix(cd->domid, cd->acc[ACC_NODES]);
-		} else if (chk_quota) {
-			d = find_or_alloc_existing_domain(cd->domid);
+	if (data->update) {
+		domain_nbentry_fix(cd->domid, cd->acc[ACC_NODES]);
+	} else if (data->chk_quota) {
+		d = find_or_alloc_existing_domain(cd->domid);
 
-			if (!d)
-				return ENOMEM;
-			if (domain_quota_add_exceeds(d, ACC_NODES,
-						     cd->acc[ACC_NODES]))
-				return ENOSPC;
-		}
+		if (!d)
+			return ENOMEM;
+		if (domain_quota_add_exceeds(d, ACC_NODES, cd->acc[ACC_NODES]))
+			return ENOSPC;
 	}
 
 	return 0;
 }
 
+int acc_fix_domains(struct hashtable *hash, bool chk_quota, bool update)
+{
+	struct acc_fix_data data = {
+		.chk_quota = chk_quota,
+		.update = update,
+	};
+
+	return hashtable_iterate(hash, acc_fix_domain, &data);
+}
+
 static struct changed_domain *acc_find_changed_domain(struct list_head *head,
 						      unsigned int domid)
 {
@@ -1043,25 +1096,68 @@ static struct changed_domain *acc_get_changed_domain(const void *ctx,
 	return cd;
 }
 
-static int acc_add_changed_dom(const void *ctx, struct list_head *head,
-			       enum accitem what, int val, unsigned int domid)
+static struct changed_domain *acc_get_ta_changed_domain(const void *ctx,
+							struct hashtable *hash,
+							unsigned int domid)
 {
 	struct changed_domain *cd;
 
-	assert(what < ARRAY_SIZE(cd->acc));
+	cd = hashtable_search(hash, &domid);
+	if (cd)
+		return cd;
 
-	cd = acc_get_changed_domain(ctx, head, domid);
+	cd = talloc_zero(ctx, struct changed_domain);
 	if (!cd)
-		return 0;
+		return NULL;
+
+	cd->domid = domid;
+	INIT_LIST_HEAD(&cd->list);
+	if (hashtable_add(hash, &cd->domid, cd)) {
+		talloc_free(cd);
+		return NULL;
+	}
+
+	return cd;
+}
+
+static int acc_changed_dom_add(struct changed_domain *cd, enum accitem what,
+			       int val)
+{
+	assert(what < ARRAY_SIZE(cd->acc));
 
 	errno = 0;
-	trace_acc("local change domid %u: what=%u %d add %d\n", domid, what,
+	trace_acc("local change domid %u: what=%u %d add %d\n", cd->domid, what,
 		  cd->acc[what], val);
 	cd->acc[what] += val;
 
 	return cd->acc[what];
 }
 
+static int acc_add_changed_dom(const void *ctx, struct list_head *head,
+			       enum accitem what, int val, unsigned int domid)
+{
+	struct changed_domain *cd;
+
+	cd = acc_get_changed_domain(ctx, head, domid);
+	if (!cd)
+		return 0;
+
+	return acc_changed_dom_add(cd, what, val);
+}
+
+static int acc_add_ta_changed_dom(const void *ctx, struct hashtable *hash,
+				  enum accitem what, int val,
+				  unsigned int domid)
+{
+	struct changed_domain *cd;
+
+	cd = acc_get_ta_changed_domain(ctx, hash, domid);
+	if (!cd)
+		return 0;
+
+	return acc_changed_dom_add(cd, what, val);
+}
+
 static void domain_conn_reset(struct domain *domain)
 {
 	struct connection *conn = domain->conn;
@@ -1150,7 +1246,10 @@ static struct domain *introduce_domain(const void *ctx,
 		if (domain->port)
 			xenevtchn_unbind(xce_handle, domain->port);
 		rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
-		domain->port = (rc == -1) ? 0 : rc;
+		domain_set_port(domain, (rc == -1) ? 0 : rc);
+		/* Requests might have been queued without an event. */
+		if (domain->conn)
+			conn_mark_active(domain->conn);
 	}
 
 	return domain;
@@ -1692,6 +1791,11 @@ static int domeq_fn(const void *key1, const void *key2)
 	return *(const unsigned int *)key1 == *(const unsigned int *)key2;
 }
 
+struct hashtable *acc_create_changed_domains(const void *ctx)
+{
+	return create_hashtable(ctx, "changed_domains", domhash_fn, domeq_fn, 0);
+}
+
 void domain_early_init(void)
 {
 	/* Start with a random rather low domain count for the hashtable. */
@@ -1699,6 +1803,10 @@ void domain_early_init(void)
 	if (!domhash)
 		barf_perror("Failed to allocate domain hashtable");
 
+	porthash = create_hashtable(NULL, "ports", domhash_fn, domeq_fn, 0);
+	if (!porthash)
+		barf_perror("Failed to allocate port hashtable");
+
 	xm_handle = xenmanage_open(NULL, 0);
 	if (!xm_handle)
 		barf_perror("Failed to open connection to libxenmanage");
@@ -1876,7 +1984,7 @@ static int domain_acc_add(struct connection *conn, unsigned int domid,
 {
 	struct domain *d;
 	struct changed_domain *cd;
-	struct list_head *head;
+	struct hashtable *hash;
 	int ret;
 
 	if (conn && domid == conn->id && conn->domain)
@@ -1901,9 +2009,9 @@ static int domain_acc_add(struct connection *conn, unsigned int domid,
 		/* Consider transaction local data. */
 		ret = 0;
 		if (conn->transaction && what < ACC_TR_N) {
-			head = transaction_get_changed_domains(
+			hash = transaction_get_changed_domains(
 				conn->transaction);
-			cd = acc_find_changed_domain(head, domid);
+			cd = hashtable_search(hash, &domid);
 			if (cd)
 				ret = cd->acc[what];
 		}
@@ -1913,9 +2021,9 @@ static int domain_acc_add(struct connection *conn, unsigned int domid,
 	}
 
 	if (conn && conn->transaction && what < ACC_TR_N) {
-		head = transaction_get_changed_domains(conn->transaction);
-		ret = acc_add_changed_dom(conn->transaction, head, what,
-					  add, domid);
+		hash = transaction_get_changed_domains(conn->transaction);
+		ret = acc_add_ta_changed_dom(conn->transaction, hash, what,
+					     add, domid);
 		if (errno) {
 			fail_transaction(conn->transaction);
 			return -1;
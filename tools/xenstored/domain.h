@@ -55,6 +55,9 @@ extern struct quota {
 
 void handle_event(void);
 
+/* Does the domain's ring hold unprocessed request data? */
+bool domain_has_input(struct connection *conn);
+
 void check_domains(void);
 
 /* domid, mfn, eventchn, path */
@@ -160,7 +163,9 @@ int domain_get_quota(const void *ctx, struct connection *conn,
  * Update or check number of nodes per domain at the end of a transaction.
  * If "update" is true, "chk_quota" is ignored.
  */
-int acc_fix_domains(struct list_head *head, bool chk_quota, bool update);
+int acc_fix_domains(struct hashtable *hash, bool chk_quota, bool update);
+/* Hashtable of changed domains of a transaction, keyed by domid. */
+struct hashtable *acc_create_changed_domains(const void *ctx);
 void acc_drop(struct connection *conn);
 void acc_commit(struct connection *conn);
 int domain_max_global_acc(const void *ctx, struct connection *conn);
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * epoll() based file descriptor event loop for Xen Store Daemon.
+ *
+ * File descriptors are registered with the kernel once instead of
+ * handing the complete set to poll() in each main loop iteration.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "core.h"
+
+#define EPOLL_MAX_EVENTS 64
+
+struct fd_event {
+	int fd;
+	short events;
+	void (*func)(void *data, short revents);
+	void *data;
+};
+
+static int epoll_fd = -1;
+
+static void epoll_init(void)
+{
+	if (epoll_fd != -1)
+		return;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		barf_perror("epoll_create1 failed");
+}
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t ret = 0;
+
+	if (events & POLLIN)
+		ret |= EPOLLIN;
+	if (events & POLLPRI)
+		ret |= EPOLLPRI;
+	if (events & POLLOUT)
+		ret |= EPOLLOUT;
+
+	return ret;
+}
+
+static short epoll_to_poll(uint32_t events)
+{
+	short ret = 0;
+
+	if (events & EPOLLIN)
+		ret |= POLLIN;
+	if (events & EPOLLPRI)
+		ret |= POLLPRI;
+	if (events & EPOLLOUT)
+		ret |= POLLOUT;
+	if (events & EPOLLERR)
+		ret |= POLLERR;
+	if (events & EPOLLHUP)
+		ret |= POLLHUP;
+
+	return ret;
+}
+
+static int destroy_fd_event(void *_ev)
+{
+	struct fd_event *ev = _ev;
+
+	/* The fd might have been closed already, which removes it, too. */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL) &&
+	    errno != EBADF && errno != ENOENT)
+		syslog(LOG_ERR, "epoll_ctl DEL failed for fd %d: %m", ev->fd);
+
+	return 0;
+}
+
+struct fd_event *fd_event_add(const void *ctx, int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data)
+{
+	struct fd_event *ev;
+	struct epoll_event eev = { };
+
+	epoll_init();
+
+	ev = talloc(ctx, struct fd_event);
+	if (!ev)
+		goto fail;
+
+	ev->fd = fd;
+	ev->events = events;
+	ev->func = func;
+	ev->data = data;
+
+	eev.events = poll_to_epoll(events);
+	eev.data.ptr = ev;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &eev)) {
+		talloc_free(ev);
+		goto fail;
+	}
+
+	talloc_set_destructor(ev, destroy_fd_event);
+
+	return ev;
+
+ fail:
+	syslog(LOG_ERR, "failed to add fd %d to event loop\n", fd);
+	return NULL;
+}
+
+void fd_event_set(struct fd_event *ev, short events)
+{
+	struct epoll_event eev = { };
+
+	if (ev->events == events)
+		return;
+
+	eev.events = poll_to_epoll(events);
+	eev.data.ptr = ev;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ev->fd, &eev))
+		barf_perror("epoll_ctl MOD failed for fd %d", ev->fd);
+
+	ev->events = events;
+}
+
+void fd_events_wait(int timeout)
+{
+	struct epoll_event eevs[EPOLL_MAX_EVENTS];
+	struct fd_event *ev;
+	int i, n;
+
+	epoll_init();
+
+	n = epoll_wait(epoll_fd, eevs, EPOLL_MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("epoll_wait failed");
+	}
+
+	for (i = 0; i < n; i++) {
+		ev = eevs[i].data.ptr;
+		ev->func(ev->data, epoll_to_poll(eevs[i].events));
+	}
+}
@@ -83,10 +83,6 @@ void set_special_fds(void)
 {
 }
 
-void handle_special_fds(void)
-{
-}
-
 int get_socket_fd(void)
 {
 	return -1;
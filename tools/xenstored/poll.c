@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * poll() based file descriptor event loop for Xen Store Daemon.
+ *
+ * Used where epoll() isn't available. The pollfd array is kept across
+ * main loop iterations and only modified when fds are added or removed.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "core.h"
+
+struct fd_event {
+	unsigned int idx;
+	short revents;
+	void (*func)(void *data, short revents);
+	void *data;
+};
+
+static struct pollfd *poll_fds;
+static struct fd_event **poll_evs;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static int destroy_fd_event(void *_ev)
+{
+	struct fd_event *ev = _ev;
+	unsigned int last = --nr_fds;
+
+	/* Fill the hole with the last entry. */
+	if (ev->idx != last) {
+		poll_fds[ev->idx] = poll_fds[last];
+		poll_evs[ev->idx] = poll_evs[last];
+		poll_evs[ev->idx]->idx = ev->idx;
+	}
+
+	return 0;
+}
+
+struct fd_event *fd_event_add(const void *ctx, int fd, short events,
+			      void (*func)(void *data, short revents),
+			      void *data)
+{
+	struct fd_event *ev;
+
+	if (current_array_size < nr_fds + 1) {
+		struct pollfd *new_fds;
+		struct fd_event **new_evs;
+		unsigned long newsize;
+
+		/* Round up to 2^8 boundary, in practice this just
+		 * make newsize larger than current_array_size.
+		 */
+		newsize = ROUNDUP(nr_fds + 1, 1U << 8);
+
+		new_fds = realloc(poll_fds, sizeof(*poll_fds) * newsize);
+		if (!new_fds)
+			goto fail;
+		poll_fds = new_fds;
+
+		new_evs = realloc(poll_evs, sizeof(*poll_evs) * newsize);
+		if (!new_evs)
+			goto fail;
+		poll_evs = new_evs;
+
+		current_array_size = newsize;
+	}
+
+	ev = talloc(ctx, struct fd_event);
+	if (!ev)
+		goto fail;
+
+	ev->idx = nr_fds++;
+	ev->revents = 0;
+	ev->func = func;
+	ev->data = data;
+
+	poll_fds[ev->idx].fd = fd;
+	poll_fds[ev->idx].events = events;
+	poll_fds[ev->idx].revents = 0;
+	poll_evs[ev->idx] = ev;
+
+	talloc_set_destructor(ev, destroy_fd_event);
+
+	return ev;
+
+ fail:
+	syslog(LOG_ERR, "failed to add fd %d to event loop\n", fd);
+	return NULL;
+}
+
+void fd_event_set(struct fd_event *ev, short events)
+{
+	poll_fds[ev->idx].events = events;
+}
+
+void fd_events_wait(int timeout)
+{
+	struct fd_event *ev;
+	unsigned int i;
+	short revents;
+
+	if (poll(poll_fds, nr_fds, timeout) < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("Poll failed");
+	}
+
+	/*
+	 * Handlers may add new fds or remove their own one, so latch the
+	 * results first. A removal moves the last entry into the hole,
+	 * which must then be looked at without advancing.
+	 */
+	for (i = 0; i < nr_fds; i++)
+		poll_evs[i]->revents = poll_fds[i].revents;
+
+	for (i = 0; i < nr_fds; ) {
+		ev = poll_evs[i];
+		revents = ev->revents;
+		ev->revents = 0;
+		if (revents)
+			ev->func(ev->data, revents);
+		if (i < nr_fds && poll_evs[i] == ev)
+			i++;
+	}
+}
@@ -36,10 +36,9 @@
 #include "osdep.h"
 #include "talloc.h"
 
-static int reopen_log_pipe0_pollfd_idx = -1;
+static struct fd_event *reopen_log_pipe0_event;
 static int reopen_log_pipe[2];
 
-static int sock_pollfd_idx = -1;
 static int sock = -1;
 
 static void write_pidfile(const char *pidfile)
@@ -240,15 +239,12 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static bool socket_can_process(struct connection *conn, int mask)
 {
-	if (conn->pollfd_idx == -1)
-		return false;
-
-	if (poll_fds[conn->pollfd_idx].revents & ~(POLLIN | POLLOUT)) {
+	if (conn->revents & ~(POLLIN | POLLOUT)) {
 		talloc_free(conn);
 		return false;
 	}
 
-	return (poll_fds[conn->pollfd_idx].revents & mask);
+	return (conn->revents & mask);
 }
 
 static bool socket_can_write(struct connection *conn)
@@ -281,6 +277,8 @@ static void accept_connection(int sock)
 	if (conn) {
 		conn->fd = fd;
 		conn->id = store_domid;
+		if (!conn_add_fd_event(conn))
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -332,6 +330,8 @@ struct connection *add_socket_connection(int fd)
 	if (!conn)
 		barf("error restoring connection");
 	conn->fd = fd;
+	if (!conn_add_fd_event(conn))
+		barf("error restoring connection");
 
 	return conn;
 }
@@ -364,42 +364,44 @@ void early_init(bool live_update, bool dofork, const char *pidfile)
 	init_pipe();
 }
 
-void set_special_fds(void)
+static void reopen_log_pipe0_event_func(void *data, short revents)
 {
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
+	if (revents & ~POLLIN) {
+		talloc_free(reopen_log_pipe0_event);
+		reopen_log_pipe0_event = NULL;
+		close(reopen_log_pipe[0]);
+		close(reopen_log_pipe[1]);
+		init_pipe();
+		set_special_fds();
+	} else if (revents & POLLIN) {
+		char c;
+
+		if (read(reopen_log_pipe[0], &c, 1) != 1)
+			barf_perror("read failed");
+		reopen_log();
+	}
+}
 
-	if (sock != -1)
-		sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
+static void sock_event_func(void *data, short revents)
+{
+	if (revents & ~POLLIN)
+		barf_perror("sock poll failed");
+	else if (revents & POLLIN)
+		accept_connection(sock);
 }
 
-void handle_special_fds(void)
+void set_special_fds(void)
 {
-	if (reopen_log_pipe0_pollfd_idx != -1) {
-		if (poll_fds[reopen_log_pipe0_pollfd_idx].revents & ~POLLIN) {
-			close(reopen_log_pipe[0]);
-			close(reopen_log_pipe[1]);
-			init_pipe();
-		} else if (poll_fds[reopen_log_pipe0_pollfd_idx].revents &
-			   POLLIN) {
-			char c;
-
-			if (read(reopen_log_pipe[0], &c, 1) != 1)
-				barf_perror("read failed");
-			reopen_log();
-		}
-		reopen_log_pipe0_pollfd_idx = -1;
-	}
+	static struct fd_event *sock_event;
 
-	if (sock_pollfd_idx != -1) {
-		if (poll_fds[sock_pollfd_idx].revents & ~POLLIN) {
-			barf_perror("sock poll failed");
-		} else if (poll_fds[sock_pollfd_idx].revents & POLLIN) {
-			accept_connection(sock);
-			sock_pollfd_idx = -1;
-		}
-	}
+	if (reopen_log_pipe[0] != -1 && !reopen_log_pipe0_event)
+		reopen_log_pipe0_event =
+			fd_event_add(NULL, reopen_log_pipe[0], POLLIN|POLLPRI,
+				     reopen_log_pipe0_event_func, NULL);
+
+	if (sock != -1 && !sock_event)
+		sock_event = fd_event_add(NULL, sock, POLLIN|POLLPRI,
+					  sock_event_func, NULL);
 }
 
 void late_init(bool live_update)
@@ -61,6 +61,8 @@
 #define TALLOC_MAGIC 0xe814ec70
 #define TALLOC_FLAG_FREE 0x01
 #define TALLOC_FLAG_LOOP 0x02
+#define TALLOC_FLAG_POOL 0x04		/* This is a talloc pool */
+#define TALLOC_FLAG_POOLMEM 0x08	/* This is allocated in a pool */
 #define TALLOC_MAGIC_REFERENCE ((const char *)1)
 
 /* by default we abort when given a bad pointer (such as when talloc_free() is called 
@@ -84,6 +86,10 @@
 static const void *null_context;
 static void *cleanup_context;
 
+/* allocation statistics, see talloc_alloc_stats() */
+static unsigned long talloc_nr_chunks;
+static unsigned long talloc_nr_mallocs;
+
 
 struct talloc_reference_handle {
 	struct talloc_reference_handle *next, *prev;
@@ -101,12 +107,31 @@ struct talloc_chunk {
 	const char *name;
 	size_t size;
 	unsigned flags;
+	struct talloc_chunk *pool; /* owning pool of a TALLOC_FLAG_POOLMEM chunk */
 };
 
 /* 16 byte alignment seems to keep everyone happy */
-#define TC_HDR_SIZE ((sizeof(struct talloc_chunk)+15)&~15)
+#define TC_ALIGN16(s) (((s)+15)&~15)
+#define TC_HDR_SIZE TC_ALIGN16(sizeof(struct talloc_chunk))
 #define TC_PTR_FROM_CHUNK(tc) ((void *)(TC_HDR_SIZE + (char*)tc))
 
+/*
+  a pool is a single malloc()ed block holding this header, the chunk of
+  the pool itself and the memory objects allocated below the pool are
+  carved from. The block is released once the pool and all objects
+  carved from it have been freed.
+*/
+struct talloc_pool_hdr {
+	char *next;			/* first unused byte */
+	char *end;			/* end of the pool memory */
+	unsigned int object_count;	/* pool chunk plus live objects */
+};
+
+#define TP_HDR_SIZE TC_ALIGN16(sizeof(struct talloc_pool_hdr))
+#define TP_HDR_FROM_CHUNK(tc) \
+	((struct talloc_pool_hdr *)((char *)(tc) - TP_HDR_SIZE))
+#define TP_CHUNK_SIZE(tc) TC_ALIGN16(TC_HDR_SIZE + (tc)->size)
+
 /* panic if we get a bad magic value */
 static struct talloc_chunk *talloc_chunk_from_ptr(const void *ptr)
 {
@@ -165,26 +190,91 @@ void *talloc_parent(const void *ptr)
 	return tc? TC_PTR_FROM_CHUNK(tc) : NULL;
 }
 
-/* 
-   Allocate a bit of memory as a child of an existing pointer
+/*
+  try to carve a chunk of the given size from the pool a new child of
+  parent would belong to. Returns NULL if there is no such pool or it
+  is exhausted.
 */
-void *_talloc(const void *context, size_t size)
+static struct talloc_chunk *talloc_alloc_pool(struct talloc_chunk *parent,
+					      size_t size)
 {
-	struct talloc_chunk *tc;
+	struct talloc_chunk *pool, *tc;
+	struct talloc_pool_hdr *ph;
+	size_t chunk_size = TC_ALIGN16(TC_HDR_SIZE + size);
+
+	if (parent->flags & TALLOC_FLAG_POOL) {
+		pool = parent;
+	} else if (parent->flags & TALLOC_FLAG_POOLMEM) {
+		pool = parent->pool;
+	} else {
+		return NULL;
+	}
 
-	if (context == NULL) {
-		context = null_context;
+	/* don't hand out memory of a pool which has been freed already */
+	if (pool->flags & TALLOC_FLAG_FREE) {
+		return NULL;
 	}
 
-	if (size >= MAX_TALLOC_SIZE) {
+	ph = TP_HDR_FROM_CHUNK(pool);
+	if ((size_t)(ph->end - ph->next) < chunk_size) {
 		return NULL;
 	}
 
-	tc = malloc(TC_HDR_SIZE+size);
-	if (tc == NULL) return NULL;
+	tc = (struct talloc_chunk *)ph->next;
+	ph->next += chunk_size;
+	ph->object_count++;
+
+	tc->flags = TALLOC_MAGIC | TALLOC_FLAG_POOLMEM;
+	tc->pool = pool;
+
+	return tc;
+}
+
+/*
+  give the memory of a freed chunk back to the system or to its pool
+*/
+static void talloc_release_chunk(struct talloc_chunk *tc)
+{
+	struct talloc_chunk *pool;
+	struct talloc_pool_hdr *ph;
+
+	if (tc->flags & TALLOC_FLAG_POOLMEM) {
+		pool = tc->pool;
+	} else if (tc->flags & TALLOC_FLAG_POOL) {
+		pool = tc;
+	} else {
+		free(tc);
+		return;
+	}
+
+	ph = TP_HDR_FROM_CHUNK(pool);
+	if (--ph->object_count == 0) {
+		free(ph);
+		return;
+	}
+
+	if (pool->flags & TALLOC_FLAG_FREE) {
+		return;
+	}
+
+	if (ph->object_count == 1) {
+		/* only the pool itself is left, start over */
+		ph->next = TC_PTR_FROM_CHUNK(pool);
+	} else if (tc != pool && (char *)tc + TP_CHUNK_SIZE(tc) == ph->next) {
+		/* the most recent object can be handed out again */
+		ph->next = (char *)tc;
+	}
+}
+
+/*
+  initialise a new chunk and link it as a child of context
+*/
+static void *talloc_setup_chunk(const void *context, struct talloc_chunk *tc,
+				size_t size)
+{
+	talloc_nr_chunks++;
 
 	tc->size = size;
-	tc->flags = TALLOC_MAGIC;
 	tc->destructor = NULL;
 	tc->child = NULL;
 	tc->name = NULL;
@@ -208,6 +298,76 @@ void *_talloc(const void *context, size_t size)
 	return TC_PTR_FROM_CHUNK(tc);
 }
 
+/* 
+   Allocate a bit of memory as a child of an existing pointer
+*/
+void *_talloc(const void *context, size_t size)
+{
+	struct talloc_chunk *tc = NULL;
+
+	if (context == NULL) {
+		context = null_context;
+	}
+
+	if (size >= MAX_TALLOC_SIZE) {
+		return NULL;
+	}
+
+	if (context) {
+		tc = talloc_alloc_pool(talloc_chunk_from_ptr(context), size);
+	}
+
+	if (tc == NULL) {
+		tc = malloc(TC_HDR_SIZE+size);
+		if (tc == NULL) return NULL;
+		talloc_nr_mallocs++;
+
+		tc->flags = TALLOC_MAGIC;
+		tc->pool = NULL;
+	}
+
+	return talloc_setup_chunk(context, tc, size);
+}
+
+/*
+  Allocate a pool of the given size as a child of an existing pointer.
+  Children of the pool (and their children) are carved from the pool
+  memory as long as it lasts, so freeing the pool releases all of them
+  with a single free(). Objects stolen away from the pool keep the
+  pool memory allocated until they are freed.
+*/
+void *talloc_pool(const void *context, size_t size)
+{
+	struct talloc_pool_hdr *ph;
+	struct talloc_chunk *tc;
+	void *ptr;
+
+	if (context == NULL) {
+		context = null_context;
+	}
+
+	if (size >= MAX_TALLOC_SIZE) {
+		return NULL;
+	}
+
+	ph = malloc(TP_HDR_SIZE+TC_HDR_SIZE+size);
+	if (ph == NULL) return NULL;
+	talloc_nr_mallocs++;
+
+	tc = (struct talloc_chunk *)((char *)ph + TP_HDR_SIZE);
+	tc->flags = TALLOC_MAGIC | TALLOC_FLAG_POOL;
+	tc->pool = NULL;
+
+	ptr = talloc_setup_chunk(context, tc, 0);
+	talloc_set_name_const(ptr, "talloc_pool");
+
+	ph->next = ptr;
+	ph->end = (char *)ptr + size;
+	ph->object_count = 1;
+
+	return ptr;
+}
+
 
 /*
   setup a destructor to be called on free of a pointer
@@ -596,7 +756,7 @@ int talloc_free(const void *ptr)
 
 	tc->flags |= TALLOC_FLAG_FREE;
 
-	free(tc);
+	talloc_release_chunk(tc);
  success:
 	errno = saved_errno;
 	return 0;
@@ -632,11 +792,45 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 	tc = talloc_chunk_from_ptr(ptr);
 
-	/* don't allow realloc on referenced pointers */
-	if (tc->refs) {
+	/* don't allow realloc on referenced pointers or pools */
+	if (tc->refs || (tc->flags & TALLOC_FLAG_POOL)) {
 		return NULL;
 	}
 
+	if (tc->flags & TALLOC_FLAG_POOLMEM) {
+		struct talloc_pool_hdr *ph = TP_HDR_FROM_CHUNK(tc->pool);
+		char *chunk_end = (char *)tc + TP_CHUNK_SIZE(tc);
+		size_t new_end = TC_ALIGN16(TC_HDR_SIZE + size);
+
+		/* shrink in place, or grow the most recent object in place */
+		if (size <= tc->size ||
+		    (chunk_end == ph->next &&
+		     !(tc->pool->flags & TALLOC_FLAG_FREE) &&
+		     (size_t)(ph->end - (char *)tc) >= new_end)) {
+			if (chunk_end == ph->next) {
+				ph->next = (char *)tc + new_end;
+			}
+			tc->size = size;
+			talloc_set_name_const(ptr, name);
+			return ptr;
+		}
+
+		/* otherwise move the object out of the pool */
+		new_ptr = malloc(size + TC_HDR_SIZE);
+		if (!new_ptr) {
+			return NULL;
+		}
+		talloc_nr_mallocs++;
+		memcpy(new_ptr, tc, tc->size + TC_HDR_SIZE);
+		tc->flags |= TALLOC_FLAG_FREE;
+		talloc_release_chunk(tc);
+
+		tc = new_ptr;
+		tc->flags &= ~(TALLOC_FLAG_FREE | TALLOC_FLAG_POOLMEM);
+		tc->pool = NULL;
+		goto relink;
+	}
+
 	/* by resetting magic we catch users of the old memory */
 	tc->flags |= TALLOC_FLAG_FREE;
 
@@ -654,8 +848,11 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 		return NULL; 
 	}
 
+	talloc_nr_mallocs++;
+
 	tc = new_ptr;
 	tc->flags &= ~TALLOC_FLAG_FREE; 
+ relink:
 	if (tc->parent) {
 		tc->parent->child = new_ptr;
 	}
@@ -1279,6 +1476,16 @@ size_t talloc_get_size(const void *context)
 	return tc->size;
 }
 
+/*
+  return the number of talloc chunks created and the number of those
+  which needed a malloc() or realloc() call since program start
+*/
+void talloc_alloc_stats(unsigned long *chunks, unsigned long *mallocs)
+{
+	*chunks = talloc_nr_chunks;
+	*mallocs = talloc_nr_mallocs;
+}
+
 /*
   find a parent of this context that has the given name, if any
 */
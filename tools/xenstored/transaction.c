@@ -157,8 +157,11 @@ struct transaction
 	/* List of accessed nodes. */
 	struct list_head accessed;
 
-	/* List of changed domains - to record the changed domain entry number */
-	struct list_head changed_domains;
+	/* Accessed nodes by name. */
+	struct hashtable *accessed_hash;
+
+	/* Changed domains by domid - to record the changed domain entry number */
+	struct hashtable *changed_domains;
 
 	/* There was at least one node created in the transaction. */
 	bool node_created;
@@ -177,13 +180,15 @@ void ta_node_created(struct transaction *trans)
 static struct accessed_node *find_accessed_node(struct transaction *trans,
 						const char *name)
 {
-	struct accessed_node *i;
-
-	list_for_each_entry(i, &trans->accessed, list)
-		if (streq(i->node, name))
-			return i;
+	return hashtable_search(trans->accessed_hash, name);
+}
 
-	return NULL;
+static void free_accessed_node(struct transaction *trans,
+			       struct accessed_node *i)
+{
+	hashtable_remove(trans->accessed_hash, i->node);
+	list_del(&i->list);
+	talloc_free(i);
 }
 
 static char *transaction_get_node_name(void *ctx, struct transaction *trans,
@@ -293,6 +298,8 @@ int access_node(struct connection *conn, struct node *node,
 				i->ta_node = true;
 			}
 		}
+		if (hashtable_add(trans->accessed_hash, i->node, i))
+			goto nomem;
 		trans->nodes++;
 		list_add_tail(&i->list, &trans->accessed);
 	}
@@ -317,6 +324,9 @@ int access_node(struct connection *conn, struct node *node,
 nomem:
 	ret = ENOMEM;
 err:
+	/* Not on trans->accessed, so destroy_transaction() can't find it. */
+	if (i && i->ta_node)
+		db_delete(conn, i->trans_name, NULL);
 	talloc_free(i);
 	trans->fail = true;
 	errno = ret;
@@ -379,8 +389,7 @@ static int finalize_transaction(struct connection *conn,
 		if (!i->modified) {
 			if (i->ta_node)
 				db_delete(conn, i->trans_name, NULL);
-			list_del(&i->list);
-			talloc_free(i);
+			free_accessed_node(trans, i);
 		}
 	}
 
@@ -424,8 +433,7 @@ static int finalize_transaction(struct connection *conn,
 			fire_watches(conn, trans, i->node, NULL, i->watch_match,
 				     i->perms.p ? &i->perms : NULL);
 
-		list_del(&i->list);
-		talloc_free(i);
+		free_accessed_node(trans, i);
 	}
 
 	return 0;
@@ -442,8 +450,7 @@ static int destroy_transaction(void *_transaction)
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
 		if (i->ta_node)
 			db_delete(conn, i->trans_name, NULL);
-		list_del(&i->list);
-		talloc_free(i);
+		free_accessed_node(trans, i);
 	}
 
 	list_del(&trans->list);
@@ -486,9 +493,17 @@ int do_transaction_start(const void *ctx, struct connection *conn,
 	if (!trans)
 		return ENOMEM;
 
-	trace_create(trans, "transaction");
 	INIT_LIST_HEAD(&trans->accessed);
-	INIT_LIST_HEAD(&trans->changed_domains);
+	trans->accessed_hash = create_hashtable(trans, "accessed",
+						hash_from_key_fn,
+						keys_equal_fn, 0);
+	trans->changed_domains = acc_create_changed_domains(trans);
+	if (!trans->accessed_hash || !trans->changed_domains) {
+		talloc_free(trans);
+		return ENOMEM;
+	}
+
+	trace_create(trans, "transaction");
 	trans->conn = conn;
 	trans->fail = false;
 	trans->generation = ++generation;
@@ -540,7 +555,7 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 	if (streq(arg, "T")) {
 		if (trans->fail)
 			return ENOMEM;
-		ret = acc_fix_domains(&trans->changed_domains, chk_quota,
+		ret = acc_fix_domains(trans->changed_domains, chk_quota,
 				      false);
 		if (ret)
 			return ret;
@@ -551,7 +566,7 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 		wrl_apply_debit_trans_commit(conn);
 
 		/* fix domain entry for each changed domain */
-		acc_fix_domains(&trans->changed_domains, false, true);
+		acc_fix_domains(trans->changed_domains, false, true);
 
 		if (is_corrupt)
 			corrupt(conn, "transaction inconsistency");
@@ -561,9 +576,9 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 	return 0;
 }
 
-struct list_head *transaction_get_changed_domains(struct transaction *trans)
+struct hashtable *transaction_get_changed_domains(struct transaction *trans)
 {
-	return &trans->changed_domains;
+	return trans->changed_domains;
 }
 
 void fail_transaction(struct transaction *trans)
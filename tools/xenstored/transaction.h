@@ -54,8 +54,8 @@ const char *transaction_prepend(struct connection *conn, const char *name);
 /* Mark the transaction as failed. This will prevent it to be committed. */
 void fail_transaction(struct transaction *trans);
 
-/* Get the list head of the changed domains. */
-struct list_head *transaction_get_changed_domains(struct transaction *trans);
+/* Get the hashtable of the changed domains. */
+struct hashtable *transaction_get_changed_domains(struct transaction *trans);
 
 void conn_delete_all_transactions(struct connection *conn);
 int check_transactions(struct hashtable *hash);
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -36,6 +37,12 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches of all connections on the same node (struct watch_path). */
+	struct list_head path_list;
+
+	/* Connection the watch has been set up for. */
+	struct connection *conn;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -44,31 +51,34 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent, int depth)
+/*
+ * All watches are indexed by their (canonicalized) node name. Firing watches
+ * for a node only needs to look up the node itself and its parents, instead
+ * of testing each watch of each connection.
+ */
+struct watch_path
 {
-	unsigned int len = strlen(parent);	/* len == 1 if parent is "/". */
-	unsigned int sub_levels = (len == 1) ? 1 : 0;
-
-	if (strncmp(child, parent, len) != 0)
-		return false;
-
-	if (child[len] != '/' && child[len] != '\0' && len > 1)
-		return false;
+	/* All watches on this node, linked via watch->path_list. */
+	struct list_head watches;
+	/* Key in watch_paths. */
+	char *name;
+};
 
-	if (depth < 0 || child[len] == '\0')
-		return true;
+static struct hashtable *watch_paths;
 
-	while (sub_levels <= depth) {
-		if (child[len] == '\0')
-			return true;
-		if (child[len] == '/')
-			sub_levels++;
-		len++;
-	}
+/* Parameters of a single fire_watches() call. */
+struct watch_fire
+{
+	const void *ctx;
+	const char *name;
+	const struct node *node;
+	struct node_perms *perms;
+	struct buffered_data *req;
+	enum watch_match match;
+};
 
-	return false;
-}
+/* Incremented for each fire_watches() call, see conn->watch_fire_seq. */
+static uint64_t watch_fire_seq;
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
 {
@@ -120,6 +130,66 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 	return perm & XS_PERM_READ;
 }
 
+/* Permission check for a connection, done only once per fire_watches(). */
+static bool watch_fire_permitted(struct connection *conn,
+				 const struct watch_fire *fire)
+{
+	if (conn->watch_fire_seq != watch_fire_seq) {
+		conn->watch_fire_seq = watch_fire_seq;
+		conn->watch_fire_permitted = watch_permitted(conn, fire->ctx,
+							     fire->name,
+							     fire->node,
+							     fire->perms);
+	}
+
+	return conn->watch_fire_permitted;
+}
+
+/*
+ * Fire the watches set on node path, which is either the node being modified
+ * or one of its parents. sub_levels is the number of path elements the
+ * modified node is below path.
+ */
+static void fire_watches_path(const struct watch_fire *fire, const char *path,
+			      unsigned int sub_levels)
+{
+	struct watch_path *wpath;
+	struct watch *watch;
+
+	wpath = hashtable_search(watch_paths, path);
+	if (!wpath)
+		return;
+
+	list_for_each_entry(watch, &wpath->watches, path_list) {
+		bool send = false;
+		bool in_depth = watch->depth < 0 ||
+				 sub_levels <= (unsigned int)watch->depth;
+
+		switch (fire->match) {
+		case MATCH_EXACT:
+			send = !sub_levels;
+			break;
+
+		case MATCH_SUBTREE:
+			send = in_depth;
+			break;
+
+		case MATCH_DEPTH:
+			send = !sub_levels || (watch->depth > 0 && in_depth);
+			break;
+
+		case MATCH_NODEPTH:
+			send = !sub_levels && watch->depth < 0;
+			break;
+		}
+
+		if (send && watch_fire_permitted(watch->conn, fire))
+			send_event(fire->req, watch->conn,
+				   get_watch_path(watch, fire->name),
+				   watch->token);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -131,9 +201,15 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  const struct node *node, enum watch_match match,
 		  struct node_perms *perms)
 {
-	struct connection *i;
-	struct buffered_data *req;
-	struct watch *watch;
+	struct watch_fire fire = {
+		.ctx = ctx,
+		.name = name,
+		.node = node,
+		.perms = perms,
+		.match = match,
+	};
+	unsigned int sub_levels = 0;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -141,49 +217,56 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		return;
 	}
 
-	req = domain_is_unprivileged(conn) ? conn->in : NULL;
-
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
-			continue;
-
-		list_for_each_entry(watch, &i->watches, list) {
-			bool send = false;
-
-			switch (match) {
-			case MATCH_EXACT:
-				send = streq(name, watch->node);
-				break;
-
-			case MATCH_SUBTREE:
-				send = is_child(name, watch->node,
-						watch->depth);
-				break;
-
-			case MATCH_DEPTH:
-				send = streq(name, watch->node) ||
-				       (watch->depth > 0 &&
-					is_child(name, watch->node,
-						 watch->depth));
-				break;
-
-			case MATCH_NODEPTH:
-				send = streq(name, watch->node) &&
-				       watch->depth < 0;
-				break;
-			}
-
-			if (send)
-				send_event(req, i, get_watch_path(watch, name),
-					   watch->token);
-		}
+	if (!watch_paths)
+		return;
+
+	fire.req = domain_is_unprivileged(conn) ? conn->in : NULL;
+	watch_fire_seq++;
+
+	/* Only watches on the node itself can match special nodes or exact. */
+	if (name[0] != '/' || match == MATCH_EXACT || match == MATCH_NODEPTH) {
+		fire_watches_path(&fire, name, 0);
+		return;
+	}
+
+	/* Walk from the root down to the node, creating events per level. */
+	for (slash = strchr(name + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+		sub_levels++;
+	if (name[1])
+		sub_levels++;
+
+	fire_watches_path(&fire, "/", sub_levels);
+	if (!sub_levels)
+		return;
+
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+
+	for (slash = path; slash; ) {
+		slash = strchr(slash + 1, '/');
+		if (slash)
+			*slash = 0;
+		fire_watches_path(&fire, path, --sub_levels);
+		if (slash)
+			*slash = '/';
 	}
+
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+	struct watch_path *wpath;
+
+	trace_destroy(watch, "watch");
+
+	wpath = hashtable_search(watch_paths, watch->node);
+	list_del(&watch->path_list);
+	if (list_empty(&wpath->watches))
+		hashtable_remove(watch_paths, wpath->name);
+
 	return 0;
 }
 
@@ -196,11 +279,42 @@ static int check_watch_path(struct connection *conn, const void *ctx,
 	return *path ? 0 : errno;
 }
 
+/* Find or create the index entry for watches on path. */
+static struct watch_path *get_watch_path_entry(const char *path)
+{
+	struct watch_path *wpath;
+
+	if (!watch_paths) {
+		watch_paths = create_hashtable(NULL, "watch_paths",
+					       hash_from_key_fn, keys_equal_fn,
+					       HASHTABLE_FREE_VALUE);
+		if (!watch_paths)
+			return NULL;
+	}
+
+	wpath = hashtable_search(watch_paths, path);
+	if (wpath)
+		return wpath;
+
+	wpath = talloc(NULL, struct watch_path);
+	if (!wpath)
+		return NULL;
+	INIT_LIST_HEAD(&wpath->watches);
+	wpath->name = talloc_strdup(wpath, path);
+	if (!wpath->name || hashtable_add(watch_paths, wpath->name, wpath)) {
+		talloc_free(wpath);
+		return NULL;
+	}
+
+	return wpath;
+}
+
 static struct watch *add_watch(struct connection *conn, const char *path,
 			       const char *token, int depth, bool relative,
 			       bool no_quota_check)
 {
 	struct watch *watch;
+	struct watch_path *wpath;
 
 	watch = talloc(conn, struct watch);
 	if (!watch)
@@ -215,9 +329,18 @@ static struct watch *add_watch(struct connection *conn, const char *path,
 		goto nomem;
 
 	watch->prefix_len = relative ? strlen(get_implicit_path(conn)) + 1 : 0;
+	watch->conn = conn;
+
+	wpath = get_watch_path_entry(path);
+	if (!wpath) {
+		domain_memory_add_nochk(conn, conn->id,
+					-strlen(path) - strlen(token));
+		goto nomem;
+	}
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->path_list, &wpath->watches);
 	talloc_set_destructor(watch, destroy_watch);
 
 	return watch;
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -27,6 +30,19 @@ mread_handle_t mread_init(int fd)
     fstat(fd, &s);
     h->file_size = s.st_size;
 
+    /*
+     * Records from different pcpus are read from all over the file; with
+     * lots of pcpus the window cache below thrashes, mapping and unmapping
+     * a buffer for nearly every record.  Map the whole file in one go if
+     * the address space allows it, and only fall back to windows if not.
+     */
+    if ( h->file_size > 0 && (size_t)h->file_size == h->file_size )
+    {
+        h->whole = mmap(NULL, h->file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( h->whole == MAP_FAILED )
+            h->whole = NULL;
+    }
+
     return h;
 }
 
@@ -66,6 +82,12 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
         len = h->file_size - offset;
     }
 
+    if ( h->whole )
+    {
+        memcpy(rec, h->whole + offset, len);
+        return len;
+    }
+
     /* Try to find the offset in our range */
     dprintf(warn, " Trying last, %d\n", last);
     if ( h->map[h->last].buffer
@@ -158,3 +180,161 @@ copy:
     return len;
 #undef dprintf
 }
+
+struct mread_readahead {
+    mread_handle_t h;
+    int nr_threads, nr_streams;
+    int stop;
+    /* Written by the consumer, read by the readahead threads */
+    off_t *hint;
+    pthread_t *threads;
+};
+
+struct mread_ra_thread {
+    struct mread_readahead *ra;
+    int id;
+};
+
+static void *mread_ra_thread(void *arg)
+{
+    struct mread_ra_thread *t = arg;
+    struct mread_readahead *ra = t->ra;
+    mread_handle_t h = ra->h;
+    const struct timespec idle = { .tv_nsec = 100000 };
+    off_t *done;
+    int s, busy;
+    volatile char sink;
+
+    done = calloc(ra->nr_streams, sizeof(*done));
+    if ( !done )
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    while ( !__atomic_load_n(&ra->stop, __ATOMIC_RELAXED) )
+    {
+        busy = 0;
+
+        /* Each thread looks after every nr_threads'th stream */
+        for ( s = t->id; s < ra->nr_streams; s += ra->nr_threads )
+        {
+            off_t want = __atomic_load_n(&ra->hint[s], __ATOMIC_RELAXED);
+            off_t start, end;
+
+            if ( want < 0 )
+                continue;
+
+            start = want & ~(PAGE_SIZE - 1);
+            if ( start < done[s] )
+                start = done[s];
+            end = want + MREAD_RA_SIZE;
+            if ( end > h->file_size )
+                end = h->file_size;
+
+            /* Touch one byte per page to pull it into the page cache */
+            for ( ; start < end; start += PAGE_SIZE )
+            {
+                sink = h->whole[start];
+                busy = 1;
+            }
+
+            if ( end > done[s] )
+                done[s] = end;
+        }
+
+        if ( !busy )
+            nanosleep(&idle, NULL);
+    }
+
+    (void)sink;
+    free(done);
+    free(t);
+
+    return NULL;
+}
+
+int mread_readahead_start(mread_handle_t h, int nr_threads, int nr_streams)
+{
+    struct mread_readahead *ra;
+    int i;
+
+    if ( !h->whole || nr_threads <= 0 || nr_streams <= 0 )
+        return -1;
+
+    ra = calloc(1, sizeof(*ra));
+    if ( !ra )
+        return -1;
+
+    ra->h = h;
+    ra->nr_threads = nr_threads;
+    ra->nr_streams = nr_streams;
+    ra->hint = malloc(nr_streams * sizeof(*ra->hint));
+    ra->threads = calloc(nr_threads, sizeof(*ra->threads));
+    if ( !ra->hint || !ra->threads )
+        goto fail;
+
+    for ( i = 0; i < nr_streams; i++ )
+        ra->hint[i] = -1;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        struct mread_ra_thread *t = malloc(sizeof(*t));
+
+        if ( !t )
+            break;
+
+        t->ra = ra;
+        t->id = i;
+        if ( pthread_create(&ra->threads[i], NULL, mread_ra_thread, t) )
+        {
+            free(t);
+            break;
+        }
+    }
+
+    if ( i < nr_threads )
+    {
+        /* Shut down whatever did start */
+        ra->nr_threads = i;
+        h->ra = ra;
+        mread_readahead_stop(h);
+        return -1;
+    }
+
+    h->ra = ra;
+
+    return 0;
+
+ fail:
+    free(ra->threads);
+    free(ra->hint);
+    free(ra);
+    return -1;
+}
+
+void mread_readahead_hint(mread_handle_t h, int stream, off_t offset)
+{
+    struct mread_readahead *ra = h->ra;
+
+    if ( ra && stream >= 0 && stream < ra->nr_streams )
+        __atomic_store_n(&ra->hint[stream], offset, __ATOMIC_RELAXED);
+}
+
+void mread_readahead_stop(mread_handle_t h)
+{
+    struct mread_readahead *ra = h->ra;
+    int i;
+
+    if ( !ra )
+        return;
+
+    __atomic_store_n(&ra->stop, 1, __ATOMIC_RELAXED);
+    for ( i = 0; i < ra->nr_threads; i++ )
+        pthread_join(ra->threads[i], NULL);
+
+    h->ra = NULL;
+    free(ra->threads);
+    free(ra->hint);
+    free(ra);
+}
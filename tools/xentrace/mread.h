@@ -1,18 +1,34 @@
 #define MREAD_MAPS 8
 #define MREAD_BUF_SHIFT 9
 #define PAGE_SHIFT 12
+#define PAGE_SIZE (1ULL<<PAGE_SHIFT)
 #define MREAD_BUF_SIZE (1ULL<<(PAGE_SHIFT+MREAD_BUF_SHIFT))
 #define MREAD_BUF_MASK (~(MREAD_BUF_SIZE-1))
+/* How far ahead of each stream the readahead threads fault pages in */
+#define MREAD_RA_SIZE (MREAD_BUF_SIZE/2)
 typedef struct mread_ctrl {
     int fd;
     off_t file_size;
+    /* Mapping of the whole file, if we could get one */
+    char * whole;
     struct mread_buffer {
         char * buffer;
         off_t start_offset;
         int accessed;
     } map[MREAD_MAPS];
     int clock, last;
+    struct mread_readahead * ra;
 } *mread_handle_t;
 
 mread_handle_t mread_init(int fd);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+
+/*
+ * Readahead: nr_threads threads fault in the pages just past the current
+ * offset of each of nr_streams independent readers, so that the (single
+ * threaded) consumer doesn't stall on I/O.  Only available when the whole
+ * file could be mapped; returns non-zero if it couldn't be started.
+ */
+int mread_readahead_start(mread_handle_t h, int nr_threads, int nr_streams);
+void mread_readahead_hint(mread_handle_t h, int stream, off_t offset);
+void mread_readahead_stop(mread_handle_t h);
@@ -191,6 +191,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size, sample_max;
+    int readahead_threads;
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -7999,6 +8000,19 @@ void sched_process(struct pcpu_info *p)
                        ri->dump_header, r->domid, r->vcpuid);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 24): /* RUNQ_LOCKED      */
+            if(opt.dump_all) {
+                struct {
+                    unsigned int rqi:16, op:16;
+                    unsigned int runq_len, time;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s csched2:%s rq# %u, runq_len = %u, "
+                       "locked for %uns\n", ri->dump_header,
+                       r->op ? "runq_insert" : "schedule",
+                       r->rqi, r->runq_len, r->time);
+            }
+            break;
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -9752,6 +9766,8 @@ ssize_t read_record(struct pcpu_info * p) {
     offset = &p->file_offset;
     ri = &p->ri;
 
+    mread_readahead_hint(G.mh, p->pid, *offset);
+
     ri->size = __read_record(&ri->rec, *offset);
     if(ri->size)
     {
@@ -10141,6 +10157,7 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_READAHEAD_THREADS,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10621,6 +10638,16 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_READAHEAD_THREADS:
+    {
+        char * inval;
+
+        opt.readahead_threads = (int)strtol(arg, &inval, 0);
+        if ( inval == arg || opt.readahead_threads < 0 )
+            argp_usage(state);
+        break;
+    }
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10910,6 +10937,12 @@ const struct argp_option cmd_opts[] =  {
       .arg = "errlevel",
       .doc = "Sets tolerance for errors found in the file.  Default is 3; max is 6.", },
 
+    { .name = "readahead-threads",
+      .key = OPT_READAHEAD_THREADS,
+      .arg = "N",
+      .doc = "Use N threads to read the trace file ahead of the analysis of each pcpu.  "
+      "Useful for large traces not already in the page cache; output is unaffected.", },
+
 
     { 0 },
 };
@@ -10942,6 +10975,10 @@ int main(int argc, char *argv[]) {
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
 
+    if ( opt.readahead_threads
+         && mread_readahead_start(G.mh, opt.readahead_threads, MAX_CPUS) )
+        fprintf(stderr, "Could not start readahead threads, continuing without\n");
+
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
 
@@ -10955,6 +10992,8 @@ int main(int argc, char *argv[]) {
 
     process_records();
 
+    mread_readahead_stop(G.mh);
+
     if(opt.interval_mode)
         interval_tail();
 
@@ -25,7 +25,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -60,6 +62,7 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long threads;
     uint8_t discard:1,
         disable_tracing:1,
         start_disabled:1;
@@ -71,6 +74,30 @@ struct t_struct {
     unsigned char **data;   /* Pointers to trace buffer data areas */
 };
 
+/*
+ * Buffers being collected.  With collector threads, each thread reads
+ * every nr_threads'th CPU's buffer on each round, and output of a window
+ * is serialised by out_lock.
+ */
+static struct {
+    struct t_struct *tbufs;
+    unsigned int num;
+    unsigned long data_size;
+
+    unsigned int nr_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned int round, busy;
+    int exit;
+} collect = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
 settings_t opts;
 
 int interrupted = 0; /* gets set if we get a SIGHUP */
@@ -333,22 +360,27 @@ fail:
 }
 
 /**
- * write_buffer - write a section of the trace buffer
- * @cpu      - source buffer CPU ID
- * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
+ * write_window - write a window of the trace buffer
+ * @cpu       - source buffer CPU ID
+ * @start     - start of the window
+ * @size      - size of the window up to the end of the buffer
+ * @wrap      - start of the buffer, where a wrapped window continues
+ * @wrap_size - size of the rest of a wrapped window (0 if it doesn't wrap)
  *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+ * Outputs the trace buffer window to a filestream, prepending the CPU and
+ * size of the window.  The whole window goes out in one writev() straight
+ * from the trace buffer mapping, under out_lock so that windows written
+ * by different collector threads don't get mixed up.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void write_window(unsigned int cpu, unsigned char *start, size_t size,
+                         unsigned char *wrap, size_t wrap_size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
+    size_t total_size = size + wrap_size;
+    ssize_t written = 0;
+
+    pthread_mutex_lock(&out_lock);
+
     if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
     {
         unsigned long long freespace;
@@ -362,10 +394,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
 
         freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+        freespace -= total_size;
 
         freespace >>= 20; /* Convert to MB */
 
@@ -376,48 +405,38 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
         }
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
-    {
-        if ( opts.memory_buffer )
-        {
-            membuf_reserve_window(cpu, total_size);
-        }
-        else
-        {
-            struct cpu_change_record rec;
-
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
-
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
-        }
-    }
-
     if ( opts.memory_buffer )
     {
+        membuf_reserve_window(cpu, total_size);
         membuf_write(start, size);
+        if ( wrap_size )
+            membuf_write(wrap, wrap_size);
     }
     else
     {
-        written = write(outfd, start, size);
-        if ( written != size )
+        /* Write a CPU_BUF record in front of each buffer "window" written. */
+        struct cpu_change_record rec = {
+            .header = CPU_CHANGE_HEADER,
+            .data.cpu = cpu,
+            .data.window_size = total_size,
+        };
+        struct iovec iov[] = {
+            { .iov_base = &rec, .iov_len = sizeof(rec) },
+            { .iov_base = start, .iov_len = size },
+            { .iov_base = wrap, .iov_len = wrap_size },
+        };
+
+        written = writev(outfd, iov, wrap_size ? 3 : 2);
+        if ( written != sizeof(rec) + total_size )
         {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
+            fprintf(stderr, "Write failed! (size %zu, returned %zd)\n",
+                    sizeof(rec) + total_size, written);
             goto fail;
         }
     }
 
+    pthread_mutex_unlock(&out_lock);
+
     return;
 
 fail:
@@ -664,6 +683,185 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/**
+ * read_tbuf - write out whatever is new in one CPU's trace buffer
+ * @cpu:           the CPU whose buffer to read
+ */
+static void read_tbuf(unsigned int cpu)
+{
+    struct t_buf *meta = collect.tbufs->meta[cpu];
+    unsigned char *data = collect.tbufs->data[cpu];
+    unsigned long data_size = collect.data_size;
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = prod % data_size;
+
+    if ( end_offset > start_offset )
+    {
+        /* If window does not wrap, write in one big chunk */
+        write_window(cpu, data + start_offset, window_size, NULL, 0);
+    }
+    else
+    {
+        /* If wrapped, write in two chunks:
+         * - first, start to the end of the buffer
+         * - second, start of buffer to end of window
+         */
+        write_window(cpu, data + start_offset, data_size - start_offset,
+                     data, end_offset);
+    }
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+}
+
+/**
+ * read_tbufs - read every @step'th CPU's trace buffer, starting at @first
+ */
+static void read_tbufs(unsigned int first, unsigned int step)
+{
+    unsigned int i;
+
+    for ( i = first; i < collect.num; i += step )
+        if ( collect.tbufs->meta[i] )
+            read_tbuf(i);
+}
+
+static void *collector_thread(void *arg)
+{
+    unsigned int id = (uintptr_t)arg, round = 0;
+
+    pthread_mutex_lock(&collect.lock);
+
+    for ( ; ; )
+    {
+        while ( collect.round == round )
+            pthread_cond_wait(&collect.start, &collect.lock);
+        round = collect.round;
+
+        if ( collect.exit )
+            break;
+
+        pthread_mutex_unlock(&collect.lock);
+        read_tbufs(id, collect.nr_threads);
+        pthread_mutex_lock(&collect.lock);
+
+        if ( --collect.busy == 0 )
+            pthread_cond_signal(&collect.done);
+    }
+
+    pthread_mutex_unlock(&collect.lock);
+
+    return NULL;
+}
+
+/**
+ * start_collectors - start the collector threads, if there are to be any
+ */
+static void start_collectors(void)
+{
+    sigset_t all, old;
+    unsigned int i;
+    int rc;
+
+    collect.nr_threads = opts.threads;
+    if ( collect.nr_threads > collect.num )
+        collect.nr_threads = collect.num;
+    if ( collect.nr_threads > 1 && opts.memory_buffer )
+    {
+        /* membuf_reserve_window() relies on windows coming in cpu order. */
+        fprintf(stderr, "Memory buffer mode is single-threaded, ignoring --threads\n");
+        collect.nr_threads = 1;
+    }
+    if ( collect.nr_threads <= 1 )
+        return;
+
+    collect.threads = calloc(collect.nr_threads, sizeof(*collect.threads));
+    if ( collect.threads == NULL )
+    {
+        PERROR("Failed to allocate collector threads");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Leave signal handling to the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for ( i = 0; i < collect.nr_threads; i++ )
+    {
+        rc = pthread_create(&collect.threads[i], NULL, collector_thread,
+                            (void *)(uintptr_t)i);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to start collector thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_collectors(void)
+{
+    unsigned int i;
+
+    if ( collect.nr_threads <= 1 )
+        return;
+
+    pthread_mutex_lock(&collect.lock);
+    collect.exit = 1;
+    collect.round++;
+    pthread_cond_broadcast(&collect.start);
+    pthread_mutex_unlock(&collect.lock);
+
+    for ( i = 0; i < collect.nr_threads; i++ )
+        pthread_join(collect.threads[i], NULL);
+
+    free(collect.threads);
+}
+
+/**
+ * read_all_tbufs - do one round of reading all the trace buffers
+ */
+static void read_all_tbufs(void)
+{
+    if ( collect.nr_threads <= 1 )
+    {
+        read_tbufs(0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&collect.lock);
+    collect.busy = collect.nr_threads;
+    collect.round++;
+    pthread_cond_broadcast(&collect.start);
+    while ( collect.busy )
+        pthread_cond_wait(&collect.done, &collect.lock);
+    pthread_mutex_unlock(&collect.lock);
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
@@ -673,16 +871,11 @@ static void monitor_tbufs(void)
     int i;
 
     struct t_struct *tbufs;      /* Pointer to hypervisor maps */
-    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
     unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
     unsigned int  num;           /* number of trace buffers / logical CPUS   */
     unsigned long tinfo_size;    /* size of t_info metadata map */
     unsigned long size;          /* size of a single trace buffer            */
 
-    unsigned long data_size;
-
     int last_read = 1;
 
     /* prepare to listen for VIRQ_TBUF */
@@ -701,74 +894,21 @@ static void monitor_tbufs(void)
 
     size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
 
-    data_size = size - sizeof(struct t_buf);
-
-    meta = tbufs->meta;
-    data = tbufs->data;
+    collect.tbufs = tbufs;
+    collect.num = num;
+    collect.data_size = size - sizeof(struct t_buf);
 
     if ( opts.discard )
         for ( i = 0; i < num; i++ )
-            if ( meta[i] )
-                meta[i]->cons = meta[i]->prod;
+            if ( tbufs->meta[i] )
+                tbufs->meta[i]->cons = tbufs->meta[i]->prod;
+
+    start_collectors();
 
     /* now, scan buffers for events */
     while ( 1 )
     {
-        for ( i = 0; i < num; i++ )
-        {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-
-            if ( !meta[i] )
-                continue;
-
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
-
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
-        }
+        read_all_tbufs();
 
         if ( interrupted )
         {
@@ -787,12 +927,14 @@ static void monitor_tbufs(void)
         wait_for_event_or_timeout(opts.poll_sleep);
     }
 
+    stop_collectors();
+
     if ( opts.memory_buffer )
         membuf_dump();
 
     /* cleanup */
-    free(meta);
-    free(data);
+    free(tbufs->meta);
+    free(tbufs->data);
     /* don't need to munmap - cleanup is automatic */
 }
 
@@ -839,6 +981,8 @@ static void usage(int status)
 "  -V, --version           Print program version\n" \
 "  -M, --memory-buffer=b   Copy trace records to a circular memory buffer.\n" \
 "                          Dump to file on exit.\n" \
+"  -j, --threads=N         Read the trace buffers using N threads, each\n" \
+"                          looking after a share of the CPUs (default 1).\n" \
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
@@ -1087,6 +1231,7 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "threads",        required_argument, 0, 'j' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -1095,7 +1240,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:j:DxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1146,6 +1291,10 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'j':
+            opts.threads = argtol(optarg, 0);
+            break;
+
         case 'h':
             usage(EXIT_SUCCESS);
             break;
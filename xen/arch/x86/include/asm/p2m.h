@@ -16,6 +16,7 @@
 
 #include <xen/paging.h>
 #include <xen/mem_access.h>
+#include <xen/tasklet.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -337,6 +338,20 @@ struct p2m_domain {
             unsigned long list[NR_POD_MRP_ENTRIES];
             unsigned int idx;
         } mrp;
+
+        /* Background sweep, refilling the cache before it runs dry. */
+        struct tasklet   sweep_tasklet;
+        gfn_t            sweep_next;   /* Next gfn to look at */
+
+        /* Statistics, reported by p2m_pod_dump_data() */
+        struct {
+            unsigned long emergency,    /* Emergency sweeps */
+                          background,   /* Background sweep runs */
+                          scanned,      /* gfns looked at by sweeps */
+                          checked,      /* Pages checked for zeroes */
+                          reclaimed,    /* 4k pages reclaimed */
+                          reclaimed_2m; /* 2M pages reclaimed */
+        } stats;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
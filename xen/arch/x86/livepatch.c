@@ -21,9 +21,21 @@
 
 static bool has_active_waitqueue(const struct vm_event_domain *ved)
 {
-    /* ved may be xzalloc()'d without INIT_LIST_HEAD() yet. */
-    return (ved && !list_head_is_null(&ved->wq.list) &&
-            !list_empty(&ved->wq.list));
+    unsigned int i;
+
+    if ( !ved )
+        return false;
+
+    for ( i = 0; i < ved->nr_rings; i++ )
+    {
+        const struct waitqueue_head *wq = &ved->ring[i].wq;
+
+        /* ved may be xzalloc()'d without INIT_LIST_HEAD() yet. */
+        if ( !list_head_is_null(&wq->list) && !list_empty(&wq->list) )
+            return true;
+    }
+
+    return false;
 }
 
 /*
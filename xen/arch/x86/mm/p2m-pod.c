@@ -376,6 +376,8 @@ int p2m_pod_empty_cache(struct domain *d)
     BUG_ON(!d->is_dying);
     rspin_barrier(&p2m->pod.lock.lock);
 
+    tasklet_kill(&p2m->pod.sweep_tasklet);
+
     lock_page_alloc(p2m);
 
     while ( (page = page_list_remove_head(&p2m->pod.super)) )
@@ -709,6 +711,31 @@ void p2m_pod_dump_data(struct domain *d)
 
     printk("    PoD entries=%ld cachesize=%ld\n",
            p2m->pod.entry_count, p2m->pod.count);
+    printk("    PoD sweeps: emergency=%lu background=%lu scanned=%lu checked=%lu reclaimed 4k=%lu 2M=%lu\n",
+           p2m->pod.stats.emergency, p2m->pod.stats.background,
+           p2m->pod.stats.scanned, p2m->pod.stats.checked,
+           p2m->pod.stats.reclaimed, p2m->pod.stats.reclaimed_2m);
+}
+
+/* Number of words looked at before trying to remove a page from the p2m */
+#define POD_QUICK_CHECK_WORDS 16
+
+/*
+ * Check whether words, a multiple of 8, are all zero.  The words of each
+ * cache line are ORed together and tested once, so a zero page costs one
+ * branch per line rather than one per word.  SIMD registers are off limits
+ * in the hypervisor, as they hold guest state.
+ */
+static bool pod_is_zero(const unsigned long *p, unsigned int words)
+{
+    unsigned int i;
+
+    for ( i = 0; i < words; i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return false;
+
+    return true;
 }
 
 
@@ -725,7 +752,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     unsigned long * map = NULL;
     int ret=0, reset = 0;
     unsigned long i, n;
-    unsigned int j;
+    bool zero;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -797,14 +824,12 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(mfn_add(mfn0, i));
-
-        for ( j = 0; j < 16; j++ )
-            if ( *(map + j) != 0 )
-                break;
-
+        zero = pod_is_zero(map, POD_QUICK_CHECK_WORDS);
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        p2m->pod.stats.checked++;
+
+        if ( !zero )
             goto out;
 
     }
@@ -836,12 +861,8 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
     {
         map = map_domain_page(mfn_add(mfn0, i));
 
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map)); j++ )
-            if ( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
+        if ( !pod_is_zero(map, PAGE_SIZE / sizeof(*map)) )
+            reset = 1;
 
         unmap_domain_page(map);
 
@@ -870,6 +891,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, gfn_t gfn)
      */
     p2m_pod_cache_add(p2m, mfn_to_page(mfn0), PAGE_ORDER_2M);
     p2m->pod.entry_count += SUPERPAGE_PAGES;
+    p2m->pod.stats.reclaimed_2m++;
 
     ioreq_request_mapcache_invalidate(d);
 
@@ -903,7 +925,8 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
     p2m_type_t types[POD_SWEEP_STRIDE];
     unsigned long *map[POD_SWEEP_STRIDE];
     struct domain *d = p2m->domain;
-    unsigned int i, j, max_ref = 1;
+    unsigned int i, max_ref = 1;
+    bool zero;
 
     BUG_ON(count > POD_SWEEP_STRIDE);
 
@@ -945,10 +968,11 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
         if ( !map[i] )
             continue;
 
+        p2m->pod.stats.checked++;
+
         /* Quick zero-check */
-        for ( j = 0; j < 16; j++ )
-            if ( *(map[i] + j) != 0 )
-                goto skip;
+        if ( !pod_is_zero(map[i], POD_QUICK_CHECK_WORDS) )
+            goto skip;
 
         /* Try to remove the page, restoring old mapping if it fails. */
         if ( p2m_set_entry(p2m, gfns[i], INVALID_MFN, PAGE_ORDER_4K,
@@ -989,9 +1013,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
         if ( !map[i] )
             continue;
 
-        for ( j = 0; j < (PAGE_SIZE / sizeof(*map[i])); j++ )
-            if ( *(map[i] + j) != 0 )
-                break;
+        zero = pod_is_zero(map[i], PAGE_SIZE / sizeof(*map[i]));
 
         unmap_domain_page(map[i]);
 
@@ -1001,7 +1023,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
          * See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.
          */
-        if ( j < (PAGE_SIZE / sizeof(*map[i])) )
+        if ( !zero )
         {
             /*
              * If the previous p2m_set_entry call succeeded, this one shouldn't
@@ -1042,6 +1064,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, const gfn_t *gfns, unsigned int count
             /* Add to cache, and account for the new p2m PoD entry */
             p2m_pod_cache_add(p2m, mfn_to_page(mfns[i]), PAGE_ORDER_4K);
             p2m->pod.entry_count++;
+            p2m->pod.stats.reclaimed++;
 
             ioreq_request_mapcache_invalidate(d);
         }
@@ -1100,7 +1123,97 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
     p2m_unlock(p2m);
     p2m->pod.reclaim_single = _gfn(i ? i - 1 : i);
+    p2m->pod.stats.emergency++;
+    p2m->pod.stats.scanned += start - i + (i != 0);
+
+}
 
+/* gfns looked at per run of the background sweep */
+#define POD_BACKGROUND_SWEEP_LIMIT (4 * POD_SWEEP_LIMIT)
+/* The background sweep starts below LOW cached pages, and stops at HIGH. */
+#define POD_BACKGROUND_SWEEP_LOW   SUPERPAGE_PAGES
+#define POD_BACKGROUND_SWEEP_HIGH  (4 * SUPERPAGE_PAGES)
+
+static bool pod_background_sweep_needed(const struct p2m_domain *p2m)
+{
+    return p2m->pod.entry_count > p2m->pod.count &&
+           p2m->pod.count < POD_BACKGROUND_SWEEP_HIGH;
+}
+
+/*
+ * Refill the cache from zeroed guest pages before it runs dry, so that
+ * faulting vCPUs don't have to do emergency sweeps.  Each run looks at a
+ * bounded number of gfns, continuing downwards from where the previous one
+ * stopped, and reschedules itself if the cache is still short.  Unlike the
+ * emergency sweep, superpage mappings are only reclaimed whole, and never
+ * shattered.  A run which gets to gfn 0 ends the sweep until the cache
+ * runs low again, so a guest without zero pages isn't scanned in a loop.
+ */
+static void cf_check p2m_pod_background_sweep(void *data)
+{
+    struct p2m_domain *p2m = data;
+    gfn_t gfns[POD_SWEEP_STRIDE];
+    unsigned long gfn, scanned = 0;
+    unsigned int j = 0;
+
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    if ( p2m->domain->is_dying || !pod_background_sweep_needed(p2m) )
+        goto out;
+
+    gfn = gfn_x(p2m->pod.sweep_next);
+    if ( gfn == 0 || gfn > gfn_x(p2m->pod.max_guest) )
+        gfn = gfn_x(p2m->pod.max_guest);
+
+    while ( gfn > 0 && scanned < POD_BACKGROUND_SWEEP_LIMIT &&
+            pod_background_sweep_needed(p2m) )
+    {
+        p2m_type_t t;
+        p2m_access_t a;
+        unsigned int order;
+
+        (void)p2m->get_entry(p2m, _gfn(gfn), &t, &a, 0, &order, NULL);
+
+        if ( order >= PAGE_ORDER_2M )
+        {
+            unsigned long base = gfn & ~(SUPERPAGE_PAGES - 1);
+
+            if ( p2m_is_ram(t) )
+                p2m_pod_zero_check_superpage(p2m, _gfn(base));
+
+            scanned += gfn - base + 1;
+            gfn = base ? base - 1 : 0;
+            continue;
+        }
+
+        if ( p2m_is_ram(t) )
+        {
+            gfns[j++] = _gfn(gfn);
+            if ( j == POD_SWEEP_STRIDE )
+            {
+                p2m_pod_zero_check(p2m, gfns, j);
+                j = 0;
+            }
+        }
+
+        scanned++;
+        gfn--;
+    }
+
+    if ( j )
+        p2m_pod_zero_check(p2m, gfns, j);
+
+    p2m->pod.sweep_next = _gfn(gfn);
+    p2m->pod.stats.background++;
+    p2m->pod.stats.scanned += scanned;
+
+    if ( gfn && pod_background_sweep_needed(p2m) )
+        tasklet_schedule(&p2m->pod.sweep_tasklet);
+
+ out:
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
 }
 
 static void pod_eager_reclaim(struct p2m_domain *p2m)
@@ -1253,6 +1366,11 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, gfn_t gfn,
 
     pod_eager_record(p2m, gfn_aligned, order);
 
+    /* Refill the cache in the background while there is some left. */
+    if ( p2m->pod.count < POD_BACKGROUND_SWEEP_LOW &&
+         p2m->pod.entry_count > p2m->pod.count )
+        tasklet_schedule(&p2m->pod.sweep_tasklet);
+
     if ( tb_init_done )
     {
         struct {
@@ -1425,6 +1543,8 @@ void p2m_pod_init(struct p2m_domain *p2m)
 
     for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
         p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
+
+    tasklet_init(&p2m->pod.sweep_tasklet, p2m_pod_background_sweep, p2m);
 }
 
 bool p2m_pod_active(const struct domain *d)
@@ -242,26 +242,91 @@ void cf_check send_IPI_mask_phys(const cpumask_t *mask, int vector)
     local_irq_restore(flags);
 }
 
-static DEFINE_SPINLOCK(flush_lock);
-static cpumask_t flush_cpumask;
-static const void *flush_va;
-static unsigned int flush_flags;
+/*
+ * Remote TLB flushes.  Every CPU has a single request slot which it fills in
+ * before IPI-ing the targets, so shootdowns from different CPUs can be in
+ * flight at the same time.  A target notes which senders have a request
+ * outstanding against it in flush_senders, and services all of them in a
+ * single interrupt, merging the TLB flushes where possible.  Only the first
+ * request queued on a target since it last took the interrupt sends an IPI.
+ */
+struct flush_request {
+    cpumask_t pending;      /* CPUs which have yet to act on the request. */
+    cpumask_t ipi;          /* Scratch space for the sender. */
+    const void *va;
+    unsigned int flags;
+};
+
+static DEFINE_PER_CPU(struct flush_request, flush_request);
+static DEFINE_PER_CPU(cpumask_t, flush_senders);
+static DEFINE_PER_CPU(cpumask_t, flush_batch);
+static DEFINE_PER_CPU(bool, flush_ipi_pending);
 
 void cf_check invalidate_interrupt(void)
 {
-    unsigned int flags = flush_flags;
+    unsigned int cpu = smp_processor_id(), sender;
+    cpumask_t *senders = &this_cpu(flush_senders);
+    cpumask_t *batch = &this_cpu(flush_batch);
+    const void *va = NULL;
+    unsigned int flags = 0, all = 0;
+    bool synced;
+
     ack_APIC_irq();
     perfc_incr(ipis);
-    if ( (flags & FLUSH_VCPU_STATE) && __sync_local_execstate() )
-        flags &= ~(FLUSH_TLB | FLUSH_TLB_GLOBAL | FLUSH_ROOT_PGTBL);
-    if ( flags & ~(FLUSH_VCPU_STATE | FLUSH_ORDER_MASK) )
-        flush_area_local(flush_va, flags);
-    cpumask_clear_cpu(smp_processor_id(), &flush_cpumask);
+
+    /* Requests queued from here on need a new IPI. */
+    this_cpu(flush_ipi_pending) = false;
+    smp_mb();
+
+    for_each_cpu ( sender, senders )
+    {
+        if ( !cpumask_test_and_clear_cpu(sender, senders) )
+            continue;
+        __cpumask_set_cpu(sender, batch);
+        all |= per_cpu(flush_request, sender).flags;
+    }
+
+    synced = (all & FLUSH_VCPU_STATE) && __sync_local_execstate();
+
+    for_each_cpu ( sender, batch )
+    {
+        const struct flush_request *req = &per_cpu(flush_request, sender);
+        unsigned int f = req->flags & ~FLUSH_VCPU_STATE;
+
+        /* Only the senders which asked for the sync may rely on it. */
+        if ( synced && (req->flags & FLUSH_VCPU_STATE) )
+            f &= ~(FLUSH_TLB | FLUSH_TLB_GLOBAL | FLUSH_ROOT_PGTBL);
+
+        if ( !(f & ~FLUSH_ORDER_MASK) )
+            continue;
+
+        /* Cache maintenance is ranged and too costly to widen: do it now. */
+        if ( f & (FLUSH_CACHE_EVICT | FLUSH_CACHE_WRITEBACK) )
+            flush_area_local(req->va, f);
+        else if ( !(flags & ~FLUSH_ORDER_MASK) )
+        {
+            flags = f;
+            va = req->va;
+        }
+        else if ( va == req->va && !((flags ^ f) & FLUSH_ORDER_MASK) )
+            flags |= f;
+        else
+            /* Different ranges: fall back to a full flush covering both. */
+            flags = (flags | f) & ~(FLUSH_ORDER_MASK | FLUSH_VA_VALID);
+    }
+
+    if ( flags & ~FLUSH_ORDER_MASK )
+        flush_area_local(va, flags);
+
+    for_each_cpu ( sender, batch )
+        cpumask_clear_cpu(cpu, &per_cpu(flush_request, sender).pending);
+    cpumask_clear(batch);
 }
 
 void flush_area_mask(const cpumask_t *mask, const void *va, unsigned int flags)
 {
-    unsigned int cpu = smp_processor_id();
+    unsigned int cpu = smp_processor_id(), target;
+    struct flush_request *req;
 
     /* Local flushes can be performed with interrupts disabled. */
     ASSERT(local_irq_is_enabled() || cpumask_subset(mask, cpumask_of(cpu)));
@@ -281,15 +346,28 @@ void flush_area_mask(const cpumask_t *mask, const void *va, unsigned int flags)
              !hypervisor_flush_tlb(mask, va, flags) )
             return;
 
-        spin_lock(&flush_lock);
-        cpumask_and(&flush_cpumask, mask, &cpu_online_map);
-        cpumask_clear_cpu(cpu, &flush_cpumask);
-        flush_va      = va;
-        flush_flags   = flags;
-        send_IPI_mask(&flush_cpumask, INVALIDATE_TLB_VECTOR);
-        while ( !cpumask_empty(&flush_cpumask) )
+        req = &this_cpu(flush_request);
+
+        /* Senders spin with interrupts on, so requests can't nest. */
+        ASSERT(cpumask_empty(&req->pending));
+
+        cpumask_and(&req->pending, mask, &cpu_online_map);
+        cpumask_clear_cpu(cpu, &req->pending);
+        req->va    = va;
+        req->flags = flags;
+
+        cpumask_clear(&req->ipi);
+        for_each_cpu ( target, &req->pending )
+        {
+            cpumask_set_cpu(cpu, &per_cpu(flush_senders, target));
+            if ( !test_and_set_bool(per_cpu(flush_ipi_pending, target)) )
+                __cpumask_set_cpu(target, &req->ipi);
+        }
+
+        if ( !cpumask_empty(&req->ipi) )
+            send_IPI_mask(&req->ipi, INVALIDATE_TLB_VECTOR);
+        while ( !cpumask_empty(&req->pending) )
             cpu_relax();
-        spin_unlock(&flush_lock);
     }
 }
 
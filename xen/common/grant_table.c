@@ -2917,31 +2917,48 @@ struct gnttab_copy_buf {
     struct domain *domain;
     mfn_t mfn;
     struct page_info *page;
-    void *virt;
     bool read_only;
     bool have_grant;
     bool have_type;
 };
 
+/*
+ * Frames claimed by a batch of copies, for one direction.  Backends spread
+ * many small copies over a handful of frames, often interleaving them, so
+ * rather than dropping a frame as soon as the next op names a different one,
+ * keep the last few pinned until the domains change or the batch ends.
+ * Only the grant and page references are kept: the frames are mapped just
+ * around each copy, as the per-vCPU mapcache is far too small to hold a
+ * mapping for every cached frame.
+ */
+#define GNTTAB_COPY_CACHE_SIZE 8
+
+struct gnttab_copy_cache {
+    struct domain *domain;
+    domid_t domid;
+    unsigned int nr, next;
+    struct gnttab_copy_buf buf[GNTTAB_COPY_CACHE_SIZE];
+};
+
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct gnttab_copy_cache *cache)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    cache->domain = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !cache->domain )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
+    cache->domid = domid;
 
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_cache *src,
+                                       struct gnttab_copy_cache *dest)
 {
     if ( src->domain )
     {
@@ -2956,8 +2973,8 @@ static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_cache *src,
+                                    struct gnttab_copy_cache *dest)
 {
     int rc;
 
@@ -2985,11 +3002,6 @@ static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
 
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
-    if ( buf->virt )
-    {
-        unmap_domain_page(buf->virt);
-        buf->virt = NULL;
-    }
     if ( buf->have_grant )
     {
         release_grant_for_copy(buf->domain, buf->ptr.u.ref, buf->read_only);
@@ -3007,6 +3019,15 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+static void gnttab_copy_release_cache(struct gnttab_copy_cache *cache)
+{
+    unsigned int i;
+
+    for ( i = 0; i < cache->nr; i++ )
+        gnttab_copy_release_buf(&cache->buf[i]);
+    cache->nr = cache->next = 0;
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -3059,7 +3080,6 @@ static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
         buf->have_type = 1;
     }
 
-    buf->virt = map_domain_page(buf->mfn);
     rc = GNTST_okay;
 
  out:
@@ -3070,17 +3090,60 @@ static bool gnttab_copy_buf_valid(
     const struct gnttab_copy_ptr *p, const struct gnttab_copy_buf *b,
     bool has_gref)
 {
-    if ( !b->virt )
+    if ( !b->page )
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/* Find the frame @ptr refers to in @cache, claiming it if not present. */
+static int gnttab_copy_get_buf(const struct gnttab_copy *op,
+                               const struct gnttab_copy_ptr *ptr,
+                               struct gnttab_copy_cache *cache,
+                               unsigned int gref_flag,
+                               struct gnttab_copy_buf **bufp)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < cache->nr; i++ )
+    {
+        buf = &cache->buf[i];
+        if ( gnttab_copy_buf_valid(ptr, buf, op->flags & gref_flag) )
+        {
+            *bufp = buf;
+            return GNTST_okay;
+        }
+    }
+
+    if ( cache->nr < ARRAY_SIZE(cache->buf) )
+        buf = &cache->buf[cache->nr++];
+    else
+    {
+        buf = &cache->buf[cache->next];
+        cache->next = (cache->next + 1) % ARRAY_SIZE(cache->buf);
+        gnttab_copy_release_buf(buf);
+    }
+
+    buf->domain = cache->domain;
+    buf->ptr.domid = cache->domid;
+    rc = gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+    if ( rc )
+        gnttab_copy_release_buf(buf);
+    else
+        *bufp = buf;
+
+    return rc;
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
                            struct gnttab_copy_buf *dest,
                            const struct gnttab_copy_buf *src)
 {
+    void *dest_virt, *src_virt;
+
     if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
          ((op->dest.offset + op->len) > PAGE_SIZE) )
     {
@@ -3108,27 +3171,33 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
     /* Make sure the above checks are not bypassed speculatively */
     block_speculation();
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+    dest_virt = map_domain_page(dest->mfn);
+    src_virt = map_domain_page(src->mfn);
+    memcpy(dest_virt + op->dest.offset, src_virt + op->source.offset,
            op->len);
+    unmap_domain_page(src_virt);
+    unmap_domain_page(dest_virt);
+
     gnttab_mark_dirty(dest->domain, dest->mfn);
 
     return GNTST_okay;
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_cache *dest,
+                           struct gnttab_copy_cache *src)
 {
+    struct gnttab_copy_buf *src_buf, *dest_buf;
     int rc;
 
     if ( unlikely(!op->len) )
         return GNTST_okay;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( !src->domain || op->source.domid != src->domid ||
+         !dest->domain || op->dest.domid != dest->domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
+        gnttab_copy_release_cache(src);
+        gnttab_copy_release_cache(dest);
         gnttab_copy_unlock_domains(src, dest);
 
         rc = gnttab_copy_lock_domains(op, src, dest);
@@ -3136,27 +3205,17 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->source, src, GNTCOPY_source_gref,
+                             &src_buf);
+    if ( rc )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->dest, dest, GNTCOPY_dest_gref,
+                             &dest_buf);
+    if ( rc )
+        goto out;
 
-    rc = gnttab_copy_buf(op, dest, src);
+    rc = gnttab_copy_buf(op, dest_buf, src_buf);
  out:
     return rc;
 }
@@ -3174,8 +3233,8 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_cache src = {};
+    struct gnttab_copy_cache dest = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -3200,8 +3259,8 @@ static long gnttab_copy(
         }
         if ( rc != GNTST_okay )
         {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
+            gnttab_copy_release_cache(&src);
+            gnttab_copy_release_cache(&dest);
         }
 
         op.status = rc;
@@ -3214,8 +3273,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
+    gnttab_copy_release_cache(&src);
+    gnttab_copy_release_cache(&dest);
     gnttab_copy_unlock_domains(&src, &dest);
 
     return rc;
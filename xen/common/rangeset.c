@@ -10,11 +10,16 @@
 #include <xen/sched.h>
 #include <xen/errno.h>
 #include <xen/rangeset.h>
+#include <xen/rbtree.h>
 #include <xsm/xsm.h>
 
-/* An inclusive range [s,e] and pointer to next range in ascending order. */
+/*
+ * An inclusive range [s,e], threaded onto the set's list in ascending order
+ * and indexed by its start in the set's tree.
+ */
 struct range {
     struct list_head list;
+    struct rb_node node;
     unsigned long s, e;
 };
 
@@ -23,8 +28,12 @@ struct rangeset {
     struct list_head rangeset_list;
     struct domain   *domain;
 
-    /* Ordered list of ranges contained in this set, and protecting lock. */
+    /*
+     * Ordered list of ranges contained in this set, search tree over the
+     * same ranges, and protecting lock.
+     */
     struct list_head range_list;
+    struct rb_root   range_tree;
 
     /* Number of ranges that can be allocated */
     long             nr_ranges;
@@ -38,20 +47,32 @@ struct rangeset {
 };
 
 /*****************************
- * Private range functions hide the underlying linked-list implementation.
+ * Private range functions hide the underlying list and tree implementation.
+ *
+ * Ranges in a set never overlap, and updates never move a range past its
+ * neighbours, so ordering by start address (as the tree does) and by list
+ * position are always the same.  Ranges can therefore be resized in place
+ * without touching the tree.
  */
 
 /* Find highest range lower than or containing s. NULL if no such range. */
 static struct range *find_range(
     struct rangeset *r, unsigned long s)
 {
-    struct range *x = NULL, *y;
+    struct rb_node *node = r->range_tree.rb_node;
+    struct range *x = NULL;
 
-    list_for_each_entry ( y, &r->range_list, list )
+    while ( node != NULL )
     {
+        struct range *y = rb_entry(node, struct range, node);
+
         if ( y->s > s )
-            break;
-        x = y;
+            node = node->rb_left;
+        else
+        {
+            x = y;
+            node = node->rb_right;
+        }
     }
 
     return x;
@@ -79,16 +100,31 @@ static struct range *next_range(
 static void insert_range(
     struct rangeset *r, struct range *x, struct range *y)
 {
+    struct rb_node **link = &r->range_tree.rb_node, *parent = NULL;
+
     list_add(&y->list, (x != NULL) ? &x->list : &r->range_list);
+
+    while ( *link != NULL )
+    {
+        parent = *link;
+        if ( y->s < rb_entry(parent, struct range, node)->s )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&y->node, parent, link);
+    rb_insert_color(&y->node, &r->range_tree);
 }
 
-/* Remove a range from its list and free it. */
+/* Remove a range from its list and tree and free it. */
 static void destroy_range(
     struct rangeset *r, struct range *x)
 {
     r->nr_ranges++;
 
     list_del(&x->list);
+    rb_erase(&x->node, &r->range_tree);
     xfree(x);
 }
 
@@ -444,6 +480,7 @@ struct rangeset *rangeset_new(
 
     rwlock_init(&r->lock);
     INIT_LIST_HEAD(&r->range_list);
+    r->range_tree = RB_ROOT;
     r->nr_ranges = -1;
 
     BUG_ON(flags & ~(RANGESETF_prettyprint_hex | RANGESETF_no_print));
@@ -526,6 +563,7 @@ void rangeset_domain_destroy(
 void rangeset_swap(struct rangeset *a, struct rangeset *b)
 {
     LIST_HEAD(tmp);
+    struct rb_root tree;
 
     if ( a < b )
     {
@@ -542,6 +580,10 @@ void rangeset_swap(struct rangeset *a, struct rangeset *b)
     list_splice_init(&b->range_list, &a->range_list);
     list_splice(&tmp, &b->range_list);
 
+    tree = a->range_tree;
+    a->range_tree = b->range_tree;
+    b->range_tree = tree;
+
     write_unlock(&a->lock);
     write_unlock(&b->lock);
 }
@@ -87,6 +87,17 @@ DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
 /* How many urgent vcpus. */
 DEFINE_PER_CPU(atomic_t, sched_urgent_count);
 
+/* When this CPU last asked for the lock around do_schedule() (tracing only). */
+DEFINE_PER_CPU(s_time_t, sched_lock_time);
+
+static inline spinlock_t *sched_lock_timed(unsigned int cpu)
+{
+    if ( unlikely(tb_init_done) )
+        this_cpu(sched_lock_time) = NOW();
+
+    return pcpu_schedule_lock_irq(cpu);
+}
+
 extern const struct sched_ops *__start_schedulers_array[];
 extern const struct sched_ops *__end_schedulers_array[];
 #define NUM_SCHEDULERS (__end_schedulers_array - __start_schedulers_array)
@@ -2587,7 +2598,7 @@ static struct sched_unit *sched_wait_rendezvous_in(struct sched_unit *prev,
 
         cpu_relax();
 
-        *lock = pcpu_schedule_lock_irq(cpu);
+        *lock = sched_lock_timed(cpu);
 
         /*
          * Check for scheduling resource switched. This happens when we are
@@ -2624,7 +2635,7 @@ static void cf_check sched_slave(void)
 
     rcu_read_lock(&sched_res_rculock);
 
-    lock = pcpu_schedule_lock_irq(cpu);
+    lock = sched_lock_timed(cpu);
 
     now = NOW();
 
@@ -2691,7 +2702,7 @@ static void cf_check schedule(void)
 
     rcu_read_lock(&sched_res_rculock);
 
-    lock = pcpu_schedule_lock_irq(cpu);
+    lock = sched_lock_timed(cpu);
 
     sr = get_sched_res(cpu);
     gran = sr->granularity;
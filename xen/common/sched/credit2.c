@@ -68,6 +68,7 @@ static unsigned int cpu_nr_siblings(unsigned int cpu)
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
 #define TRC_CSCHED2_RUNQ_CAND_CHECK  TRC_SCHED_CLASS_EVT(CSCHED2, 23)
+#define TRC_CSCHED2_RUNQ_LOCKED      TRC_SCHED_CLASS_EVT(CSCHED2, 24)
 
 /*
  * TODO:
@@ -504,6 +505,7 @@ struct csched2_runqueue_data {
 
     struct list_head rql;      /* List of runqueues                          */
     struct list_head runq;     /* Ordered list of runnable vms               */
+    unsigned int nr_runq;      /* How many units are in runq                 */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -847,6 +849,36 @@ static inline struct csched2_unit * runq_elem(struct list_head *elem)
     return list_entry(elem, struct csched2_unit, runq_elem);
 }
 
+/*
+ * Time spent with the runqueue lock held, for operations on the runqueue
+ * that depend on its length. @start is when the operation began (and it is
+ * only meaningful if tracing is enabled): for scheduling, that is when the
+ * lock was requested, see sched_lock_time; for insertion, when the walk
+ * of the runqueue started.
+ */
+#define RUNQ_LOCKED_SCHEDULE 0
+#define RUNQ_LOCKED_INSERT   1
+
+static void trace_runq_locked(const struct csched2_runqueue_data *rqd,
+                              unsigned int op, s_time_t start)
+{
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            uint16_t rq_id, op;
+            uint32_t runq_len;
+            uint32_t time;
+        } d = {
+            .rq_id    = rqd->id,
+            .op       = op,
+            .runq_len = rqd->nr_runq,
+            .time     = min_t(s_time_t, NOW() - start, UINT32_MAX),
+        };
+
+        trace_time(TRC_CSCHED2_RUNQ_LOCKED, sizeof(d), &d);
+    }
+}
+
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
 {
     return cpu_to_node(cpua) == cpu_to_node(cpub);
@@ -1438,7 +1470,9 @@ static void runq_insert(struct csched2_unit *svc)
 {
     struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    struct list_head *runq = &rqd->runq;
+    s_time_t start = unlikely(tb_init_done) ? NOW() : 0;
     int pos = 0;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
@@ -1461,6 +1495,7 @@ static void runq_insert(struct csched2_unit *svc)
         pos++;
     }
     list_add_tail(&svc->runq_elem, iter);
+    rqd->nr_runq++;
 
     if ( unlikely(tb_init_done) )
     {
@@ -1473,6 +1508,7 @@ static void runq_insert(struct csched2_unit *svc)
             .pos  = pos,
         };
 
+        trace_runq_locked(rqd, RUNQ_LOCKED_INSERT, start);
         trace_time(TRC_CSCHED2_RUNQ_POS, sizeof(d), &d);
     }
 }
@@ -1480,7 +1516,9 @@ static void runq_insert(struct csched2_unit *svc)
 static inline void runq_remove(struct csched2_unit *svc)
 {
     ASSERT(unit_on_runq(svc));
+    ASSERT(svc->rqd->nr_runq);
     list_del_init(&svc->runq_elem);
+    svc->rqd->nr_runq--;
 }
 
 static void burn_credits(struct csched2_runqueue_data *rqd,
@@ -3775,6 +3813,8 @@ static void cf_check csched2_schedule(
     currunit->next_task = snext->unit;
     snext->unit->migrated = migrated;
 
+    trace_runq_locked(rqd, RUNQ_LOCKED_SCHEDULE, this_cpu(sched_lock_time));
+
     CSCHED2_UNIT_CHECK(currunit->next_task);
 }
 
@@ -3911,7 +3951,7 @@ csched2_dump(const struct scheduler *ops)
         for_each_cpu(j, &rqd->active)
             dump_pcpu(ops, j);
 
-        printk("RUNQ:\n");
+        printk("RUNQ (%u):\n", rqd->nr_runq);
         list_for_each( iter, runq )
         {
             const struct csched2_unit *svc = runq_elem(iter);
@@ -3973,6 +4013,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
         INIT_LIST_HEAD(&rqd->runq);
+        rqd->nr_runq = 0;
         spin_lock_init(&rqd->lock);
         prv->active_queues++;
     }
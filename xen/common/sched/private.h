@@ -208,6 +208,12 @@ DECLARE_PER_CPU(cpumask_t, cpumask_scratch);
 #define cpumask_scratch        (&this_cpu(cpumask_scratch))
 #define cpumask_scratch_cpu(c) (&per_cpu(cpumask_scratch, c))
 
+/*
+ * Time at which the scheduler lock held around ->do_schedule() was
+ * requested.  Only updated while tracing is enabled.
+ */
+DECLARE_PER_CPU(s_time_t, sched_lock_time);
+
 /*
  * Deal with _spin_lock_irqsave() returning the flags value instead of storing
  * it in a passed parameter.
@@ -29,12 +29,24 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Timer wheel geometry: see WHEEL OPERATIONS below. */
+#define WHEEL_SHIFT      20 /* A tick is 2^20ns, about 1ms. */
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SIZE       (1U << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS     4
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
+
+    /* Timer wheel, for timers which aren't due within the next tick. */
+    s_time_t       wheel_clk;
+    unsigned int   wheel_count;
+    uint64_t       wheel_map[WHEEL_LEVELS];
+    struct list_head wheel[WHEEL_LEVELS * WHEEL_SIZE];
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -176,6 +188,207 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * WHEEL OPERATIONS.
+ *
+ * Timers which aren't due within the next tick are parked on a hierarchical
+ * timing wheel, where arming and disarming them is O(1).  Most such timers
+ * (watchdogs, periodic accounting, emulated platform timers) get re-armed or
+ * stopped well before they expire.  Those which don't are moved to the heap
+ * one tick ahead of their deadline, so that they still fire precisely.
+ *
+ * Each of the WHEEL_LEVELS levels has WHEEL_SIZE slots, a slot of level L
+ * covering 2^(L * WHEEL_LEVEL_BITS) ticks.  When the wheel clock reaches the
+ * start of a non-empty slot of level L > 0, its timers are cascaded to the
+ * levels below.  ts->wheel_clk is the first tick not processed yet.
+ *
+ * A timer goes on the lowest level whose WHEEL_SIZE slots starting with the
+ * current one include its tick.  On levels above 0 that is never the current
+ * slot, as the timer would otherwise have fitted a level below.  So the
+ * current slot of those levels is only in use while its start is the tick
+ * being processed, and any other slot in use is the next one of its level
+ * with that index.
+ */
+
+static unsigned int wheel_index(s_time_t tick, unsigned int level)
+{
+    return (tick >> (level * WHEEL_LEVEL_BITS)) & (WHEEL_SIZE - 1);
+}
+
+/* Time at which the wheel needs processing for timers in @tick. */
+static s_time_t wheel_tick_time(s_time_t tick)
+{
+    return (tick - 1) << WHEEL_SHIFT;
+}
+
+/*
+ * Add @t to the wheel of @ts, returning false if it is due too soon.  If
+ * @due is not NULL, it is set to the tick at which @t's slot is processed.
+ */
+static bool add_to_wheel(struct timers *ts, struct timer *t, s_time_t *due)
+{
+    s_time_t tick = t->expires >> WHEEL_SHIFT;
+    unsigned int level, shift, idx;
+
+    BUILD_BUG_ON(WHEEL_LEVELS * WHEEL_SIZE > (typeof(t->wheel_slot))~0 + 1);
+
+    if ( tick < ts->wheel_clk )
+        return false;
+
+    for ( level = 0; ; level++ )
+    {
+        shift = level * WHEEL_LEVEL_BITS;
+        if ( (tick >> shift) - (ts->wheel_clk >> shift) < WHEEL_SIZE )
+            break;
+
+        /*
+         * Timers beyond the wheel's span wait in the last slot of the top
+         * level, and get placed again when it is cascaded.
+         */
+        if ( level == WHEEL_LEVELS - 1 )
+        {
+            tick = ((ts->wheel_clk >> shift) + WHEEL_SIZE - 1) << shift;
+            break;
+        }
+    }
+
+    idx = wheel_index(tick, level);
+    t->wheel_slot = level * WHEEL_SIZE + idx;
+    list_add_tail(&t->wheel_list, &ts->wheel[t->wheel_slot]);
+    ts->wheel_map[level] |= 1ULL << idx;
+    ts->wheel_count++;
+
+    /* The slot gets processed when the wheel clock reaches its start. */
+    if ( due )
+        *due = (tick >> shift) << shift;
+
+    return true;
+}
+
+static int remove_from_wheel(struct timers *ts, struct timer *t)
+{
+    unsigned int slot = t->wheel_slot;
+
+    list_del(&t->wheel_list);
+    if ( list_empty(&ts->wheel[slot]) )
+        ts->wheel_map[slot / WHEEL_SIZE] &= ~(1ULL << (slot % WHEEL_SIZE));
+    ts->wheel_count--;
+
+    /* The wheel never holds the earliest deadline. */
+    return 0;
+}
+
+/* First tick at which the wheel needs processing, or STIME_MAX. */
+static s_time_t wheel_next_tick(const struct timers *ts)
+{
+    s_time_t next = STIME_MAX;
+    unsigned int level;
+
+    if ( !ts->wheel_count )
+        return STIME_MAX;
+
+    for ( level = 0; level < WHEEL_LEVELS; level++ )
+    {
+        unsigned int shift = level * WHEEL_LEVEL_BITS;
+        unsigned int cur = wheel_index(ts->wheel_clk, level);
+        uint64_t map = ts->wheel_map[level];
+        unsigned int offset;
+
+        if ( !map )
+            continue;
+
+        /* Rotate the map such that bit 0 is the current slot. */
+        if ( cur )
+            map = (map >> cur) | (map << (WHEEL_SIZE - cur));
+        offset = ffs64(map) - 1;
+
+        /* See the comment at the top: no slot is a full revolution away. */
+        ASSERT(offset || !(ts->wheel_clk & ((1LL << shift) - 1)));
+
+        next = min(next, ((ts->wheel_clk >> shift) + offset) << shift);
+    }
+
+    return next;
+}
+
+/* Some timer on the wheel of @ts, or NULL if it is empty. */
+static struct timer *wheel_first(const struct timers *ts)
+{
+    unsigned int level;
+
+    for ( level = 0; level < WHEEL_LEVELS; level++ )
+        if ( ts->wheel_map[level] )
+            return list_first_entry(
+                &ts->wheel[level * WHEEL_SIZE +
+                           ffs64(ts->wheel_map[level]) - 1],
+                struct timer, wheel_list);
+
+    return NULL;
+}
+
+/* Keep an empty wheel's clock current, so that new timers get placed well. */
+static void wheel_sync(struct timers *ts)
+{
+    if ( !ts->wheel_count )
+        ts->wheel_clk = max(ts->wheel_clk, (NOW() >> WHEEL_SHIFT) + 2);
+}
+
+static int add_entry(struct timer *t);
+
+/*
+ * Process the wheel of @ts up to one tick beyond @now: cascade slots of
+ * upper levels, and move timers due by then to the heap.
+ */
+static void wheel_advance(struct timers *ts, s_time_t now)
+{
+    s_time_t target = (now >> WHEEL_SHIFT) + 2;
+
+    while ( ts->wheel_clk < target )
+    {
+        s_time_t next = wheel_next_tick(ts);
+        struct list_head *head;
+        unsigned int level;
+        struct timer *t;
+
+        /* Nothing happens for empty slots, so skip straight past them. */
+        if ( next >= target )
+        {
+            ts->wheel_clk = target;
+            break;
+        }
+        ts->wheel_clk = next;
+
+        for ( level = WHEEL_LEVELS - 1; level > 0; level-- )
+        {
+            if ( ts->wheel_clk & ((1LL << (level * WHEEL_LEVEL_BITS)) - 1) )
+                continue;
+
+            head = &ts->wheel[level * WHEEL_SIZE +
+                              wheel_index(ts->wheel_clk, level)];
+            while ( !list_empty(head) )
+            {
+                bool added;
+
+                t = list_first_entry(head, struct timer, wheel_list);
+                remove_from_wheel(ts, t);
+                added = add_to_wheel(ts, t, NULL);
+                ASSERT(added);
+            }
+        }
+
+        head = &ts->wheel[wheel_index(ts->wheel_clk, 0)];
+        ts->wheel_clk++;
+        while ( !list_empty(head) )
+        {
+            t = list_first_entry(head, struct timer, wheel_list);
+            remove_from_wheel(ts, t);
+            t->status = TIMER_STATUS_invalid;
+            add_entry(t);
+        }
+    }
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -193,6 +406,9 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        rc = remove_from_wheel(timers, t);
+        break;
     default:
         rc = 0;
         BUG();
@@ -205,10 +421,21 @@ static int remove_entry(struct timer *t)
 static int add_entry(struct timer *t)
 {
     struct timers *timers = &per_cpu(timers, t->cpu);
+    s_time_t due;
     int rc;
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Park timers not due within the next tick on the wheel. */
+    wheel_sync(timers);
+    if ( add_to_wheel(timers, t, &due) )
+    {
+        s_time_t deadline = per_cpu(timer_deadline, t->cpu);
+
+        t->status = TIMER_STATUS_in_wheel;
+        return !deadline || wheel_tick_time(due) < deadline;
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -499,6 +726,9 @@ static void cf_check timer_softirq_action(void)
 
     now = NOW();
 
+    /* Move timers coming due off the wheel. */
+    wheel_advance(ts, now);
+
     /* Execute ready heap timers. */
     while ( (heap_metadata(heap)->size != 0) &&
             ((t = heap[1])->expires < now) )
@@ -530,6 +760,8 @@ static void cf_check timer_softirq_action(void)
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+    if ( ts->wheel_count )
+        deadline = min(deadline, wheel_tick_time(wheel_next_tick(ts)));
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -561,6 +793,7 @@ static void cf_check dump_timerq(unsigned char key)
     unsigned long  flags;
     s_time_t       now = NOW();
     unsigned int   i, j;
+    struct list_head *head;
 
     printk("Dumping timer queues:\n");
 
@@ -574,6 +807,10 @@ static void cf_check dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list; t != NULL; t = t->list_next )
             dump_timer(t, now);
+        for ( head = ts->wheel; head < ts->wheel + ARRAY_SIZE(ts->wheel);
+              head++ )
+            list_for_each_entry ( t, head, wheel_list )
+                dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -602,7 +839,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
     }
 
     while ( (t = heap_metadata(old_ts->heap)->size
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+             ? old_ts->heap[1] : old_ts->list ?: wheel_first(old_ts)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
@@ -636,6 +873,7 @@ static void free_percpu_timers(unsigned int cpu)
     struct timers *ts = &per_cpu(timers, cpu);
 
     ASSERT(heap_metadata(ts->heap)->size == 0);
+    ASSERT(!ts->wheel_count);
     if ( heap_metadata(ts->heap)->limit )
     {
         xfree(ts->heap);
@@ -657,7 +895,11 @@ static int cf_check cpu_callback(
         /* Only initialise ts once. */
         if ( !ts->heap )
         {
+            unsigned int i;
+
             INIT_LIST_HEAD(&ts->inactive);
+            for ( i = 0; i < ARRAY_SIZE(ts->wheel); i++ )
+                INIT_LIST_HEAD(&ts->wheel[i]);
             spin_lock_init(&ts->lock);
             ts->heap = dummy_heap;
         }
@@ -30,7 +30,6 @@
 #include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <xen/sections.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -54,9 +53,20 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
+/*
+ * Records are inserted without taking a lock or disabling interrupts.  A
+ * writer reserves space by advancing its CPU's t_head with cmpxchg(), fills
+ * it in, and the outermost writer on the CPU then publishes everything
+ * reserved so far by copying t_head to buf->prod.  Writers nested inside it
+ * (tracing from interrupt context) always complete before it resumes, so
+ * they just leave the publishing to it.  t_head uses the same encoding as
+ * buf->prod, and the two are equal whenever t_nesting is zero.
+ */
+static DEFINE_PER_CPU(uint32_t, t_head);
+static DEFINE_PER_CPU(unsigned int, t_nesting);
+
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
@@ -75,21 +85,6 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
-static int cf_check cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     return DIV_ROUND_UP(offsetof(struct t_info, mfn_offset[NR_CPUS]),
@@ -225,7 +220,7 @@ static int alloc_trace_bufs(unsigned int pages)
     {
         struct t_buf *buf;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
+        per_cpu(t_head, cpu) = 0;
 
         offset = t_info->mfn_offset[cpu];
 
@@ -341,7 +336,6 @@ int trace_will_trace_event(u32 event)
 static void __init __constructor init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -413,16 +407,16 @@ int tb_control(struct xen_sysctl_tbuf_op *tbc)
         int i;
 
         tb_init_done = 0;
-        smp_wmb();
-        /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
+        smp_mb(); /* Pairs with the barrier in trace(). */
+        /* Wait for writers which may have seen tracing enabled, then clear any
+         * lost-record info so we don't get phantom lost records next time we
+         * start tracing.  After this hypercall returns, no more records should
+         * be placed into the buffers. */
         for_each_online_cpu(i)
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
+            while ( ACCESS_ONCE(per_cpu(t_nesting, i)) )
+                cpu_relax();
+            per_cpu(lost_records, i) = 0;
         }
     }
         break;
@@ -459,15 +453,10 @@ static inline bool bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(uint32_t prod, uint32_t cons)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
     int32_t x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return data_size;
-
     x = prod - cons;
     if ( x < 0 )
         x += 2*data_size;
@@ -478,15 +467,10 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(uint32_t prod)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
     int32_t x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
-
     x = data_size - prod;
     if ( x <= 0 )
         x += data_size;
@@ -497,27 +481,20 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
+static inline u32 calc_bytes_avail(uint32_t prod, uint32_t cons)
 {
-    return data_size - calc_unconsumed_bytes(buf);
+    return data_size - calc_unconsumed_bytes(prod, cons);
 }
 
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
+static unsigned char *next_record(uint32_t x, unsigned char **next_page,
+                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
     if ( x >= data_size )
         x -= data_size;
 
@@ -546,28 +523,33 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
     return this_page;
 }
 
-static inline void __insert_record(struct t_buf *buf,
-                                   unsigned long event,
-                                   unsigned int extra,
-                                   bool cycles,
-                                   unsigned int rec_size,
-                                   const void *extra_data)
+static uint32_t insert_pad_record(const struct t_buf *buf, uint32_t next,
+                                  unsigned int size);
+
+/*
+ * Write a record at @next, which must have been reserved, and return the
+ * position following it.
+ */
+static inline uint32_t __insert_record(const struct t_buf *buf,
+                                       uint32_t next,
+                                       unsigned long event,
+                                       unsigned int extra,
+                                       bool cycles,
+                                       unsigned int rec_size,
+                                       const void *extra_data)
 {
     struct t_rec split_rec, *rec;
     uint32_t *dst;
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
+    this_page = next_record(next, &next_page, &offset);
 
     remaining = PAGE_SIZE - offset;
 
@@ -575,11 +557,20 @@ static inline void __insert_record(struct t_buf *buf,
     {
         if ( next_page == NULL )
         {
-            /* access beyond end of buffer */
-            printk(XENLOG_WARNING
-                   "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
-                   __func__, data_size, next, buf->cons, rec_size, remaining);
-            return;
+            /*
+             * Access beyond end of buffer.  The space is reserved already:
+             * drop the record, count it as lost, and fill the space with
+             * records the consumer skips.
+             */
+            printk_once(XENLOG_WARNING
+                        "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
+                        __func__, data_size, next, buf->cons, rec_size,
+                        remaining);
+            if ( arch_fetch_and_add(&this_cpu(lost_records), 1) == 0 )
+                this_cpu(lost_records_first_tsc) = (u64)get_cycles();
+
+            next = insert_pad_record(buf, next, remaining);
+            return insert_pad_record(buf, next, rec_size - remaining);
         }
         rec = &split_rec;
     } else {
@@ -606,24 +597,21 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
 
-    smp_wmb();
-
     next += rec_size;
     if ( next >= 2*data_size )
         next -= 2*data_size;
     ASSERT(next < 2*data_size);
-    buf->prod = next;
+
+    return next;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
-                                      unsigned int size)
+/* Fill @size bytes at @next with a wrap record, which the consumer skips. */
+static uint32_t insert_pad_record(const struct t_buf *buf, uint32_t next,
+                                  unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
-    unsigned int extra_space = space_left - sizeof(u32);
+    unsigned int extra_space = size - sizeof(u32);
     bool cycles = false;
 
-    BUG_ON(space_left > size);
-
     /* We may need to add cycles to take up enough space... */
     if ( (extra_space/sizeof(u32)) > TRACE_EXTRA_MAX )
     {
@@ -632,13 +620,27 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
-                    space_left, NULL);
+    return __insert_record(buf, next, TRC_TRACE_WRAP_BUFFER, extra_space,
+                           cycles, size, NULL);
+}
+
+static inline uint32_t insert_wrap_record(const struct t_buf *buf,
+                                          uint32_t next,
+                                          unsigned int size)
+{
+    u32 space_left = calc_bytes_to_wrap(next);
+
+    BUG_ON(space_left > size);
+
+    return insert_pad_record(buf, next, space_left);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline uint32_t insert_lost_records(const struct t_buf *buf,
+                                           uint32_t next,
+                                           unsigned long lost,
+                                           uint64_t first_tsc)
 {
     struct __packed {
         u32 lost_records;
@@ -648,13 +650,11 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
-    ed.first_tsc = this_cpu(lost_records_first_tsc);
-
-    this_cpu(lost_records) = 0;
+    ed.lost_records = lost;
+    ed.first_tsc = first_tsc;
 
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
-                    LOST_REC_SIZE, &ed);
+    return __insert_record(buf, next, TRC_LOST_RECORDS, sizeof(ed),
+                           1 /* cycles */, LOST_REC_SIZE, &ed);
 }
 
 /*
@@ -679,10 +679,12 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
 void trace(uint32_t event, unsigned int extra, const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
+    uint32_t head, next, cons;
     u32 bytes_to_tail, bytes_to_wrap;
     unsigned int rec_size, total_size;
-    bool started_below_highwater;
+    unsigned long lost;
+    uint64_t lost_tsc;
+    bool crossed_highwater = false, outermost;
     bool cycles = event & TRC_HD_CYCLE_FLAG;
 
     if( !tb_init_done )
@@ -714,99 +716,144 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return;
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
 
     if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        return;
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    /*
+     * Any writer interrupting us has finished, and restored t_nesting, by
+     * the time we resume, so a plain increment is good enough here.
+     */
+    outermost = !this_cpu(t_nesting)++;
+    smp_mb(); /* Pairs with the barrier in tb_control(). */
+
+    if ( !tb_init_done )
+        goto publish;
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
-
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-
     /*
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
+     * Reserve space for the record, plus whatever wrap and lost_records
+     * records need to go in front of it.  A nested writer reserving space
+     * meanwhile makes the cmpxchg() fail, and we go round again.
      */
-    total_size = 0;
+    do {
+        head = ACCESS_ONCE(this_cpu(t_head));
+        cons = ACCESS_ONCE(buf->cons);
 
-    /* First, check to see if we need to include a lost_record.
-     */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
+        if ( bogus(head, cons) )
+            goto publish;
+
+        /*
+         * Nested writers leave reporting lost records to the outermost one,
+         * so that the count it claims below can only have gone up.
+         */
+        lost = outermost ? ACCESS_ONCE(this_cpu(lost_records)) : 0;
+
+        /* How many bytes are available in the buffer? */
+        bytes_to_tail = calc_bytes_avail(head, cons);
+
+        /* How many bytes until the next wrap-around? */
+        bytes_to_wrap = calc_bytes_to_wrap(head);
+
+        /*
+         * Calculate expected total size to commit this record by
+         * doing a dry-run.
+         */
+        total_size = 0;
+
+        /* First, check to see if we need to include a lost_record.
+         */
+        if ( lost )
+        {
+            if ( LOST_REC_SIZE > bytes_to_wrap )
+            {
+                total_size += bytes_to_wrap;
+                bytes_to_wrap = data_size;
+            }
+            total_size += LOST_REC_SIZE;
+            bytes_to_wrap -= LOST_REC_SIZE;
+
+            /* LOST_REC might line up perfectly with the buffer wrap */
+            if ( bytes_to_wrap == 0 )
+                bytes_to_wrap = data_size;
+        }
+
+        if ( rec_size > bytes_to_wrap )
         {
             total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
         }
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
+        total_size += rec_size;
 
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
+        /* Do we have enough space for everything? */
+        if ( total_size > bytes_to_tail )
+        {
+            if ( arch_fetch_and_add(&this_cpu(lost_records), 1) == 0 )
+                this_cpu(lost_records_first_tsc)=(u64)get_cycles();
+            goto publish;
+        }
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    }
-    total_size += rec_size;
+        next = head + total_size;
+        if ( next >= 2 * data_size )
+            next -= 2 * data_size;
+    } while ( cmpxchg(&this_cpu(t_head), head, next) != head );
 
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+    /* Notify trace buffer consumer when we cross the high water mark. */
+    crossed_highwater =
+        calc_unconsumed_bytes(head, cons) < t_buf_highwater &&
+        calc_unconsumed_bytes(next, cons) >= t_buf_highwater;
 
     /*
      * Now, actually write information
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    bytes_to_wrap = calc_bytes_to_wrap(head);
 
-    if ( this_cpu(lost_records) )
+    if ( lost )
     {
+        lost_tsc = this_cpu(lost_records_first_tsc);
+        lost = xchg(&this_cpu(lost_records), 0);
+
         if ( LOST_REC_SIZE > bytes_to_wrap )
-        {
-            insert_wrap_record(buf, LOST_REC_SIZE);
-            bytes_to_wrap = data_size;
-        }
-        insert_lost_records(buf);
-        bytes_to_wrap -= LOST_REC_SIZE;
+            head = insert_wrap_record(buf, head, LOST_REC_SIZE);
+        head = insert_lost_records(buf, head, lost, lost_tsc);
 
         /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
+        bytes_to_wrap = calc_bytes_to_wrap(head);
     }
 
     if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+        head = insert_wrap_record(buf, head, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    head = __insert_record(buf, head, event, extra, cycles, rec_size,
+                           extra_data);
+    ASSERT(head == next);
+
+ publish:
+    /*
+     * The outermost writer publishes what it and any writers which
+     * interrupted it have reserved.  Once t_nesting is back to zero, an
+     * interrupting writer is the outermost one and publishes for itself,
+     * but something may have been reserved just before that.
+     */
+    while ( outermost )
+    {
+        head = ACCESS_ONCE(this_cpu(t_head));
+        smp_wmb(); /* Records must be visible before prod. */
+        ACCESS_ONCE(buf->prod) = head;
+
+        this_cpu(t_nesting)--;
+        if ( likely(ACCESS_ONCE(this_cpu(t_head)) == head) )
+            break;
+        this_cpu(t_nesting)++;
+    }
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    if ( !outermost )
+        this_cpu(t_nesting)--;
 
-    /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( crossed_highwater )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 
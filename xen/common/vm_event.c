@@ -22,6 +22,7 @@
 
 #include <xen/sched.h>
 #include <xen/event.h>
+#include <xen/guest_access.h>
 #include <xen/wait.h>
 #include <xen/vm_event.h>
 #include <xen/mem_access.h>
@@ -51,6 +52,7 @@ static int vm_event_enable(
 {
     int rc;
     unsigned long ring_gfn = d->arch.hvm.params[param];
+    unsigned int i, nr_rings = 1;
     struct vm_event_domain *ved;
 
     /*
@@ -60,38 +62,69 @@ static int vm_event_enable(
     if ( *p_ved != NULL )
         return -EBUSY;
 
+    if ( vec->op == XEN_VM_EVENT_ENABLE_RINGS )
+    {
+        nr_rings = vec->u.enable_rings.nr_rings;
+        if ( nr_rings == 0 || nr_rings > d->max_vcpus ||
+             vec->u.enable_rings.pad )
+            return -EINVAL;
+    }
     /* No chosen ring GFN?  Nothing we can do. */
-    if ( ring_gfn == 0 )
+    else if ( ring_gfn == 0 )
         return -EOPNOTSUPP;
 
-    ved = xzalloc(struct vm_event_domain);
+    ved = xzalloc_flex_struct(struct vm_event_domain, ring, nr_rings);
     if ( !ved )
         return -ENOMEM;
 
     /* Trivial setup. */
-    spin_lock_init(&ved->lock);
-    init_waitqueue_head(&ved->wq);
+    for ( i = 0; i < nr_rings; i++ )
+    {
+        spin_lock_init(&ved->ring[i].lock);
+        init_waitqueue_head(&ved->ring[i].wq);
+    }
     ved->pause_flag = pause_flag;
+    ved->nr_rings = nr_rings;
 
     rc = vm_event_init_domain(d);
     if ( rc < 0 )
         goto err;
 
-    rc = prepare_ring_for_helper(d, ring_gfn, &ved->ring_pg_struct,
-                                 &ved->ring_page);
-    if ( rc < 0 )
-        goto err;
-
-    FRONT_RING_INIT(&ved->front_ring,
-                    (vm_event_sring_t *)ved->ring_page,
-                    PAGE_SIZE);
-
-    rc = alloc_unbound_xen_event_channel(d, 0, current->domain->domain_id,
-                                         notification_fn);
-    if ( rc < 0 )
-        goto err;
+    for ( i = 0; i < nr_rings; i++ )
+    {
+        struct vm_event_ring *ring = &ved->ring[i];
+        uint64_t gfn = ring_gfn;
+        uint32_t port;
+
+        rc = -EFAULT;
+        if ( vec->op == XEN_VM_EVENT_ENABLE_RINGS &&
+             copy_from_guest_offset(&gfn, vec->u.enable_rings.gfns, i, 1) )
+            goto err;
+
+        rc = prepare_ring_for_helper(d, gfn, &ring->ring_pg_struct,
+                                     &ring->ring_page);
+        if ( rc < 0 )
+            goto err;
+
+        FRONT_RING_INIT(&ring->front_ring,
+                        (vm_event_sring_t *)ring->ring_page,
+                        PAGE_SIZE);
+
+        rc = alloc_unbound_xen_event_channel(d, 0, current->domain->domain_id,
+                                             notification_fn);
+        if ( rc < 0 )
+            goto err;
+
+        ring->xen_port = port = rc;
+
+        rc = -EFAULT;
+        if ( vec->op == XEN_VM_EVENT_ENABLE_RINGS &&
+             copy_to_guest_offset(vec->u.enable_rings.ports, i, &port, 1) )
+            goto err;
+    }
 
-    ved->xen_port = vec->u.enable.port = rc;
+    if ( vec->op == XEN_VM_EVENT_ENABLE )
+        vec->u.enable.port = ved->ring[0].xen_port;
 
     /* Success.  Fill in the domain's appropriate ved. */
     *p_ved = ved;
@@ -99,18 +132,54 @@ static int vm_event_enable(
     return 0;
 
  err:
-    destroy_ring_for_helper(&ved->ring_page, ved->ring_pg_struct);
+    for ( i = 0; i < nr_rings; i++ )
+    {
+        struct vm_event_ring *ring = &ved->ring[i];
+
+        /* Port 0 is reserved, so never one of ours. */
+        if ( ring->xen_port )
+            free_xen_event_channel(d, ring->xen_port);
+        destroy_ring_for_helper(&ring->ring_page, ring->ring_pg_struct);
+    }
     xfree(ved);
 
     return rc;
 }
 
-static unsigned int vm_event_ring_available(struct vm_event_domain *ved)
+/*
+ * The ring the current context puts its requests on: guest vCPUs are spread
+ * over all rings, while foreign producers (the toolstack, helpers of other
+ * domains) all use the first one.  claim_slot(), put_request() and
+ * cancel_slot() on behalf of a request all run in the same context, so agree
+ * on the ring.
+ */
+static struct vm_event_ring *vm_event_ring(const struct domain *d,
+                                           struct vm_event_domain *ved)
+{
+    const struct vcpu *curr = current;
+
+    if ( curr->domain != d )
+        return &ved->ring[0];
+
+    return &ved->ring[curr->vcpu_id % ved->nr_rings];
+}
+
+/* The number of vCPUs putting their requests on @ring. */
+static unsigned int vm_event_ring_vcpus(const struct domain *d,
+                                        const struct vm_event_domain *ved,
+                                        const struct vm_event_ring *ring)
+{
+    unsigned int r = ring - ved->ring;
+
+    return (d->max_vcpus - r + ved->nr_rings - 1) / ved->nr_rings;
+}
+
+static unsigned int vm_event_ring_available(struct vm_event_ring *ring)
 {
-    int avail_req = RING_FREE_REQUESTS(&ved->front_ring);
+    int avail_req = RING_FREE_REQUESTS(&ring->front_ring);
 
-    avail_req -= ved->target_producers;
-    avail_req -= ved->foreign_producers;
+    avail_req -= ring->target_producers;
+    avail_req -= ring->foreign_producers;
 
     BUG_ON(avail_req < 0);
 
@@ -123,32 +192,36 @@ static unsigned int vm_event_ring_available(struct vm_event_domain *ved)
  * but need to be resumed where the ring is capable of processing at least
  * one event from them.
  */
-static void vm_event_wake_blocked(struct domain *d, struct vm_event_domain *ved)
+static void vm_event_wake_blocked(struct domain *d, struct vm_event_domain *ved,
+                                  struct vm_event_ring *ring)
 {
     struct vcpu *v;
-    unsigned int i, j, k, avail_req = vm_event_ring_available(ved);
+    unsigned int i, j, k, avail_req = vm_event_ring_available(ring);
+    unsigned int r = ring - ved->ring, nr = ved->nr_rings;
+    unsigned int n = vm_event_ring_vcpus(d, ved, ring);
 
-    if ( avail_req == 0 || ved->blocked == 0 )
+    if ( avail_req == 0 || ring->blocked == 0 )
         return;
 
     /* We remember which vcpu last woke up to avoid scanning always linearly
-     * from zero and starving higher-numbered vcpus under high load */
-    for ( i = ved->last_vcpu_wake_up + 1, j = 0; j < d->max_vcpus; i++, j++ )
+     * from zero and starving higher-numbered vcpus under high load.  Only
+     * vCPUs r, r + nr, r + 2 * nr, ... use ring r, so can be blocked on it. */
+    for ( i = ring->last_vcpu_wake_up / nr + 1, j = 0; j < n; i++, j++ )
     {
-        k = i % d->max_vcpus;
+        k = (i % n) * nr + r;
         v = d->vcpu[k];
         if ( !v )
             continue;
 
-        if ( !ved->blocked || avail_req == 0 )
+        if ( !ring->blocked || avail_req == 0 )
             break;
 
         if ( test_and_clear_bit(ved->pause_flag, &v->pause_flags) )
         {
             vcpu_unpause(v);
             avail_req--;
-            ved->blocked--;
-            ved->last_vcpu_wake_up = k;
+            ring->blocked--;
+            ring->last_vcpu_wake_up = k;
         }
     }
 }
@@ -158,12 +231,12 @@ static void vm_event_wake_blocked(struct domain *d, struct vm_event_domain *ved)
  * was unable to do so, it is queued on a wait queue.  These are woken as
  * needed, and take precedence over the blocked vCPUs.
  */
-static void vm_event_wake_queued(struct domain *d, struct vm_event_domain *ved)
+static void vm_event_wake_queued(struct domain *d, struct vm_event_ring *ring)
 {
-    unsigned int avail_req = vm_event_ring_available(ved);
+    unsigned int avail_req = vm_event_ring_available(ring);
 
     if ( avail_req > 0 )
-        wake_up_nr(&ved->wq, avail_req);
+        wake_up_nr(&ring->wq, avail_req);
 }
 
 /*
@@ -173,48 +246,69 @@ static void vm_event_wake_queued(struct domain *d, struct vm_event_domain *ved)
  * call vm_event_wake() again, ensuring that any blocked vCPUs will get
  * unpaused once all the queued vCPUs have made it through.
  */
-static void vm_event_wake(struct domain *d, struct vm_event_domain *ved)
+static void vm_event_wake(struct domain *d, struct vm_event_domain *ved,
+                          struct vm_event_ring *ring)
 {
-    if ( !list_empty(&ved->wq.list) )
-        vm_event_wake_queued(d, ved);
+    if ( !list_empty(&ring->wq.list) )
+        vm_event_wake_queued(d, ring);
     else
-        vm_event_wake_blocked(d, ved);
+        vm_event_wake_blocked(d, ved, ring);
 }
 
 static int vm_event_disable(struct domain *d, struct vm_event_domain **p_ved)
 {
     struct vm_event_domain *ved = *p_ved;
+    unsigned int i;
 
     if ( vm_event_check_ring(ved) )
     {
         struct vcpu *v;
 
-        spin_lock(&ved->lock);
-
-        if ( !list_empty(&ved->wq.list) )
+        /*
+         * The domain is paused (or dying), so no vCPU can get onto a wait
+         * queue behind our back once we have found them all empty.
+         */
+        for ( i = 0; i < ved->nr_rings; i++ )
         {
-            spin_unlock(&ved->lock);
-            return -EBUSY;
-        }
+            struct vm_event_ring *ring = &ved->ring[i];
+            bool busy;
 
-        /* Free domU's event channel and leave the other one unbound */
-        free_xen_event_channel(d, ved->xen_port);
+            spin_lock(&ring->lock);
+            busy = !list_empty(&ring->wq.list);
+            spin_unlock(&ring->lock);
 
-        /* Unblock all vCPUs */
-        for_each_vcpu ( d, v )
+            if ( busy )
+                return -EBUSY;
+        }
+
+        for ( i = 0; i < ved->nr_rings; i++ )
         {
-            if ( test_and_clear_bit(ved->pause_flag, &v->pause_flags) )
+            struct vm_event_ring *ring = &ved->ring[i];
+
+            spin_lock(&ring->lock);
+
+            /* Free domU's event channel and leave the other one unbound */
+            free_xen_event_channel(d, ring->xen_port);
+
+            /* Unblock the vCPUs of this ring */
+            for_each_vcpu ( d, v )
             {
-                vcpu_unpause(v);
-                ved->blocked--;
+                if ( v->vcpu_id % ved->nr_rings != i )
+                    continue;
+
+                if ( test_and_clear_bit(ved->pause_flag, &v->pause_flags) )
+                {
+                    vcpu_unpause(v);
+                    ring->blocked--;
+                }
             }
-        }
 
-        destroy_ring_for_helper(&ved->ring_page, ved->ring_pg_struct);
+            destroy_ring_for_helper(&ring->ring_page, ring->ring_pg_struct);
 
-        vm_event_cleanup_domain(d);
+            spin_unlock(&ring->lock);
+        }
 
-        spin_unlock(&ved->lock);
+        vm_event_cleanup_domain(d);
     }
 
     xfree(ved);
@@ -224,28 +318,30 @@ static int vm_event_disable(struct domain *d, struct vm_event_domain **p_ved)
 }
 
 static void vm_event_release_slot(struct domain *d,
-                                  struct vm_event_domain *ved)
+                                  struct vm_event_domain *ved,
+                                  struct vm_event_ring *ring)
 {
     /* Update the accounting */
     if ( current->domain == d )
-        ved->target_producers--;
+        ring->target_producers--;
     else
-        ved->foreign_producers--;
+        ring->foreign_producers--;
 
     /* Kick any waiters */
-    vm_event_wake(d, ved);
+    vm_event_wake(d, ved, ring);
 }
 
 /*
  * vm_event_mark_and_pause() tags vcpu and put it to sleep.
  * The vcpu will resume execution in vm_event_wake_blocked().
  */
-static void vm_event_mark_and_pause(struct vcpu *v, struct vm_event_domain *ved)
+static void vm_event_mark_and_pause(struct vcpu *v, struct vm_event_domain *ved,
+                                    struct vm_event_ring *ring)
 {
     if ( !test_and_set_bit(ved->pause_flag, &v->pause_flags) )
     {
         vcpu_pause_nosync(v);
-        ved->blocked++;
+        ring->blocked++;
     }
 }
 
@@ -259,6 +355,7 @@ void vm_event_put_request(struct domain *d,
                           struct vm_event_domain *ved,
                           vm_event_request_t *req)
 {
+    struct vm_event_ring *ring;
     vm_event_front_ring_t *front_ring;
     int free_req;
     unsigned int avail_req;
@@ -279,10 +376,12 @@ void vm_event_put_request(struct domain *d,
 
     req->version = VM_EVENT_INTERFACE_VERSION;
 
-    spin_lock(&ved->lock);
+    ring = vm_event_ring(d, ved);
+
+    spin_lock(&ring->lock);
 
     /* Due to the reservations, this step must succeed. */
-    front_ring = &ved->front_ring;
+    front_ring = &ring->front_ring;
     free_req = RING_FREE_REQUESTS(front_ring);
     ASSERT(free_req > 0);
 
@@ -296,31 +395,32 @@ void vm_event_put_request(struct domain *d,
     RING_PUSH_REQUESTS(front_ring);
 
     /* We've actually *used* our reservation, so release the slot. */
-    vm_event_release_slot(d, ved);
+    vm_event_release_slot(d, ved, ring);
 
     /* Give this vCPU a black eye if necessary, on the way out.
      * See the comments above wake_blocked() for more information
      * on how this mechanism works to avoid waiting. */
-    avail_req = vm_event_ring_available(ved);
-    if( curr->domain == d && avail_req < d->max_vcpus &&
+    avail_req = vm_event_ring_available(ring);
+    if( curr->domain == d && avail_req < vm_event_ring_vcpus(d, ved, ring) &&
         !atomic_read(&curr->vm_event_pause_count) )
-        vm_event_mark_and_pause(curr, ved);
+        vm_event_mark_and_pause(curr, ved, ring);
 
-    spin_unlock(&ved->lock);
+    spin_unlock(&ring->lock);
 
-    notify_via_xen_event_channel(d, ved->xen_port);
+    notify_via_xen_event_channel(d, ring->xen_port);
 }
 
 static int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
+                                 struct vm_event_ring *ring,
                                  vm_event_response_t *rsp)
 {
     vm_event_front_ring_t *front_ring;
     RING_IDX rsp_cons;
     int rc = 0;
 
-    spin_lock(&ved->lock);
+    spin_lock(&ring->lock);
 
-    front_ring = &ved->front_ring;
+    front_ring = &ring->front_ring;
     rsp_cons = front_ring->rsp_cons;
 
     if ( !RING_HAS_UNCONSUMED_RESPONSES(front_ring) )
@@ -336,12 +436,12 @@ static int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
 
     /* Kick any waiters -- since we've just consumed an event,
      * there may be additional space available in the ring. */
-    vm_event_wake(d, ved);
+    vm_event_wake(d, ved, ring);
 
     rc = 1;
 
  out:
-    spin_unlock(&ved->lock);
+    spin_unlock(&ring->lock);
 
     return rc;
 }
@@ -354,7 +454,8 @@ static int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
  * Note: responses are handled the same way regardless of which ring they
  * arrive on.
  */
-static int vm_event_resume(struct domain *d, struct vm_event_domain *ved)
+static void vm_event_resume_ring(struct domain *d, struct vm_event_domain *ved,
+                                 struct vm_event_ring *ring)
 {
     vm_event_response_t rsp;
 
@@ -368,11 +469,8 @@ static int vm_event_resume(struct domain *d, struct vm_event_domain *ved)
      */
     ASSERT(d != current->domain);
 
-    if ( unlikely(!vm_event_check_ring(ved)) )
-         return -ENODEV;
-
     /* Pull all responses off the ring. */
-    while ( vm_event_get_response(d, ved, &rsp) )
+    while ( vm_event_get_response(d, ved, ring, &rsp) )
     {
         struct vcpu *v;
 
@@ -449,70 +547,103 @@ static int vm_event_resume(struct domain *d, struct vm_event_domain *ved)
                 vm_event_vcpu_unpause(v);
         }
     }
+}
+
+/* Pull the responses off all rings. */
+static int vm_event_resume(struct domain *d, struct vm_event_domain *ved)
+{
+    unsigned int i;
+
+    if ( unlikely(!vm_event_check_ring(ved)) )
+         return -ENODEV;
+
+    for ( i = 0; i < ved->nr_rings; i++ )
+        vm_event_resume_ring(d, ved, &ved->ring[i]);
 
     return 0;
 }
 
+/* Pull the responses off the ring whose event channel was notified. */
+static void vm_event_resume_port(struct domain *d, struct vm_event_domain *ved,
+                                 unsigned int port)
+{
+    unsigned int i;
+
+    if ( unlikely(!vm_event_check_ring(ved)) )
+         return;
+
+    for ( i = 0; i < ved->nr_rings; i++ )
+        if ( ved->ring[i].xen_port == port )
+        {
+            vm_event_resume_ring(d, ved, &ved->ring[i]);
+            break;
+        }
+}
+
 void vm_event_cancel_slot(struct domain *d, struct vm_event_domain *ved)
 {
+    struct vm_event_ring *ring;
+
     if( !vm_event_check_ring(ved) )
         return;
 
-    spin_lock(&ved->lock);
-    vm_event_release_slot(d, ved);
-    spin_unlock(&ved->lock);
+    ring = vm_event_ring(d, ved);
+
+    spin_lock(&ring->lock);
+    vm_event_release_slot(d, ved, ring);
+    spin_unlock(&ring->lock);
 }
 
-static int vm_event_grab_slot(struct vm_event_domain *ved, int foreign)
+static int vm_event_grab_slot(struct vm_event_ring *ring, int foreign)
 {
     unsigned int avail_req;
     int rc;
 
-    if ( !ved->ring_page )
+    if ( !ring->ring_page )
         return -EOPNOTSUPP;
 
-    spin_lock(&ved->lock);
+    spin_lock(&ring->lock);
 
-    avail_req = vm_event_ring_available(ved);
+    avail_req = vm_event_ring_available(ring);
 
     rc = -EBUSY;
     if ( avail_req == 0 )
         goto out;
 
     if ( !foreign )
-        ved->target_producers++;
+        ring->target_producers++;
     else
-        ved->foreign_producers++;
+        ring->foreign_producers++;
 
     rc = 0;
 
  out:
-    spin_unlock(&ved->lock);
+    spin_unlock(&ring->lock);
 
     return rc;
 }
 
 /* Simple try_grab wrapper for use in the wait_event() macro. */
-static int vm_event_wait_try_grab(struct vm_event_domain *ved, int *rc)
+static int vm_event_wait_try_grab(struct vm_event_ring *ring, int *rc)
 {
-    *rc = vm_event_grab_slot(ved, 0);
+    *rc = vm_event_grab_slot(ring, 0);
 
     return *rc;
 }
 
 /* Call vm_event_grab_slot() until the ring doesn't exist, or is available. */
-static int vm_event_wait_slot(struct vm_event_domain *ved)
+static int vm_event_wait_slot(struct vm_event_ring *ring)
 {
     int rc = -EBUSY;
 
-    wait_event(ved->wq, vm_event_wait_try_grab(ved, &rc) != -EBUSY);
+    wait_event(ring->wq, vm_event_wait_try_grab(ring, &rc) != -EBUSY);
 
     return rc;
 }
 
 bool vm_event_check_ring(struct vm_event_domain *ved)
 {
-    return ved && ved->ring_page;
+    return ved && ved->ring[0].ring_page;
 }
 
 /*
@@ -530,63 +661,75 @@ bool vm_event_check_ring(struct vm_event_domain *ved)
 int __vm_event_claim_slot(struct domain *d, struct vm_event_domain *ved,
                           bool allow_sleep)
 {
+    struct vm_event_ring *ring;
+
     if ( !vm_event_check_ring(ved) )
         return -EOPNOTSUPP;
 
+    ring = vm_event_ring(d, ved);
+
     if ( (current->domain == d) && allow_sleep )
-        return vm_event_wait_slot(ved);
+        return vm_event_wait_slot(ring);
     else
-        return vm_event_grab_slot(ved, current->domain != d);
+        return vm_event_grab_slot(ring, current->domain != d);
 }
 
 #ifdef CONFIG_MEM_PAGING
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void cf_check mem_paging_notification(struct vcpu *v, unsigned int port)
 {
-    vm_event_resume(v->domain, v->domain->vm_event_paging);
+    vm_event_resume_port(v->domain, v->domain->vm_event_paging, port);
 }
 #endif
 
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void cf_check monitor_notification(struct vcpu *v, unsigned int port)
 {
-    vm_event_resume(v->domain, v->domain->vm_event_monitor);
+    vm_event_resume_port(v->domain, v->domain->vm_event_monitor, port);
 }
 
 #ifdef CONFIG_MEM_SHARING
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void cf_check mem_sharing_notification(struct vcpu *v, unsigned int port)
 {
-    vm_event_resume(v->domain, v->domain->vm_event_share);
+    vm_event_resume_port(v->domain, v->domain->vm_event_share, port);
 }
 #endif
 
+/*
+ * Destroying the wait queue heads means waking up all queued vcpus. This will
+ * drain the lists, allowing the disable routine to complete. It will also drop
+ * all domain refs the wait-queued vcpus are holding. Finally, because this
+ * code path involves previously pausing the domain (domain_kill), unpausing
+ * the vcpus causes no harm.
+ */
+static void vm_event_destroy_waitqueues(struct vm_event_domain *ved)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ved->nr_rings; i++ )
+        destroy_waitqueue_head(&ved->ring[i].wq);
+}
+
 /* Clean up on domain destruction */
 void vm_event_cleanup(struct domain *d)
 {
 #ifdef CONFIG_MEM_PAGING
     if ( vm_event_check_ring(d->vm_event_paging) )
     {
-        /* Destroying the wait queue head means waking up all
-         * queued vcpus. This will drain the list, allowing
-         * the disable routine to complete. It will also drop
-         * all domain refs the wait-queued vcpus are holding.
-         * Finally, because this code path involves previously
-         * pausing the domain (domain_kill), unpausing the
-         * vcpus causes no harm. */
-        destroy_waitqueue_head(&d->vm_event_paging->wq);
+        vm_event_destroy_waitqueues(d->vm_event_paging);
         (void)vm_event_disable(d, &d->vm_event_paging);
     }
 #endif
     if ( vm_event_check_ring(d->vm_event_monitor) )
     {
-        destroy_waitqueue_head(&d->vm_event_monitor->wq);
+        vm_event_destroy_waitqueues(d->vm_event_monitor);
         (void)vm_event_disable(d, &d->vm_event_monitor);
     }
 #ifdef CONFIG_MEM_SHARING
     if ( vm_event_check_ring(d->vm_event_share) )
     {
-        destroy_waitqueue_head(&d->vm_event_share->wq);
+        vm_event_destroy_waitqueues(d->vm_event_share);
         (void)vm_event_disable(d, &d->vm_event_share);
     }
 #endif
@@ -642,6 +785,7 @@ int vm_event_domctl(struct domain *d, struct xen_domctl_vm_event_op *vec)
         switch( vec->op )
         {
         case XEN_VM_EVENT_ENABLE:
+        case XEN_VM_EVENT_ENABLE_RINGS:
         {
             rc = -EOPNOTSUPP;
             /* hvm fixme: p2m_is_foreign types need addressing */
@@ -698,6 +842,7 @@ int vm_event_domctl(struct domain *d, struct xen_domctl_vm_event_op *vec)
         switch( vec->op )
         {
         case XEN_VM_EVENT_ENABLE:
+        case XEN_VM_EVENT_ENABLE_RINGS:
             /* domain_pause() not required here, see XSA-99 */
             rc = arch_monitor_init_domain(d);
             if ( rc )
@@ -736,6 +881,7 @@ int vm_event_domctl(struct domain *d, struct xen_domctl_vm_event_op *vec)
         switch( vec->op )
         {
         case XEN_VM_EVENT_ENABLE:
+        case XEN_VM_EVENT_ENABLE_RINGS:
             rc = -EOPNOTSUPP;
             /* hvm fixme: p2m_is_foreign types need addressing */
             if ( is_hvm_domain(hardware_domain) )
@@ -22,6 +22,67 @@
 #include <xen/sched.h>
 #include <xen/vmap.h>
 
+#define VPCI_INDEX_LEAF_SIZE (1U << VPCI_INDEX_LEAF_SHIFT)
+
+/* Index slot of the config space dword containing @reg, if allocated. */
+static struct vpci_register **vpci_index_slot(const struct vpci *vpci,
+                                              unsigned int reg)
+{
+    unsigned int dword = reg / 4;
+    struct vpci_register **leaf = vpci->index[dword >> VPCI_INDEX_LEAF_SHIFT];
+
+    return leaf ? &leaf[dword & (VPCI_INDEX_LEAF_SIZE - 1)] : NULL;
+}
+
+/*
+ * First handler in the list that may overlap [reg, reg + size), or NULL if
+ * none does.  Handlers further down the list may overlap as well, so this is
+ * where to start walking the list from, rather than from its head.
+ */
+static struct vpci_register *vpci_index_first(const struct vpci *vpci,
+                                              unsigned int reg,
+                                              unsigned int size)
+{
+    unsigned int end = reg + size;
+
+    for ( reg &= ~3; reg < end; reg += 4 )
+    {
+        struct vpci_register **slot = vpci_index_slot(vpci, reg);
+
+        if ( slot && *slot )
+            return *slot;
+    }
+
+    return NULL;
+}
+
+/* Account for @r having been inserted into the handler list. */
+static void vpci_index_add(struct vpci *vpci, struct vpci_register *r)
+{
+    struct vpci_register **slot = vpci_index_slot(vpci, r->offset);
+
+    if ( !*slot || (*slot)->offset > r->offset )
+        *slot = r;
+}
+
+/* Account for @r being about to be removed from the handler list. */
+static void vpci_index_remove(struct vpci *vpci, const struct vpci_register *r)
+{
+    struct vpci_register **slot = vpci_index_slot(vpci, r->offset);
+    struct vpci_register *next;
+
+    if ( *slot != r )
+        return;
+
+    *slot = NULL;
+    if ( !list_is_last(&r->node, &vpci->handlers) )
+    {
+        next = list_entry(r->node.next, struct vpci_register, node);
+        if ( next->offset / 4 == r->offset / 4 )
+            *slot = next;
+    }
+}
+
 #ifdef __XEN__
 
 #ifdef CONFIG_HAS_VPCI_GUEST_SUPPORT
@@ -75,7 +136,11 @@ struct vpci_register *vpci_get_register(const struct vpci *vpci,
 
     ASSERT(spin_is_locked(&vpci->lock));
 
-    list_for_each_entry ( r, &vpci->handlers, node )
+    r = vpci_index_first(vpci, offset, 1);
+    if ( !r )
+        return NULL;
+
+    list_for_each_entry_from ( r, &vpci->handlers, node )
     {
         if ( r->offset == offset && r->size == size )
             return r;
@@ -114,6 +179,11 @@ void vpci_deassign_device(struct pci_dev *pdev)
         list_del(&r->node);
         xfree(r);
     }
+    for ( i = 0; i < ARRAY_SIZE(pdev->vpci->index); i++ )
+    {
+        xfree(pdev->vpci->index[i]);
+        pdev->vpci->index[i] = NULL;
+    }
     spin_unlock(&pdev->vpci->lock);
 
     for ( i = 0; i < ARRAY_SIZE(pdev->vpci->header.bars); i++ )
@@ -269,7 +339,7 @@ int vpci_add_register_mask(struct vpci *vpci, vpci_read_t *read_handler,
                            uint32_t rsvdz_mask)
 {
     struct list_head *prev;
-    struct vpci_register *r;
+    struct vpci_register *r, ***leaf, **new_leaf = NULL;
 
     /* Some sanity checks. */
     if ( (size != 1 && size != 2 && size != 4) ||
@@ -298,8 +368,25 @@ int vpci_add_register_mask(struct vpci *vpci, vpci_read_t *read_handler,
     r->rsvdp_mask = rsvdp_mask;
     r->rsvdz_mask = rsvdz_mask;
 
+    leaf = &vpci->index[offset / (4 << VPCI_INDEX_LEAF_SHIFT)];
+    if ( !*leaf )
+    {
+        new_leaf = xzalloc_array(struct vpci_register *, VPCI_INDEX_LEAF_SIZE);
+        if ( !new_leaf )
+        {
+            xfree(r);
+            return -ENOMEM;
+        }
+    }
+
     spin_lock(&vpci->lock);
 
+    if ( !*leaf )
+    {
+        *leaf = new_leaf;
+        new_leaf = NULL;
+    }
+
     /* The list of handlers must be kept sorted at all times. */
     list_for_each ( prev, &vpci->handlers )
     {
@@ -312,14 +399,18 @@ int vpci_add_register_mask(struct vpci *vpci, vpci_read_t *read_handler,
         if ( cmp == 0 )
         {
             spin_unlock(&vpci->lock);
+            xfree(new_leaf);
             xfree(r);
             return -EEXIST;
         }
     }
 
     list_add_tail(&r->node, prev);
+    vpci_index_add(vpci, r);
     spin_unlock(&vpci->lock);
 
+    xfree(new_leaf);
+
     return 0;
 }
 
@@ -343,6 +434,7 @@ int vpci_remove_registers(struct vpci *vpci, unsigned int start,
         /* Remove rm if rm is inside the range. */
         if ( rm->offset >= start && rm->offset + rm->size <= end )
         {
+            vpci_index_remove(vpci, rm);
             list_del(&rm->node);
             xfree(rm);
             continue;
@@ -511,7 +603,9 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
     spin_lock(&pdev->vpci->lock);
 
     /* Read from the hardware or the emulated register handlers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_index_first(pdev->vpci, reg, size);
+    r = list_prepare_entry(r, &pdev->vpci->handlers, node);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
@@ -641,7 +735,9 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
     spin_lock(&pdev->vpci->lock);
 
     /* Write the value to the hardware or emulated registers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    r = vpci_index_first(pdev->vpci, reg, size);
+    r = list_prepare_entry(r, &pdev->vpci->handlers, node);
+    list_for_each_entry_from ( r, &pdev->vpci->handlers, node )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
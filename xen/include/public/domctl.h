@@ -836,6 +836,16 @@ struct xen_domctl_gdbsx_domstatus {
 #define XEN_VM_EVENT_DISABLE              1
 #define XEN_VM_EVENT_RESUME               2
 #define XEN_VM_EVENT_GET_VERSION          3
+/*
+ * Like XEN_VM_EVENT_ENABLE, but with up to one ring per vCPU, each with its
+ * own event channel, instead of the single ring named by the HVM param.
+ * Requests of vCPU n are put on ring n % nr_rings, requests raised on the
+ * domain's behalf by other domains on ring 0.  Notifying the event channel
+ * of a ring makes Xen pull the responses off that ring, so a response is
+ * expected on the ring its request came from.  XEN_VM_EVENT_RESUME pulls
+ * the responses off all rings.
+ */
+#define XEN_VM_EVENT_ENABLE_RINGS         4
 
 /*
  * Domain memory paging
@@ -903,6 +913,13 @@ struct xen_domctl_vm_event_op {
             uint32_t port;       /* OUT: event channel for ring */
         } enable;
 
+        struct {
+            uint32_t nr_rings;   /* IN: 1 to the number of vCPUs */
+            uint32_t pad;        /* IN: must be zero */
+            XEN_GUEST_HANDLE_64(uint64) gfns;  /* IN: ring gfns [nr_rings] */
+            XEN_GUEST_HANDLE_64(uint32) ports; /* OUT: event channels */
+        } enable_rings;
+
         uint32_t version;
     } u;
 };
@@ -39,6 +39,7 @@ enum xsd_sockmsg_type
     XS_SET_FEATURE,
     XS_GET_QUOTA,
     XS_SET_QUOTA,
+    XS_MULTI,
 
     XS_TYPE_COUNT,      /* Number of valid types. */
 
@@ -128,6 +129,8 @@ struct xenstore_domain_interface {
 #define XENSTORE_SERVER_FEATURE_WATCHDEPTH   4
 /* The capability to use DOMID_ANY for node permissions */
 #define XENSTORE_SERVER_FEATURE_DOMID_ANY    8
+/* The XS_MULTI command is supported */
+#define XENSTORE_SERVER_FEATURE_MULTI       16
 
 /* Valid values for the connection field */
 #define XENSTORE_CONNECTED 0 /* the steady-state */
@@ -27,7 +27,7 @@
 #include <public/vm_event.h>
 #include <asm/vm_event.h>
 
-struct vm_event_domain
+struct vm_event_ring
 {
     spinlock_t lock;
     /* The ring has 64 entries */
@@ -38,10 +38,8 @@ struct vm_event_domain
     struct page_info *ring_pg_struct;
     /* front-end ring */
     vm_event_front_ring_t front_ring;
-    /* event channel port (vcpu0 only) */
+    /* event channel port */
     int xen_port;
-    /* vm_event bit for vcpu->pause_flags */
-    int pause_flag;
     /* list of vcpus waiting for room in the ring */
     struct waitqueue_head wq;
     /* the number of vCPUs blocked */
@@ -50,6 +48,18 @@ struct vm_event_domain
     unsigned int last_vcpu_wake_up;
 };
 
+struct vm_event_domain
+{
+    /* vm_event bit for vcpu->pause_flags */
+    int pause_flag;
+    /*
+     * Requests of vCPU n go to ring n % nr_rings, requests raised by other
+     * domains to ring 0.
+     */
+    unsigned int nr_rings;
+    struct vm_event_ring ring[];
+};
+
 /* Returns whether a ring has been set up */
 #ifdef CONFIG_VM_EVENT
 bool vm_event_check_ring(struct vm_event_domain *ved);
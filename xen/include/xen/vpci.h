@@ -38,9 +38,19 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
  */
 bool __must_check vpci_process_pending(struct vcpu *v);
 
+/* Dwords of config space covered by each leaf of the handler index. */
+#define VPCI_INDEX_LEAF_SHIFT 6
+
 struct vpci {
     /* List of vPCI handlers for a device. */
     struct list_head handlers;
+    /*
+     * Index of the handlers by config space dword: the first handler in the
+     * list overlapping each dword, or NULL.  Leaves are allocated as handlers
+     * get added.
+     */
+    struct vpci_register **index[PCI_CFG_SPACE_EXP_SIZE /
+                                 (4 << VPCI_INDEX_LEAF_SHIFT)];
     spinlock_t lock;
 
 #ifdef __XEN__